@@ -14,6 +14,7 @@
 #include "mmc.h"
 #include "usb/storage_ex.h"
 #include "fat_compat.h"
+#include "bufpool.h"
 
 /* Definitions of physical drive number for each drive */
 #define DEV_MMC		0
@@ -21,12 +22,23 @@
 
 static char enable_cache = 0;
 static LBA_t cache_sector;
+static BYTE *cache_buf = 0;
 static LBA_t database;
 extern char fat_device;
 
+// drop the cached sectors, the card was written around FatFs
+void disk_cache_invalidate(void) {
+	cache_sector = -1;
+}
+
 void disk_cache_set(char enable, LBA_t base) {
 	cache_sector = -1;
 	database = base;
+	if(enable && !cache_buf) cache_buf = bufpool_acquire(BUF_DIRCACHE);
+	if(!enable && cache_buf) {
+		bufpool_release(cache_buf);
+		cache_buf = 0;
+	}
 	enable_cache = enable;
 }
 
@@ -103,7 +115,7 @@ DSTATUS disk_initialize (
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_read (
+TCMFUNC DRESULT disk_read (
 	BYTE pdrv,		/* Physical drive nmuber to identify the drive */
 	BYTE *buff,		/* Data buffer to store read data */
 	LBA_t sector,	/* Start sector in LBA */
@@ -115,7 +127,7 @@ DRESULT disk_read (
 
 	//iprintf("disk_read: %d LBA: %d count: %d\n", pdrv, sector, count);
 	if(enable_cache && cache_sector != -1 && sector >= cache_sector && (sector + count - 1) <= (cache_sector + SECTOR_BUFFER_SIZE/512 - 1)) {
-		memcpy(buff, &sector_buffer[512*(sector-cache_sector)], count*512);
+		memcpy(buff, &cache_buf[512*(sector-cache_sector)], count*512);
 		return RES_OK;
 	}
 
@@ -123,8 +135,8 @@ DRESULT disk_read (
 	switch (fat_device) {
 	case DEV_MMC :
 		if(enable_cache && sector >= database) {
-			result = MMC_ReadMultiple(sector, sector_buffer, SECTOR_BUFFER_SIZE/512);
-			memcpy(buff, sector_buffer, count*512);
+			result = MMC_ReadMultiple(sector, cache_buf, SECTOR_BUFFER_SIZE/512);
+			memcpy(buff, cache_buf, count*512);
 			cache_sector = sector;
 		} else if (count == 1) {
 			result = MMC_Read(sector, buff);
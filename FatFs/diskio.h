@@ -10,6 +10,7 @@ extern "C" {
 #endif
 
 void disk_cache_set(char enable, LBA_t base);
+void disk_cache_invalidate(void);
 
 /* Status of Disk Functions */
 typedef BYTE	DSTATUS;
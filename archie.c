@@ -9,6 +9,7 @@
 #include "user_io.h"
 #include "data_io.h"
 #include "debug.h"
+#include "prof.h"
 
 #define CONFIG_FILENAME  "ARCHIE  CFG"
 #define MAX_FLOPPY 2
@@ -149,6 +150,10 @@ void archie_set_rom(const unsigned char *name) {
     archie_debugf("ROM %.11s no found", name);
 }
 
+#ifdef PROFILE
+static prof_input_t tx_lat;   // oldest report waiting for the keyboard protocol
+#endif
+
 static void archie_kbd_enqueue(unsigned char state, unsigned char byte) {
   if(QUEUE_NEXT(tx_queue_wptr) == tx_queue_rptr) {
     archie_debugf("KBD tx queue overflow");
@@ -159,10 +164,12 @@ static void archie_kbd_enqueue(unsigned char state, unsigned char byte) {
   tx_queue[tx_queue_wptr][0] = state;
   tx_queue[tx_queue_wptr][1] = byte;
   tx_queue_wptr = QUEUE_NEXT(tx_queue_wptr);
+  PROF_INPUT_QUEUE(&tx_lat);
 } 
 
 static void archie_kbd_tx(unsigned char state, unsigned char byte) {
   archie_debugf("KBD TX %x (%x)", byte, state);
+  PROF_INPUT_SENT();
   spi_uio_cmd_cont(0x05);
   spi8(byte);
   DisableIO();
@@ -327,6 +334,7 @@ static void archie_check_queue(void) {
   if(tx_queue_rptr == tx_queue_wptr)
     return;
 
+  PROF_INPUT_DEQUEUE(&tx_lat);
   archie_kbd_tx(tx_queue[tx_queue_rptr][0], tx_queue[tx_queue_rptr][1]); 
   tx_queue_rptr = QUEUE_NEXT(tx_queue_rptr);
 }
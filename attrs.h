@@ -1,7 +1,17 @@
 #ifndef ATTRS_H
 #define ATTRS_H
 
+#ifdef HAVE_TCM
+// SAMV71 built with TCM=1: the RAM functions and TCMFUNC run from the ITCM,
+// TCMDATA goes to the DTCM. Don't use TCMDATA for DMA buffers.
+#define RAMFUNC __attribute__ ((long_call, section (".itcm")))
+#define TCMFUNC RAMFUNC
+#define TCMDATA __attribute__ ((section (".dtcm")))
+#else
 #define RAMFUNC __attribute__ ((long_call, section (".ramsection")))
+#define TCMFUNC
+#define TCMDATA
+#endif
 #define FAST __attribute__((optimize("-Ofast")))
 
 #endif // ATTRS_H
@@ -0,0 +1,104 @@
+/*
+ * bufpool.c
+ *
+ * All file, disk and USB code used to share the global sector_buffer, so
+ * nothing could keep data in it across a call into another module. The
+ * pool hands out blocks of SECTOR_BUFFER_SIZE bytes to the hot paths with
+ * an owner tag. Boards without spare RAM (BUF_POOL_BLOCKS 0) keep sharing
+ * sector_buffer, but overlapping borrows are counted and reported.
+ */
+
+#include <string.h>
+
+#include "bufpool.h"
+#include "hardware.h"
+#include "fat_compat.h"
+#include "debug.h"
+
+#if BUF_POOL_BLOCKS
+static uint8_t pool[BUF_POOL_BLOCKS][SECTOR_BUFFER_SIZE] __attribute__((aligned(32)));
+static uint8_t owners[BUF_POOL_BLOCKS];
+#endif
+static uint8_t shared_owner = BUF_NONE;
+
+static bufpool_stats_t stats = { BUF_POOL_BLOCKS };
+
+static const char *owner_names[BUF_OWNERS] = {
+  "none", "dircache", "hdd", "sd", "storage", "data_io", "xfer"
+};
+
+const char *bufpool_owner_name(uint8_t owner) {
+  return (owner < BUF_OWNERS) ? owner_names[owner] : "?";
+}
+
+uint8_t *bufpool_try_acquire(uint8_t owner) {
+#if BUF_POOL_BLOCKS
+  uint8_t i;
+
+  for (i = 0; i < BUF_POOL_BLOCKS; i++) {
+    if (owners[i] == BUF_NONE) {
+      owners[i] = owner;
+      if (++stats.used > stats.peak) stats.peak = stats.used;
+      return pool[i];
+    }
+  }
+#endif
+  return 0;
+}
+
+uint8_t *bufpool_acquire(uint8_t owner) {
+  uint8_t *buf = bufpool_try_acquire(owner);
+
+  if (buf) return buf;
+
+  // pool exhausted: share the global buffer like before
+  stats.fallbacks++;
+  if (stats.shared) {
+    stats.conflicts++;
+    bufpool_debugf("%s takes sector_buffer from %s", bufpool_owner_name(owner), bufpool_owner_name(shared_owner));
+  }
+  shared_owner = owner;
+  if (++stats.shared > stats.shared_peak) stats.shared_peak = stats.shared;
+  return sector_buffer;
+}
+
+void bufpool_release(uint8_t *buf) {
+#if BUF_POOL_BLOCKS
+  uint8_t i;
+#endif
+
+  if (buf == sector_buffer) {
+    if (stats.shared && !--stats.shared) shared_owner = BUF_NONE;
+    return;
+  }
+
+#if BUF_POOL_BLOCKS
+  for (i = 0; i < BUF_POOL_BLOCKS; i++) {
+    if (buf == pool[i]) {
+      if (owners[i] == BUF_NONE) {
+        bufpool_debugf("block %d released twice", i);
+        return;
+      }
+      owners[i] = BUF_NONE;
+      stats.used--;
+#ifdef BUF_POOL_POISON
+      // stale pointers read garbage instead of the previous owner's data
+      memset(buf, BUF_POOL_POISON, SECTOR_BUFFER_SIZE);
+#endif
+      return;
+    }
+  }
+#endif
+  bufpool_debugf("release of unknown buffer %p", buf);
+}
+
+const bufpool_stats_t *bufpool_stats(void) {
+  return &stats;
+}
+
+void bufpool_reset_stats(void) {
+  stats.peak = stats.used;
+  stats.shared_peak = stats.shared;
+  stats.fallbacks = 0;
+  stats.conflicts = 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * bufpool.h
+ * Fixed size sector buffers with ownership tracking
+ *
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <inttypes.h>
+
+// buffer owners
+#define BUF_NONE     0
+#define BUF_DIRCACHE 1 // directory read cache of diskio.c
+#define BUF_HDD      2 // IDE sector transfers
+#define BUF_SD       3 // SD card emulation writes
+#define BUF_STORAGE  4 // USB mass storage export
+#define BUF_DATA_IO  5 // file up- and downloads
+#define BUF_XFER     6 // file transfers over the USB CDC port
+#define BUF_OWNERS   7
+
+typedef struct {
+  uint8_t blocks;     // pool blocks, sector_buffer not counted
+  uint8_t used;
+  uint8_t peak;       // high-water mark of used
+  uint8_t shared;     // current borrowers of sector_buffer
+  uint8_t shared_peak;
+  uint32_t fallbacks; // acquisitions served from sector_buffer
+  uint32_t conflicts; // sector_buffer handed out while already borrowed
+} bufpool_stats_t;
+
+// returns a SECTOR_BUFFER_SIZE block. Falls back to the global
+// sector_buffer when the pool is exhausted, so it never fails.
+uint8_t *bufpool_acquire(uint8_t owner);
+// a pool block or NULL, for owners that hold their buffer across the main
+// loop polls, while the others use sector_buffer directly
+uint8_t *bufpool_try_acquire(uint8_t owner);
+void bufpool_release(uint8_t *buf);
+const bufpool_stats_t *bufpool_stats(void);
+void bufpool_reset_stats(void);
+const char *bufpool_owner_name(uint8_t owner);
+
+#endif // BUFPOOL_H
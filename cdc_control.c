@@ -1,9 +1,16 @@
 /*
   cdc_control.c
 
+  The CDC data goes through a transmit ring. A bulk IN transfer is started
+  from it whenever the previous one has completed, so the data of several
+  polls goes out in one transfer under load and without delay otherwise.
+  In MIDI mode only complete messages are released to the USB. Data from
+  the PC is collected in a receive ring and handed on in spans. In the file
+  transfer mode of xfer.c the packets bypass the ring.
 */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "cdc_control.h"
 #include "usbdev.h"
@@ -11,26 +18,144 @@
 #include "user_io.h"
 #include "tos.h"
 #include "debug.h"
+#include "prof.h"
+#include "xfer.h"
+#include "hardware.h"
 
-static char buffer[32];
-static unsigned char fill = 0;
-static unsigned long flush_timer = 0;
+// ring sizes, powers of two
+#ifdef CONFIG_CHIP_SAMV71
+#define CDC_TX_RING 2048
+#define CDC_RX_RING 1024
+#else
+#define CDC_TX_RING 256
+#define CDC_RX_RING 128
+#endif
+
+// ms of file transfer data taken per poll
+#define CDC_XFER_SLICE 10
+
+static char tx_ring[CDC_TX_RING] __attribute__((aligned(32)));
+static uint16_t tx_head = 0;   // free running indices
+static uint16_t tx_ready = 0;  // data up to here may be sent
+static uint16_t tx_tail = 0;
+static uint16_t tx_busy = 0;   // bytes in flight from tx_tail on
+static char tx_stalled = 0;    // the host stopped reading, don't wait again
+
+static char rx_ring[CDC_RX_RING];
+static uint16_t rx_head = 0, rx_tail = 0;
+
+static uint8_t midi_status = 0; // for running status, 0xf0 in SysEx
+static uint8_t midi_left = 0;   // data bytes missing in the current message
 
 extern const char version[];
 
-// send everything in buffer 
-void cdc_control_flush(void) {
-  if(fill) usb_cdc_write(buffer, fill);
-  fill = 0;
+// start the next transfer once the previous one is complete
+static void cdc_tx_kick(void) {
+  uint16_t len;
+
+  if(tx_busy) {
+    if(usb_cdc_write_busy()) return;
+    tx_tail += tx_busy;
+    tx_busy = 0;
+    tx_stalled = 0;
+  }
+
+  len = tx_ready - tx_tail;
+  if(!len) return;
+
+  // one span up to the end of the ring, the rest goes with the next one
+  len = MIN(len, CDC_TX_RING - (tx_tail & (CDC_TX_RING-1)));
+  // a transfer of full packets only would wait for more data on the host
+  if(!(len % BULK_IN_SIZE)) len--;
+
+  tx_busy = len;
+  usb_cdc_write_start(tx_ring + (tx_tail & (CDC_TX_RING-1)), len);
+}
+
+// make room in a full ring, gives up if the host does not read
+static void cdc_tx_wait(void) {
+  long to = GetTimer(100);
+
+  tx_ready = tx_head;
+  cdc_tx_kick();
+  if(tx_stalled) return;
+
+  while(usb_cdc_write_busy())
+    if(CheckTimer(to)) {
+      tx_stalled = 1;
+      return;
+    }
+  cdc_tx_kick();
+}
+
+static uint8_t midi_data_len(uint8_t status) {
+  switch(status & 0xf0) {
+  case 0xc0:
+  case 0xd0:
+    return 1;
+  case 0xf0:
+    if((status == 0xf1) || (status == 0xf3)) return 1;
+    if(status == 0xf2) return 2;
+    return 0;
+  default:
+    return 2;
+  }
+}
+
+// returns 1 if the byte completes a MIDI message
+static uint8_t midi_parse(uint8_t c) {
+  // realtime messages may appear anywhere, even within others
+  if(c >= 0xf8) return 1;
+
+  if(c & 0x80) {
+    // system common messages cancel the running status
+    midi_status = ((c < 0xf0) || (c == 0xf0)) ? c : 0;
+    midi_left = midi_data_len(c);
+    return !midi_left;
+  }
+
+  // SysEx data and stray bytes are not held back
+  if(midi_status == 0xf0) return 1;
+  if(!midi_left) {
+    if(!midi_status) return 1;
+    midi_left = midi_data_len(midi_status);
+  }
+  return !--midi_left;
+}
+
+void cdc_control_write(const char *data, uint16_t len) {
+  char midi = (tos_get_cdc_control_redirect() == CDC_REDIRECT_MIDI);
+  char eol = 0;
+
+  while(len) {
+    if(tx_head - tx_tail == CDC_TX_RING) {
+      cdc_tx_wait();
+      if(tx_head - tx_tail == CDC_TX_RING) return; // drop the rest
+    }
+
+    tx_ring[tx_head++ & (CDC_TX_RING-1)] = *data;
+    if(!midi || midi_parse(*data)) tx_ready = tx_head;
+    if(*data == '\n') eol = 1;
+    data++;
+    len--;
+  }
+
+#ifdef USB_CDC_WRITE_SYNC
+  // each transfer blocks until the host took it, so text is collected up
+  // to the end of a line or a full packet, the poll sends the rest
+  if(!midi && !eol && (uint16_t)(tx_ready - tx_tail) < BULK_IN_SIZE) return;
+#endif
+  cdc_tx_kick();
 }
 
 void cdc_control_tx(char c) {
-  // buffer full? flush it!
-  if(fill == sizeof(buffer))
-    cdc_control_flush();
+  cdc_control_write(&c, 1);
+}
 
-  flush_timer = GetTimer(100);
-  buffer[fill++] = c;
+// send everything in the ring, complete or not
+void cdc_control_flush(void) {
+  tx_ready = tx_head;
+  cdc_tx_kick();
 }
 
 static void cdc_puts(char *str) {
@@ -49,85 +174,138 @@ static void cdc_puts(char *str) {
   cdc_control_flush();
 }
 
+static void cdc_control_cmd(char c) {
+  // force lower case
+  if((c >= 'A') && (c <= 'Z'))
+    c = c - 'A' + 'a';
+
+  switch(c) {
+  case '\r':
+    cdc_puts("\n\033[7m <<< MIST board controller >>> \033[0m");
+    cdc_puts("Firmware version ATH" VDATE);
+    cdc_puts("Commands:");
+    cdc_puts("\033[7mR\033[0meset");
+    cdc_puts("\033[7mC\033[0moldreset");
+    cdc_puts("\033[7mD\033[0mebug output redirect");
+    cdc_puts("R\033[7mS\033[0m232 redirect");
+    cdc_puts("\033[7mP\033[0marallel redirect");
+    cdc_puts("\033[7mM\033[0mIDI redirect");
+    cdc_puts("\033[7mF\033[0mile transfer mode");
+#ifdef PROFILE
+    cdc_puts("\033[7mT\033[0miming statistics");
+#endif
+    cdc_puts("");
+    break;
+
+  case 'r':
+    cdc_puts("Reset ...");
+    tos_reset(0);
+    break;
+
+  case 'c':
+    cdc_puts("Coldreset ...");
+    tos_reset(1);
+    break;
+
+  case 'd':
+    cdc_puts("Debug output redirect enabled");
+    tos_set_cdc_control_redirect(CDC_REDIRECT_DEBUG);
+    break;
+
+  case 's':
+    cdc_puts("RS232 redirect enabled");
+    tos_set_cdc_control_redirect(CDC_REDIRECT_RS232);
+    break;
+
+  case 'p':
+    cdc_puts("Parallel redirect enabled");
+    tos_set_cdc_control_redirect(CDC_REDIRECT_PARALLEL);
+    break;
+
+  case 'm':
+    cdc_puts("MIDI redirect enabled");
+    tos_set_cdc_control_redirect(CDC_REDIRECT_MIDI);
+    break;
+
+  case 'f':
+    cdc_puts("File transfer mode");
+    xfer_start();
+    break;
+
+#ifdef PROFILE
+  case 't':
+    prof_dump(cdc_puts);
+    break;
+#endif
+  }
+}
+
+// feed the packets straight to the transfer protocol for a time slice
+static void cdc_xfer_poll(void) {
+  unsigned long start = GetRTTC();
+  uint16_t read;
+  char data[BULK_OUT_SIZE];
+
+  xfer_poll();
+  while(xfer_active() && usb_cdc_is_configured() &&
+        ((read = usb_cdc_read(data, BULK_OUT_SIZE)) != 0)) {
+    xfer_rx(data, read);
+    if(GetRTTC() - start >= CDC_XFER_SLICE) break;
+  }
+}
+
 void cdc_control_poll(void) {
-  // flush out queue every now and then
-  if(flush_timer && CheckTimer(flush_timer)) {
-    cdc_control_flush();
-    flush_timer = 0;
+  cdc_tx_kick();
+
+  if(xfer_active() && rx_head == rx_tail) {
+    cdc_xfer_poll();
+    return;
   }
 
   if(usb_cdc_is_configured()) {
-    uint16_t read, i;
+    uint16_t read;
     char data[BULK_OUT_SIZE];
 
-    // check for user input
-    if((read = usb_cdc_read(data, BULK_OUT_SIZE)) != 0) {
-      
-      switch(tos_get_cdc_control_redirect()) {
-      case CDC_REDIRECT_RS232:
-	iprintf("RS232 forward:\n");
-	hexdump(data, read, 0);
-
-	user_io_serial_tx(data, read);
-	break;
-	
-      case CDC_REDIRECT_CONTROL:
-	for(i=0;i<read;i++) {
-	  // force lower case
-	  if((data[i] >= 'A') && (data[i] <= 'Z'))
-	    data[i] = data[i] - 'A' + 'a';
-	  
-	  switch(data[i]) {
-	  case '\r':
-	    cdc_puts("\n\033[7m <<< MIST board controller >>> \033[0m");
-	    cdc_puts("Firmware version ATH" VDATE);
-	    cdc_puts("Commands:");
-	    cdc_puts("\033[7mR\033[0meset");
-	    cdc_puts("\033[7mC\033[0moldreset");
-	    cdc_puts("\033[7mD\033[0mebug output redirect");
-	    cdc_puts("R\033[7mS\033[0m232 redirect");
-	    cdc_puts("\033[7mP\033[0marallel redirect");
-	    cdc_puts("\033[7mM\033[0mIDI redirect");
-	    cdc_puts("");
-	    break;
-	    
-	  case 'r':
-	    cdc_puts("Reset ...");
-	    tos_reset(0);
-	    break;
-	    
-	  case 'c':
-	    cdc_puts("Coldreset ...");
-	    tos_reset(1);
-	    break;
-	    
-	  case 'd':
-	    cdc_puts("Debug output redirect enabled");
-	    tos_set_cdc_control_redirect(CDC_REDIRECT_DEBUG);
-	    break;
-	    
-	  case 's':
-	    cdc_puts("RS232 redirect enabled");
-	    tos_set_cdc_control_redirect(CDC_REDIRECT_RS232);
-	    break;
-	    
-	  case 'p':
-	    cdc_puts("Parallel redirect enabled");
-	    tos_set_cdc_control_redirect(CDC_REDIRECT_PARALLEL);
-	    break;
-	    
-	  case 'm':
-	    cdc_puts("MIDI redirect enabled");
-	    tos_set_cdc_control_redirect(CDC_REDIRECT_MIDI);
-	    break;
-	    
-	  }
-	  break;
-	}
-  
-	default:
-	  break;
+    // collect the packets from the PC while there is room for a full one
+    while((CDC_RX_RING - (uint16_t)(rx_head - rx_tail) >= BULK_OUT_SIZE) &&
+          ((read = usb_cdc_read(data, BULK_OUT_SIZE)) != 0)) {
+      uint16_t i;
+      for(i=0;i<read;i++)
+        rx_ring[rx_head++ & (CDC_RX_RING-1)] = data[i];
+    }
+  }
+
+  // and hand them on in spans up to the end of the ring
+  while(rx_head != rx_tail) {
+    char *span = rx_ring + (rx_tail & (CDC_RX_RING-1));
+    uint16_t len = MIN((uint16_t)(rx_head - rx_tail), CDC_RX_RING - (rx_tail & (CDC_RX_RING-1)));
+
+    switch(tos_get_cdc_control_redirect()) {
+    case CDC_REDIRECT_RS232:
+      user_io_serial_tx(span, len);
+      break;
+
+    case CDC_REDIRECT_MIDI: {
+      uint16_t i;
+      for(i=0;i<len;i++)
+        user_io_midi_tx(span[i]);
+      break;
+    }
+
+    case CDC_REDIRECT_CONTROL:
+      // a command may change the redirection or start a file transfer,
+      // one at a time
+      if(xfer_active())
+        xfer_rx(span, len);
+      else {
+        cdc_control_cmd(*span);
+        len = 1;
       }
+      break;
+
+    default:
+      break;
     }
+    rx_tail += len;
   }
 }
@@ -1,6 +1,8 @@
 #ifndef CDC_CONTROL_H
 #define CDC_CONTROL_H
 
+#include <inttypes.h>
+
 #define CDC_REDIRECT_NONE     0x00
 #define CDC_REDIRECT_CONTROL  0x01
 #define CDC_REDIRECT_DEBUG    0x02
@@ -10,6 +12,7 @@
 
 void cdc_control_poll(void);
 void cdc_control_tx(char c);
+void cdc_control_write(const char *data, uint16_t len);
 void cdc_control_flush(void);
 
 #endif // CDC_CONTROL_H
@@ -6,6 +6,7 @@
 #include "user_io.h"
 #include "data_io.h"
 #include "debug.h"
+#include "bufpool.h"
 #include "spi.h"
 #ifdef HAVE_QSPI
 #include "qspi.h"
@@ -101,6 +102,7 @@ void data_io_file_tx_prepare(FIL *file, char index, const char *ext) {
 static void data_io_file_tx_send(FIL *file) {
   FSIZE_t bytes2send = f_size(file);
   UINT br;
+  uint8_t *buf = bufpool_acquire(BUF_DATA_IO);
 
   /* transmit the entire file using one transfer */
   iprintf("Selected %llu bytes to send\n", bytes2send);
@@ -121,20 +123,26 @@ static void data_io_file_tx_send(FIL *file) {
       bytes2send = 0;
     } else {
       DISKLED_ON
-      f_read(file, sector_buffer, chunk, &br);
+      f_read(file, buf, chunk, &br);
       DISKLED_OFF
 
 #ifdef HAVE_QSPI
       if (user_io_get_core_features() & FEAT_QSPI) {
-        qspi_write_block(sector_buffer, chunk);
+        qspi_write_block(buf, chunk);
       } else {
 #endif
-        EnableFpga();
-        SPI(DIO_FILE_TX_DAT);
-
-//      spi_write(sector_buffer, chunk); // DMA -- too fast for some cores
-        for(p = sector_buffer, c=0;c < chunk;c++)
-          SPI(*p++);
+        if (user_io_get_core_features() & FEAT_DIO_DMA) {
+          // DMA, paced by the inter-byte gap the core asked for
+          EnableFpgaPaced(100 * ((user_io_get_core_features() & FEAT_DIO_GAP) >> FEAT_DIO_GAP_SHIFT));
+          SPI(DIO_FILE_TX_DAT);
+          spi_write(buf, chunk);
+        } else {
+          // DMA is too fast for cores not advertising FEAT_DIO_DMA
+          EnableFpga();
+          SPI(DIO_FILE_TX_DAT);
+          for(p = buf, c=0;c < chunk;c++)
+            SPI(*p++);
+        }
 
         DisableFpga();
 #ifdef HAVE_QSPI
@@ -143,6 +151,7 @@ static void data_io_file_tx_send(FIL *file) {
       bytes2send -= chunk;
     }
   }
+  bufpool_release(buf);
 }
 
 
@@ -228,6 +237,7 @@ static void data_io_file_rx_receive(FIL *file, unsigned int len) {
   unsigned int bytes2receive = len;
   char first = 1;
   UINT bw;
+  uint8_t *buf = bufpool_acquire(BUF_DATA_IO);
   /* receive the entire file using one transfer */
   iprintf("Selected %lu bytes to receive\n", bytes2receive);
 
@@ -244,15 +254,16 @@ static void data_io_file_rx_receive(FIL *file, unsigned int len) {
       first=0;
     }
 
-    for(p = sector_buffer, c=0;c < chunk;c++)
+    for(p = buf, c=0;c < chunk;c++)
       *p++ = SPI(0xFF);
 
     DisableFpga();
     bytes2receive -= chunk;
     DISKLED_ON
-    f_write(file, sector_buffer, chunk, &bw);
+    f_write(file, buf, chunk, &bw);
     DISKLED_OFF
   }
+  bufpool_release(buf);
 }
 
 static void data_io_file_rx_done(void) {
@@ -126,6 +126,13 @@
 #define pl2303_debugf(...)
 #endif
 
+#if 0
+// file transfers over usb cdc in blue
+#define xfer_debugf(a, ...) iprintf("\033[1;34mXFER: " a "\033[0m\n", ##__VA_ARGS__)
+#else
+#define xfer_debugf(...)
+#endif
+
 #if 1
 // ini_parser debug output
 #define ini_parser_debugf(a, ...) iprintf("\033[1;34mINI_PARSER : " a "\033[0m\n",## __VA_ARGS__)
@@ -175,4 +182,12 @@
 #define hdmi_debugf(...)
 #endif
 
+#if 0
+// buffer pool debug output, poisons released blocks
+#define bufpool_debugf(a, ...) iprintf("\033[1;33mBUF : " a "\033[0m\n",## __VA_ARGS__)
+#define BUF_POOL_POISON 0xa5
+#else
+#define bufpool_debugf(...)
+#endif
+
 #endif // DEBUG_H
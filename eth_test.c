@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eth_bridge.h"
+
+// hw/ATSAMV71/eth_bridge.c between a simulated GMAC and a simulated FPGA
+// endpoint. The frames of the core leave through the GMAC TX ring and are
+// looped back into the RX ring, from where they have to reach the core
+// complete and in order. The RX ring is kept small so frames wrap around
+// its end and it runs over when the core doesn't take its frames.
+
+#define RX_UNITS   24
+#define TX_UNITS   8
+#define UNIT       128
+#define QUEUE      64
+
+#define RX_OWN     (1u << 0)
+#define RX_WRAP    (1u << 1)
+#define RX_SOF     (1u << 14)
+#define RX_EOF     (1u << 15)
+#define RSR_BNA    (1u << 0)
+#define RSR_REC    (1u << 1)
+
+static eth_bridge_desc_t rx_desc[RX_UNITS];
+static uint8_t rx_buffer[RX_UNITS*UNIT + ETH_MAX_FRAMELEN];
+static int gmac_rx_head;
+
+static uint8_t tx_buffer[TX_UNITS][ETH_MAX_FRAMELEN];
+static uint16_t tx_len[TX_UNITS];
+static int tx_head, tx_tail;
+
+// the core side
+static struct {
+  uint32_t seq[QUEUE];       // frames the core wants to send
+  int head, tail;
+  uint32_t next_seq;
+  int busy;                  // status polls until the core took the last frame
+  int busy_polls;
+  uint32_t received;
+  uint32_t last_seq;
+  uint32_t bad;
+  uint32_t status_reads;
+} core;
+
+static uint32_t wraps;
+
+// ---------------- frames ----------------
+
+static uint16_t frame_len(uint32_t seq) {
+  if(seq % 97 == 50) return 1600;   // too long for the GMAC
+  return 60 + (seq * 7919) % (1514 - 60);
+}
+
+static void frame_fill(uint32_t seq, uint8_t *d) {
+  uint16_t len = frame_len(seq), i;
+
+  memcpy(d, &seq, 4);
+  for(i=4;i<len;i++) d[i] = seq * 13 + i * 7 + (i >> 8);
+}
+
+// ---------------- the firmware side ----------------
+
+void cache_invalidate_region(void *start, uint32_t length) {
+  wraps++;
+}
+
+uint8_t *eth_tx_buffer(void) {
+  if(((tx_head + 1) % TX_UNITS) == tx_tail) return 0;
+  return tx_buffer[tx_head];
+}
+
+void eth_tx_submit(uint16_t len) {
+  tx_len[tx_head] = len;
+  tx_head = (tx_head + 1) % TX_UNITS;
+}
+
+// ---------------- the FPGA ----------------
+
+uint32_t user_io_eth_get_status(void) {
+  uint32_t s = 0;
+
+  core.status_reads++;
+  if(core.busy) {
+    core.busy--;
+    s |= 0x20000;
+  }
+  if(core.head != core.tail)
+    s |= (0xa5 << 24) | frame_len(core.seq[core.tail]);
+  return s;
+}
+
+void user_io_eth_receive_tx_frame(uint8_t *d, uint16_t len) {
+  uint32_t seq = core.seq[core.tail];
+
+  if(core.head == core.tail || len != frame_len(seq)) {
+    printf("tx frame of %u bytes not offered\n", len);
+    core.bad++;
+    return;
+  }
+  core.tail = (core.tail + 1) % QUEUE;
+  if(d) frame_fill(seq, d);
+}
+
+void user_io_eth_send_rx_frame(uint8_t *s, uint16_t len) {
+  static uint8_t ref[ETH_MAX_FRAMELEN];
+  uint32_t seq;
+
+  memcpy(&seq, s, 4);
+  frame_fill(seq, ref);
+  if(core.busy || len != frame_len(seq) || memcmp(s, ref, len) || (core.received && seq <= core.last_seq)) {
+    printf("bad rx frame %u, %u bytes%s\n", seq, len, core.busy ? ", fpga busy" : "");
+    core.bad++;
+  }
+  core.received++;
+  core.last_seq = seq;
+  core.busy = core.busy_polls;
+}
+
+static void core_send(int n) {
+  while(n-- && (core.head + 1) % QUEUE != core.tail) {
+    core.seq[core.head] = core.next_seq++;
+    core.head = (core.head + 1) % QUEUE;
+  }
+}
+
+// ---------------- the GMAC ----------------
+
+static void gmac_init(void) {
+  int i;
+
+  memset(rx_desc, 0, sizeof(rx_desc));
+  for(i=0;i<RX_UNITS;i++)
+    rx_desc[i].addr = (uint32_t)(i * UNIT);
+  rx_desc[RX_UNITS-1].addr |= RX_WRAP;
+  gmac_rx_head = 0;
+  tx_head = tx_tail = 0;
+  eth_bridge_init(rx_desc, rx_buffer, RX_UNITS);
+}
+
+// a received frame goes to the RX ring, without room for all of it only
+// its first fragments are written
+static void gmac_receive(const uint8_t *d, uint16_t len) {
+  int units = (len + UNIT - 1) / UNIT, i;
+
+  for(i=0;i<units;i++) {
+    eth_bridge_desc_t *desc = rx_desc + gmac_rx_head;
+    uint16_t n = (len - i*UNIT < UNIT) ? len - i*UNIT : UNIT;
+
+    if(desc->addr & RX_OWN) {
+      eth_bridge_rx_irq(RSR_BNA);
+      return;
+    }
+    memcpy(rx_buffer + gmac_rx_head * UNIT, d + i*UNIT, n);
+    desc->status = (i ? 0 : RX_SOF) | ((i == units - 1) ? (RX_EOF | len) : 0);
+    desc->addr |= RX_OWN;
+    gmac_rx_head = (gmac_rx_head + 1) % RX_UNITS;
+  }
+  eth_bridge_rx_irq(RSR_REC);
+}
+
+// the wire loops n frames of the TX ring back
+static void gmac_transmit(int n) {
+  while(n-- && tx_tail != tx_head) {
+    gmac_receive(tx_buffer[tx_tail], tx_len[tx_tail]);
+    tx_tail = (tx_tail + 1) % TX_UNITS;
+  }
+}
+
+// ---------------- tests ----------------
+
+int main() {
+  const eth_stats_t *st = eth_stats();
+  int errors = 0, i;
+  uint32_t sent, reads;
+
+  gmac_init();
+
+  // steady traffic, nothing may be lost
+  core.busy_polls = 1;
+  for(i=0;i<2000;i++) {
+    core_send(rand() % 3);
+    gmac_transmit(1);
+    eth_bridge_poll();
+  }
+  for(i=0;i<1000;i++) {
+    gmac_transmit(1);
+    eth_bridge_poll();
+  }
+  sent = core.next_seq;
+  if(core.received != st->tx_frames || st->rx_frames != core.received || st->rx_dropped || st->rx_overruns) {
+    printf("steady: %u sent, %u received, %u rx dropped, %u overruns\n",
+      sent, core.received, st->rx_dropped, st->rx_overruns);
+    errors++;
+  }
+  if(st->tx_dropped != (sent + 46) / 97 || !wraps) {
+    printf("steady: %u too long frames dropped, %u wraps\n", st->tx_dropped, wraps);
+    errors++;
+  }
+  printf("steady: %u frames, %u bytes, %u wrapped, %u tx ring full\n",
+    st->rx_frames, st->rx_bytes, wraps, st->tx_full);
+
+  // several single frame commands in one poll, until the TX ring is full
+  core_send(TX_UNITS + 2);
+  i = st->tx_frames;
+  reads = st->tx_full;
+  eth_bridge_poll();
+  if(st->tx_frames - i != TX_UNITS - 1 || st->tx_full != reads + 1) {
+    printf("poll: %u frames moved, ring full %u times\n", st->tx_frames - i, st->tx_full - reads);
+    errors++;
+  }
+
+  // the core doesn't take its frames, the RX ring runs over
+  core.busy = 1000000;
+  for(i=0;i<200;i++) {
+    core_send(1);
+    gmac_transmit(TX_UNITS);
+    eth_bridge_poll();
+  }
+  if(!st->rx_overruns) {
+    printf("no overrun\n");
+    errors++;
+  }
+  // the frame cut off by the overrun is dropped once the next one arrives
+  core.busy = 0;
+  reads = core.received;
+  for(i=0;i<1000;i++) {
+    if(i < 100) core_send(1);
+    gmac_transmit(1);
+    eth_bridge_poll();
+  }
+  if(!st->rx_dropped || core.received - reads < 90) {
+    printf("after overrun: %u dropped, %u received\n", st->rx_dropped, core.received - reads);
+    errors++;
+  }
+  printf("overrun: %u received, %u overruns, %u dropped\n", core.received, st->rx_overruns, st->rx_dropped);
+
+  // back to normal, an orphaned fragment in between
+  gmac_receive((uint8_t*)"junk", 4);
+  rx_desc[(gmac_rx_head + RX_UNITS - 1) % RX_UNITS].status = 0;
+  reads = st->rx_dropped;
+  sent = core.received;
+  for(i=0;i<500;i++) {
+    core_send(1);
+    gmac_transmit(1);
+    eth_bridge_poll();
+  }
+  for(i=0;i<1000;i++) {
+    gmac_transmit(1);
+    eth_bridge_poll();
+  }
+  if(st->rx_dropped != reads + 1 || core.received - sent < 490) {
+    printf("recovery: %u dropped, %u received\n", st->rx_dropped - reads, core.received - sent);
+    errors++;
+  }
+
+  // nothing to do costs one status read
+  reads = core.status_reads;
+  eth_bridge_poll();
+  if(core.status_reads != reads + 1) {
+    printf("idle poll: %u status reads\n", core.status_reads - reads);
+    errors++;
+  }
+
+  errors += core.bad;
+  printf("%u rx frames, %u tx frames, %u bad, %d errors\n", st->rx_frames, st->tx_frames, core.bad, errors);
+
+  if(errors) {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  printf("OK\n");
+  return 0;
+}
@@ -12,7 +12,7 @@
 #include "FatFs/ff.h"
 #include "FatFs/diskio.h"
 
-unsigned char sector_buffer[SECTOR_BUFFER_SIZE]; // sector buffer for one CDDA sector (or 4 SD sector)
+unsigned char sector_buffer[SECTOR_BUFFER_SIZE] __attribute__ ((aligned (32))); // sector buffer for one CDDA sector (or 4 SD sector)
 struct PartitionEntry partitions[4];             // lbastart and sectors will be byteswapped as necessary
 int partitioncount;
 
@@ -34,6 +34,14 @@ int8_t fat_medium_present() {
 		return 1;
 }
 
+// the card was written behind the back of FatFs (USB storage export), drop
+// the sector window, the free cluster count and the directory read cache
+void fat_invalidate(void) {
+	if (!fs.wflag) fs.winsect = (LBA_t)0 - 1;
+	fs.free_clst = 0xFFFFFFFF;
+	disk_cache_invalidate();
+}
+
 void fat_switch_to_usb() {
 	fat_device = 1;
 }
@@ -398,7 +406,7 @@ char ScanDirectory(unsigned long mode, char *extension, unsigned char options) {
 		find_dir = options & FIND_DIR;
 	}
 
-	//enable caching in the sector buffer while traversing the directory,
+	//enable caching in a pool buffer while traversing the directory,
 	//because FatFs is inefficiently using single sector reads
 	disk_cache_set(true, fs.database);
 	f_rewinddir(&dir);
@@ -75,7 +75,8 @@ struct InfoSector {
 #define FILEDATE(y,m,d) ((((y-1980)<<9)&0xFE00)|((m<<5)&0x1E0)|(d&0x1F))
 
 // global sector buffer, data for read/write actions is stored here.
-// BEWARE, this buffer is also used and thus trashed by all other functions
+// BEWARE, this buffer is also used and thus trashed by all other functions.
+// Code that keeps data across calls should take a block from bufpool.h
 extern unsigned char sector_buffer[SECTOR_BUFFER_SIZE]; // sector buffer
 extern unsigned char cluster_size;
 extern uint32_t cluster_mask;
@@ -122,5 +123,6 @@ void fat_switch_to_usb(void);
 char *fs_type_to_string(void);
 int8_t fat_medium_present(void);
 int8_t fat_uses_mmc(void);
+void fat_invalidate(void);
 
 #endif
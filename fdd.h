@@ -24,6 +24,8 @@ typedef struct
     char          name[22]; /*floppy name*/
 } adfTYPE;
 
+extern adfTYPE df[4];
+
 void SectorGapToFpga(void);
 void SectorHeaderToFpga(unsigned char n, unsigned char dsksynch, unsigned char dsksyncl);
 //unsigned short SectorToFpga(unsigned char sector, unsigned char track, unsigned char dsksynch, unsigned char dsksyncl);
@@ -38,6 +38,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "mist_cfg.h"
 #include "settings.h"
 #include "usb/joymapping.h"
+#include "hdd.h"
+#ifdef HAVE_QSPI
+#include "qspi.h"
+#endif
 
 #ifndef DEFAULT_CORE_NAME
 #define DEFAULT_CORE_NAME "CORE.RBF"
@@ -131,6 +135,9 @@ unsigned char ConfigureFpga(const char *name)
     FIL file;
     UINT br;
 
+    // the request line may toggle during configuration
+    FpgaIrqEnable(0);
+
     // set outputs
     *AT91C_PIOA_SODR = XILINX_CCLK | XILINX_DIN | XILINX_PROG_B;
     // enable outputs
@@ -238,28 +245,129 @@ unsigned char ConfigureFpga(const char *name)
 
 
 #ifdef ALTERA_DCLK
-static inline void ShiftFpga(unsigned char data)
+// DATA0/DCLK are not connected to a serial peripheral, so the passive serial
+// stream is bit-banged. Both pins are written at once through ODSR: DATA0
+// with DCLK low, then the same value with DCLK high. The bits are shifted
+// out LSB first, which is the order the data is stored in the RBF.
+#define SHIFT_BIT(b) \
+    d = ((data >> (b)) & 1) << ALTERA_DATA0_SHIFT; \
+    ALTERA_SHIFT_ODSR = d; \
+    ALTERA_SHIFT_ODSR = d | ALTERA_DCLK;
+
+RAMFUNC static void ShiftFpgaBlock(const unsigned char *ptr, unsigned long len)
 {
-    unsigned char i;
-    for ( i = 0; i < 8; i++ )
+    unsigned long d, data;
+
+    ALTERA_SHIFT_START
+    while (len--)
     {
-        /* Dump to DATA0 and insert a positive edge pulse at the same time */
-        ALTERA_DATA0_RESET;
-        ALTERA_DCLK_RESET;
-        if(data & 1) ALTERA_DATA0_SET;
-        ALTERA_DCLK_SET;
-        data >>= 1;
+        data = *ptr++;
+        SHIFT_BIT(0)
+        SHIFT_BIT(1)
+        SHIFT_BIT(2)
+        SHIFT_BIT(3)
+        SHIFT_BIT(4)
+        SHIFT_BIT(5)
+        SHIFT_BIT(6)
+        SHIFT_BIT(7)
+    }
+    ALTERA_SHIFT_STOP
+}
+
+RAMFUNC static void ShiftFpgaRepeat(unsigned long data, unsigned long len)
+{
+    unsigned long d;
+
+    ALTERA_SHIFT_START
+    while (len--)
+    {
+        SHIFT_BIT(0)
+        SHIFT_BIT(1)
+        SHIFT_BIT(2)
+        SHIFT_BIT(3)
+        SHIFT_BIT(4)
+        SHIFT_BIT(5)
+        SHIFT_BIT(6)
+        SHIFT_BIT(7)
+    }
+    ALTERA_SHIFT_STOP
+}
+
+// RBZ decoder state, tokens may span buffer boundaries
+typedef struct {
+    unsigned char literal; // literal bytes left in the current token
+    unsigned char run;     // run length, waiting for the byte to repeat
+    unsigned long size;    // bytes shifted out
+} rbz_state_t;
+
+static void ShiftFpgaRBZ(rbz_state_t *rbz, const unsigned char *ptr, unsigned long len)
+{
+    const unsigned char *end = ptr + len;
+    unsigned long n;
+
+    while (ptr < end)
+    {
+        if (rbz->literal) {
+            n = end - ptr;
+            if (n > rbz->literal) n = rbz->literal;
+            ShiftFpgaBlock(ptr, n);
+            ptr += n;
+            rbz->literal -= n;
+            rbz->size += n;
+        } else if (rbz->run) {
+            ShiftFpgaRepeat(*ptr++, rbz->run);
+            rbz->size += rbz->run;
+            rbz->run = 0;
+        } else {
+            n = *ptr++;
+            if (n & 0x80)
+                rbz->run = (n & 0x7f) + 2;
+            else
+                rbz->literal = n + 1;
+        }
+    }
+}
+
+// open <name>, or <name>.RBZ instead of a missing <name>.RBF
+static FRESULT OpenBitstream(FIL *file, const char *name, unsigned long *rbz_size)
+{
+    unsigned char hdr[RBZ_HEADER_SIZE];
+    const char *ext;
+    FRESULT res;
+    UINT br;
+
+    *rbz_size = 0;
+    ext = GetExtension(name);
+    res = f_open(file, name, FA_READ);
+    if (res != FR_OK && ext && !strncasecmp(ext, "RBF", 3) && strlen(name) < sizeof(s)) {
+        if (name != s) strcpy(s, name);
+        strcpy(s + (ext - name), "RBZ");
+        res = f_open(file, s, FA_READ);
+        ext = GetExtension(s);
     }
+    if (res != FR_OK || !ext || strncasecmp(ext, "RBZ", 3))
+        return res;
+
+    if (f_read(file, hdr, RBZ_HEADER_SIZE, &br) != FR_OK || br != RBZ_HEADER_SIZE || memcmp(hdr, RBZ_MAGIC, 4)) {
+        iprintf("Invalid compressed bitstream!\r");
+        f_close(file);
+        return FR_INVALID_OBJECT;
+    }
+    *rbz_size = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) | ((unsigned long)hdr[7] << 24);
+    return FR_OK;
 }
 
 // Altera FPGA configuration
 unsigned char ConfigureFpga(const char *name)
 {
-    unsigned long i;
-    unsigned char *ptr;
+    unsigned long i, rbz_size;
+    rbz_state_t rbz = {0, 0, 0};
     FIL file;
     UINT br;
 
+    // the request line may toggle during configuration
+    FpgaIrqEnable(0);
+
     // set outputs
     ALTERA_DCLK_SET;
     ALTERA_NCONFIG_SET;
@@ -269,18 +377,16 @@ unsigned char ConfigureFpga(const char *name)
       name = DEFAULT_CORE_NAME;
 
     // open bitstream file
-    if (f_open(&file, name, FA_READ) != FR_OK)
+    if (OpenBitstream(&file, name, &rbz_size) != FR_OK)
     {
         iprintf("No FPGA configuration file found!\r");
         return ERROR_BITSTREAM_OPEN;
     }
 
     iprintf("FPGA bitstream file %s opened, file size = %llu\r", name, f_size(&file));
+    if (rbz_size) iprintf("Compressed bitstream, %lu bytes\r", rbz_size);
     iprintf("[");
 
-    // send all bytes to FPGA in loop
-    ptr = sector_buffer;
-
     ALTERA_START_CONFIG
     /* Drive a transition of 0 to 1 to NCONFIG to indicate start of configuration */
     for(i=0;i<10;i++)
@@ -304,53 +410,46 @@ unsigned char ConfigureFpga(const char *name)
 
     DISKLED_ON;
 
-    int t = 0;
-    int n = f_size(&file) >> 3;
-
-    /* Loop through every single byte */
-    for ( i = 0; i < f_size(&file); )
+    /* Loop through the file a buffer at a time */
+    for ( i = 0; f_tell(&file) < f_size(&file); i += br )
     {
-        // read sector if SECTOR_BUFFER_SIZE bytes done
-        if ((i & (SECTOR_BUFFER_SIZE-1)) == 0)
-        {
-            if (i & (1<<13))
-                DISKLED_OFF
-            else
-                DISKLED_ON
-
-            if ((i & (SECTOR_BUFFER_SIZE*4-1)) == 0)
-                iprintf("*");
+        if (i & (1<<13))
+            DISKLED_OFF
+        else
+            DISKLED_ON
 
-            if (f_read(&file, sector_buffer, SECTOR_BUFFER_SIZE, &br) != FR_OK) {
-                f_close(&file);
-                return ERROR_READ_BITSTREAM_FAILED;
-            }
+        if ((i & (SECTOR_BUFFER_SIZE*4-1)) == 0)
+            iprintf("*");
 
-            ptr = sector_buffer;
+        if (f_read(&file, sector_buffer, SECTOR_BUFFER_SIZE, &br) != FR_OK || !br) {
+            ALTERA_STOP_CONFIG
+            f_close(&file);
+            return ERROR_READ_BITSTREAM_FAILED;
         }
 
-        int bytes2copy = (i < f_size(&file) - 8)?8:f_size(&file)-i;
-        i += bytes2copy;
-        while(bytes2copy) {
-          ShiftFpga(*ptr++);
-          bytes2copy--;
-        }
+        if (rbz_size)
+            ShiftFpgaRBZ(&rbz, sector_buffer, br);
+        else
+            ShiftFpgaBlock(sector_buffer, br);
 
-        /* Check for error through NSTATUS for every 10KB programmed and the last byte */
-        if ( !(i % 10240) || (i == f_size(&file) - 1) ) {
-            if ( !ALTERA_NSTATUS_STATE ) {
-                ALTERA_STOP_CONFIG
+        /* Check for error through NSTATUS after every buffer */
+        if ( !ALTERA_NSTATUS_STATE ) {
+            ALTERA_STOP_CONFIG
 
-                iprintf("FPGA NSTATUS is NOT high!\r");
-                f_close(&file);
-                return ERROR_UPDATE_PROGRESS_FAILED;
-            }
+            iprintf("FPGA NSTATUS is NOT high!\r");
+            f_close(&file);
+            return ERROR_UPDATE_PROGRESS_FAILED;
         }
     }
     ALTERA_STOP_CONFIG
 
     f_close(&file);
 
+    if (rbz_size && rbz.size != rbz_size) {
+        iprintf("Compressed bitstream size mismatch (%lu)\r", rbz.size);
+        return ERROR_READ_BITSTREAM_FAILED;
+    }
+
     iprintf("]\r");
     iprintf("FPGA bitstream loaded\r");
     DISKLED_OFF;
@@ -913,6 +1012,96 @@ unsigned char GetFPGAStatus(void)
     return status;
 }
 
+// Cores with FEAT_FPGA_IRQ pull the FPGA_IRQ line on new requests, so
+// their status only has to be read after an edge. An edge is pending for
+// every reader of the status until that reader consumed it, and a reader
+// that still saw a request reads again on the next pass. The slow
+// fallback poll covers edges lost while the line was disarmed.
+static unsigned char fpga_req = 0;
+static unsigned long fpga_req_timer[2] = { 0, 0 };
+
+char FpgaRequestPending(unsigned char reader)
+{
+    unsigned long *timer = &fpga_req_timer[reader == FPGA_REQ_IDE];
+
+    if (!(user_io_get_core_features() & FEAT_FPGA_IRQ))
+        return 1;
+
+    if (FpgaIrqPending())
+        fpga_req = FPGA_REQ_FDD | FPGA_REQ_IDE;
+
+    if ((fpga_req & reader) || CheckTimer(*timer)) {
+        fpga_req &= ~reader;
+        *timer = GetTimer(FPGA_REQ_FALLBACK);
+        return 1;
+    }
+    return 0;
+}
+
+// the status showed a request, it may not be done in a single pass
+void FpgaRequestAgain(unsigned char reader)
+{
+    fpga_req |= reader;
+}
+
+// wait for one of the mask bits in the status, 0 on timeout
+char WaitFPGAStatus(unsigned char mask, unsigned long timeout)
+{
+    unsigned long to = GetTimer(timeout);
+
+    while (!(GetFPGAStatus() & mask))
+        if (CheckTimer(to)) return 0;
+
+    return 1;
+}
+
+// the minimig_v2 core always took the IDE sector data on QSPI, reading it
+// back that way needs a core with FEAT_IDE_QSPI
+static char fpga_bulk_qspi(unsigned char cmd)
+{
+#ifdef HAVE_QSPI
+    char qspi = (user_io_get_core_features() & FEAT_IDE_QSPI) != 0;
+
+    if (cmd == CMD_IDE_DATA_WR) return qspi || minimig_v2();
+    if (cmd == CMD_IDE_DATA_RD) return qspi;
+#endif
+    return 0;
+}
+
+void fpga_bulk_write(unsigned char cmd, const unsigned char *buf, unsigned short len)
+{
+#ifdef HAVE_QSPI
+    if (fpga_bulk_qspi(cmd)) {
+        qspi_start_write();
+        qspi_write_block(buf, len);
+        qspi_end();
+        return;
+    }
+#endif
+    EnableFpga();
+    SPI(cmd);
+    spi_n(0x00, 5);
+    spi_write((const char*)buf, len);
+    DisableFpga();
+}
+
+void fpga_bulk_read(unsigned char cmd, unsigned char *buf, unsigned short len)
+{
+#ifdef HAVE_QSPI
+    if (fpga_bulk_qspi(cmd)) {
+        qspi_start_read();
+        qspi_read_block(buf, len);
+        qspi_end();
+        return;
+    }
+#endif
+    EnableFpga();
+    SPI(cmd);
+    spi_n(0x00, 5);
+    spi_read((char*)buf, len);
+    DisableFpga();
+}
+
 
 unsigned char fpga_init(const char *name) {
   unsigned long time = GetRTTC();
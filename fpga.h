@@ -3,6 +3,19 @@
 
 #include "fat_compat.h"
 
+// compressed bitstream (.RBZ, created with mkrbz)
+// header: "RBZ" 0x01, uncompressed size (32 bit LE)
+// data:   0x00-0x7f: n+1 literal bytes follow
+//         0x80-0xff: next byte repeated (n&0x7f)+2 times
+#define RBZ_MAGIC       "RBZ\x01"
+#define RBZ_HEADER_SIZE 8
+
+#define FPGA_REQ_FALLBACK 100 // ms between status polls of FEAT_FPGA_IRQ cores
+
+// readers of the FPGA status, each keeps its own pending request
+#define FPGA_REQ_FDD      0x01  // HandleFpga()
+#define FPGA_REQ_IDE      0x02  // IDE channel in user_io_poll()
+
 unsigned char fpga_init(const char *name);
 unsigned char ConfigureFpga(const char*);
 void SendFile(FIL *file);
@@ -14,6 +27,13 @@ char PrepareBootUpload(unsigned char base, unsigned char size);
 void BootExit(void);
 void ClearMemory(unsigned long base, unsigned long size);
 unsigned char GetFPGAStatus(void);
+char FpgaRequestPending(unsigned char reader);
+void FpgaRequestAgain(unsigned char reader);
+char WaitFPGAStatus(unsigned char mask, unsigned long timeout);
+// bulk data of the IDE channel: cmd and 5 padding bytes followed by len
+// bytes over SPI DMA, or the data alone over QSPI if the core takes it there
+void fpga_bulk_write(unsigned char cmd, const unsigned char *buf, unsigned short len);
+void fpga_bulk_read(unsigned char cmd, unsigned char *buf, unsigned short len);
 
 // minimig reset stuff
 #define SPI_RST_USR         0x1
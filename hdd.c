@@ -35,18 +35,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "hdd_internal.h"
 #include "menu.h"
 #include "fpga.h"
+#include "prof.h"
+#include "bufpool.h"
 #include "scsi.h"
 #include "cue_parser.h"
-#ifdef HAVE_QSPI
-#include "qspi.h"
-#include "user_io.h"
-#endif
 #include "debug.h"
 
 hardfileTYPE  *hardfile[HARDFILES];
 
 // hardfile structure
-hdfTYPE hdf[HARDFILES];
+hdfTYPE hdf[HARDFILES] TCMDATA;
 
 #define AUDIO_PLAYING  0x11
 #define AUDIO_PAUSED   0x12
@@ -344,29 +342,13 @@ static void WritePacket(unsigned char unit, const unsigned char *buf, unsigned s
   unsigned short bytes;
   do {
     bytes = MIN(bufsize, bytelimit);
-    while (!(GetFPGAStatus() & CMD_IDECMD)); // wait for empty sector buffer
-    WriteTaskFile(0, 0x02, 0, bytes & 0xff, (bytes>>8) & 0xff, 0xa0 | ((unit & 0x01)<<4));
-    if (bytes) {
-#ifdef HAVE_QSPI
-      if(minimig_v2()) {
-        qspi_start_write();
-        qspi_write_block(buf, bytes);
-        qspi_end();
-      } else {
-#endif
-        EnableFpga();
-        SPI(CMD_IDE_DATA_WR); // write data command
-        SPI(0x00);
-        SPI(0x00);
-        SPI(0x00);
-        SPI(0x00);
-        SPI(0x00);
-        spi_write(buf, bytes);
-        DisableFpga();
-#ifdef HAVE_QSPI
-      }
-#endif
+    if (!WaitFPGAStatus(CMD_IDECMD, HDD_REQ_TIMEOUT)) { // wait for empty sector buffer
+      hdd_debugf("IDE%d: packet timeout", unit);
+      return;
     }
+    WriteTaskFile(0, 0x02, 0, bytes & 0xff, (bytes>>8) & 0xff, 0xa0 | ((unit & 0x01)<<4));
+    if (bytes)
+      fpga_bulk_write(CMD_IDE_DATA_WR, buf, bytes);
     buf += bytes;
     bufsize -= bytes;
     if (lastpacket && !bufsize)
@@ -424,15 +406,7 @@ static void cdrom_playaudio()
   int offset = (cdrom.currentlba - toc.tracks[track].start) * toc.tracks[track].sector_size + toc.tracks[track].offset;
   f_lseek(&toc.file->file, offset);
   f_read(&toc.file->file, sector_buffer, 2352, &br);
-  EnableFpga();
-  SPI(CMD_IDE_CDDA_WR); // write cdda command
-  SPI(0x00);
-  SPI(0x00);
-  SPI(0x00);
-  SPI(0x00);
-  SPI(0x00);
-  spi_write(sector_buffer, 2352);
-  DisableFpga();
+  fpga_bulk_write(CMD_IDE_CDDA_WR, sector_buffer, 2352);
   DISKLED_OFF
   if (cdrom.currentlba == cdrom.endlba)
     cdrom.audiostatus = AUDIO_COMPLETE;
@@ -850,13 +824,10 @@ static void PKT_ModeSelect(unsigned char unit, unsigned short bytelimit, char se
   bytelimit = MIN(bytelimit, SECTOR_BUFFER_SIZE);
   WriteTaskFile(0, 0, 0, bytelimit & 0xff, (bytelimit>>8) & 0xff, 0xa0 | ((unit & 0x01)<<4));
   WriteStatus(IDE_STATUS_REQ | IDE_STATUS_PKT | IDE_STATUS_IRQ); // wait for parameter list
-  unsigned long to = GetTimer(100);
-  while (!(GetFPGAStatus() & CMD_IDEDAT)) { // wait for full write buffer
-    if (CheckTimer(to)) {
-      cdrom_setsense(SENSEKEY_NOT_READY, 0x04, 0);
-      cdrom_send_error(unit);
-      return;
-    }
+  if (!WaitFPGAStatus(CMD_IDEDAT, 100)) { // wait for full write buffer
+    cdrom_setsense(SENSEKEY_NOT_READY, 0x04, 0);
+    cdrom_send_error(unit);
+    return;
   }
   EnableFpga();
   SPI(CMD_IDE_DATA_RD); // read parameter list
@@ -1019,13 +990,10 @@ static inline void ATA_Packet(unsigned char *tfr, unsigned char unit, unsigned s
   tfr[TFR_SCOUNT] = 0x01; //C/D flag
   WriteTaskFile(tfr[1], tfr[2], tfr[3], tfr[4], tfr[5], tfr[6]);
   WriteStatus(IDE_STATUS_REQ | IDE_STATUS_PKT); // wait for command packet
-  unsigned long to = GetTimer(20);
-  while (!(GetFPGAStatus() & CMD_IDEDAT)) { // wait for full write buffer
-    if (CheckTimer(to)) {
-      cdrom_setsense(SENSEKEY_NOT_READY, 0x04, 0);
-      cdrom_send_error(unit);
-      return;
-    }
+  if (!WaitFPGAStatus(CMD_IDEDAT, 20)) { // wait for full write buffer
+    cdrom_setsense(SENSEKEY_NOT_READY, 0x04, 0);
+    cdrom_send_error(unit);
+    return;
   }
   EnableFpga();
   SPI(CMD_IDE_DATA_RD); // read data command
@@ -1162,18 +1130,7 @@ static void ATA_IdentifyDevice(unsigned char* tfr, unsigned char unit, char pack
 
   WriteTaskFile(0, tfr[2], tfr[3], tfr[4], tfr[5], tfr[6]);
   WriteStatus(IDE_STATUS_RDY); // pio in (class 1) command type
-  EnableFpga();
-  SPI(CMD_IDE_DATA_WR); // write data command
-  SPI(0x00);
-  SPI(0x00);
-  SPI(0x00);
-  SPI(0x00);
-  SPI(0x00);
-  for (i = 0; i < 256; i++) {
-    SPI((unsigned char)id[i]);
-    SPI((unsigned char)(id[i] >> 8));
-  }
-  DisableFpga();
+  fpga_bulk_write(CMD_IDE_DATA_WR, (unsigned char*)id, 512); // little endian words
   WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ);
 }
 
@@ -1235,6 +1192,7 @@ static inline void ATA_ReadSectors(unsigned char* tfr, unsigned short sector, un
   long lba;
   int i;
   int block_count, blocks;
+  unsigned char *block = bufpool_acquire(BUF_HDD);
 
   lba=chs2lba(cylinder, head, sector, unit, lbamode);
   hdd_debugf("IDE%d: read %s, %d.%d.%d:%d, %d", unit, (lbamode ? "LBA" : "CHS"), cylinder, head, sector, lba, sector_count);
@@ -1246,7 +1204,12 @@ static inline void ATA_ReadSectors(unsigned char* tfr, unsigned short sector, un
 
     if (!verify) {
       WriteStatus(IDE_STATUS_RDY); // pio in (class 1) command type
-      while (!(GetFPGAStatus() & CMD_IDECMD)); // wait for empty sector buffer
+      if (!WaitFPGAStatus(CMD_IDECMD, HDD_REQ_TIMEOUT)) { // wait for empty sector buffer
+        hdd_debugf("IDE%d: read timeout", unit);
+        WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ | IDE_STATUS_ERR);
+        bufpool_release(block);
+        return;
+      }
     }
     /* Advance CHS address while DRQ is not asserted with the address of last (anticipated) read. */
     int block_count_tmp = block_count;
@@ -1309,13 +1272,8 @@ static inline void ATA_ReadSectors(unsigned char* tfr, unsigned short sector, un
               rdb->rdb_Flags=swab32(0x12);
             }
           }
-          if (!verify) {
-            EnableFpga();
-            spi8(CMD_IDE_DATA_WR); // write data command
-            spi_n(0x00, 5);
-            spi_block_write(sector_buffer);
-            DisableFpga();
-          }
+          if (!verify)
+            fpga_bulk_write(CMD_IDE_DATA_WR, sector_buffer, 512);
           ++lba;
           --blk;
         }
@@ -1329,24 +1287,9 @@ static inline void ATA_ReadSectors(unsigned char* tfr, unsigned short sector, un
 #endif
             blocks = blk;
             while (blocks) {
-              FileReadBlockEx(&hdf[unit].idxfile->file, sector_buffer, MIN(blocks, SECTOR_BUFFER_SIZE/512));
-              if (!verify) {
-#ifdef HAVE_QSPI
-                if(minimig_v2()) {
-                  qspi_start_write();
-                  qspi_write_block(sector_buffer, 512*MIN(blocks, SECTOR_BUFFER_SIZE/512));
-                  qspi_end();
-                } else {
-#endif
-                EnableFpga();
-                spi8(CMD_IDE_DATA_WR); // write data command
-                spi_n(0x00, 5);
-                spi_write(sector_buffer, 512*MIN(blocks, SECTOR_BUFFER_SIZE/512));
-                DisableFpga();
-#ifdef HAVE_QSPI
-                }
-#endif
-              }
+              FileReadBlockEx(&hdf[unit].idxfile->file, block, MIN(blocks, SECTOR_BUFFER_SIZE/512));
+              if (!verify)
+                fpga_bulk_write(CMD_IDE_DATA_WR, block, 512*MIN(blocks, SECTOR_BUFFER_SIZE/512));
               blocks-=MIN(blocks, SECTOR_BUFFER_SIZE/512);
             }
 #ifndef SD_NO_DIRECT_MODE
@@ -1372,25 +1315,9 @@ static inline void ATA_ReadSectors(unsigned char* tfr, unsigned short sector, un
 #endif
           blocks = block_count;
           while (blocks) {
-            disk_read(fs.pdrv, sector_buffer, lba+hdf[unit].offset, MIN(blocks, SECTOR_BUFFER_SIZE/512));
-            if (!verify) {
-#ifdef HAVE_QSPI
-              if(minimig_v2()) {
-                qspi_start_write();
-                qspi_write_block(sector_buffer, 512*MIN(blocks, SECTOR_BUFFER_SIZE/512));
-                qspi_end();
-              } else {
-#else
-              EnableFpga();
-              spi8(CMD_IDE_DATA_WR); // write data command
-              spi_n(0x00, 5);
-              spi_write(sector_buffer, 512*MIN(blocks, SECTOR_BUFFER_SIZE/512));
-              DisableFpga();
-#endif
-#ifdef HAVE_QSPI
-              }
-#endif
-            }
+            disk_read(fs.pdrv, block, lba+hdf[unit].offset, MIN(blocks, SECTOR_BUFFER_SIZE/512));
+            if (!verify)
+              fpga_bulk_write(CMD_IDE_DATA_WR, block, 512*MIN(blocks, SECTOR_BUFFER_SIZE/512));
             lba+=MIN(blocks, SECTOR_BUFFER_SIZE/512);
             blocks-=MIN(blocks, SECTOR_BUFFER_SIZE/512);
           }
@@ -1400,6 +1327,7 @@ static inline void ATA_ReadSectors(unsigned char* tfr, unsigned short sector, un
         break;
     }
   }
+  bufpool_release(block);
   if (verify) {
     WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ);
   } else {
@@ -1414,6 +1342,7 @@ static inline void ATA_WriteSectors(unsigned char* tfr, unsigned short sector, u
   unsigned short i;
   unsigned short block_count, block_size, sectors;
   unsigned char *buf;
+  unsigned char *block = bufpool_acquire(BUF_HDD);
   long lba=chs2lba(cylinder, head, sector, unit, lbamode);
 
   // write sectors
@@ -1436,18 +1365,15 @@ static inline void ATA_WriteSectors(unsigned char* tfr, unsigned short sector, u
     {
       block_size = (block_count > SECTOR_BUFFER_SIZE/512) ? (SECTOR_BUFFER_SIZE/512) : block_count;
       sectors = block_size;
-      buf = sector_buffer;
+      buf = block;
       while(sectors--) {
-        while (!(GetFPGAStatus() & CMD_IDEDAT)); // wait for full write buffer
-        EnableFpga();
-        SPI(CMD_IDE_DATA_RD); // read data command
-        SPI(0x00);
-        SPI(0x00);
-        SPI(0x00);
-        SPI(0x00);
-        SPI(0x00);
-        spi_block_read(buf);
-        DisableFpga();
+        if (!WaitFPGAStatus(CMD_IDEDAT, HDD_REQ_TIMEOUT)) { // wait for full write buffer
+          hdd_debugf("IDE%d: write timeout", unit);
+          WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ | IDE_STATUS_ERR);
+          bufpool_release(block);
+          return;
+        }
+        fpga_bulk_read(CMD_IDE_DATA_RD, buf, 512);
         buf += 512;
       }
       switch(hdf[unit].type) {
@@ -1455,7 +1381,7 @@ static inline void ATA_WriteSectors(unsigned char* tfr, unsigned short sector, u
         case HDF_FILE:
           if (f_size(&hdf[unit].idxfile->file) && (lba>-1)) {
             // Don't attempt to write to fake RDB
-            f_write(&hdf[unit].idxfile->file, sector_buffer, 512*block_size, &bw);
+            f_write(&hdf[unit].idxfile->file, block, 512*block_size, &bw);
           }
           lba+=block_size;
           break;
@@ -1464,7 +1390,7 @@ static inline void ATA_WriteSectors(unsigned char* tfr, unsigned short sector, u
         case HDF_CARDPART1:
         case HDF_CARDPART2:
         case HDF_CARDPART3:
-          disk_write(fs.pdrv, sector_buffer, lba, block_size);
+          disk_write(fs.pdrv, block, lba, block_size);
           lba+=block_size;
           break;
       }
@@ -1506,11 +1432,12 @@ static inline void ATA_WriteSectors(unsigned char* tfr, unsigned short sector, u
     else
         WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ);
   }
+  bufpool_release(block);
 }
 
 
-// HandleHDD()
-void HandleHDD(unsigned char c1, unsigned char c2, unsigned char cs1ena)
+// HandleHDDRequest()
+static void HandleHDDRequest(unsigned char c1, unsigned char c2, unsigned char cs1ena)
 {
   unsigned char  tfr[8];
   unsigned short i;
@@ -1610,6 +1537,14 @@ void HandleHDD(unsigned char c1, unsigned char c2, unsigned char cs1ena)
   if (c1 & 0x01) cdrom_playaudio();
 }
 
+void HandleHDD(unsigned char c1, unsigned char c2, unsigned char cs1ena)
+{
+  PROF_START(t);
+  HandleHDDRequest(c1, c2, cs1ena);
+  // idle polls would hide the requests in the average
+  if (c1 & CMD_IDECMD) PROF_END(PROF_HDD, t);
+}
+
 
 // GetHardfileGeometry()
 // this function comes from WinUAE, should return the same CHS as WinUAE
@@ -21,6 +21,8 @@
 
 #define CMD_IDE_CFG_WR    0xFA
 
+#define HDD_REQ_TIMEOUT   2000 // ms the core may take to fill/drain the sector buffer
+
 #define IDE_STATUS_END  0x80
 #define IDE_STATUS_PKT  0x20
 #define IDE_STATUS_IRQ  0x10
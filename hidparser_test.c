@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "hidparser.h"
+
+// random report descriptors are parsed and the extraction plan is compared
+// against the generic bit collector the report processing used before
+
+#define DESCRIPTORS 20000
+#define REPORTS     50
+
+void iprintf(const char *format, ...) {
+  // the parser is quite verbose
+}
+
+// the former collect_bits() of usb/hid.c
+static uint16_t collect_bits(uint8_t *p, uint16_t offset, uint8_t size, bool is_signed) {
+  // mask unused bits of first byte
+  uint8_t mask = 0xff << (offset&7);
+  uint8_t byte = offset/8;
+  uint8_t bits = size;
+  uint8_t shift = offset&7;
+
+  uint16_t rval = (p[byte++] & mask) >> shift;
+  mask = 0xff;
+  shift = 8-shift;
+  bits -= shift;
+
+  // first byte already contained more bits than we need
+  if(shift > size) {
+    // mask unused bits
+    rval &= (1<<size)-1;
+  } else {
+    // further bytes if required
+    while(bits) {
+      mask = (bits<8)?(0xff>>(8-bits)):0xff;
+      rval += (p[byte++] & mask) << shift;
+      shift += 8;
+      bits -= (bits>8)?8:bits;
+    }
+  }
+
+  if(is_signed && size) {
+    // do sign expansion
+    uint16_t sign_bit = 1<<(size-1);
+    if(rval & sign_bit) {
+      while(sign_bit) {
+        rval |= sign_bit;
+        sign_bit <<= 1;
+      }
+    }
+  }
+
+  return rval;
+}
+
+static uint8_t desc[512];
+static uint16_t len;
+
+static void item(uint8_t tag, uint8_t type, uint32_t value, uint8_t size) {
+  desc[len++] = (tag << 4) | (type << 2) | (size == 4 ? 3 : size);
+  while(size--) {
+    desc[len++] = value;
+    value >>= 8;
+  }
+}
+
+#define MAIN(tag, v)   item(tag, 0, v, 1)
+#define GLOBAL(tag, v) item(tag, 1, v, ((v) > 0xff) ? 2 : 1)
+#define LOCAL(tag, v)  item(tag, 2, v, 1)
+
+static void random_descriptor(void) {
+  int n = 1 + rand() % 6;
+
+  len = 0;
+  GLOBAL(0, 1);                    // usage page generic desktop
+  LOCAL(0, (rand() & 1) ? 4 : 5);  // usage joystick/gamepad
+  MAIN(10, 1);                     // application collection
+
+  while(n--) {
+    int size = 1 + rand() % 16, count = 1 + rand() % 4, i;
+
+    switch(rand() % 4) {
+    case 0: // buttons, mostly one bit each
+      if(rand() % 4) size = 1;
+      count = 1 + rand() % 14;
+      GLOBAL(0, 9);
+      LOCAL(1, 1);
+      LOCAL(2, count);
+      GLOBAL(1, 0);
+      GLOBAL(2, 1);
+      break;
+
+    case 1: // axes, signed ones have min > max
+      GLOBAL(0, 1);
+      for(i=0;i<count;i++)
+        LOCAL(0, 48 + rand() % 6);
+      if(rand() & 1) {
+        GLOBAL(1, (size > 8) ? 0x8000 : 0x80);
+        GLOBAL(2, (size > 8) ? 0x7fff : 0x7f);
+      } else {
+        GLOBAL(1, 0);
+        GLOBAL(2, (size > 8) ? 0xffff : 0xff);
+      }
+      break;
+
+    case 2: // hat
+      count = 1;
+      GLOBAL(0, 1);
+      LOCAL(0, 57);
+      GLOBAL(1, 0);
+      GLOBAL(2, 7);
+      GLOBAL(3, 0);
+      GLOBAL(4, 315);
+      break;
+
+    default: // padding
+      break;
+    }
+
+    GLOBAL(7, size);
+    GLOBAL(9, count);
+    MAIN(8, 2);
+  }
+
+  MAIN(12, 0);
+}
+
+static int check_report(hid_report_t *conf, uint8_t *p) {
+  uint8_t i, btn = 0, btn_extra = 0;
+  int err = 0;
+
+  for(i=0;i<MAX_AXES;i++) {
+    bool is_signed = conf->joystick_mouse.axis[i].logical.min >
+      conf->joystick_mouse.axis[i].logical.max;
+    if(hid_field_get(&conf->plan.axis[i], p) !=
+       collect_bits(p, conf->joystick_mouse.axis[i].offset, conf->joystick_mouse.axis[i].size, is_signed)) {
+      printf("axis %d @%d size %d mismatch\n", i, conf->joystick_mouse.axis[i].offset, conf->joystick_mouse.axis[i].size);
+      err++;
+    }
+  }
+
+  if(hid_field_get(&conf->plan.hat, p) !=
+     collect_bits(p, conf->joystick_mouse.hat.offset, conf->joystick_mouse.hat.size, 0)) {
+    printf("hat @%d size %d mismatch\n", conf->joystick_mouse.hat.offset, conf->joystick_mouse.hat.size);
+    err++;
+  }
+
+  for(i=0;i<MAX_BUTTONS;i++)
+    if(p[conf->joystick_mouse.button[i].byte_offset] & conf->joystick_mouse.button[i].bitmask) {
+      if(i<4) btn |= 1<<i;
+      else    btn_extra |= 1<<(i-4);
+    }
+
+  if(conf->plan.buttons_packed) {
+    uint16_t b = hid_field_get(&conf->plan.buttons, p);
+    if((b & 0x0f) != btn || (b >> 4) != btn_extra) {
+      printf("buttons mismatch %x != %x/%x\n", b, btn, btn_extra);
+      err++;
+    }
+  }
+
+  return err;
+}
+
+int main() {
+  hid_report_t conf;
+  uint8_t report[256+3];
+  int d, r, i, usable = 0, packed = 0, errors = 0;
+
+  srand(1);
+
+  for(d=0;d<DESCRIPTORS;d++) {
+    random_descriptor();
+    if(!parse_report_descriptor(desc, len, &conf))
+      continue;
+
+    usable++;
+    if(conf.plan.buttons_packed) packed++;
+
+    for(r=0;r<REPORTS;r++) {
+      for(i=0;i<sizeof(report);i++)
+        report[i] = rand();
+      errors += check_report(&conf, report);
+    }
+
+    // swapped buttons (like a mist.ini remap) disable the packed path
+    if(conf.joystick_mouse.button_count > 1) {
+      uint8_t byte_offset = conf.joystick_mouse.button[0].byte_offset;
+      uint8_t bitmask = conf.joystick_mouse.button[0].bitmask;
+      conf.joystick_mouse.button[0] = conf.joystick_mouse.button[1];
+      conf.joystick_mouse.button[1].byte_offset = byte_offset;
+      conf.joystick_mouse.button[1].bitmask = bitmask;
+      hid_plan_compile(&conf);
+      if(conf.plan.buttons_packed) {
+        printf("swapped buttons still packed\n");
+        errors++;
+      }
+      errors += check_report(&conf, report);
+    }
+  }
+
+  // fields at every bit position and size
+  for(d=0;d<8*8;d++) {
+    for(i=0;i<=24;i++) {
+      conf.joystick_mouse.axis[0].offset = d;
+      conf.joystick_mouse.axis[0].size = i;
+      conf.joystick_mouse.axis[0].logical.min = rand() & 1;
+      conf.joystick_mouse.axis[0].logical.max = 0;
+      hid_plan_compile(&conf);
+      for(r=0;r<REPORTS;r++) {
+        for(int j=0;j<sizeof(report);j++)
+          report[j] = rand();
+        errors += check_report(&conf, report);
+      }
+    }
+  }
+
+  printf("%d descriptors, %d usable, %d with packed buttons, %d errors\n",
+    DESCRIPTORS, usable, packed, errors);
+
+  if(errors || !usable || !packed) {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  printf("OK\n");
+  return 0;
+}
@@ -136,18 +136,20 @@ uint16_t AT91F_USB_Read(char *pData, uint16_t length) {
 //* \brief Send through endpoint 2
 //*----------------------------------------------------------------------------
 
-static void wait4tx(char ep) {
+// returns 0 if the host didn't take the packet in time
+static char wait4tx(char ep) {
   long to = GetTimer(2);  // wait max 2ms for tx to succeed
 
   // wait for host to acknowledge data reception
   while ( !(AT91C_BASE_UDP->UDP_CSR[ep] & AT91C_UDP_TXCOMP) ) 
-    if(CheckTimer(to)) return;
+    if(CheckTimer(to)) return 0;
 
   // clear flag (clear irq)
   AT91C_BASE_UDP->UDP_CSR[ep] &= ~AT91C_UDP_TXCOMP;
 
   // wait for register clear to succeed
   while (AT91C_BASE_UDP->UDP_CSR[ep] & AT91C_UDP_TXCOMP);
+  return 1;
 }
 
 // copy bytes to the endpoint fifo and start transmission
@@ -164,14 +166,13 @@ static uint16_t ep_tx(char ep, const char *pData, uint16_t length) {
 
 uint16_t AT91F_USB_Write(const char *pData, uint16_t length) {
 
-  if ( !AT91F_USB_Is_Configured() )
-    return length;
-
-  while(length) {
+  // stop at a timeout or when the host deconfigures the device,
+  // the bytes not sent are returned
+  while(length && AT91F_USB_Is_Configured()) {
     uint16_t sent = ep_tx(AT91C_EP_IN, pData, length);
     length -= sent;
     pData += sent;
-    wait4tx(AT91C_EP_IN);
+    if(!wait4tx(AT91C_EP_IN)) break;
   }
 
   return length;
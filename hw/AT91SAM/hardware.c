@@ -301,6 +301,60 @@ void WaitTimer(unsigned long time)
     while (!CheckTimer(time));
 }
 
+#ifdef FPGA_IRQ
+static volatile unsigned char fpga_irq;
+
+static void FpgaIrqHandler(void) {
+    // reading the status acknowledges the input change
+    if(*AT91C_PIOA_ISR & FPGA_IRQ)
+        fpga_irq = 1;
+}
+
+char FpgaIrqEnable(char on) {
+    unsigned int dummy;
+
+    AT91C_BASE_AIC->AIC_IDCR = 1 << AT91C_ID_PIOA;
+    *AT91C_PIOA_IDR = FPGA_IRQ;
+    if(!on) return 0;
+
+    AT91C_BASE_AIC->AIC_SVR[AT91C_ID_PIOA] = (unsigned int)FpgaIrqHandler;
+    AT91C_BASE_AIC->AIC_SMR[AT91C_ID_PIOA] = 1 | AT91C_AIC_SRCTYPE_INT_HIGH_LEVEL;
+    dummy = *AT91C_PIOA_ISR;
+    AT91C_BASE_AIC->AIC_ICCR = 1 << AT91C_ID_PIOA;
+
+    // fetch the status once in case a request is already waiting
+    fpga_irq = 1;
+    *AT91C_PIOA_IER = FPGA_IRQ;
+    AT91C_BASE_AIC->AIC_IECR = 1 << AT91C_ID_PIOA;
+    return 1;
+}
+
+char FpgaIrqPending(void) {
+    if(!fpga_irq) return 0;
+    fpga_irq = 0;
+    return 1;
+}
+#else
+char FpgaIrqEnable(char on) {
+    return 0;
+}
+
+char FpgaIrqPending(void) {
+    return 0;
+}
+#endif
+
+#ifdef PROFILE
+void InitProfTicks(void) {
+    // the PIT is already running for GetTimer()
+}
+
+RAMFUNC unsigned long GetProfTicks(void) {
+    unsigned long piir = *AT91C_PITC_PIIR;
+    return (piir >> 20) * (MCLK/16/1000) + (piir & AT91C_PITC_CPIV);
+}
+#endif
+
 inline char mmc_inserted() {
   return !(*AT91C_PIOA_PDSR & SD_CD);
 }
@@ -55,6 +55,12 @@
 #define ALTERA_NSTATUS_STATE (FPGA_PDSR & ALTERA_NSTATUS)
 #define ALTERA_DONE_STATE    (FPGA_DONE_PDSR & ALTERA_DONE)
 
+// DATA0 and DCLK written together through ODSR while shifting the bitstream
+#define ALTERA_DATA0_SHIFT   9
+#define ALTERA_SHIFT_START   *AT91C_PIOA_OWER = ALTERA_DATA0 | ALTERA_DCLK;
+#define ALTERA_SHIFT_STOP    *AT91C_PIOA_OWDR = ALTERA_DATA0 | ALTERA_DCLK;
+#define ALTERA_SHIFT_ODSR    (*AT91C_PIOA_ODSR)
+
 #endif
 
 // db9 joystick ports
@@ -83,6 +89,9 @@
 
 #define VBL           AT91C_PIO_PA7
 
+// no user I/O of the FPGA is routed back to the controller, so there
+// is no FPGA_IRQ request line and FEAT_FPGA_IRQ cores are polled
+
 #define USB_LOAD_VAR         *(int*)(0x0020FF04)
 #define USB_LOAD_VALUE       12345678
 
@@ -100,6 +109,7 @@
 #define USB_BOOT_VAR         (*(int*)0x0020FF18)
 
 #define SECTOR_BUFFER_SIZE   4096
+#define BUF_POOL_BLOCKS      0    // no RAM to spare, all users share sector_buffer
 
 char mmc_inserted(void);
 char mmc_write_protected(void);
@@ -115,6 +125,17 @@ void WaitTimer(unsigned long time);
 
 void USART_Poll(void);
 
+char FpgaIrqEnable(char on);
+char FpgaIrqPending(void);
+
+#ifdef PROFILE
+// sub-ms PIT counter (MCLK/16) combined with the ms count, wraps after 4096ms
+#define PROF_TICKS_PER_US  (MCLK/16/1000000)
+#define PROF_TICKS_WRAP    (4096*(MCLK/16/1000))
+void InitProfTicks(void);
+unsigned long GetProfTicks(void);
+#endif
+
 void inline MCUReset() {*AT91C_RSTC_RCR = 0xA5 << 24 | AT91C_RSTC_PERRST | AT91C_RSTC_PROCRST | AT91C_RSTC_EXTRST;}
 
 void InitRTTC();
@@ -39,7 +39,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "mmc.h"
 
+#define MMC_LOOKAHEAD 8 // bytes after a block's CRC searched for the next data token
+
 // variables
+static unsigned char crc_tail[2 + MMC_LOOKAHEAD]; // received CRC, not checked
+static unsigned char crc_dummy[2] = { 0xff, 0xff };
 static unsigned char crc;
 static unsigned long timeout;
 static unsigned char response;
@@ -291,7 +295,7 @@ RAMFUNC static unsigned char MMC_WaitBusy(unsigned long timeout)
     }
 }
 
-RAMFUNC static unsigned char MMC_ReceiveDataBlock(unsigned char *pReadBuffer)
+RAMFUNC static unsigned char MMC_WaitDataToken(void)
 {
     // now we are waiting for data token, it takes around 300us
     timeout = 0;
@@ -303,6 +307,12 @@ RAMFUNC static unsigned char MMC_ReceiveDataBlock(unsigned char *pReadBuffer)
             return(0);
         }
     }
+    return(1);
+}
+
+RAMFUNC static unsigned char MMC_ReceiveDataBlock(unsigned char *pReadBuffer)
+{
+    if (!MMC_WaitDataToken()) return(0);
 
     if (pReadBuffer == 0)
     {   // in this mode we do not receive data, instead the FPGA captures directly the data stream transmitted by the SD/MMC card
@@ -312,12 +322,47 @@ RAMFUNC static unsigned char MMC_ReceiveDataBlock(unsigned char *pReadBuffer)
         SPI(0xff);
         //spi_read(sector_buffer, 512);
         DisableDMode();
+        SPI(0xFF); // read CRC lo byte
+        SPI(0xFF); // read CRC hi byte
     }
     else
-      spi_block_read(pReadBuffer);
+      spi_read_chained(pReadBuffer, 512, crc_tail, 2); // data and CRC in one PDC transfer
+
+    return(1);
+}
+
+// Receive the blocks of a CMD18 into memory. The PDC transfer of each block
+// also fetches the CRC and a few bytes of the gap to the next block. The
+// next data token is usually among them, so the byte by byte token wait and
+// the start of the next block's data are saved.
+static unsigned char MMC_ReceiveDataBlocks(unsigned char *pReadBuffer, unsigned long nBlockCount)
+{
+    unsigned char *next = crc_tail;
+    unsigned short got = 0; // bytes of the next block already in crc_tail
+    unsigned char i;
 
-    SPI(0xFF); // read CRC lo byte
-    SPI(0xFF); // read CRC hi byte
+    if (!MMC_WaitDataToken()) return(0);
+
+    while (nBlockCount--)
+    {
+        memcpy(pReadBuffer, next, got);
+        spi_read_chained(pReadBuffer + got, 512 - got, crc_tail, nBlockCount ? sizeof(crc_tail) : 2);
+        pReadBuffer += 512;
+        if (!nBlockCount) break;
+
+        for (i = 2; i < sizeof(crc_tail) && crc_tail[i] == 0xFF; i++);
+        if (i == sizeof(crc_tail)) {
+            // token not there yet
+            if (!MMC_WaitDataToken()) return(0);
+            got = 0;
+        } else if (crc_tail[i] != 0xFE) {
+            iprintf("CMD18 (READ_MULTIPLE_BLOCK): error token 0x%02X\r", crc_tail[i]);
+            return(0);
+        } else {
+            next = &crc_tail[i + 1];
+            got = sizeof(crc_tail) - i - 1;
+        }
+    }
     return(1);
 }
 
@@ -371,13 +416,19 @@ unsigned char MMC_ReadMultiple(unsigned long lba, unsigned char *pReadBuffer, un
         return(0);
     }
 
-    while (nBlockCount--)
+    if (pReadBuffer)
     {
-        if (!MMC_ReceiveDataBlock(pReadBuffer)) {
+        if (!MMC_ReceiveDataBlocks(pReadBuffer, nBlockCount)) {
+            DisableCard();
+            return (0);
+        }
+    }
+    else while (nBlockCount--)
+    {
+        if (!MMC_ReceiveDataBlock(0)) {
             DisableCard();
             return (0);
         }
-        if (pReadBuffer) pReadBuffer+=512;
     }
     MMC_CMD12(); // stop multi block transmission
 
@@ -395,13 +446,10 @@ static char MMC_SendDataBlock(const unsigned char *pWriteBuffer, unsigned char t
     SPI(0xFF); // one byte gap
     SPI(token); // send token
 
-    // send sector bytes
-    spi_block_write(pWriteBuffer);
+    // send sector bytes and the (unchecked) CRC in one PDC transfer
+    spi_write_chained(pWriteBuffer, 512, crc_dummy, 2);
     spi_wait4xfer_end();
 
-    SPI(0xFF); // send CRC lo byte
-    SPI(0xFF); // send CRC hi byte
-
     response = SPI(0xFF); // read packet response
 
     // Status codes
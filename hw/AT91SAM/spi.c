@@ -1,6 +1,15 @@
 #include "spi.h"
+#include "spi_batch.h"
 #include "hardware.h"
 
+#define SPI_CSR_FPGA (AT91C_SPI_CPOL | AT91C_SPI_CSAAT | (2 << 8) | (0x04 << 16))
+
+// delay between consecutive transfers (DLYBCT) is counted in 32 MCLK units
+static unsigned char spi_dlybct(unsigned short gap) {
+    unsigned long dly = ((unsigned long)gap * (MCLK / 1000000) + 31999) / 32000;
+    return (dly > 255) ? 255 : dly;
+}
+
 void spi_init() {
     // Enable the peripheral clock in the PMC
     AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_SPI;
@@ -14,7 +23,7 @@ void spi_init() {
     // SPI CS register
     AT91C_SPI_CSR[0] = AT91C_SPI_CPOL | AT91C_SPI_CSAAT | (2 << 8) | (0x04 << 16) | (0x00 << 24); // USB
     AT91C_SPI_CSR[1] = AT91C_SPI_CPOL | AT91C_SPI_CSAAT | (48 << 8) | (0x04 << 16) | (0x00 << 24); // MMC/CONF_DATA
-    AT91C_SPI_CSR[2] = AT91C_SPI_CPOL | AT91C_SPI_CSAAT | (2 << 8) | (0x04 << 16) | (0x00 << 24); // Data IO
+    AT91C_SPI_CSR[2] = SPI_CSR_FPGA | (0x00 << 24); // Data IO
     AT91C_SPI_CSR[3] = AT91C_SPI_CPOL | AT91C_SPI_CSAAT | (2 << 8) | (0x04 << 16) | (0x00 << 24); // OSD
 
     // Configure pins for SPI use
@@ -36,6 +45,15 @@ RAMFUNC void spi_wait4xfer_end() {
 
 void EnableFpga()
 {
+    AT91C_SPI_CSR[2] = SPI_CSR_FPGA;
+    *AT91C_SPI_CR = AT91C_SPI_SPIEN;
+    *AT91C_SPI_MR = AT91C_SPI_MSTR | AT91C_SPI_MODFDIS  | (0x03 << 16); // NPCS2
+}
+
+// select the FPGA with at least 'gap' ns between the bytes of a (DMA) transfer
+void EnableFpgaPaced(unsigned short gap)
+{
+    AT91C_SPI_CSR[2] = SPI_CSR_FPGA | (spi_dlybct(gap) << 24);
     *AT91C_SPI_CR = AT91C_SPI_SPIEN;
     *AT91C_SPI_MR = AT91C_SPI_MSTR | AT91C_SPI_MODFDIS  | (0x03 << 16); // NPCS2
 }
@@ -134,6 +152,52 @@ RAMFUNC void spi_read(char *addr, uint16_t len) {
   *AT91C_PIOA_PDR = AT91C_PA13_MOSI; // disable GPIO function
 }
 
+// full duplex transfer, either buffer may be NULL
+RAMFUNC void spi_transfer(const char *src, char *dst, uint16_t len) {
+  if (!src) {
+    spi_read(dst, len);
+    return;
+  }
+  if (!dst) {
+    spi_write(src, len);
+    return;
+  }
+
+  // use SPI PDC (DMA transfer)
+  *AT91C_SPI_TPR = (unsigned long)src;
+  *AT91C_SPI_TCR = len;
+  *AT91C_SPI_TNCR = 0;
+  *AT91C_SPI_RPR = (unsigned long)dst;
+  *AT91C_SPI_RCR = len;
+  *AT91C_SPI_RNCR = 0;
+  *AT91C_SPI_PTCR = AT91C_PDC_RXTEN | AT91C_PDC_TXTEN; // start DMA transfer
+  // wait for tranfer end
+  while ((*AT91C_SPI_SR & (AT91C_SPI_ENDTX | AT91C_SPI_ENDRX)) != (AT91C_SPI_ENDTX | AT91C_SPI_ENDRX));
+  *AT91C_SPI_PTCR = AT91C_PDC_RXTDIS | AT91C_PDC_TXTDIS; // disable transmitter and receiver
+}
+
+// two buffers in one PDC transfer, the second one through the next pointer
+RAMFUNC void spi_read_chained(char *addr, uint16_t len, char *addr2, uint16_t len2) {
+  *AT91C_PIOA_SODR = AT91C_PA13_MOSI; // set GPIO output register
+  *AT91C_PIOA_OER = AT91C_PA13_MOSI;  // GPIO pin as output
+  *AT91C_PIOA_PER = AT91C_PA13_MOSI;  // enable GPIO function
+
+  *AT91C_SPI_TPR = (unsigned long)addr;
+  *AT91C_SPI_TCR = len;
+  *AT91C_SPI_TNPR = (unsigned long)addr2;
+  *AT91C_SPI_TNCR = len2;
+  *AT91C_SPI_RPR = (unsigned long)addr;
+  *AT91C_SPI_RCR = len;
+  *AT91C_SPI_RNPR = (unsigned long)addr2;
+  *AT91C_SPI_RNCR = len2;
+  *AT91C_SPI_PTCR = AT91C_PDC_RXTEN | AT91C_PDC_TXTEN; // start DMA transfer
+  // wait until both buffers are done
+  while ((*AT91C_SPI_SR & (AT91C_SPI_TXBUFE | AT91C_SPI_RXBUFF)) != (AT91C_SPI_TXBUFE | AT91C_SPI_RXBUFF));
+  *AT91C_SPI_PTCR = AT91C_PDC_RXTDIS | AT91C_PDC_TXTDIS; // disable transmitter and receiver
+
+  *AT91C_PIOA_PDR = AT91C_PA13_MOSI; // disable GPIO function
+}
+
 RAMFUNC void spi_block_read(char *addr) {
   spi_read(addr, 512);
 }
@@ -150,6 +214,18 @@ void spi_write(const char *addr, uint16_t len) {
   *AT91C_SPI_PTCR = AT91C_PDC_TXTDIS; // disable transmitter
 }
 
+void spi_write_chained(const char *addr, uint16_t len, const char *addr2, uint16_t len2) {
+  *AT91C_SPI_TPR = (unsigned long)addr;
+  *AT91C_SPI_TCR = len;
+  *AT91C_SPI_TNPR = (unsigned long)addr2;
+  *AT91C_SPI_TNCR = len2;
+  *AT91C_SPI_RCR = 0;
+  *AT91C_SPI_PTCR = AT91C_PDC_TXTEN; // start DMA transfer
+  // wait until both buffers are done
+  while (!(*AT91C_SPI_SR & AT91C_SPI_TXBUFE));
+  *AT91C_SPI_PTCR = AT91C_PDC_TXTDIS; // disable transmitter
+}
+
 void spi_block_write(const char *addr) {
   spi_write(addr, 512);
 }
@@ -281,8 +357,10 @@ void spi_osd_cmd32le(unsigned char cmd, unsigned long parm) {
   DisableOsd();
 }
 
-/* User_io related SPI functions */
+/* User_io related SPI functions. Commands still queued in spi_batch.c go
+   first, so a newer direct write can't be overwritten by a stale one. */
 void spi_uio_cmd_cont(unsigned char cmd) {
+  spi_batch_flush();
   EnableIO();
   SPI(cmd);
 }
@@ -293,6 +371,7 @@ void spi_uio_cmd(unsigned char cmd) {
 }
 
 void spi_uio_cmd8_cont(unsigned char cmd, unsigned char parm) {
+  spi_batch_flush();
   EnableIO();
   SPI(cmd);
   SPI(parm);
@@ -304,6 +383,7 @@ void spi_uio_cmd8(unsigned char cmd, unsigned char parm) {
 }
 
 void spi_uio_cmd32(unsigned char cmd, unsigned long parm) {
+  spi_batch_flush();
   EnableIO();
   SPI(cmd);
   SPI(parm);
@@ -314,6 +394,7 @@ void spi_uio_cmd32(unsigned char cmd, unsigned long parm) {
 }
 
 void spi_uio_cmd64(unsigned char cmd, unsigned long long parm) {
+  spi_batch_flush();
   EnableIO();
   SPI(cmd);
   SPI(parm);
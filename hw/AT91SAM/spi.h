@@ -19,6 +19,7 @@ void spi_set_speed(unsigned char speed);
 /* chip select functions */
 #define EnableFpgaMinimig EnableFpga
 void EnableFpga(void);
+void EnableFpgaPaced(unsigned short gap);
 void DisableFpga(void);
 void EnableOsd(void);
 void DisableOsd(void);
@@ -43,6 +44,9 @@ RAMFUNC void spi_read(char *addr, uint16_t len);
 void spi_block_write(const char *addr);
 void spi_write(const char *addr, uint16_t len);
 void spi_block(unsigned short num);
+RAMFUNC void spi_transfer(const char *src, char *dst, uint16_t len);
+RAMFUNC void spi_read_chained(char *addr, uint16_t len, char *addr2, uint16_t len2);
+void spi_write_chained(const char *addr, uint16_t len, const char *addr2, uint16_t len2);
 
 /* OSD related SPI functions */
 void spi_osd_cmd_cont(unsigned char cmd);
@@ -455,6 +455,14 @@ uint8_t usb_cdc_is_configured() {
   return (!mist_cfg.usb_storage);
 }
 
+void usb_cdc_write_start(const char *pData, uint16_t length) {
+  usb_cdc_write(pData, length);
+}
+
+uint8_t usb_cdc_write_busy(void) {
+  return 0;
+}
+
 //*----------------------------------------------------------------------------
 //* \fn    AT91F_CDC_Open
 //* \brief
@@ -484,6 +492,42 @@ uint8_t usb_storage_is_configured() {
   return (mist_cfg.usb_storage);
 }
 
+static uint32_t storage_xfer_done;
+
+void usb_storage_write_start(const char *pData, uint32_t length) {
+  storage_xfer_done = 0;
+  if (!usb_storage_is_configured()) return;
+  while (length) {
+    uint16_t write = MIN(length, 0x8000);
+    uint16_t left = AT91F_USB_Write(pData, write);
+    storage_xfer_done += write - left;
+    // usb_storage_wait() reports the short transfer
+    if (left) return;
+    pData += write;
+    length -= write;
+  }
+}
+
+void usb_storage_read_start(char *pData, uint32_t length) {
+  long to = GetTimer(100);  // wait max 100ms for host
+
+  storage_xfer_done = 0;
+  while (length) {
+    uint16_t read;
+    if (CheckTimer(to)) return;
+    read = usb_storage_read(pData, MIN(length, AT91C_EP_OUT_SIZE));
+    pData += read;
+    length -= read;
+    storage_xfer_done += read;
+    // a short packet ends the transfer
+    if (read && read < AT91C_EP_OUT_SIZE) return;
+  }
+}
+
+uint32_t usb_storage_wait(void) {
+  return storage_xfer_done;
+}
+
 void usb_dev_open(void) {
   if (mist_cfg.usb_storage)
     usb_storage_open();
@@ -0,0 +1,110 @@
+/*
+This file is part of MiST-firmware
+
+MiST-firmware is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+MiST-firmware is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include "hardware.h"
+#include "cache.h"
+
+void cache_init(void)
+{
+    // The last 4K of the SRAM hold the DMA descriptors and the variables
+    // which survive a reset (USB_LOAD_VAR, VIDEO_*_VAR...). Map them as
+    // shareable, non-cacheable normal memory, the rest keeps the default map.
+    ARM_MPU_Disable();
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(0, SRAM_NC_ADDR),
+                      ARM_MPU_RASR(1, ARM_MPU_AP_FULL, 1, 1, 0, 0, 0, ARM_MPU_REGION_SIZE_4KB));
+    ARM_MPU_Enable(MPU_CTRL_PRIVDEFENA_Msk);
+
+    SCB_EnableICache();
+    SCB_EnableDCache();
+}
+
+#ifdef CACHE_TEST
+
+// DMA stress test: memory to memory XDMAC copies between cached buffers
+// with random offsets and lengths, using the same maintenance as the
+// drivers. Checks the copied data and the guard bytes around it.
+
+#define CACHE_TEST_SIZE   2048
+#define CACHE_TEST_ROUNDS 20000
+#define CACHE_TEST_GUARD  0xEE
+
+static uint8_t test_src[CACHE_TEST_SIZE + 2*CACHE_LINE_SIZE] CACHE_ALIGNED;
+static uint8_t test_dst[CACHE_TEST_SIZE + 2*CACHE_LINE_SIZE] CACHE_ALIGNED;
+static uint32_t seed = 1;
+
+static uint32_t test_rand(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static void test_dma_copy(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    cache_clean_region(src, len);
+    cache_clean_invalidate_region(dst, len);
+
+    XDMAC0->XDMAC_GD = XDMAC_GD_DI5;
+    XDMAC0->XDMAC_CH[DMA_CH_MEMCPY].XDMAC_CC = XDMAC_CC_TYPE_MEM_TRAN
+                                             | XDMAC_CC_MBSIZE_SINGLE
+                                             | XDMAC_CC_SWREQ_SWR_CONNECTED
+                                             | XDMAC_CC_CSIZE_CHK_1
+                                             | XDMAC_CC_DWIDTH_BYTE
+                                             | XDMAC_CC_SIF_AHB_IF0
+                                             | XDMAC_CC_DIF_AHB_IF0
+                                             | XDMAC_CC_SAM_INCREMENTED_AM
+                                             | XDMAC_CC_DAM_INCREMENTED_AM;
+    XDMAC0->XDMAC_CH[DMA_CH_MEMCPY].XDMAC_CSA = (uint32_t)src;
+    XDMAC0->XDMAC_CH[DMA_CH_MEMCPY].XDMAC_CDA = (uint32_t)dst;
+    XDMAC0->XDMAC_CH[DMA_CH_MEMCPY].XDMAC_CUBC = XDMAC_CUBC_UBLEN(len);
+    XDMAC0->XDMAC_CH[DMA_CH_MEMCPY].XDMAC_CIS; //read interrupt reg to clear any flags prior to enabling channel
+    XDMAC0->XDMAC_CH[DMA_CH_MEMCPY].XDMAC_CIE = XDMAC_CIE_BIE;
+    XDMAC0->XDMAC_GE = XDMAC_GE_EN5;
+    while (!(XDMAC0->XDMAC_CH[DMA_CH_MEMCPY].XDMAC_CIS & XDMAC_CIS_BIS));
+
+    cache_invalidate_region(dst, len);
+}
+
+void cache_test(void)
+{
+    uint32_t round, i, offs, len, errors = 0;
+    uint8_t pattern;
+
+    iprintf("Cache DMA test: %d rounds\n", CACHE_TEST_ROUNDS);
+    for (round = 0; round < CACHE_TEST_ROUNDS; round++) {
+        offs = test_rand() % (2*CACHE_LINE_SIZE);
+        len = 1 + test_rand() % CACHE_TEST_SIZE;
+        pattern = test_rand();
+
+        // dirty lines everywhere: new source data, guard around the target
+        for (i = 0; i < len; i++) test_src[offs + i] = pattern + i;
+        for (i = 0; i < sizeof(test_dst); i++) test_dst[i] = CACHE_TEST_GUARD;
+
+        test_dma_copy(test_dst + offs, test_src + offs, len);
+
+        for (i = 0; i < sizeof(test_dst); i++) {
+            uint8_t expect = (i >= offs && i < offs + len) ? (uint8_t)(pattern + i - offs) : CACHE_TEST_GUARD;
+            if (test_dst[i] != expect) {
+                if (errors++ < 10)
+                    iprintf("round %lu offs %lu len %lu: [%lu] %02x != %02x\n", round, offs, len, i, test_dst[i], expect);
+            }
+        }
+    }
+    iprintf("Cache DMA test: %lu errors\n", errors);
+}
+
+#endif // CACHE_TEST
@@ -0,0 +1,58 @@
+/*
+This file is part of MiST-firmware
+
+MiST-firmware is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+MiST-firmware is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <inttypes.h>
+#include "chip.h"
+#include "compiler.h"
+#include "core_cm7.h"
+
+#define CACHE_LINE_SIZE 32
+
+// DMA descriptors go to the sram_nc region of flash.ld, which the MPU maps
+// as non-cacheable. DMA buffers in cached SRAM should be line aligned, so the
+// maintenance of one buffer doesn't touch its neighbours.
+#define NOT_CACHED    SECTION(".region_nocache")
+#define CACHE_ALIGNED ALIGNED(CACHE_LINE_SIZE)
+
+void cache_init(void);
+#ifdef CACHE_TEST
+void cache_test(void);
+#endif
+
+// before a DMA reads memory written by the CPU
+static inline void cache_clean_region(const void *start, uint32_t length)
+{
+    SCB_CleanDCache_by_Addr((uint32_t*)start, length);
+}
+
+// before a DMA writes memory: no dirty line may be evicted over the new
+// data, and the data of neighbours sharing a line goes to the SRAM first
+static inline void cache_clean_invalidate_region(void *start, uint32_t length)
+{
+    SCB_CleanInvalidateDCache_by_Addr((uint32_t*)start, length);
+}
+
+// after a DMA wrote memory, before the CPU reads it
+static inline void cache_invalidate_region(void *start, uint32_t length)
+{
+    SCB_InvalidateDCache_by_Addr(start, length);
+}
+
+#endif // CACHE_H
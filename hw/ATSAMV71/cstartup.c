@@ -28,6 +28,12 @@ extern uint32_t _srelocate;
 extern uint32_t _erelocate;
 extern uint32_t _szero;
 extern uint32_t _ezero;
+extern uint32_t _sitcm;
+extern uint32_t _eitcm;
+extern uint32_t _litcm;
+extern uint32_t _sdtcm;
+extern uint32_t _edtcm;
+extern uint32_t _ldtcm;
 
 #define CSTACK_TOP (&_cstack)
 
@@ -175,6 +181,63 @@ static void _dummy_handler(void)
 	/* do nothing */
 }
 
+/* GPNVM bits 7-8: 0 - no TCM, 1 - 32K ITCM + 32K DTCM (TCM_SIZE in flash.ld) */
+#ifdef HAVE_TCM
+#define TCM_GPNVM 1
+#else
+#define TCM_GPNVM 0
+#endif
+
+/**
+ * \brief Program the TCM size into the GPNVM bits if it doesn't match the
+ * build, and reset to apply it. Runs from SRAM, as the flash can't be read
+ * while the EEFC executes a command.
+ */
+SECTION(".ramsection") __attribute__((long_call, noinline))
+static void _tcm_configure(void)
+{
+	uint32_t gpnvm;
+
+	while (!(EEFC->EEFC_FSR & EEFC_FSR_FRDY));
+	EEFC->EEFC_FCR = EEFC_FCR_FCMD_GGPB | EEFC_FCR_FKEY_PASSWD;
+	while (!(EEFC->EEFC_FSR & EEFC_FSR_FRDY));
+	gpnvm = EEFC->EEFC_FRR;
+	if (((gpnvm >> 7) & 3) == TCM_GPNVM)
+		return;
+
+	EEFC->EEFC_FCR = ((TCM_GPNVM & 1) ? EEFC_FCR_FCMD_SGPB : EEFC_FCR_FCMD_CGPB) | EEFC_FCR_FARG(7) | EEFC_FCR_FKEY_PASSWD;
+	while (!(EEFC->EEFC_FSR & EEFC_FSR_FRDY));
+	EEFC->EEFC_FCR = ((TCM_GPNVM & 2) ? EEFC_FCR_FCMD_SGPB : EEFC_FCR_FCMD_CGPB) | EEFC_FCR_FARG(8) | EEFC_FCR_FKEY_PASSWD;
+	while (!(EEFC->EEFC_FSR & EEFC_FSR_FRDY));
+
+	RSTC->RSTC_CR = RSTC_CR_PROCRST | RSTC_CR_KEY_PASSWD;
+	while (1);
+}
+
+#ifdef HAVE_TCM
+static void _tcm_init(void)
+{
+	uint32_t *src, *dst;
+
+	/* the ITCM hides the flash alias at address 0 */
+	SCB->VTOR = (uint32_t)&__vector_table;
+
+	dsb();
+	isb();
+	SCB->ITCMCR = SCB_ITCMCR_EN_Msk | SCB_ITCMCR_RMW_Msk | SCB_ITCMCR_RETEN_Msk;
+	SCB->DTCMCR = SCB_DTCMCR_EN_Msk | SCB_DTCMCR_RMW_Msk | SCB_DTCMCR_RETEN_Msk;
+	dsb();
+	isb();
+
+	for (dst = &_sitcm, src = &_litcm; dst < &_eitcm; dst++, src++)
+		*dst = *src;
+	for (dst = &_sdtcm, src = &_ldtcm; dst < &_edtcm; dst++, src++)
+		*dst = *src;
+	dsb();
+	isb();
+}
+#endif
+
 /*----------------------------------------------------------------------------
  *        Exported functions
  *----------------------------------------------------------------------------*/
@@ -203,6 +266,11 @@ void reset_handler(void)
 	for (dst = (uint32_t*)&_srelocate, src = (uint32_t*)&_etext; dst < (uint32_t*)&_erelocate; dst++, src++)
 		*dst = *src;
 
+	_tcm_configure();
+#ifdef HAVE_TCM
+	_tcm_init();
+#endif
+
 	/* initialize the C library */
 	__libc_init_array();
 
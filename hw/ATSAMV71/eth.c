@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include "eth.h"
+#include "eth_bridge.h"
 #include "hardware.h"
 #include "debug.h"
 
@@ -7,31 +8,27 @@
 #include "network/phy.h"
 #include "network/ethd.h"
 #include "network/gmii.h"
+#include "network/ring.h"
 
 #include "user_io.h"
 
-extern unsigned char sector_buffer[SECTOR_BUFFER_SIZE];
-
 static struct _phy phy;
 static struct _phy_desc phy_desc;
 static struct _ethd ethd;
 static uint8_t mac[] = {0x02, 0x00, 0x01, 0x02, 0x03, 0x04};
 
-#define RX_BUFFERS 20
-#define TX_BUFFERS 5
-static uint8_t rx_buffer[ETH_RX_UNITSIZE*RX_BUFFERS] __attribute__ ((aligned));
-static uint8_t tx_buffer[ETH_TX_UNITSIZE*TX_BUFFERS] __attribute__ ((aligned));
-static struct _eth_desc rx_desc[RX_BUFFERS] __attribute__ ((aligned));
-static struct _eth_desc tx_desc[TX_BUFFERS] __attribute__ ((aligned));
+// room for 8 full sized frames in each direction, the frames wrapping
+// around the end of the RX ring are completed behind it
+#define RX_BUFFERS 96
+#define TX_BUFFERS 8
+static uint8_t rx_buffer[ETH_RX_UNITSIZE*RX_BUFFERS + ETH_MAX_FRAMELEN] CACHE_ALIGNED;
+static uint8_t tx_buffer[ETH_TX_UNITSIZE*TX_BUFFERS] CACHE_ALIGNED;
+static struct _eth_desc rx_desc[RX_BUFFERS] ALIGNED(8) NOT_CACHED;
+static struct _eth_desc tx_desc[TX_BUFFERS] ALIGNED(8) NOT_CACHED;
 
 static char link = 0;
 static char link_changed = 0;
 
-static unsigned long timerMAC;
-
-#define MAX_FRAMELEN 1536
-static uint32_t old_status;
-
 static void PIOAIrqHandler()
 {
 	volatile uint32_t isr = PIOA->PIO_ISR;
@@ -40,6 +37,11 @@ static void PIOAIrqHandler()
 	link_changed = 1;
 };
 
+static void eth_rx_callback(uint8_t queue, uint32_t status)
+{
+	eth_bridge_rx_irq(status);
+}
+
 int eth_init()
 {
 	int retval;
@@ -49,6 +51,8 @@ int eth_init()
 	ethd_configure(&ethd, ETH_TYPE_GMAC, GMAC0, 0, 0);
 	ethd_set_mac_addr(&ethd, 0, mac);
 	ethd_setup_queue(&ethd, 0, RX_BUFFERS, rx_buffer, rx_desc, TX_BUFFERS, tx_buffer, tx_desc, 0);
+	eth_bridge_init((volatile eth_bridge_desc_t*)rx_desc, rx_buffer, RX_BUFFERS);
+	ethd_set_rx_callback(&ethd, 0, eth_rx_callback);
 
 	phy_desc.phy_if = PHY_IF_GMAC;
 	phy_desc.addr = GMAC0;
@@ -68,7 +72,6 @@ int eth_init()
 	PIOA->PIO_ESR = PHY_INT; // edge triggered irq
 	PIOA->PIO_FELLSR = PHY_INT; // detect falling edge
 	PIOA->PIO_IER = PHY_INT;
-	timerMAC = 0;
 	ethd_start(&ethd);
 	return 0;
 }
@@ -96,45 +99,27 @@ int eth_poll()
 		return status;
 	}
 
-	if (CheckTimer(timerMAC)) {
-		user_io_eth_send_mac(mac);
-		timerMAC = GetTimer(2000);
-	}
+	user_io_eth_update_mac(mac);
 
 	if (!link) return 0;
 
-	uint32_t status = user_io_eth_get_status();
-
-	if(status != old_status) {
-		eth_debug("fpga status changed to cmd %x, eq=%d, prx=%d, ptx=%d, len=%d",
-		  status >> 24, (status & 0x40000)?1:0, (status & 0x20000)?1:0,
-		  (status & 0x10000)?1:0, status & 0xffff);
-		old_status = status;
-	}
-
-	if((status >> 24) == 0xa5) {
-		uint16_t len = status & 0xffff;
+	eth_bridge_poll();
+	return 0;
+}
 
-		if(len <= MAX_FRAMELEN) {
-			user_io_eth_receive_tx_frame(sector_buffer, len);
-			//iprintf("sending packet: %d bytes\n", len);
-			//hexdump(sector_buffer, len, 0);
-			ethd_send(&ethd, 0, sector_buffer, len, 0);
-		}
-	}
+// the next free TX buffer, the frame is put there by DMA
+uint8_t *eth_tx_buffer(void)
+{
+	struct _ethd_queue *q = &ethd.queues[0];
 
-	if(!(status & 0x20000)) {
+	if (!RING_SPACE(q->tx_head, q->tx_tail, q->tx_size)) return 0;
+	return (uint8_t*)q->tx_desc[q->tx_head].addr;
+}
 
-		uint32_t recv_size = 0;
-		if (ethd_poll(&ethd, 0, sector_buffer, SECTOR_BUFFER_SIZE, &recv_size) == ETH_OK) {
-			if (recv_size) {
-				user_io_eth_send_rx_frame(sector_buffer, recv_size);
-				//iprintf("received packet: %d bytes\n", recv_size);
-				//hexdump(sector_buffer, recv_size, 0);
-			}
-		}
-	}
-	return 0;
+void eth_tx_submit(uint16_t len)
+{
+	// no buffer, the data is in place already
+	ethd_send(&ethd, 0, 0, len, 0);
 }
 
 void eth_get_mac(uint8_t* mac)
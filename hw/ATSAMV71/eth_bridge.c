@@ -0,0 +1,182 @@
+#include <string.h>
+#include "eth_bridge.h"
+
+#ifdef ETH_TEST
+void cache_invalidate_region(void *start, uint32_t length);
+uint32_t user_io_eth_get_status(void);
+void user_io_eth_send_rx_frame(uint8_t *, uint16_t);
+void user_io_eth_receive_tx_frame(uint8_t *, uint16_t);
+#define eth_debug(...)
+#else
+#include "cache.h"
+#include "user_io.h"
+#include "debug.h"
+#endif
+
+// the bits of the RX descriptors and of GMAC_RSR, see network/ethd.h
+#define RX_ADDR_OWN       (1u << 0)
+#define RX_STATUS_LENGTH  0x3fffu
+#define RX_STATUS_SOF     (1u << 14)
+#define RX_STATUS_EOF     (1u << 15)
+#define RX_UNITSIZE       128
+#define RSR_BNA           (1u << 0)
+#define RSR_RXOVR         (1u << 2)
+
+// FPGA status, see user_io_eth_get_status()
+#define FPGA_TX_FRAME(s)  (((s) >> 24) == 0xa5)
+#define FPGA_RX_BUSY      0x20000
+
+static volatile eth_bridge_desc_t *rx_desc;
+static uint8_t *rx_buffer;
+static uint16_t rx_size;
+static uint16_t rx_head;
+static volatile uint8_t rx_pending;
+
+static eth_stats_t stats;
+static uint32_t old_status;
+
+void eth_bridge_init(volatile eth_bridge_desc_t *desc, uint8_t *buffer, uint16_t size)
+{
+	rx_desc = desc;
+	rx_buffer = buffer;
+	rx_size = size;
+	rx_head = 0;
+	rx_pending = 1;
+	old_status = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+// from the GMAC interrupt, a frame was received or the ring ran full
+void eth_bridge_rx_irq(uint32_t rsr)
+{
+	if (rsr & (RSR_BNA | RSR_RXOVR)) stats.rx_overruns++;
+	rx_pending = 1;
+}
+
+// give n descriptors from rx_head on back to the GMAC
+static void rx_release(uint16_t n)
+{
+	while (n--) {
+		rx_desc[rx_head].addr &= ~RX_ADDR_OWN;
+		if (++rx_head == rx_size) rx_head = 0;
+	}
+}
+
+// send the oldest complete frame of the RX ring to the core, returns 0
+// if there is none
+static uint8_t rx_frame(void)
+{
+	uint16_t idx, n;
+	uint32_t status;
+
+	// fragments of a frame the ring had no room for
+	if ((rx_desc[rx_head].addr & RX_ADDR_OWN) && !(rx_desc[rx_head].status & RX_STATUS_SOF)) {
+		stats.rx_dropped++;
+		do {
+			rx_release(1);
+		} while ((rx_desc[rx_head].addr & RX_ADDR_OWN) && !(rx_desc[rx_head].status & RX_STATUS_SOF));
+	}
+
+	idx = rx_head;
+	for (n = 1;; n++) {
+		if (!(rx_desc[idx].addr & RX_ADDR_OWN)) return 0;   // still being received
+		status = rx_desc[idx].status;
+		if (n > 1 && (status & RX_STATUS_SOF)) {
+			// a new frame without an end of the previous one
+			stats.rx_dropped++;
+			rx_release(n - 1);
+			return 1;
+		}
+		if (status & RX_STATUS_EOF) break;
+		if (n == rx_size) {
+			stats.rx_dropped++;
+			rx_release(n);
+			return 1;
+		}
+		if (++idx == rx_size) idx = 0;
+	}
+
+	uint16_t len = status & RX_STATUS_LENGTH;
+	if (!len || len > ETH_MAX_FRAMELEN || len > n * RX_UNITSIZE) {
+		stats.rx_dropped++;
+		rx_release(n);
+		return 1;
+	}
+
+	// the part wrapped around to the start of the ring goes behind its end
+	uint8_t *frame = rx_buffer + rx_head * RX_UNITSIZE;
+	uint32_t first = (rx_size - rx_head) * RX_UNITSIZE;
+	if (len > first) {
+		cache_invalidate_region(rx_buffer, len - first);
+		memcpy(rx_buffer + rx_size * RX_UNITSIZE, rx_buffer, len - first);
+	}
+
+	user_io_eth_send_rx_frame(frame, len);
+	stats.rx_frames++;
+	stats.rx_bytes += len;
+	rx_release(n);
+	return 1;
+}
+
+// read the frame of the core into the next GMAC TX buffer, returns 0 if
+// the ring is full and the frame has to wait in the FPGA
+static uint8_t tx_frame(uint16_t len)
+{
+	uint8_t *buf;
+
+	if (!len || len > ETH_MAX_FRAMELEN) {
+		// discard it, the FPGA won't offer anything else before
+		user_io_eth_receive_tx_frame(0, len);
+		stats.tx_dropped++;
+		return 1;
+	}
+
+	if (!(buf = eth_tx_buffer())) {
+		stats.tx_full++;
+		return 0;
+	}
+
+	user_io_eth_receive_tx_frame(buf, len);
+	eth_tx_submit(len);
+	stats.tx_frames++;
+	stats.tx_bytes += len;
+	return 1;
+}
+
+void eth_bridge_poll(void)
+{
+	uint8_t i, moved;
+
+	// one frame per SPI command, the FPGA status tells if the next one
+	// may follow
+	for (i = 0; i < ETH_POLL_FRAMES; i++) {
+		uint32_t status = user_io_eth_get_status();
+
+		if (status != old_status) {
+			eth_debug("fpga status changed to cmd %x, eq=%d, prx=%d, ptx=%d, len=%d",
+			  status >> 24, (status & 0x40000)?1:0, (status & 0x20000)?1:0,
+			  (status & 0x10000)?1:0, status & 0xffff);
+			old_status = status;
+		}
+
+		moved = 0;
+		if (FPGA_TX_FRAME(status))
+			moved |= tx_frame(status & 0xffff);
+
+		if (!(status & FPGA_RX_BUSY) && rx_pending) {
+			// a frame completing during the walk sets it again
+			rx_pending = 0;
+			if (rx_frame()) {
+				rx_pending = 1;
+				moved = 1;
+			}
+		}
+
+		if (!moved) break;
+	}
+}
+
+const eth_stats_t *eth_stats(void)
+{
+	return &stats;
+}
@@ -0,0 +1,45 @@
+#ifndef ETH_BRIDGE_H
+#define ETH_BRIDGE_H
+
+#include <stdint.h>
+
+// Frames between the GMAC rings and the ethernet MAC of the core. Received
+// frames go to the FPGA by SPI DMA straight out of the GMAC RX buffers,
+// frames of the core are read by SPI DMA straight into the GMAC TX buffers.
+// The core takes one frame per UIO_ETH_FRM_IN/OUT command, a poll loops
+// over up to ETH_POLL_FRAMES of these commands with a status read before
+// each. The core has no QSPI instruction for frames, FEAT_IDE_QSPI only
+// covers the IDE data.
+
+#define ETH_MAX_FRAMELEN 1536
+#define ETH_POLL_FRAMES  8      // single frame commands per poll and direction
+
+// same layout as the RX descriptors of the GMAC (struct _eth_desc)
+typedef struct {
+	uint32_t addr;
+	uint32_t status;
+} eth_bridge_desc_t;
+
+typedef struct {
+	uint32_t rx_frames;    // GMAC -> core
+	uint32_t rx_bytes;
+	uint32_t rx_dropped;   // broken or too long frames
+	uint32_t rx_overruns;  // no free RX buffer or overrun, counted in the irq
+	uint32_t tx_frames;    // core -> GMAC
+	uint32_t tx_bytes;
+	uint32_t tx_dropped;   // too long frames
+	uint32_t tx_full;      // polls with the GMAC TX ring full
+} eth_stats_t;
+
+// the RX buffer needs room for ETH_MAX_FRAMELEN bytes after rx_size units,
+// frames wrapping around the end of the ring are made contiguous there
+void eth_bridge_init(volatile eth_bridge_desc_t *rx_desc, uint8_t *rx_buffer, uint16_t rx_size);
+void eth_bridge_rx_irq(uint32_t rsr);
+void eth_bridge_poll(void);
+const eth_stats_t *eth_stats(void);
+
+// GMAC TX ring, eth.c
+uint8_t *eth_tx_buffer(void);
+void eth_tx_submit(uint16_t len);
+
+#endif
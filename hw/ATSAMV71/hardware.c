@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include "hardware.h"
 #include "irq/nvic.h"
+#include "spi.h"
 #include "utils.h"
 #include "mist_cfg.h"
 #include "user_io.h"
@@ -35,8 +36,7 @@ RAMFUNC void _default_systick_handler()
 
 void __init_hardware()
 {
-    SCB_EnableICache();
-    //SCB_EnableDCache();
+    cache_init();
 
     SUPC->SUPC_MR = SUPC_MR_BODRSTEN_NOT_ENABLE | SUPC_MR_BODDIS_DISABLE | SUPC_MR_ONREG_ONREG_USED | SUPC_MR_OSCBYPASS_NO_EFFECT | SUPC_MR_KEY_PASSWD;
     WDT->WDT_MR = WDT_MR_WDDIS; // disable watchdog
@@ -292,6 +292,117 @@ void WaitTimer(unsigned long time)
     while (!CheckTimer(time));
 }
 
+static volatile unsigned char fpga_irq;
+static unsigned char fpga_irq_on;
+static void (*usb_irq)(void);
+
+// FPGA_IRQ and the MAX3421E USB_INT share the PIOD interrupt
+static void PiodIrqHandler() {
+    // reading the status acknowledges the edges
+    uint32_t isr = PIOD->PIO_ISR;
+
+    if(isr & FPGA_IRQ)
+        fpga_irq = 1;
+
+    // USB_INT is level active, also serve it while it's low when
+    // the irq was pended again by the SPI or the USB host layer
+    if(usb_irq && ((isr & USB_INT) || !(PIOD->PIO_PDSR & USB_INT))) {
+        if(spi_irq_claim(ID_PIOD)) {
+            usb_irq();
+            spi_irq_release();
+        }
+    }
+}
+
+static void PiodIrqUpdate() {
+    NVIC_SetVector(ID_PIOD, (uint32_t) &PiodIrqHandler);
+    if(PIOD->PIO_IMR & (FPGA_IRQ | USB_INT)) {
+        // below the other interrupts, the USB handler does SPI transfers
+        NVIC_SetPriority(ID_PIOD, 4);
+        NVIC_EnableIRQ(ID_PIOD);
+    }
+    // check USB_INT once, the status read may have eaten its edge
+    if(usb_irq)
+        NVIC_SetPendingIRQ(ID_PIOD);
+}
+
+char FpgaIrqEnable(char on) {
+    volatile uint32_t dummy;
+
+    NVIC_DisableIRQ(ID_PIOD);
+    PIOD->PIO_IDR = FPGA_IRQ;
+    PIOD->PIO_PUDR = FPGA_IRQ;
+    fpga_irq_on = on;
+    if(on) {
+        PIOD->PIO_PUER = FPGA_IRQ; // idles high between requests
+        PIOD->PIO_AIMER = FPGA_IRQ; // edge triggered irq
+        PIOD->PIO_ESR = FPGA_IRQ;
+        PIOD->PIO_FELLSR = FPGA_IRQ; // request is signalled by a falling edge
+        dummy = PIOD->PIO_ISR;
+
+        // fetch the status once in case a request is already waiting
+        fpga_irq = 1;
+        PIOD->PIO_IER = FPGA_IRQ;
+    }
+    PiodIrqUpdate();
+    return on;
+}
+
+// the QSPI transfers drive IO3, their edges are no requests
+void FpgaIrqMask(char mask) {
+    volatile uint32_t dummy;
+
+    if(!fpga_irq_on) return;
+    if(mask) {
+        PIOD->PIO_IDR = FPGA_IRQ;
+        return;
+    }
+
+    NVIC_DisableIRQ(ID_PIOD);
+    // drop the edges of the transfer. The status is read once in case the
+    // core raised a request meanwhile, and PiodIrqUpdate() checks USB_INT.
+    dummy = PIOD->PIO_ISR;
+    fpga_irq = 1;
+    PIOD->PIO_IER = FPGA_IRQ;
+    PiodIrqUpdate();
+}
+
+void UsbIrqEnable(void (*handler)(void)) {
+    NVIC_DisableIRQ(ID_PIOD);
+    PIOD->PIO_IDR = USB_INT;
+    usb_irq = handler;
+    if(handler) {
+        PIOD->PIO_AIMER = USB_INT; // edge triggered irq
+        PIOD->PIO_ESR = USB_INT;
+        PIOD->PIO_FELLSR = USB_INT; // INT goes low with the first pending event
+        PIOD->PIO_IER = USB_INT;
+    }
+    PiodIrqUpdate();
+}
+
+void UsbIrqRetrigger() {
+    NVIC_SetPendingIRQ(ID_PIOD);
+}
+
+char FpgaIrqPending() {
+    if(!fpga_irq) return 0;
+    fpga_irq = 0;
+    return 1;
+}
+
+#ifdef PROFILE
+void InitProfTicks() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->LAR = 0xC5ACCE55; // unlock
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+RAMFUNC unsigned long GetProfTicks() {
+    return DWT->CYCCNT;
+}
+#endif
+
 inline char mmc_inserted() {
     return !(PIOD->PIO_PDSR & SD_CD);
 }
@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "chip.h"
 #include "samv71.h"
 #include "core_cm7.h"
+#include "cache.h"
 
 #define MCLK   144000000
 #define PLLCLK 288000000
@@ -32,6 +33,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define DMA_CH_SPI_REC       2
 #define DMA_CH_QSPI_TRANS    3
 #define DMA_CH_QSPI_REC      4
+#define DMA_CH_MEMCPY        5 // cache_test()
 
 #define DISKLED              PIO_PD28
 #define DISKLED_ON           PIOD->PIO_CODR = DISKLED;
@@ -78,6 +80,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define ALTERA_NSTATUS_STATE (PIOD->PIO_PDSR & ALTERA_NSTATUS)
 #define ALTERA_DONE_STATE    (PIOD->PIO_PDSR & ALTERA_DONE)
 
+// DATA0 and DCLK written together through ODSR while shifting the bitstream
+#define ALTERA_DATA0_SHIFT   12
+#define ALTERA_SHIFT_START   PIOD->PIO_OWER = ALTERA_DATA0 | ALTERA_DCLK;
+#define ALTERA_SHIFT_STOP    PIOD->PIO_OWDR = ALTERA_DATA0 | ALTERA_DCLK;
+#define ALTERA_SHIFT_ODSR    (PIOD->PIO_ODSR)
+
 #endif
 
 // chip selects for FPGA communication
@@ -85,6 +93,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define FPGA1                PIO_PB2
 #define FPGA3                PIO_PD12   // same as ALTERA_DATA0
 
+// service request line of cores with FEAT_FPGA_IRQ. The board has no free
+// line, so it is QSPI IO3: such a core keeps IO3 released outside of its
+// QSPI transfers and pulls it low for a request only while the QSPI chip
+// select is inactive. The pull-up and the edge detection are only armed for
+// these cores, and masked during every QSPI transfer.
+#define FPGA_IRQ             PIO_PD31   // same as QSPI0_IO3
+
 // SD
 #define SD_CD                PIO_PD18
 #define SD_WP                PIO_PD19
@@ -123,24 +138,33 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define PHY_INT              PIO_PA19
 #define PHY_SIGDET           PIO_PA20
 
+// non-cached RAM, the last 4K of the SRAM (sram_nc in flash.ld). The
+// TCM (make TCM=1) takes 2x32K from the end of the SRAM.
+#ifdef HAVE_TCM
+#define SRAM_NC_ADDR         0x2044F000
+#else
+#define SRAM_NC_ADDR         0x2045F000
+#endif
+
 // in non-cached RAM
-#define USB_LOAD_VAR         *(int*)(0x2045F000)
+#define USB_LOAD_VAR         *(int*)(SRAM_NC_ADDR)
 #define USB_LOAD_VALUE       0x12345678
 
 #define USB_BOOT_VALUE       0x8007F007
-#define USB_BOOT_VAR         (*(int*)0x002045F013)
+#define USB_BOOT_VAR         (*(int*)(SRAM_NC_ADDR + 0x13))
 
-#define DEBUG_MODE_VAR       *(int*)(0x2045F008)
+#define DEBUG_MODE_VAR       *(int*)(SRAM_NC_ADDR + 0x08)
 #define DEBUG_MODE_VALUE     87654321
 #define DEBUG_MODE           (DEBUG_MODE_VAR == DEBUG_MODE_VALUE)
 
 #define VIDEO_KEEP_VALUE     0x87654321
-#define VIDEO_KEEP_VAR       (*(int*)0x2045F00C)
-#define VIDEO_ALTERED_VAR    (*(uint8_t*)0x2045F010)
-#define VIDEO_SD_DISABLE_VAR (*(uint8_t*)0x2045F011)
-#define VIDEO_YPBPR_VAR      (*(uint8_t*)0x2045F012)
+#define VIDEO_KEEP_VAR       (*(int*)(SRAM_NC_ADDR + 0x0C))
+#define VIDEO_ALTERED_VAR    (*(uint8_t*)(SRAM_NC_ADDR + 0x10))
+#define VIDEO_SD_DISABLE_VAR (*(uint8_t*)(SRAM_NC_ADDR + 0x11))
+#define VIDEO_YPBPR_VAR      (*(uint8_t*)(SRAM_NC_ADDR + 0x12))
 
 #define SECTOR_BUFFER_SIZE   8192
+#define BUF_POOL_BLOCKS      3    // SECTOR_BUFFER_SIZE blocks besides sector_buffer
 
 void __init_hardware();
 
@@ -159,6 +183,20 @@ void WaitTimer(unsigned long time);
 
 void USART_Poll();
 
+char FpgaIrqEnable(char on);
+void FpgaIrqMask(char mask);
+char FpgaIrqPending();
+void UsbIrqEnable(void (*handler)(void));
+void UsbIrqRetrigger();
+
+#ifdef PROFILE
+// DWT cycle counter
+#define PROF_TICKS_PER_US  (MCLK/1000000)
+#define PROF_TICKS_WRAP    0
+void InitProfTicks();
+unsigned long GetProfTicks();
+#endif
+
 void MCUReset();
 
 void InitRTTC();
@@ -260,10 +260,8 @@ unsigned char MMC_Init(void)
     return(CARDTYPE_NONE);
 }
 
-RAMFUNC static unsigned char MMC_ReadBlocks(unsigned char *buffer, unsigned long lba, unsigned long blocks)
+RAMFUNC static unsigned char MMC_ReadBlocksDMA(unsigned char *buffer, unsigned long lba, unsigned long blocks)
 {
-    if(!buffer) return 0; // direct transfer is not supported
-
     if (CardType != CARDTYPE_SDHC) // SDHC cards are addressed in sectors not bytes
         lba = lba << 9; // otherwise convert sector adddress to byte address
 
@@ -275,6 +273,7 @@ RAMFUNC static unsigned char MMC_ReadBlocks(unsigned char *buffer, unsigned long
         return(0);
     }
 
+    cache_clean_invalidate_region(buffer, blocks*512);
     XDMAC0->XDMAC_GD = XDMAC_GD_DI0;
     if ((uint32_t)buffer & 3) {
         // byte transfer
@@ -313,6 +312,7 @@ RAMFUNC static unsigned char MMC_ReadBlocks(unsigned char *buffer, unsigned long
 
     unsigned char retval = MMC_WaitTransferEnd();
     XDMAC0->XDMAC_GD = XDMAC_GD_DI0;
+    cache_invalidate_region(buffer, blocks*512);
 /*
     for (int i=0; i<blocks; i++) {
       hexdump(buffer, 512, 0);
@@ -324,6 +324,40 @@ RAMFUNC static unsigned char MMC_ReadBlocks(unsigned char *buffer, unsigned long
     return(retval);
 }
 
+// The DMA only writes whole cache lines of the buffer, the invalidate after
+// it would drop what the CPU wrote next to a buffer that isn't line aligned
+// (FATFS.win and FIL.buf sit inside structs). The first and the last block
+// of such a buffer are read into a block of their own.
+static unsigned char mmc_edge[512] CACHE_ALIGNED;
+
+RAMFUNC static unsigned char MMC_ReadEdge(unsigned char *buffer, unsigned long lba)
+{
+    if (!MMC_ReadBlocksDMA(mmc_edge, lba, 1)) return 0;
+    memcpy(buffer, mmc_edge, 512);
+    return 1;
+}
+
+RAMFUNC static unsigned char MMC_ReadBlocks(unsigned char *buffer, unsigned long lba, unsigned long blocks)
+{
+    if(!buffer) return 0; // direct transfer is not supported
+
+    if (!((uint32_t)buffer & (CACHE_LINE_SIZE-1)))
+        return MMC_ReadBlocksDMA(buffer, lba, blocks);
+
+    if (!MMC_ReadEdge(buffer, lba)) return 0;
+    if (!--blocks) return 1;
+    buffer += 512;
+    lba++;
+
+    if (blocks > 1) {
+        if (!MMC_WaitReady() || !MMC_ReadBlocksDMA(buffer, lba, blocks - 1)) return 0;
+        buffer += 512*(blocks - 1);
+        lba += blocks - 1;
+    }
+
+    return MMC_WaitReady() && MMC_ReadEdge(buffer, lba);
+}
+
 // Read single 512-byte block
 RAMFUNC unsigned char MMC_Read(unsigned long lba, unsigned char *pReadBuffer)
 {
@@ -342,6 +376,7 @@ RAMFUNC unsigned char MMC_ReadMultiple(unsigned long lba, unsigned char *pReadBu
 
 static unsigned char MMC_WriteBlocks(unsigned long lba, const unsigned char *pWriteBuffer, unsigned long blocks)
 {
+    cache_clean_region(pWriteBuffer, blocks*512);
     XDMAC0->XDMAC_GD = XDMAC_GD_DI0;
     if ((uint32_t)pWriteBuffer & 3) {
         // byte transfer
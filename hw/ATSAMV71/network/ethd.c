@@ -34,6 +34,7 @@
  *----------------------------------------------------------------------------*/
 
 #include "barriers.h"
+#include "cache.h"
 #include "debug.h"
 #include "ring.h"
 
@@ -160,7 +161,7 @@ uint8_t ethd_send_sg(struct _ethd* ethd, uint8_t queue, const struct _eth_sg_lis
 		/* Copy data into transmittion buffer */
 		if (sg->buffer && sg->size) {
 			memcpy((void*)desc->addr, sg->buffer, sg->size);
-//			cache_clean_region((void*)desc->addr, sg->size);
+			cache_clean_region((void*)desc->addr, sg->size);
 		}
 
 		/* Compute buffer descriptor status word */
@@ -270,7 +271,7 @@ uint8_t ethd_poll(struct _ethd* ethd, uint8_t queue, uint8_t* buffer, uint32_t b
 			}
 
 			void* addr = (void*)(desc->addr & ETH_RX_ADDR_MASK);
-//			cache_invalidate_region(addr, length);
+			cache_invalidate_region(addr, length);
 			memcpy(cur_frame, addr, length);
 			cur_frame += length;
 			cur_frame_size += length;
@@ -33,6 +33,7 @@
 
 #include <stdio.h>
 #include "barriers.h"
+#include "cache.h"
 #include "chip.h"
 #include "core_cm7.h"
 #include "debug.h"
@@ -52,8 +53,6 @@
 #define GMAC_INT_TX_ERR_BITS (GMAC_IER_TUR | GMAC_IER_RLEX | GMAC_IER_TFC)
 #define GMAC_INT_TX_BITS     (GMAC_INT_TX_ERR_BITS | GMAC_IER_TCOMP)
 
-#define NOT_CACHED
-#define CACHE_ALIGNED
 /*---------------------------------------------------------------------------
  *         Types
  *---------------------------------------------------------------------------*/
@@ -15,10 +15,13 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
 #include "qspi.h"
 #include "hardware.h"
+#include "utils.h"
 
 static uint8_t* dst;
+static uint8_t* src;
 
 void qspi_init() {
   PMC->PMC_PCER1 = (1 << (ID_QSPI0 - 32));
@@ -28,6 +31,7 @@ void qspi_init() {
 }
 
 void qspi_start_write() {
+  FpgaIrqMask(1);
   QSPI0->QSPI_SCR = QSPI_SCR_CPOL | QSPI_SCR_SCBR((MCLK/24000000) - 1);
   QSPI0->QSPI_IAR = 0;
   QSPI0->QSPI_ICR = QSPI_ICR_INST(QSPI_WRITE);
@@ -43,6 +47,7 @@ void qspi_write(uint8_t data) {
 
 void qspi_write_block(const uint8_t *data, uint32_t len) {
 
+  cache_clean_region(data, len);
   XDMAC0->XDMAC_GD = XDMAC_GD_DI1;
   XDMAC0->XDMAC_CH[DMA_CH_QSPI_TRANS].XDMAC_CC = XDMAC_CC_TYPE_MEM_TRAN
                                                | XDMAC_CC_MBSIZE_SINGLE
@@ -67,7 +72,76 @@ void qspi_write_block(const uint8_t *data, uint32_t len) {
   dst += len;
 }
 
+void qspi_start_read() {
+  FpgaIrqMask(1);
+  QSPI0->QSPI_SCR = QSPI_SCR_CPOL | QSPI_SCR_SCBR((MCLK/24000000) - 1);
+  QSPI0->QSPI_IAR = 0;
+  QSPI0->QSPI_ICR = QSPI_ICR_INST(QSPI_READ);
+  QSPI0->QSPI_IFR = QSPI_IFR_WIDTH_QUAD_CMD | QSPI_IFR_INSTEN | QSPI_IFR_DATAEN | QSPI_IFR_TFRTYP_TRSFR_READ | QSPI_IFR_NBDUM(QSPI_READ_DUMMY);
+  src = (uint8_t*)QSPIMEM0_ADDR;
+  uint32_t dummy = QSPI0->QSPI_IFR;
+}
+
+static void qspi_dma_read(uint8_t *data, uint32_t len) {
+
+  cache_clean_invalidate_region(data, len);
+  XDMAC0->XDMAC_GD = XDMAC_GD_DI4;
+  XDMAC0->XDMAC_CH[DMA_CH_QSPI_REC].XDMAC_CC = XDMAC_CC_TYPE_MEM_TRAN
+                                             | XDMAC_CC_MBSIZE_SINGLE
+                                             | XDMAC_CC_DSYNC_PER2MEM
+                                             | XDMAC_CC_CSIZE_CHK_1
+                                             | XDMAC_CC_DWIDTH_BYTE
+                                             | XDMAC_CC_SIF_AHB_IF1
+                                             | XDMAC_CC_DIF_AHB_IF1
+                                             | XDMAC_CC_SAM_INCREMENTED_AM
+                                             | XDMAC_CC_DAM_INCREMENTED_AM
+                                             | XDMAC_CC_PERID(6); // QSPI receiver
+  XDMAC0->XDMAC_CH[DMA_CH_QSPI_REC].XDMAC_CSA = (uint32_t)src;
+  XDMAC0->XDMAC_CH[DMA_CH_QSPI_REC].XDMAC_CDA = (uint32_t)data;
+  XDMAC0->XDMAC_CH[DMA_CH_QSPI_REC].XDMAC_CUBC = XDMAC_CUBC_UBLEN(len);
+  XDMAC0->XDMAC_CH[DMA_CH_QSPI_REC].XDMAC_CIS; //read interrupt reg to clear any flags prior to enabling channel
+  XDMAC0->XDMAC_CH[DMA_CH_QSPI_REC].XDMAC_CIE = XDMAC_CIE_BIE;
+  // Start the receiver
+  XDMAC0->XDMAC_GE = XDMAC_GE_EN4;
+
+  // Wait for end of transfer
+  while (!(XDMAC0->XDMAC_CH[DMA_CH_QSPI_REC].XDMAC_CIS & XDMAC_CIS_BIS));
+  cache_invalidate_region(data, len);
+  src += len;
+}
+
+// like spi_transfer(), the unaligned start and end of the buffer are read
+// into a cache line of their own, so the invalidate after the DMA doesn't
+// drop what the CPU wrote next to the buffer
+static uint8_t qspi_edge[CACHE_LINE_SIZE] CACHE_ALIGNED;
+
+static void qspi_read_edge(uint8_t *data, uint32_t len) {
+  qspi_dma_read(qspi_edge, len);
+  memcpy(data, qspi_edge, len);
+}
+
+void qspi_read_block(uint8_t *data, uint32_t len) {
+  uint32_t n;
+
+  n = MIN(len, -(uint32_t)data & (CACHE_LINE_SIZE-1));
+  if (n) {
+    qspi_read_edge(data, n);
+    data += n;
+    len -= n;
+  }
+
+  n = len & ~(CACHE_LINE_SIZE-1);
+  if (n) {
+    qspi_dma_read(data, n);
+    data += n;
+    len -= n;
+  }
+
+  if (len) qspi_read_edge(data, len);
+}
+
 void qspi_end() {
   QSPI0->QSPI_CR = QSPI_CR_LASTXFER;
   while (!(QSPI0->QSPI_SR & QSPI_SR_INSTRE));
+  FpgaIrqMask(0);
 }
@@ -22,11 +22,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #define QSPI_READ  0x40
 #define QSPI_WRITE 0x41
+#define QSPI_READ_DUMMY 8 // turnaround cycles before the FPGA drives the bus
 
 void qspi_init();
 void qspi_start_write();
 void qspi_write(uint8_t data);
 void qspi_write_block(const uint8_t *data, uint32_t len);
+void qspi_start_read();
+void qspi_read_block(uint8_t *data, uint32_t len);
 void qspi_end();
 
 #endif // QSPI_H
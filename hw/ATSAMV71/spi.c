@@ -15,8 +15,18 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
 #include "spi.h"
+#include "spi_batch.h"
 #include "hardware.h"
+#include "utils.h"
+
+// delay between consecutive transfers (DLYBCT) is counted in 32 MCLK units
+static unsigned char spi_dlybct(unsigned short gap)
+{
+    unsigned long dly = ((unsigned long)gap * (MCLK / 1000000) + 31999) / 32000;
+    return (dly > 255) ? 255 : dly;
+}
 
 void spi_init()
 {
@@ -42,6 +52,39 @@ void spi_wait4xfer_end()
     while (!(SPI0->SPI_SR & SPI_SR_TXEMPTY));
 }
 
+// interrupt handlers may use the bus between two chip selects (see spi_irq_claim)
+static volatile int16_t spi_deferred_irq = -1;
+static uint32_t spi_irq_mr;
+
+static void spi_release()
+{
+    spi_wait4xfer_end();
+    SPI0->SPI_CR = SPI_CR_SPIDIS;
+    if (spi_deferred_irq >= 0) {
+        NVIC_SetPendingIRQ(spi_deferred_irq);
+        spi_deferred_irq = -1;
+    }
+}
+
+// Called from an interrupt handler before it talks to a device. Fails if
+// the main loop has a chip select active, the irq is pended again when it
+// releases the bus then.
+char spi_irq_claim(uint32_t irq)
+{
+    if (SPI0->SPI_SR & SPI_SR_SPIENS) {
+        spi_deferred_irq = irq;
+        return 0;
+    }
+    // the main loop may be between setting the mode and enabling the SPI
+    spi_irq_mr = SPI0->SPI_MR;
+    return 1;
+}
+
+void spi_irq_release()
+{
+    SPI0->SPI_MR = spi_irq_mr;
+}
+
 void EnableFpga()
 {
     SPI0->SPI_CSR[3] = SPI_CSR_CPOL | SPI_CSR_SCBR(SPI_SDC_CLK_VALUE) | SPI_CSR_DLYBCT(0) | SPI_CSR_CSAAT | SPI_CSR_DLYBS(10); // SS2
@@ -56,10 +99,17 @@ void EnableFpgaMinimig()
     SPI0->SPI_CR = SPI_CR_SPIEN;
 }
 
+// select the FPGA with at least 'gap' ns between the bytes of a (DMA) transfer
+void EnableFpgaPaced(unsigned short gap)
+{
+    SPI0->SPI_CSR[3] = SPI_CSR_CPOL | SPI_CSR_SCBR(SPI_SDC_CLK_VALUE) | SPI_CSR_DLYBCT(spi_dlybct(gap)) | SPI_CSR_CSAAT | SPI_CSR_DLYBS(10); // SS2
+    SPI0->SPI_MR = SPI_MR_MSTR | SPI_MR_MODFDIS | SPI_MR_PCS(0x7); // NPCS3
+    SPI0->SPI_CR = SPI_CR_SPIEN;
+}
+
 void DisableFpga()
 {
-    spi_wait4xfer_end();
-    SPI0->SPI_CR = SPI_CR_SPIDIS;
+    spi_release();
 }
 
 void EnableOsd()
@@ -70,8 +120,7 @@ void EnableOsd()
 
 void DisableOsd()
 {
-    spi_wait4xfer_end();
-    SPI0->SPI_CR = SPI_CR_SPIDIS;
+    spi_release();
 }
 
 void EnableIO()
@@ -82,8 +131,7 @@ void EnableIO()
 
 void DisableIO()
 {
-    spi_wait4xfer_end();
-    SPI0->SPI_CR = SPI_CR_SPIDIS;
+    spi_release();
 }
 
 void EnableDMode() {}
@@ -102,8 +150,7 @@ void spi_max_start()
 
 void spi_max_end()
 {
-    spi_wait4xfer_end();
-    SPI0->SPI_CR = SPI_CR_SPIDIS;
+    spi_release();
 }
 
 void spi_block(unsigned short num)
@@ -120,10 +167,13 @@ void spi_block(unsigned short num)
 }
 
 
-void spi_transfer(const char *srcAddr, char *dstAddr, uint16_t len)
+static TCMFUNC void spi_dma(const char *srcAddr, char *dstAddr, uint16_t len)
 {
     static uint32_t dummy __attribute__ ((aligned)) = 0xdeadbeaf;
 
+    if (srcAddr) cache_clean_region(srcAddr, len);
+    if (dstAddr) cache_clean_invalidate_region(dstAddr, len);
+
     // Transmitter setup
     XDMAC0->XDMAC_GD = XDMAC_GD_DI1;
     XDMAC0->XDMAC_CH[DMA_CH_SPI_TRANS].XDMAC_CC = XDMAC_CC_TYPE_PER_TRAN
@@ -165,24 +215,66 @@ void spi_transfer(const char *srcAddr, char *dstAddr, uint16_t len)
 
     // Wait for end of transfer
     while (!(XDMAC0->XDMAC_CH[DMA_CH_SPI_TRANS].XDMAC_CIS & XDMAC_CIS_BIS));
+
+    if (dstAddr) cache_invalidate_region(dstAddr, len);
+}
+
+// The DMA only writes whole cache lines of the destination, the invalidate
+// after it would drop what the CPU wrote next to the buffer in the meantime
+// (the USB host reads its packets into buffers on the stack). The unaligned
+// start and end of the buffer go through a line of their own.
+static uint8_t spi_edge[CACHE_LINE_SIZE] CACHE_ALIGNED;
+
+static TCMFUNC void spi_dma_edge(const char *srcAddr, char *dstAddr, uint16_t len)
+{
+    spi_dma(srcAddr, (char*)spi_edge, len);
+    memcpy(dstAddr, spi_edge, len);
+}
+
+TCMFUNC void spi_transfer(const char *srcAddr, char *dstAddr, uint16_t len)
+{
+    uint16_t n;
+
+    if (!dstAddr) {
+        spi_dma(srcAddr, 0, len);
+        return;
+    }
+
+    n = MIN(len, -(uint32_t)dstAddr & (CACHE_LINE_SIZE-1));
+    if (n) {
+        spi_dma_edge(srcAddr, dstAddr, n);
+        if (srcAddr) srcAddr += n;
+        dstAddr += n;
+        len -= n;
+    }
+
+    n = len & ~(CACHE_LINE_SIZE-1);
+    if (n) {
+        spi_dma(srcAddr, dstAddr, n);
+        if (srcAddr) srcAddr += n;
+        dstAddr += n;
+        len -= n;
+    }
+
+    if (len) spi_dma_edge(srcAddr, dstAddr, len);
 }
 
-void spi_read(char *addr, uint16_t len)
+TCMFUNC void spi_read(char *addr, uint16_t len)
 {
     spi_transfer(0, addr, len);
 }
 
-void spi_block_read(char *addr)
+TCMFUNC void spi_block_read(char *addr)
 {
   spi_read(addr, 512);
 }
 
-void spi_write(const char *addr, uint16_t len)
+TCMFUNC void spi_write(const char *addr, uint16_t len)
 {
     spi_transfer(addr, 0, len);
 }
 
-void spi_block_write(const char *addr)
+TCMFUNC void spi_block_write(const char *addr)
 {
   spi_write(addr, 512);
 }
@@ -335,9 +427,11 @@ void spi_osd_cmd32le(unsigned char cmd, unsigned long parm)
   DisableOsd();
 }
 
-/* User_io related SPI functions */
+/* User_io related SPI functions. Commands still queued in spi_batch.c go
+   first, so a newer direct write can't be overwritten by a stale one. */
 void spi_uio_cmd_cont(unsigned char cmd)
 {
+  spi_batch_flush();
   EnableIO();
   SPI(cmd);
 }
@@ -350,6 +444,7 @@ void spi_uio_cmd(unsigned char cmd)
 
 void spi_uio_cmd8_cont(unsigned char cmd, unsigned char parm)
 {
+  spi_batch_flush();
   EnableIO();
   SPI(cmd);
   SPI(parm);
@@ -363,6 +458,7 @@ void spi_uio_cmd8(unsigned char cmd, unsigned char parm)
 
 void spi_uio_cmd32(unsigned char cmd, unsigned long parm)
 {
+  spi_batch_flush();
   EnableIO();
   SPI(cmd);
   SPI(parm);
@@ -374,6 +470,7 @@ void spi_uio_cmd32(unsigned char cmd, unsigned long parm)
 
 void spi_uio_cmd64(unsigned char cmd, unsigned long long parm)
 {
+  spi_batch_flush();
   EnableIO();
   SPI(cmd);
   SPI(parm);
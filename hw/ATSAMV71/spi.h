@@ -35,6 +35,7 @@ void spi_set_speed(unsigned char speed);
 /* chip select functions */
 void EnableFpga(void);
 void EnableFpgaMinimig(void);
+void EnableFpgaPaced(unsigned short gap);
 void DisableFpga(void);
 void EnableOsd(void);
 void DisableOsd(void);
@@ -59,6 +60,7 @@ void spi_read(char *addr, uint16_t len);
 void spi_block_write(const char *addr);
 void spi_write(const char *addr, uint16_t len);
 void spi_block(unsigned short num);
+void spi_transfer(const char *src, char *dst, uint16_t len);
 
 /* OSD related SPI functions */
 void spi_osd_cmd_cont(unsigned char cmd);
@@ -90,6 +92,9 @@ static inline unsigned char SPI(unsigned char outByte) {
 void spi_max_start();
 void spi_max_end();
 
+char spi_irq_claim(uint32_t irq);
+void spi_irq_release();
+
 #define SPI_SDC_CLK_VALUE MCLK/24000000  // 24 Mhz
 #define SPI_MMC_CLK_VALUE MCLK/16000000  // 16 Mhz
 #define SPI_SLOW_CLK_VALUE MCLK/600000   // 600kHz
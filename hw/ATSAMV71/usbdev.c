@@ -239,19 +239,25 @@ void usb_dump_regs() {
 // Maximum transfer size on USB DMA
 #define EPT_VIRTUAL_SIZE  0x8000
 
-static void usb_dma_transfer(uint8_t ep, uint8_t* data, uint32_t size)
+static void usb_dma_start(uint8_t ep, uint8_t* data, uint32_t size, uint32_t ctrl)
 {
 	UsbhsDevDma* devdma = &USBHS->USBHS_DEVDMA[ep-1];
 	devdma->USBHS_DEVDMAADDRESS = (uint32_t) data;
 	devdma->USBHS_DEVDMASTATUS = devdma->USBHS_DEVDMASTATUS; // clear pending bits
 	devdma->USBHS_DEVDMACONTROL = 0;
-	devdma->USBHS_DEVDMACONTROL = USBHS_DEVDMACONTROL_BURST_LCK | USBHS_DEVDMACONTROL_CHANN_ENB | USBHS_DEVDMACONTROL_BUFF_LENGTH(size);
-	while (devdma->USBHS_DEVDMASTATUS & USBHS_DEVDMASTATUS_CHANN_ACT);
+	devdma->USBHS_DEVDMACONTROL = USBHS_DEVDMACONTROL_BURST_LCK | USBHS_DEVDMACONTROL_CHANN_ENB | USBHS_DEVDMACONTROL_BUFF_LENGTH(size) | ctrl;
+}
+
+static void usb_dma_transfer(uint8_t ep, uint8_t* data, uint32_t size)
+{
+	usb_dma_start(ep, data, size, 0);
+	while (USBHS->USBHS_DEVDMA[ep-1].USBHS_DEVDMASTATUS & USBHS_DEVDMASTATUS_CHANN_ACT);
 }
 
 static void usb_write_fifo_buffer(uint8_t ep, uint8_t* data, uint32_t size)
 {
 	if (ep) { // EP0 doesn't have DMA
+		cache_clean_region(data, size);
 		usb_dma_transfer(ep, data, size);
 	} else {
 		volatile uint8_t *fifo = ((volatile uint8_t*)USBHS_RAM_ADDR) + EPT_VIRTUAL_SIZE * ep;
@@ -262,10 +268,20 @@ static void usb_write_fifo_buffer(uint8_t ep, uint8_t* data, uint32_t size)
 	}
 }
 
+// packets for buffers that don't cover whole cache lines, the invalidate
+// after the DMA would drop what the CPU wrote next to them in the meantime
+static uint8_t usb_rx_bounce[BULK_OUT_SIZE] CACHE_ALIGNED;
+
 static void usb_read_fifo_buffer(uint8_t ep, uint8_t* data, uint32_t size)
 {
 	if (ep) { // EP0 doesn't have DMA
-		usb_dma_transfer(ep, data, size);
+		uint8_t *dst = data;
+		if (((uint32_t)data | size) & (CACHE_LINE_SIZE-1))
+			dst = usb_rx_bounce;
+		cache_clean_invalidate_region(dst, size);
+		usb_dma_transfer(ep, dst, size);
+		cache_invalidate_region(dst, size);
+		if (dst != data) memcpy(data, dst, size);
 	} else {
 		volatile uint8_t *fifo = ((volatile uint8_t*)USBHS_RAM_ADDR) + EPT_VIRTUAL_SIZE * ep;
 		dmb();
@@ -317,12 +333,12 @@ static void usb_irq_handler(void) {
 		                            EP0_SIZE_CONF | USBHS_DEVEPTCFG_EPDIR_IN | USBHS_DEVEPTCFG_EPTYPE_INTRPT | USBHS_DEVEPTCFG_AUTOSW;
 		USBHS->USBHS_DEVEPTIER[3] = USBHS_DEVEPTIER_TXINES;
 
-		// setup endpoint 4 for IN requests
-		USBHS->USBHS_DEVEPTCFG[4] = USBHS_DEVEPTCFG_ALLOC | USBHS_DEVEPTCFG_EPBK_1_BANK |
+		// setup endpoint 4 for IN requests, two banks keep the mass storage data streaming
+		USBHS->USBHS_DEVEPTCFG[4] = USBHS_DEVEPTCFG_ALLOC | USBHS_DEVEPTCFG_EPBK_2_BANK |
 		                            BULK_SIZE_CONF | USBHS_DEVEPTCFG_EPDIR_IN | USBHS_DEVEPTCFG_EPTYPE_BLK | USBHS_DEVEPTCFG_AUTOSW;
 
 		// setup endpoint 5 for OUT requests
-		USBHS->USBHS_DEVEPTCFG[5] = USBHS_DEVEPTCFG_ALLOC | USBHS_DEVEPTCFG_EPBK_1_BANK |
+		USBHS->USBHS_DEVEPTCFG[5] = USBHS_DEVEPTCFG_ALLOC | USBHS_DEVEPTCFG_EPBK_2_BANK |
 		                            BULK_SIZE_CONF | USBHS_DEVEPTCFG_EPDIR_OUT | USBHS_DEVEPTCFG_EPTYPE_BLK | USBHS_DEVEPTCFG_AUTOSW;
 
 		USBHS->USBHS_DEVEPT = USBHS_DEVEPT_EPEN0 | USBHS_DEVEPT_EPEN1 | USBHS_DEVEPT_EPEN2 | USBHS_DEVEPT_EPEN3 | USBHS_DEVEPT_EPEN4 | USBHS_DEVEPT_EPEN5;
@@ -626,6 +642,29 @@ uint16_t usb_cdc_write(const char *pData, uint16_t length) {
 	return usb_write(1, pData, length);
 }
 
+// multi-packet DMA of a whole buffer to an IN endpoint
+static void usb_dma_in_start(uint8_t ep, const char *pData, uint32_t length) {
+	cache_clean_region((void*)pData, length);
+	// a short last packet is only sent at the end of the buffer with END_B_EN
+	usb_dma_start(ep, (uint8_t*)pData, length, (length % BULK_IN_SIZE) ? USBHS_DEVDMACONTROL_END_B_EN : 0);
+}
+
+void usb_cdc_write_start(const char *pData, uint16_t length) {
+	if (usb_is_configured() && length)
+		usb_dma_in_start(1, pData, length);
+}
+
+uint8_t usb_cdc_write_busy(void) {
+	UsbhsDevDma* devdma = &USBHS->USBHS_DEVDMA[0];
+
+	if (!(devdma->USBHS_DEVDMASTATUS & USBHS_DEVDMASTATUS_CHANN_ENB)) return 0;
+	if (!usb_is_configured()) {
+		devdma->USBHS_DEVDMACONTROL = 0; // stop the channel
+		return 0;
+	}
+	return 1;
+}
+
 uint8_t usb_storage_is_configured(void) {
 	return (usb_is_configured());
 }
@@ -638,4 +677,67 @@ uint16_t usb_storage_write(const char *pData, uint16_t length) {
 	return usb_write(4, pData, length);
 }
 
+// Data phase of the mass storage commands. The DMA moves the whole buffer
+// in packets on its own and switches the endpoint banks, the CPU is free
+// until usb_storage_wait().
+#define STORAGE_TIMEOUT 500 // ms the host may take for one transfer
+
+static struct {
+	uint8_t ep;
+	uint8_t *buf;
+	uint32_t size;
+} storage_xfer;
+
+void usb_storage_write_start(const char *pData, uint32_t length) {
+	storage_xfer.ep = 4;
+	storage_xfer.buf = (uint8_t*)pData;
+	storage_xfer.size = length;
+	if (!usb_is_configured() || !length) {
+		storage_xfer.size = 0;
+		return;
+	}
+	usb_dma_in_start(4, pData, length);
+}
+
+void usb_storage_read_start(char *pData, uint32_t length) {
+	storage_xfer.ep = 5;
+	storage_xfer.buf = (uint8_t*)pData;
+	storage_xfer.size = length;
+	if (!usb_is_configured() || !length) {
+		storage_xfer.size = 0;
+		return;
+	}
+	cache_clean_invalidate_region(pData, length);
+	// a short packet from the host ends the transfer early
+	usb_dma_start(5, (uint8_t*)pData, length, USBHS_DEVDMACONTROL_END_TR_EN);
+}
+
+uint32_t usb_storage_wait(void) {
+	UsbhsDevDma* devdma = &USBHS->USBHS_DEVDMA[storage_xfer.ep-1];
+	long to = GetTimer(STORAGE_TIMEOUT);
+	uint32_t left;
+
+	if (!storage_xfer.size) return 0;
+
+	// CHANN_ACT drops between the packets, CHANN_ENB only at the end
+	while (devdma->USBHS_DEVDMASTATUS & USBHS_DEVDMASTATUS_CHANN_ENB) {
+		if (CheckTimer(to) || !usb_is_configured()) {
+			usb_debugf("storage transfer timeout on ep %d", storage_xfer.ep);
+			devdma->USBHS_DEVDMACONTROL = 0; // stop the channel
+			break;
+		}
+	}
+
+	left = (devdma->USBHS_DEVDMASTATUS & USBHS_DEVDMASTATUS_BUFF_COUNT_Msk) >> USBHS_DEVDMASTATUS_BUFF_COUNT_Pos;
+	if (storage_xfer.ep == 5) {
+		cache_invalidate_region(storage_xfer.buf, storage_xfer.size);
+		// the DMA took all banks, the next CBW is polled through RXOUTI again
+		USBHS->USBHS_DEVEPTICR[5] = USBHS_DEVEPTICR_RXOUTIC;
+	}
+	storage_xfer.size -= left;
+	left = storage_xfer.size;
+	storage_xfer.size = 0;
+	return left;
+}
+
 void usb_dev_reconnect(void) {}
\ No newline at end of file
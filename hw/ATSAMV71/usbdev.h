@@ -46,9 +46,19 @@ void usb_dev_reconnect(void);
 uint8_t  usb_cdc_is_configured(void);
 uint16_t usb_cdc_write(const char *pData, uint16_t length);
 uint16_t usb_cdc_read(char *pData, uint16_t length);
+// send in the background, the data must stay untouched while busy
+void     usb_cdc_write_start(const char *pData, uint16_t length);
+uint8_t  usb_cdc_write_busy(void);
 
 uint8_t  usb_storage_is_configured(void);
 uint16_t usb_storage_write(const char *pData, uint16_t length);
 uint16_t usb_storage_read(char *pData, uint16_t length);
 
+// bulk data phase in the background, the buffer must stay untouched until
+// usb_storage_wait() returns the number of bytes actually transferred. The
+// buffer of a read has to cover whole cache lines.
+void     usb_storage_write_start(const char *pData, uint32_t length);
+void     usb_storage_read_start(char *pData, uint32_t length);
+uint32_t usb_storage_wait(void);
+
 #endif // USBDEV_H
@@ -35,6 +35,7 @@
 #include "debug.h"
 #include "hardware.h"
 #include "utils.h"
+#include "prof.h"
 
 #define IKBD_AUTO_MS   20
 
@@ -56,6 +57,10 @@
 static unsigned short tx_queue[QUEUE_LEN];
 static unsigned char wptr = 0, rptr = 0;
 static unsigned long ikbd_timer = 0;
+#ifdef PROFILE
+static prof_input_t tx_lat;     // oldest report in the queue
+static prof_input_t auto_lat;   // oldest report for the next auto events
+#endif
 
 /* -------- main structure to keep track of ikbd state -------- */
 static struct {
@@ -126,6 +131,7 @@ static void enqueue(unsigned short b) {
 
   tx_queue[wptr] = b;
   wptr = (wptr+1)&(QUEUE_LEN-1);
+  PROF_INPUT_QUEUE(&tx_lat);
 }
 
 // convert internal joystick format into atari ikbd format
@@ -409,6 +415,9 @@ void ikbd_poll(void) {
   // do auto events every 20ms
   if(CheckTimer(ikbd.auto_timer)) {
     ikbd.auto_timer = GetTimer(IKBD_AUTO_MS);
+#ifdef PROFILE
+    unsigned char auto_wptr = wptr;
+#endif
 
     if(!(ikbd.state & IKBD_STATE_WAIT4RESET) &&
        !(ikbd.state & IKBD_STATE_PAUSED)) {
@@ -524,6 +533,10 @@ void ikbd_poll(void) {
 	}
       }
     }
+#ifdef PROFILE
+    // the joystick and mouse reports have become events or are dropped
+    PROF_INPUT_MOVE((wptr != auto_wptr) ? &tx_lat : 0, &auto_lat);
+#endif
   }
 
   static unsigned long mtimer = 0;
@@ -568,6 +581,7 @@ void ikbd_poll(void) {
   }
   
   // transmit data from queue
+  PROF_INPUT_DEQUEUE(&tx_lat);
   spi_uio_cmd_cont(UIO_IKBD_OUT);
   spi8(tx_queue[rptr]);
   DisableIO();
@@ -580,6 +594,7 @@ void ikbd_poll(void) {
 // called from external parts to report joystick states
 void ikbd_joystick(unsigned char joystick, unsigned char map) {
   ikbd.joy[joystick].state = joystick_map2ikbd(map);
+  PROF_INPUT_QUEUE(&auto_lat);
 }
 
 void ikbd_keyboard(unsigned char code) {
@@ -590,6 +605,7 @@ void ikbd_keyboard(unsigned char code) {
 }
 
 void ikbd_mouse(unsigned char b, char x, char y) {
+  PROF_INPUT_QUEUE(&auto_lat);
 
   // honour reversal of y axis
   if(ikbd.state & IKBD_STATE_MOUSE_Y_BOTTOM)
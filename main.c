@@ -65,6 +65,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "usbdev.h"
 #include "cdc_control.h"
 #include "storage_control.h"
+#include "sched.h"
+#include "prof.h"
 #include "FatFs/diskio.h"
 #ifdef HAVE_QSPI
 #include "qspi.h"
@@ -101,7 +103,13 @@ void FatalError(unsigned long error) {
 
 void HandleFpga(void) {
   unsigned char  c1, c2;
-  
+
+  if (!FpgaRequestPending(FPGA_REQ_FDD)) {
+    HandleHDD(0, 0, 1); // keep CDDA streaming
+    UpdateDriveStatus();
+    return;
+  }
+
   EnableFpga();
   c1 = SPI(0); // cmd request and drive number
   c2 = SPI(0); // track number
@@ -110,6 +118,9 @@ void HandleFpga(void) {
   SPI(0);
   SPI(0);
   DisableFpga();
+
+  if (c1 & (CMD_RDTRK | CMD_WRTRK | CMD_IDECMD | CMD_IDEDAT))
+    FpgaRequestAgain(FPGA_REQ_FDD);
   
   HandleFDD(c1, c2);
   HandleHDD(c1, c2, 1);
@@ -132,9 +143,68 @@ int GetUSBStorageDevices()
 }
 #endif
 
+static uint8_t mmc_ok = 0;
+
+// main loop tasks
+static void disk_poll(void) {
+  user_io_poll_disk();
+
+  // call original minimig handlers if minimig core is found
+  if((user_io_core_type() == CORE_TYPE_MINIMIG) ||
+    (user_io_core_type() == CORE_TYPE_MINIMIG2)) {
+    if(!mmc_ok)
+      EjectAllFloppies();
+
+    PROF_START(t);
+    HandleFpga();
+    PROF_END(PROF_FPGA, t);
+  }
+}
+
+static void ui_poll(void) {
+  // MIST (atari) core supports the same UI as Minimig
+  if((user_io_core_type() == CORE_TYPE_MIST) ||
+     (user_io_core_type() == CORE_TYPE_MIST2)) {
+     if(!mmc_ok)
+       tos_eject_all();
+
+     HandleUI();
+  }
+
+  if((user_io_core_type() == CORE_TYPE_MINIMIG) ||
+    (user_io_core_type() == CORE_TYPE_MINIMIG2))
+    HandleUI();
+
+  // 8 bit cores can also have a ui if a valid config string can be read from it
+  if((user_io_core_type() == CORE_TYPE_8BIT) && 
+     user_io_is_8bit_with_config_string())
+    HandleUI();
+
+  // Archie core will get its own treatment one day ...
+  if(user_io_core_type() == CORE_TYPE_ARCHIE)
+    HandleUI();
+}
+
+static void eth_task(void) {
+  eth_poll();
+}
+
+static sched_task_t main_tasks[] = {
+  // name       poll                  class             period budget
+  { "disk",     disk_poll,            SCHED_DISK,       0,     5  },
+#ifdef HAVE_USB_IRQ
+  { "hid",      usb_irq_poll,         SCHED_INPUT,      0,     1  },
+#endif
+  { "user_io",  user_io_poll,         SCHED_INPUT,      0,     2  },
+  { "usb",      usb_poll,             SCHED_INPUT,      0,     5  },
+  { "ui",       ui_poll,              SCHED_UI,         0,     20 },
+  { "cdc",      cdc_control_poll,     SCHED_BACKGROUND, 0,     2  },
+  { "storage",  storage_control_poll, SCHED_BACKGROUND, 0,     20 },
+  { "eth",      eth_task,             SCHED_BACKGROUND, 0,     2  },
+};
+
 int main(void)
 {
-    uint8_t mmc_ok = 0;
 
 #ifdef __GNUC__
     __init_hardware();
@@ -153,6 +223,9 @@ int main(void)
     zx_init();
     serial_sink_init();
     Timer_Init();
+#ifdef PROFILE
+    prof_init();
+#endif
 
     USART_Init(115200);
 
@@ -160,6 +233,10 @@ int main(void)
     iprintf("\rARM Controller by Jakub Bednarski\r\r");
     iprintf("Version %s\r\r", version+5);
 
+#ifdef CACHE_TEST
+    cache_test();
+#endif
+
     spi_init();
 #ifdef HAVE_QSPI
     qspi_init();
@@ -244,45 +321,14 @@ int main(void)
 
     usb_dev_open();
 
+    for (int i = 0; i < sizeof(main_tasks)/sizeof(main_tasks[0]); i++)
+      sched_add(&main_tasks[i]);
+
     while (1) {
+      PROF_START(t);
       mmc_ok = fat_medium_present();
-
-      cdc_control_poll();
-      storage_control_poll();
-
-      user_io_poll();
-
-      usb_poll();
-
-      eth_poll();
-
-      // MIST (atari) core supports the same UI as Minimig
-      if((user_io_core_type() == CORE_TYPE_MIST) ||
-         (user_io_core_type() == CORE_TYPE_MIST2)) {
-         if(!mmc_ok)
-             tos_eject_all();
-
-         HandleUI();
-      }
-
-      // call original minimig handlers if minimig core is found
-      if((user_io_core_type() == CORE_TYPE_MINIMIG) ||
-        (user_io_core_type() == CORE_TYPE_MINIMIG2)) {
-        if(!mmc_ok)
-            EjectAllFloppies();
-
-        HandleFpga();
-        HandleUI();
-      }
-
-      // 8 bit cores can also have a ui if a valid config string can be read from it
-      if((user_io_core_type() == CORE_TYPE_8BIT) && 
-	 user_io_is_8bit_with_config_string())
-	HandleUI();
-
-      // Archie core will get its own treatment one day ...
-      if(user_io_core_type() == CORE_TYPE_ARCHIE)
-	HandleUI();
+      sched_run();
+      PROF_END(PROF_LOOP, t);
     }
     return 0;
 }
@@ -51,6 +51,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "settings.h"
 #include "usb.h"
 #include "usbdev.h"
+#include "prof.h"
+#include "bufpool.h"
 #ifdef CONFIG_HAVE_ETH
 #include "eth.h"
 #endif
@@ -492,6 +494,12 @@ static char GetMenuPage_System(uint8_t idx, char action, menu_page_t *page) {
 			page->title = "Status";
 			page->timer = 10;
 			break;
+#ifdef PROFILE
+		case 11:
+			page->title = "Profiler";
+			page->timer = 1000;
+			break;
+#endif
 	}
 	return 0;
 }
@@ -516,6 +524,10 @@ static char GetMenuItem_System(uint8_t idx, char action, menu_item_t *item) {
 	else if (idx<=40) {item->page = 8; item->active = 0;}
 	else if (idx<=46) {item->page = 9; item->active = 0;}
 	else if (idx<=55) {item->page = 10; item->active = 0;}
+#ifdef PROFILE
+	else if (idx==56) item->page = 10;
+	else if (idx<60+prof_entries()) {item->page = 11; item->active = (idx<59);}
+#endif
 	else return 0;
 	if (item->page != page_idx) return 1; // shortcut
 
@@ -736,6 +748,18 @@ static char GetMenuItem_System(uint8_t idx, char action, menu_item_t *item) {
 						);
 					item->item = s;
 					break;
+#ifdef PROFILE
+				case 36: {
+					// report to core latency, min/avg/max
+					const prof_stat_t *st = prof_input_stat(PROF_IN_JOY + page_idx-4);
+					if (st->count)
+						siprintf(s, "   Lag us %6lu%6lu%6lu", st->min, (uint32_t)(st->total / st->count), st->max);
+					else
+						strcpy(s, "   Lag us      -     -     -");
+					item->item = s;
+					}
+					break;
+#endif
 
 				// page 8 - keyboard test
 				case 37:
@@ -862,8 +886,36 @@ static char GetMenuItem_System(uint8_t idx, char action, menu_item_t *item) {
 					item->item = s;
 					break;
 				}
+#endif
+#ifdef PROFILE
+				case 56:
+					item->item = " Profiler";
+					item->newpage = 11;
+					break;
+
+				// page 11 - profiler
+				case 57:
+					item->item = " Reset statistics";
+					break;
+				case 58:
+					item->item = " Dump to serial";
+					break;
+				case 59:
+					siprintf(s, "%-7s%7s%7s%7s", "us", "min", "avg", "max");
+					item->item = s;
+					break;
 #endif
 				default:
+#ifdef PROFILE
+					if (idx >= 60) {
+						const prof_stat_t *st = prof_stat(idx-60);
+						if (st->count)
+							siprintf(s, "%-7.7s%7lu%7lu%7lu", prof_name(idx-60), st->min, (uint32_t)(st->total / st->count), st->max);
+						else
+							siprintf(s, "%-7.7s%7s%7s%7s", prof_name(idx-60), "-", "-", "-");
+						item->item = s;
+					}
+#endif
 					item->active = 0;
 			}
 			break;
@@ -914,7 +966,7 @@ static char GetMenuItem_System(uint8_t idx, char action, menu_item_t *item) {
 					}
 					break;
 				case 13:
-					SelectFileNG("RBFARC", SCAN_LFN | SCAN_SYSDIR, CoreFileSelected, 0);
+					SelectFileNG("RBFRBZARC", SCAN_LFN | SCAN_SYSDIR, CoreFileSelected, 0);
 					break;
 				case 21:
 				case 22:
@@ -928,6 +980,19 @@ static char GetMenuItem_System(uint8_t idx, char action, menu_item_t *item) {
 				case 26:
 					item->newpage = 9;
 					break;
+#ifdef PROFILE
+				case 56:
+					item->newpage = 11;
+					break;
+				case 57:
+					prof_reset();
+					sched_reset_stats();
+					bufpool_reset_stats();
+					break;
+				case 58:
+					prof_dump(0);
+					break;
+#endif
 			}
 			break;
 		case MENU_ACT_LEFT:
@@ -1048,7 +1113,7 @@ void SelectFile(char* pFileExt, unsigned char Options, unsigned char MenuSelect,
 
 	menu_debugf("pFileExt = %3s\n", pFileExt);
 	strcpy(fs_pFileExt, pFileExt);
-	fs_ShowExt = ((strlen(fs_pFileExt)>3 && strncmp(fs_pFileExt, "RBFARC", 6)) || strchr(fs_pFileExt, '*') || strchr(fs_pFileExt, '?'));
+	fs_ShowExt = ((strlen(fs_pFileExt)>3 && strncmp(fs_pFileExt, "RBFRBZARC", 9)) || strchr(fs_pFileExt, '*') || strchr(fs_pFileExt, '?'));
 	fs_Options = Options;
 	fs_MenuSelect = MenuSelect;
 
@@ -1265,7 +1330,7 @@ void HandleUI(void)
 					}
 					// the "menu" core is special in jumps directly to the core selection menu
 					if(!strcmp(user_io_get_core_name(), "MENU") || (user_io_get_core_features() & FEAT_MENU)) {
-						SelectFileNG("RBFARC", SCAN_LFN | SCAN_SYSDIR, CoreFileSelected, 0);
+						SelectFileNG("RBFRBZARC", SCAN_LFN | SCAN_SYSDIR, CoreFileSelected, 0);
 					}
 				}
 
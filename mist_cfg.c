@@ -69,7 +69,9 @@ mist_cfg_t mist_cfg = {
   .ypbpr = 0,
   .keep_video_mode = 0,
   .led_animation = 0,
-  .amiga_mod_keys = 0
+  .amiga_mod_keys = 0,
+  .usb_storage_share = 100,
+  .pl2303_rtscts = 0
 };
 
 minimig_cfg_t minimig_cfg = {
@@ -126,6 +128,8 @@ const ini_var_t mist_ini_vars[] = {
   {"ROM", (void*)ini_rom_upload, CUSTOM_HANDLER, 0, 0, 1},
   {"AMIGA_MOD_KEYS", (void*)(&(mist_cfg.amiga_mod_keys)), UINT8, 0, 3, 1},
   {"USB_STORAGE", (void*)(&(mist_cfg.usb_storage)), UINT8, 0, 1, 1},
+  {"USB_STORAGE_SHARE", (void*)(&(mist_cfg.usb_storage_share)), UINT8, 10, 100, 1},
+  {"PL2303_RTSCTS", (void*)(&(mist_cfg.pl2303_rtscts)), UINT8, 0, 1, 1},
   // [MINIMIG_CONFIG]
   {"KICK1X_MEMORY_DETECTION_PATCH", (void*)(&(minimig_cfg.kick1x_memory_detection_patch)), UINT8, 0, 1, 2},
   {"CLOCK_FREQ", (void*)(&(minimig_cfg.clock_freq)), UINT8, 0, 2, 2},
@@ -0,0 +1,393 @@
+/*
+ * mistxfer.c
+ *
+ * Host side of the file transfer protocol of xfer.h, for copying files to
+ * the SD card through the USB CDC port of a running MiST. The CDC port
+ * has to be in the control mode.
+ *
+ *   mistxfer [-d /dev/ttyACM0] put [-r] <local file> [<remote path>]
+ *   mistxfer [-d /dev/ttyACM0] ls [<remote dir>]
+ *   mistxfer [-d /dev/ttyACM0] rm <remote path>
+ *   mistxfer [-d /dev/ttyACM0] mkdir <remote path>
+ *
+ * put -r resumes an interrupted transfer. Every transfer ends with the
+ * comparison of the CRC32 of the file the card reads back.
+ *
+ * The protocol functions go through an xfer_link_t, xfer_test.c runs them
+ * against the firmware side in xfer.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "xfer.h"
+#include "mistxfer.h"
+
+#define MX_TIMEOUT       1000  // ms for a reply
+#define MX_CLOSE_TIMEOUT 60000 // the card reads the file back
+#define MX_RETRIES       10
+
+static uint32_t crc32_table[256];
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, uint32_t len) {
+  if(!crc32_table[1]) {
+    uint32_t i, j, c;
+    for(i=0;i<256;i++) {
+      for(c=i, j=0;j<8;j++)
+        c = (c >> 1) ^ ((c & 1) ? 0xedb88320 : 0);
+      crc32_table[i] = c;
+    }
+  }
+
+  while(len--)
+    crc = crc32_table[(uint8_t)crc ^ *p++] ^ (crc >> 8);
+  return crc;
+}
+
+static void mx_send(xfer_link_t *l, uint8_t cmd, uint32_t offset, const void *data, uint16_t len) {
+  uint8_t frame[sizeof(xfer_hdr_t) + 65535];
+  xfer_hdr_t hdr = { XFER_MAGIC, cmd, 0, len, offset, 0 };
+
+  hdr.crc = ~crc32_update(crc32_update(~0, (uint8_t*)&hdr, sizeof(hdr)), data, len);
+  memcpy(frame, &hdr, sizeof(hdr));
+  memcpy(frame + sizeof(hdr), data, len);
+  l->write(l->ctx, frame, sizeof(hdr) + len);
+}
+
+static int mx_getc(xfer_link_t *l, int timeout) {
+  if(l->rx_pos == l->rx_len) {
+    l->rx_pos = 0;
+    l->rx_len = l->read(l->ctx, l->rx_buf, sizeof(l->rx_buf), timeout);
+    if(l->rx_len <= 0) {
+      l->rx_len = 0;
+      return -1;
+    }
+  }
+  return l->rx_buf[l->rx_pos++];
+}
+
+// returns 1 with a reply, 0 on timeout. Damaged frames and anything not
+// a frame, like the text of the control mode, are skipped.
+static int mx_recv(xfer_link_t *l, xfer_hdr_t *hdr, uint8_t *payload, int timeout) {
+  uint8_t *b = (uint8_t*)hdr;
+  uint32_t crc;
+  int fill = 0, c, i;
+
+  for(;;) {
+    while(fill < sizeof(xfer_hdr_t)) {
+      if((c = mx_getc(l, timeout)) < 0) return 0;
+      if(fill < 4 && c != ((XFER_MAGIC >> (8*fill)) & 0xff)) {
+        fill = 0;
+        if(c != (XFER_MAGIC & 0xff)) continue;
+      }
+      b[fill++] = c;
+    }
+    fill = 0;
+
+    if(hdr->len > XFER_CMD_MAX) continue;
+    for(i=0;i<hdr->len;i++) {
+      if((c = mx_getc(l, timeout)) < 0) return 0;
+      payload[i] = c;
+    }
+
+    crc = hdr->crc;
+    hdr->crc = 0;
+    if(crc == ~crc32_update(crc32_update(~0, b, sizeof(xfer_hdr_t)), payload, hdr->len))
+      return 1;
+  }
+}
+
+// send a request and wait for its reply, with retries
+static int mx_request(xfer_link_t *l, uint8_t cmd, uint32_t offset, const void *data, uint16_t len,
+                      xfer_hdr_t *reply, uint8_t *payload, int timeout) {
+  int retry;
+
+  for(retry=0;retry<MX_RETRIES;retry++) {
+    mx_send(l, cmd, offset, data, len);
+    while(mx_recv(l, reply, payload, timeout)) {
+      if(reply->cmd != (cmd | XFER_REPLY)) continue;  // late replies of DATA
+      if(reply->status != XFER_ERR_CRC) return 0;
+      break;
+    }
+  }
+  fprintf(stderr, "no reply to request %d\n", cmd);
+  return -1;
+}
+
+int mx_connect(xfer_link_t *l) {
+  xfer_hdr_t reply;
+  uint8_t payload[XFER_CMD_MAX];
+
+  l->write(l->ctx, (const uint8_t*)"F", 1);
+  if(mx_request(l, XFER_HELLO, 0, 0, 0, &reply, payload, MX_TIMEOUT))
+    return -1;
+
+  if(reply.offset != XFER_VERSION || reply.len < 3) {
+    fprintf(stderr, "protocol version %u not supported\n", reply.offset);
+    return -1;
+  }
+  l->payload = payload[0] | (payload[1] << 8);
+  l->window = payload[2];
+  return 0;
+}
+
+static int mx_path_request(xfer_link_t *l, uint8_t cmd, const char *path) {
+  xfer_hdr_t reply;
+  uint8_t payload[XFER_CMD_MAX];
+
+  if(strlen(path) >= XFER_CMD_MAX) return -1;
+  if(mx_request(l, cmd, 0, path, strlen(path), &reply, payload, MX_TIMEOUT))
+    return -1;
+  if(reply.status != XFER_OK) {
+    fprintf(stderr, "%s: error %d\n", path, reply.offset);
+    return -1;
+  }
+  return 0;
+}
+
+int mx_remove(xfer_link_t *l, const char *path) {
+  return mx_path_request(l, XFER_DELETE, path);
+}
+
+int mx_mkdir(xfer_link_t *l, const char *path) {
+  return mx_path_request(l, XFER_MKDIR, path);
+}
+
+int mx_list(xfer_link_t *l, const char *path, void (*entry)(const char *name, uint32_t size, uint8_t attr)) {
+  xfer_hdr_t reply;
+  uint8_t payload[XFER_CMD_MAX];
+
+  if(strlen(path) >= XFER_CMD_MAX) return -1;
+  if(mx_request(l, XFER_LIST, 0, path, strlen(path), &reply, payload, MX_TIMEOUT))
+    return -1;
+
+  for(;;) {
+    int i = 0;
+    uint32_t size;
+
+    if(reply.status != XFER_OK && reply.status != XFER_MORE) {
+      fprintf(stderr, "%s: cannot list\n", path);
+      return -1;
+    }
+
+    while(i + 5 < reply.len) {
+      memcpy(&size, payload + i, 4);
+      entry((char*)payload + i + 5, size, payload[i + 4]);
+      i += 5 + strlen((char*)payload + i + 5) + 1;
+    }
+
+    if(reply.status == XFER_OK) return 0;
+    if(!mx_recv(l, &reply, payload, MX_TIMEOUT)) return -1;
+  }
+}
+
+int mx_exit(xfer_link_t *l) {
+  xfer_hdr_t reply;
+  uint8_t payload[XFER_CMD_MAX];
+
+  return mx_request(l, XFER_EXIT, 0, 0, 0, &reply, payload, MX_TIMEOUT);
+}
+
+int mx_put(xfer_link_t *l, const uint8_t *data, uint32_t size, const char *remote, int resume) {
+  uint8_t req[XFER_CMD_MAX];
+  uint8_t payload[XFER_CMD_MAX];
+  xfer_hdr_t reply;
+  uint32_t acked, sent, crc, window = l->window * l->payload;
+  int retries = 0;
+
+  if(strlen(remote) + 1 >= XFER_CMD_MAX) return -1;
+  req[0] = resume ? XFER_RESUME : 0;
+  strcpy((char*)req + 1, remote);
+  if(mx_request(l, XFER_OPEN, size, req, 1 + strlen(remote), &reply, payload, MX_TIMEOUT))
+    return -1;
+  if(reply.status != XFER_OK) {
+    if(reply.status == XFER_ERR_STATE)
+      fprintf(stderr, "%s: cannot open, the device is busy\n", remote);
+    else
+      fprintf(stderr, "%s: cannot open, error %d\n", remote, reply.offset);
+    return -1;
+  }
+  if(reply.offset > size) {
+    fprintf(stderr, "%s: remote file is larger\n", remote);
+    return -1;
+  }
+
+  acked = sent = reply.offset;
+  l->resumed = acked;
+  l->frames = l->resent = 0;
+
+  while(acked < size) {
+    // fill the window, a frame ends at the next multiple of the payload
+    while(sent < size && sent - acked < window) {
+      uint32_t n = l->payload - (sent % l->payload);
+      if(n > size - sent) n = size - sent;
+      mx_send(l, XFER_DATA, sent, data + sent, n);
+      sent += n;
+      l->frames++;
+    }
+
+    // the window is full, wait for it to move on
+    if(!mx_recv(l, &reply, payload, MX_TIMEOUT)) {
+      if(++retries == MX_RETRIES) {
+        fprintf(stderr, "%s: transfer timed out at %u\n", remote, acked);
+        return -1;
+      }
+      // start over from the last acknowledged offset
+      l->resent += sent - acked;
+      sent = acked;
+      continue;
+    }
+
+    if(reply.cmd != (XFER_DATA | XFER_REPLY)) continue;
+    retries = 0;
+
+    if(reply.status == XFER_OK) {
+      if(reply.offset > acked) acked = reply.offset;
+    } else if(reply.status == XFER_ERR_SEQ) {
+      l->resent += sent - reply.offset;
+      acked = sent = reply.offset;
+    } else {
+      fprintf(stderr, "%s: write failed at %u\n", remote, acked);
+      return -1;
+    }
+  }
+
+  // compare with what the card reads back
+  crc = ~crc32_update(~0, data, size);
+  if(mx_request(l, XFER_CLOSE, size, 0, 0, &reply, payload, MX_CLOSE_TIMEOUT))
+    return -1;
+  if(reply.status != XFER_OK || reply.len != 4) {
+    fprintf(stderr, "%s: close failed\n", remote);
+    return -1;
+  }
+  if(memcmp(payload, &crc, 4)) {
+    fprintf(stderr, "%s: verify failed\n", remote);
+    return -1;
+  }
+  return 0;
+}
+
+#ifndef XFER_TEST
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+static int serial_read(void *ctx, uint8_t *buf, int len, int timeout) {
+  struct pollfd p = { *(int*)ctx, POLLIN, 0 };
+
+  if(poll(&p, 1, timeout) <= 0) return 0;
+  return read(*(int*)ctx, buf, len);
+}
+
+static void serial_write(void *ctx, const uint8_t *buf, int len) {
+  while(len > 0) {
+    int n = write(*(int*)ctx, buf, len);
+    if(n <= 0) return;
+    buf += n;
+    len -= n;
+  }
+}
+
+static void print_entry(const char *name, uint32_t size, uint8_t attr) {
+  if(attr & 0x10) printf("%10s  %s/\n", "<dir>", name);
+  else            printf("%10u  %s\n", size, name);
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int usage(void) {
+  printf("Usage: mistxfer [-d <device>] put [-r] <local file> [<remote path>]\n");
+  printf("                              ls [<remote dir>]\n");
+  printf("                              rm <remote path>\n");
+  printf("                              mkdir <remote path>\n");
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  const char *dev = "/dev/ttyACM0";
+  struct termios tio;
+  xfer_link_t link;
+  int fd, ret = -1;
+
+  argv++; argc--;
+  if(argc >= 2 && !strcmp(argv[0], "-d")) {
+    dev = argv[1];
+    argv += 2; argc -= 2;
+  }
+  if(argc < 1) return usage();
+
+  fd = open(dev, O_RDWR | O_NOCTTY);
+  if(fd < 0) {
+    printf("Unable to open %s\n", dev);
+    return -1;
+  }
+  tcgetattr(fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(fd, TCSANOW, &tio);
+  tcflush(fd, TCIOFLUSH);
+
+  memset(&link, 0, sizeof(link));
+  link.read = serial_read;
+  link.write = serial_write;
+  link.ctx = &fd;
+
+  if(mx_connect(&link)) {
+    printf("No answer from %s, is the CDC port in the control mode?\n", dev);
+    close(fd);
+    return -1;
+  }
+
+  if(!strcmp(argv[0], "put") && argc >= 2) {
+    int resume = (argc >= 3 && !strcmp(argv[1], "-r"));
+    const char *local = argv[1 + resume];
+    const char *remote = (argc > 2 + resume) ? argv[2 + resume] : local;
+    FILE *f = fopen(local, "rb");
+    uint8_t *data;
+    long size;
+    double t;
+
+    if(!f) {
+      printf("Unable to open %s\n", local);
+    } else {
+      fseek(f, 0, SEEK_END);
+      size = ftell(f);
+      fseek(f, 0, SEEK_SET);
+      data = malloc(size ? size : 1);
+      if(fread(data, 1, size, f) != size) {
+        printf("Read error on %s\n", local);
+      } else {
+        t = now();
+        ret = mx_put(&link, data, size, remote, resume);
+        t = now() - t;
+        if(!ret)
+          printf("%s: %ld bytes from %u in %.2fs, %.0f kB/s, %u bytes resent\n", remote, size,
+                 link.resumed, t, (size - link.resumed) / t / 1000, link.resent);
+      }
+      free(data);
+      fclose(f);
+    }
+  } else if(!strcmp(argv[0], "ls")) {
+    ret = mx_list(&link, (argc > 1) ? argv[1] : "/", print_entry);
+  } else if(!strcmp(argv[0], "rm") && argc == 2) {
+    ret = mx_remove(&link, argv[1]);
+  } else if(!strcmp(argv[0], "mkdir") && argc == 2) {
+    ret = mx_mkdir(&link, argv[1]);
+  } else {
+    usage();
+  }
+
+  mx_exit(&link);
+  close(fd);
+  return ret;
+}
+
+#endif // XFER_TEST
@@ -0,0 +1,38 @@
+/*
+ * mistxfer.h
+ * Host side of the file transfer protocol of xfer.h
+ *
+ */
+
+#ifndef MISTXFER_H
+#define MISTXFER_H
+
+#include <inttypes.h>
+
+typedef struct {
+  // returns the bytes read, 0 after timeout ms without data
+  int (*read)(void *ctx, uint8_t *buf, int len, int timeout);
+  void (*write)(void *ctx, const uint8_t *buf, int len);
+  void *ctx;
+
+  uint8_t rx_buf[512];
+  int rx_pos, rx_len;
+
+  // from the HELLO reply
+  uint16_t payload;
+  uint8_t window;
+
+  // of the last put
+  uint32_t resumed;   // offset the transfer started at
+  uint32_t frames;
+  uint32_t resent;    // bytes
+} xfer_link_t;
+
+int mx_connect(xfer_link_t *l);
+int mx_put(xfer_link_t *l, const uint8_t *data, uint32_t size, const char *remote, int resume);
+int mx_list(xfer_link_t *l, const char *path, void (*entry)(const char *name, uint32_t size, uint8_t attr));
+int mx_remove(xfer_link_t *l, const char *path);
+int mx_mkdir(xfer_link_t *l, const char *path);
+int mx_exit(xfer_link_t *l);
+
+#endif // MISTXFER_H
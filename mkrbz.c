@@ -0,0 +1,92 @@
+/*
+ * mkrbz - create compressed FPGA bitstreams (.RBZ) from Altera .RBF files
+ *
+ * Format (see fpga.h):
+ * header: "RBZ" 0x01, uncompressed size (32 bit LE)
+ * data:   0x00-0x7f: n+1 literal bytes follow
+ *         0x80-0xff: next byte repeated (n&0x7f)+2 times
+ *
+ * Runs only need the current byte, so the firmware can decompress straight
+ * into the configuration shifter without any history buffer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define MAX_LITERAL 128
+#define MAX_RUN     129
+
+static void put_literal(FILE *out, const unsigned char *p, int len) {
+  fputc(len - 1, out);
+  fwrite(p, 1, len, out);
+}
+
+int main(int argc, char **argv) {
+  FILE *in, *out;
+  unsigned char *buf;
+  long size, i, lit, run;
+
+  printf("mkrbz - mist compressed core creator\n");
+
+  if(argc != 3) {
+    printf("Usage: mkrbz <infile>.rbf <outfile>.rbz\n");
+    return -1;
+  }
+
+  if(!(in = fopen(argv[1], "rb"))) {
+    perror("");
+    return -1;
+  }
+
+  fseek(in, 0, SEEK_END);
+  size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+
+  buf = malloc(size);
+  if(!buf || fread(buf, 1, size, in) != size) {
+    printf("Error reading %s\n", argv[1]);
+    return -1;
+  }
+  fclose(in);
+
+  if(!(out = fopen(argv[2], "wb"))) {
+    perror("");
+    return -1;
+  }
+
+  fwrite("RBZ\x01", 1, 4, out);
+  fputc(size & 0xff, out);
+  fputc((size >> 8) & 0xff, out);
+  fputc((size >> 16) & 0xff, out);
+  fputc((size >> 24) & 0xff, out);
+
+  i = lit = 0;
+  while(i < size) {
+    // length of the run starting at i
+    for(run = 1; i + run < size && run < MAX_RUN && buf[i + run] == buf[i]; run++);
+
+    // a run of two only pays off when no literal is pending
+    if(run > 2 || (run == 2 && !lit)) {
+      if(lit) put_literal(out, buf + i - lit, lit);
+      lit = 0;
+      fputc(0x80 | (run - 2), out);
+      fputc(buf[i], out);
+      i += run;
+    } else {
+      lit++;
+      i++;
+      if(lit == MAX_LITERAL) {
+        put_literal(out, buf + i - lit, lit);
+        lit = 0;
+      }
+    }
+  }
+  if(lit) put_literal(out, buf + i - lit, lit);
+
+  printf("%ld -> %ld bytes\n", size, ftell(out));
+  fclose(out);
+  free(buf);
+
+  return 0;
+}
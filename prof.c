@@ -0,0 +1,205 @@
+/*
+ * prof.c
+ *
+ * Run time statistics of the main loop stages. The time stamps come from
+ * the PIT on the SAM7S and from the DWT cycle counter on the SAMV71. The
+ * whole module is only built with PROFILE defined, the PROF_START/PROF_END
+ * macros compile to nothing otherwise.
+ */
+
+#ifdef PROFILE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hardware.h"
+#include "prof.h"
+#include "bufpool.h"
+#include "spi_batch.h"
+#include "user_io.h"
+#ifdef HAVE_USB_IRQ
+#include "usb.h"
+#endif
+#ifdef CONFIG_CHIP_SAMV71
+#include "eth_bridge.h"
+#endif
+
+static const char *prof_names[PROF_TASK] = {
+  "loop", "fpga", "hdd", "sd", "pcecd", "neocd"
+};
+
+static const char *prof_input_names[PROF_INPUTS] = {
+  "joy1", "joy2", "joy3", "joy4", "joy5", "joy6", "kbd", "mouse"
+};
+
+static prof_stat_t stats[PROF_ENTRIES];
+static prof_stat_t input_stats[PROF_INPUTS];
+static prof_input_t input;    // the report being processed
+
+void prof_init(void) {
+  InitProfTicks();
+  prof_reset();
+}
+
+uint32_t prof_start(void) {
+  return GetProfTicks();
+}
+
+static void prof_account(prof_stat_t *st, uint32_t start) {
+  uint32_t t = GetProfTicks() - start;
+  uint8_t b;
+
+#if PROF_TICKS_WRAP
+  if ((int32_t)t < 0) t += PROF_TICKS_WRAP;
+#endif
+  t /= PROF_TICKS_PER_US;
+
+  st->count++;
+  st->total += t;
+  if (t < st->min) st->min = t;
+  if (t > st->max) st->max = t;
+
+  for (b = 0; b < PROF_BUCKETS-1 && t >= (16UL << (2*b)); b++);
+  st->hist[b]++;
+}
+
+void prof_end(uint8_t id, uint32_t start) {
+  prof_account(&stats[id], start);
+}
+
+void prof_input_arrival(uint32_t t) {
+  input.t = t ? t : 1;
+  input.src = 0xff;
+}
+
+void prof_input_source(uint8_t src) {
+  if (src >= PROF_INPUTS) return;
+  input.src = src;
+#ifdef PROF_INPUT_LED
+  DISKLED_ON
+#endif
+}
+
+static void prof_input_done(prof_input_t *q) {
+  if (!q->t || q->src >= PROF_INPUTS) return;
+  prof_account(&input_stats[q->src], q->t);
+  q->t = 0;
+#ifdef PROF_INPUT_LED
+  DISKLED_OFF
+#endif
+}
+
+// the first bytes of the current report went to the core
+void prof_input_sent(void) {
+  prof_input_done(&input);
+}
+
+void prof_input_end(void) {
+  input.t = 0;
+}
+
+// the current report was queued, only the oldest pending one is timed
+void prof_input_queue(prof_input_t *q) {
+  if (!q->t && input.t && input.src < PROF_INPUTS) *q = input;
+}
+
+// pass the pending report on to the next queue, drop it if to is NULL
+void prof_input_move(prof_input_t *to, prof_input_t *from) {
+  if (to && !to->t) *to = *from;
+  from->t = 0;
+}
+
+// the data of a queue went to the core
+void prof_input_dequeue(prof_input_t *q) {
+  prof_input_done(q);
+}
+
+const prof_stat_t *prof_input_stat(uint8_t src) {
+  return (src < PROF_INPUTS) ? &input_stats[src] : 0;
+}
+
+void prof_reset(void) {
+  uint8_t i;
+
+  memset(stats, 0, sizeof(stats));
+  for (i = 0; i < PROF_ENTRIES; i++)
+    stats[i].min = 0xffffffff;
+  memset(input_stats, 0, sizeof(input_stats));
+  for (i = 0; i < PROF_INPUTS; i++)
+    input_stats[i].min = 0xffffffff;
+}
+
+// the fixed entries followed by the registered scheduler tasks
+uint8_t prof_entries(void) {
+  return PROF_TASK + sched_tasks();
+}
+
+const char *prof_name(uint8_t id) {
+  if (id < PROF_TASK) return prof_names[id];
+  if (id < prof_entries()) return sched_task(id - PROF_TASK)->name;
+  return 0;
+}
+
+const prof_stat_t *prof_stat(uint8_t id) {
+  return (id < PROF_ENTRIES) ? &stats[id] : 0;
+}
+
+static void prof_iputs(char *str) {
+  iprintf("%s\n", str);
+}
+
+void prof_dump(void (*out)(char *)) {
+  char line[96];
+  uint8_t i, b;
+  int n;
+
+  if (!out) out = prof_iputs;
+
+  out("stage        count    min    avg    max  <16u  <64u <256u   <1m   <4m  <16m  <64m  more");
+  for (i = 0; i < prof_entries() + PROF_INPUTS; i++) {
+    const prof_stat_t *st = (i < prof_entries()) ? &stats[i] : &input_stats[i - prof_entries()];
+    if (!st->count) continue;
+
+    n = siprintf(line, "%-8s %9lu %6lu %6lu %6lu",
+      (i < prof_entries()) ? prof_name(i) : prof_input_names[i - prof_entries()],
+      st->count, st->min, (uint32_t)(st->total / st->count), st->max);
+    for (b = 0; b < PROF_BUCKETS; b++)
+      n += siprintf(line + n, " %5lu", st->hist[b] > 99999 ? 99999 : st->hist[b]);
+    out(line);
+  }
+
+  out("task       runs  max ms  max gap  overruns");
+  for (i = 0; i < sched_tasks(); i++) {
+    const sched_task_t *task = sched_task(i);
+    siprintf(line, "%-8s %8lu %7u %8u %9lu", task->name, task->runs, task->max_time, task->max_gap, task->overruns);
+    out(line);
+  }
+
+  siprintf(line, "spi batch: %u xfers, %u bytes", spi_batch_stats()->xfers, spi_batch_stats()->bytes);
+  out(line);
+
+  siprintf(line, "buffers: %u/%u used, peak %u, shared peak %u, fallbacks %lu, conflicts %lu",
+    bufpool_stats()->used, bufpool_stats()->blocks, bufpool_stats()->peak,
+    bufpool_stats()->shared_peak, bufpool_stats()->fallbacks, bufpool_stats()->conflicts);
+  out(line);
+
+#ifdef HAVE_USB_IRQ
+  siprintf(line, "usb irq: %lu reports, %lu naks, %lu errors, %lu dropped",
+    usb_irq_stats()->reports, usb_irq_stats()->naks, usb_irq_stats()->errors, usb_irq_stats()->dropped);
+  out(line);
+#endif
+
+#ifdef CONFIG_CHIP_SAMV71
+  siprintf(line, "eth rx: %lu frames, %lu bytes, %lu dropped, %lu overruns",
+    eth_stats()->rx_frames, eth_stats()->rx_bytes, eth_stats()->rx_dropped, eth_stats()->rx_overruns);
+  out(line);
+  siprintf(line, "eth tx: %lu frames, %lu bytes, %lu dropped, %lu ring full",
+    eth_stats()->tx_frames, eth_stats()->tx_bytes, eth_stats()->tx_dropped, eth_stats()->tx_full);
+  out(line);
+#endif
+
+  // the shadow table of the user_io writes goes to the debug output only
+  if (out == prof_iputs) user_io_shadow_dump();
+}
+
+#endif // PROFILE
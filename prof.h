@@ -0,0 +1,97 @@
+/*
+ * prof.h
+ * Main loop latency profiler, build with PROFILE=1 to enable
+ *
+ */
+
+#ifndef PROF_H
+#define PROF_H
+
+#include <inttypes.h>
+
+#include "sched.h"
+
+#define PROF_LOOP    0 // one scheduler pass
+#define PROF_FPGA    1 // HandleFpga()
+#define PROF_HDD     2 // HandleHDD()
+#define PROF_SD      3 // SD card emulation
+#define PROF_PCECD   4 // pcecd_poll()
+#define PROF_NEOCD   5 // neocd_poll()
+#define PROF_TASK    6 // scheduler tasks, by index
+#define PROF_ENTRIES (PROF_TASK + SCHED_MAX_TASKS)
+
+// histogram buckets: <16us, <64us, <256us, <1ms, <4ms, <16ms, <64ms, more
+#define PROF_BUCKETS 8
+
+// input latency sources
+#define PROF_IN_JOY    0 // joysticks by OSD index 0-5, USB and DB9
+#define PROF_IN_KBD    6
+#define PROF_IN_MOUSE  7
+#define PROF_INPUTS    8
+
+#ifdef PROFILE
+
+typedef struct {
+  uint32_t count;
+  uint32_t min;    // us
+  uint32_t max;
+  uint64_t total;
+  uint32_t hist[PROF_BUCKETS];
+} prof_stat_t;
+
+void prof_init(void);
+uint32_t prof_start(void);
+void prof_end(uint8_t id, uint32_t start);
+void prof_reset(void);
+uint8_t prof_entries(void);
+const char *prof_name(uint8_t id);
+const prof_stat_t *prof_stat(uint8_t id);
+// print the statistics line by line, to the debug output if out is NULL
+void prof_dump(void (*out)(char *));
+
+// Input latency, from the arrival of a report to the first byte of its
+// data sent to the core. The USB layer stamps the arrival, the driver
+// names the source once it knows the device and the user_io layer marks
+// the SPI write. Data which is queued first carries its arrival time in
+// a prof_input_t of the queue.
+typedef struct {
+  uint32_t t;      // arrival in prof ticks, 0 if nothing pending
+  uint8_t src;
+} prof_input_t;
+
+void prof_input_arrival(uint32_t t);
+void prof_input_source(uint8_t src);
+void prof_input_sent(void);
+void prof_input_end(void);
+void prof_input_queue(prof_input_t *q);
+void prof_input_move(prof_input_t *to, prof_input_t *from);
+void prof_input_dequeue(prof_input_t *q);
+const prof_stat_t *prof_input_stat(uint8_t src);
+
+#define PROF_START(t)   uint32_t t = prof_start()
+#define PROF_END(id, t) prof_end(id, t)
+
+#define PROF_INPUT_ARRIVAL(t)       prof_input_arrival(t)
+#define PROF_INPUT_SOURCE(src)      prof_input_source(src)
+#define PROF_INPUT_SENT()           prof_input_sent()
+#define PROF_INPUT_END()            prof_input_end()
+#define PROF_INPUT_QUEUE(q)         prof_input_queue(q)
+#define PROF_INPUT_MOVE(to, from)   prof_input_move(to, from)
+#define PROF_INPUT_DEQUEUE(q)       prof_input_dequeue(q)
+
+#else
+
+#define PROF_START(t)
+#define PROF_END(id, t) do {} while (0)
+
+#define PROF_INPUT_ARRIVAL(t)       do {} while (0)
+#define PROF_INPUT_SOURCE(src)      do {} while (0)
+#define PROF_INPUT_SENT()           do {} while (0)
+#define PROF_INPUT_END()            do {} while (0)
+#define PROF_INPUT_QUEUE(q)         do {} while (0)
+#define PROF_INPUT_MOVE(to, from)   do {} while (0)
+#define PROF_INPUT_DEQUEUE(q)       do {} while (0)
+
+#endif // PROFILE
+
+#endif // PROF_H
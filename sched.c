@@ -0,0 +1,131 @@
+/*
+ * sched.c
+ *
+ * The main loop used to call every subsystem in a fixed order, so one slow
+ * USB enumeration or directory scan delayed the disk emulation by its full
+ * duration. Now each subsystem registers a task with a period and a
+ * deadline class. A pass runs the due tasks in class order, and after any
+ * task that took a millisecond or more the disk class gets serviced before
+ * the next one. Long operations can call sched_yield() between their steps
+ * to do the same.
+ */
+
+#include <string.h>
+
+#include "attrs.h"
+#include "sched.h"
+#include "prof.h"
+
+#ifdef SCHED_TEST
+uint32_t sched_test_now(void);
+#define sched_now() sched_test_now()
+#else
+#include "hardware.h"
+#define sched_now() ((uint32_t)GetRTTC())
+#endif
+
+static sched_task_t *tasks[SCHED_MAX_TASKS] TCMDATA;
+static uint8_t task_cnt = 0;
+static uint8_t running = 0;
+static uint8_t in_disk = 0;
+
+static void sched_clear(sched_task_t *task) {
+  task->last = sched_now();
+  task->runs = 0;
+  task->time = 0;
+  task->max_time = 0;
+  task->max_gap = 0;
+  task->overruns = 0;
+}
+
+void sched_add(sched_task_t *task) {
+  uint8_t i;
+
+  if (task_cnt == SCHED_MAX_TASKS) return;
+
+  // keep the list ordered by class, and by registration within a class
+  for (i = task_cnt; i > 0 && tasks[i-1]->cls > task->cls; i--)
+    tasks[i] = tasks[i-1];
+  tasks[i] = task;
+  task_cnt++;
+  sched_clear(task);
+}
+
+static char sched_due(sched_task_t *task) {
+  return !task->runs || (sched_now() - task->last) >= task->period;
+}
+
+// returns the run time in ms
+static uint32_t sched_exec(uint8_t idx) {
+  sched_task_t *task = tasks[idx];
+  uint32_t start = sched_now();
+  uint32_t elapsed;
+
+  if (task->runs) {
+    elapsed = start - task->last;
+    if (elapsed > 0xffff) elapsed = 0xffff;
+    if (elapsed > task->max_gap) task->max_gap = elapsed;
+  }
+  task->last = start;
+
+  PROF_START(t);
+  task->poll();
+  PROF_END(PROF_TASK + idx, t);
+
+  elapsed = sched_now() - start;
+  task->runs++;
+  task->time += elapsed;
+  if (elapsed > task->max_time) task->max_time = (elapsed > 0xffff) ? 0xffff : elapsed;
+  if (elapsed > task->budget) task->overruns++;
+  return elapsed;
+}
+
+// run the due tasks of the disk class (they are first in the list)
+static void sched_run_disk(void) {
+  uint8_t i;
+
+  if (in_disk) return;
+  in_disk = 1;
+  for (i = 0; i < task_cnt && tasks[i]->cls == SCHED_DISK; i++)
+    if (sched_due(tasks[i])) sched_exec(i);
+  in_disk = 0;
+}
+
+void sched_run(void) {
+  uint8_t i;
+
+  running = 1;
+  for (i = 0; i < task_cnt; i++) {
+    if (!sched_due(tasks[i])) continue;
+
+    if (tasks[i]->cls == SCHED_DISK) {
+      in_disk = 1;
+      sched_exec(i);
+      in_disk = 0;
+    } else if (sched_exec(i)) {
+      sched_run_disk();
+    }
+  }
+  running = 0;
+}
+
+// service the disk class from within a long running task. Does nothing
+// outside sched_run() or when called from a disk task itself.
+void sched_yield(void) {
+  if (running) sched_run_disk();
+}
+
+void sched_reset_stats(void) {
+  uint8_t i;
+
+  for (i = 0; i < task_cnt; i++)
+    sched_clear(tasks[i]);
+}
+
+uint8_t sched_tasks(void) {
+  return task_cnt;
+}
+
+const sched_task_t *sched_task(uint8_t idx) {
+  return (idx < task_cnt) ? tasks[idx] : 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * sched.h
+ * Cooperative deadline scheduler for the main loop
+ *
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <inttypes.h>
+
+#define SCHED_MAX_TASKS  12
+
+// deadline classes, in order of urgency
+#define SCHED_DISK       0 // IDE, SD card emulation, CDDA
+#define SCHED_INPUT      1 // USB HID, joysticks, keyboard/mouse to the core
+#define SCHED_UI         2 // OSD menu
+#define SCHED_BACKGROUND 3 // CDC, USB storage export, Ethernet
+#define SCHED_CLASSES    4
+
+typedef struct {
+  const char *name;
+  void (*poll)(void);
+  uint8_t  cls;
+  uint16_t period;    // ms between runs, 0 = every pass
+  uint16_t budget;    // expected worst case run time in ms
+
+  // statistics
+  uint32_t last;      // start of the last run
+  uint32_t runs;
+  uint32_t time;      // accumulated run time in ms
+  uint16_t max_time;
+  uint16_t max_gap;   // longest time between two runs
+  uint32_t overruns;  // runs exceeding the budget
+} sched_task_t;
+
+void sched_add(sched_task_t *task);
+void sched_run(void);
+void sched_yield(void);
+void sched_reset_stats(void);
+uint8_t sched_tasks(void);
+const sched_task_t *sched_task(uint8_t idx);
+
+#endif // SCHED_H
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sched.h"
+
+// simulated main loop: every task advances a virtual millisecond clock by
+// its run time, and the longest gap between two runs of the disk task has
+// to stay below a fixed deadline, although a file transfer runs for 400ms
+
+#define SIM_TIME      600000 // ms
+#define DISK_DEADLINE 105    // ms, the longest step that doesn't yield is
+                             // the 100ms port power delay of a USB hub
+
+static uint32_t now = 0;
+static uint32_t worst_step = 0;
+
+uint32_t sched_test_now(void) {
+  return now;
+}
+
+static void step(uint32_t ms) {
+  now += ms;
+  if (ms > worst_step) worst_step = ms;
+}
+
+static void disk_poll(void) {
+  // a sector transfer every now and then
+  now += (rand() % 8) ? 0 : 2;
+}
+
+static void user_io_poll(void) {
+  step(rand() % 2);
+}
+
+static void usb_poll(void) {
+  // USB delays don't yield, the USB stack isn't reentrant
+  step((rand() % 5000) ? rand() % 2 : 100);
+}
+
+static void ui_poll(void) {
+  // directory scan without yield
+  step((rand() % 2000) ? rand() % 2 : 35);
+}
+
+static void background_poll(void) {
+  step(rand() % 3 ? 0 : 1);
+}
+
+static void cdc_poll(void) {
+  // file transfer: 400ms of block writes, yielding after each block
+  if (!(rand() % 5000)) {
+    for (int i = 0; i < 40; i++) {
+      step(10);
+      sched_yield();
+    }
+  } else {
+    background_poll();
+  }
+}
+
+static sched_task_t tasks[] = {
+  { "disk",     disk_poll,       SCHED_DISK,       0, 5  },
+  { "user_io",  user_io_poll,    SCHED_INPUT,      0, 2  },
+  { "usb",      usb_poll,        SCHED_INPUT,      0, 5  },
+  { "ui",       ui_poll,         SCHED_UI,         0, 20 },
+  { "cdc",      cdc_poll,        SCHED_BACKGROUND, 0, 2  },
+  { "eth",      background_poll, SCHED_BACKGROUND, 5, 2  },
+};
+
+int main() {
+  int i;
+  const sched_task_t *t;
+
+  srand(1);
+  for (i = 0; i < sizeof(tasks)/sizeof(tasks[0]); i++)
+    sched_add(&tasks[i]);
+
+  while (now < SIM_TIME) {
+    now++; // main loop overhead
+    sched_run();
+  }
+
+  printf("task       runs      avg  max  gap  overruns\n");
+  for (i = 0; i < sched_tasks(); i++) {
+    t = sched_task(i);
+    printf("%-8s %8u %6.2f %4u %4u %9u\n", t->name, t->runs,
+      t->runs ? (double)t->time / t->runs : 0.0, t->max_time, t->max_gap, t->overruns);
+  }
+
+  t = sched_task(0);
+  printf("worst disk latency %u ms, longest step %u ms, deadline %u ms\n",
+    t->max_gap, worst_step, DISK_DEADLINE);
+  if (t->max_gap > DISK_DEADLINE) {
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -14,6 +14,7 @@
 #define SENSEKEY_HARDWARE_ERROR  0x4
 #define SENSEKEY_ILLEGAL_REQUEST 0x5
 #define SENSEKEY_UNIT_ATTENTION  0x6
+#define SENSEKEY_DATA_PROTECT    0x7
 #define SENSEKEY_ABORTED_COMMAND 0xB
 
 
@@ -0,0 +1,79 @@
+/*
+ * spi_batch.c
+ *
+ * Every user_io command needs its own chip select cycle, the core takes
+ * the command byte after each falling edge. The commands of a poll pass
+ * are collected in a descriptor list and sent back to back, the few bytes
+ * of the usual commands by programmed I/O and longer ones by DMA. The
+ * responses are demultiplexed into the callers' buffers afterwards. The
+ * direct spi_uio_cmd*() functions flush the queue first, so the core sees
+ * all commands in the order they were issued.
+ */
+
+#include <string.h>
+
+#include "hardware.h"
+#include "spi.h"
+#include "spi_batch.h"
+
+// below this the DMA and cache maintenance setup costs more than it saves
+#define SPI_BATCH_PIO_MAX 16
+
+typedef struct {
+  uint8_t len;   // command byte + payload
+  uint8_t *rsp;
+} spi_batch_xfer_t;
+
+static spi_batch_xfer_t xfers[SPI_BATCH_MAX_XFERS];
+static uint8_t tx_buf[SPI_BATCH_MAX_BYTES] __attribute__ ((aligned (32)));
+static uint8_t rx_buf[SPI_BATCH_MAX_BYTES] __attribute__ ((aligned (32)));
+static uint8_t xfer_cnt = 0;
+static uint8_t byte_cnt = 0;
+static spi_batch_stats_t stats;
+
+uint8_t *spi_batch_uio(uint8_t cmd, uint8_t len, uint8_t *rsp) {
+  uint8_t *p;
+
+  if (xfer_cnt == SPI_BATCH_MAX_XFERS || byte_cnt + len + 1 > SPI_BATCH_MAX_BYTES)
+    spi_batch_flush();
+
+  xfers[xfer_cnt].len = len + 1;
+  xfers[xfer_cnt].rsp = rsp;
+  xfer_cnt++;
+
+  p = &tx_buf[byte_cnt];
+  *p++ = cmd;
+  memset(p, 0, len);
+  byte_cnt += len + 1;
+  return p;
+}
+
+void spi_batch_flush(void) {
+  uint8_t i, j, *tx = tx_buf, *rx = rx_buf;
+
+  for (i = 0; i < xfer_cnt; i++) {
+    EnableIO();
+    if (xfers[i].len <= SPI_BATCH_PIO_MAX) {
+      for (j = 0; j < xfers[i].len; j++)
+        rx[j] = SPI(tx[j]);
+    } else
+      spi_transfer((const char*)tx, xfers[i].rsp ? (char*)rx : 0, xfers[i].len);
+    DisableIO();
+
+    if (xfers[i].rsp)
+      memcpy(xfers[i].rsp, rx + 1, xfers[i].len - 1);
+    tx += xfers[i].len;
+    rx += xfers[i].len;
+  }
+
+  if (xfer_cnt) {
+    stats.xfers = xfer_cnt;
+    stats.bytes = byte_cnt;
+  }
+  xfer_cnt = 0;
+  byte_cnt = 0;
+}
+
+const spi_batch_stats_t *spi_batch_stats(void) {
+  return &stats;
+}
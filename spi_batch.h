@@ -0,0 +1,29 @@
+/*
+ * spi_batch.h
+ * Queue several user_io transactions and run them back to back
+ *
+ */
+
+#ifndef SPI_BATCH_H
+#define SPI_BATCH_H
+
+#include <inttypes.h>
+
+#define SPI_BATCH_MAX_XFERS  16
+#define SPI_BATCH_MAX_BYTES  128
+
+// statistics of the last flushed batch
+typedef struct {
+  uint16_t xfers;
+  uint16_t bytes;
+} spi_batch_stats_t;
+
+// queue a user_io command with 'len' payload bytes. Returns the payload
+// area to be filled by the caller (zeroed, i.e. ready for reads).
+// If 'rsp' is given, the 'len' bytes clocked in after the command byte
+// are copied there by spi_batch_flush().
+uint8_t *spi_batch_uio(uint8_t cmd, uint8_t len, uint8_t *rsp);
+void spi_batch_flush(void);
+const spi_batch_stats_t *spi_batch_stats(void);
+
+#endif // SPI_BATCH_H
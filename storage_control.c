@@ -14,6 +14,13 @@
 #include "fat_compat.h"
 #include "usbdev.h"
 #include "FatFs/diskio.h"
+#include "bufpool.h"
+#include "idxfile.h"
+#include "mist_cfg.h"
+#include "sched.h"
+#include "fdd.h"
+#include "hdd.h"
+#include "tos.h"
 #include "debug.h"
 
 typedef struct
@@ -24,6 +31,17 @@ typedef struct
 } sense_t;
 
 static sense_t sense;
+static uint8_t *storage_buf; // pool buffer, held during storage_control_poll()
+static uint8_t *storage_buf2; // second one for the data phase, may be the same
+
+// the data phase the host announced in the CBW and what was moved of it
+static uint32_t data_len;
+static uint32_t data_done;
+static uint8_t  data_in;
+
+static uint16_t slice_time;       // ms of card access in the current time slice
+static unsigned long slice_pause; // timer of the pause after a full slice
+static uint8_t slice_paused;
 
 typedef struct {
 	uint32_t dCBWSignature;
@@ -35,6 +53,19 @@ typedef struct {
 	uint8_t  CBWCB[16];
 } __attribute__ ((packed)) CBW_t;
 
+#define CBW_SIGNATURE 0x43425355
+#define CSW_SIGNATURE 0x53425355
+
+#define CSW_PASSED      0
+#define CSW_FAILED      1
+#define CSW_PHASE_ERROR 2
+
+// sectors per disk and USB transfer in the data phase pipeline
+#define STORAGE_CHUNK   (SECTOR_BUFFER_SIZE/512)
+
+// ms of card access before the export pauses with a share below 100%
+#define STORAGE_SLICE   10
+
 typedef struct {
 	uint32_t dCSWSignature;
 	uint32_t dCSWTag;
@@ -52,9 +83,60 @@ static void make_sense(uint8_t key, uint8_t asc, uint8_t ascq) {
 	sense.ascq = ascq;
 }
 
+// The running core may write its disk images while the PC changes the
+// file system under them, so the card is only writable if the core has
+// none of them open and doesn't access the card directly.
+static uint8_t storage_read_only(void) {
+	uint8_t i;
+
+	if (fat_uses_mmc() && mmc_write_protected()) return 1;
+	// hard disks, CD images and the 8 bit core disks
+	for (i = 0; i < SD_IMAGES; i++)
+		if (sd_image[i].file.obj.fs) return 1;
+	// Minimig floppies and hard disks on the card or its partitions
+	for (i = 0; i < 4; i++)
+		if (df[i].status & DSK_INSERTED) return 1;
+	for (i = 0; i < HARDFILES; i++)
+		if ((hdf[i].type & HDF_TYPEMASK) >= HDF_CARD &&
+		    (hdf[i].type & HDF_TYPEMASK) <= HDF_CARDPART3) return 1;
+	// Atari ST floppies and ACSI disks, ACSI0 may be the card itself
+	for (i = 0; i < 4; i++)
+		if (tos_disk_is_inserted(i)) return 1;
+	if (hdd_direct) return 1;
+	return 0;
+}
+
+// Let the disk class of the running core (IDE, ACSI, SD card emulation)
+// have its turn between two chunks.
+static void storage_yield(void) {
+	sched_yield();
+}
+
+// Below a 100% share the export pauses after each time slice of card
+// access, for as long as the slice took scaled to the share. The poll
+// returns to the main loop until the pause is over.
+static void storage_slice(unsigned long ms) {
+	uint8_t share = mist_cfg.usb_storage_share;
+
+	if (share >= 100) return;
+	slice_time += ms;
+	if (slice_time >= STORAGE_SLICE) {
+		slice_pause = GetTimer(slice_time * (100 - share) / share);
+		slice_paused = 1;
+		slice_time = 0;
+	}
+}
+
+// data in of the short responses, cut to what the host asked for
+static void storage_send(const char *data, uint32_t len) {
+	len = MIN(len, data_len - data_done);
+	// both backends return the bytes they couldn't send
+	data_done += len - usb_storage_write(data, len);
+}
+
 static void scsi_inquiry(uint8_t *cmd) {
 	uint16_t len = cmd[3]<<8 | cmd[4];
-	INQUIRYDATA_t *data = (INQUIRYDATA_t*)sector_buffer;
+	INQUIRYDATA_t *data = (INQUIRYDATA_t*)storage_buf;
 	memset(data, 0, sizeof(INQUIRYDATA_t));
 	data->Versions = 0x04;
 	data->RemovableMedia = 1;
@@ -63,7 +145,7 @@ static void scsi_inquiry(uint8_t *cmd) {
 	memcpy(data->VendorId, "Lotharek", 8);
 	memcpy(data->ProductId, "MiST Board      ", 16);
 	memcpy(data->ProductRevisionLevel, "1.3 ", 4);
-	usb_storage_write(sector_buffer, MIN(len, sizeof(INQUIRYDATA_t)));
+	storage_send(storage_buf, MIN(len, sizeof(INQUIRYDATA_t)));
 }
 
 static void scsi_readcapacity(uint8_t *cmd) {
@@ -72,7 +154,7 @@ static void scsi_readcapacity(uint8_t *cmd) {
 	disk_ioctl(fs.pdrv, GET_SECTOR_COUNT, &capacity);
 	cap.LBA = swab32(capacity-1);
 	cap.blocklen = swab32(512);
-	usb_storage_write((const char*) &cap, sizeof(CAPACITYDATA_t));
+	storage_send((const char*) &cap, sizeof(CAPACITYDATA_t));
 }
 
 static void scsi_request_sense(uint8_t *cmd) {
@@ -86,7 +168,7 @@ static void scsi_request_sense(uint8_t *cmd) {
 	dat.AdditionalSenseLength = sizeof(SENSEDATA_t)-7;
 	dat.AdditionalSenseCode = sense.asc;
 	dat.AdditionalSenseCodeQualifier = sense.ascq;
-	usb_storage_write((const char*) &dat, MIN(len, sizeof(SENSEDATA_t)));
+	storage_send((const char*) &dat, MIN(len, sizeof(SENSEDATA_t)));
 }
 
 static void scsi_mode_sense(uint8_t *cmd) {
@@ -94,20 +176,20 @@ static void scsi_mode_sense(uint8_t *cmd) {
 	if (cmd[0] == 0x5A) { // MODE_SENSE10
 		len = cmd[7]<<8 | cmd[8];
 		datalen = 8;
-		sector_buffer[0] = 0x00;
-		sector_buffer[1] = datalen-2;
-		sector_buffer[2] = 0;
-		sector_buffer[3] = (fat_uses_mmc() && mmc_write_protected()) ? 0x80 : 0x00;
-		sector_buffer[4] = sector_buffer[5] = sector_buffer[6] = sector_buffer[7] = 0;
+		storage_buf[0] = 0x00;
+		storage_buf[1] = datalen-2;
+		storage_buf[2] = 0;
+		storage_buf[3] = storage_read_only() ? 0x80 : 0x00;
+		storage_buf[4] = storage_buf[5] = storage_buf[6] = storage_buf[7] = 0;
 	} else {
 		len = cmd[4]; // MODE SENSE6
 		datalen = 4;
-		sector_buffer[0] = datalen-1;
-		sector_buffer[1] = 0;
-		sector_buffer[2] = (fat_uses_mmc() && mmc_write_protected()) ? 0x80 : 0x00;
-		sector_buffer[3] = 0;
+		storage_buf[0] = datalen-1;
+		storage_buf[1] = 0;
+		storage_buf[2] = storage_read_only() ? 0x80 : 0x00;
+		storage_buf[3] = 0;
 	}
-	usb_storage_write(sector_buffer, MIN(len, datalen));
+	storage_send(storage_buf, MIN(len, datalen));
 }
 
 static void scsi_read_format_capacities(uint8_t *cmd) {
@@ -120,152 +202,287 @@ static void scsi_read_format_capacities(uint8_t *cmd) {
 	dat.Length = 8;
 	dat.Blocks = capacity;
 	dat.Blocklen[1] = 0x02; // 512 bytes
-	usb_storage_write((const char*) &dat, MIN(len, sizeof(FORMATCAPACITYDATA_t)));
+	storage_send((const char*) &dat, MIN(len, sizeof(FORMATCAPACITYDATA_t)));
 }
 
-static uint8_t scsi_read(uint8_t *cmd) {
-	uint32_t lba = cmd[2]<<24 | cmd[3]<<16 | cmd[4]<<8 | cmd[5];
-	uint16_t len = cmd[7]<<8 | cmd[8];
+// READ(10)/(12) and WRITE(10)/(12) block address and length
+static uint32_t scsi_rw_lba(uint8_t *cmd) {
+	return cmd[2]<<24 | cmd[3]<<16 | cmd[4]<<8 | cmd[5];
+}
+
+static uint32_t scsi_rw_len(uint8_t *cmd) {
+	if (cmd[0] == 0xA8 || cmd[0] == 0xAA)
+		return cmd[6]<<24 | cmd[7]<<16 | cmd[8]<<8 | cmd[9];
+	return cmd[7]<<8 | cmd[8];
+}
+
+static uint8_t *other_buf(uint8_t *buf) {
+	return (buf == storage_buf) ? storage_buf2 : storage_buf;
+}
+
+// wait for the data phase transfer in flight and count what it moved
+static uint8_t storage_wait(uint32_t len) {
+	uint32_t done = usb_storage_wait();
+	data_done += done;
+	return done == len;
+}
+
+// The SD card reads the next chunk into one buffer while the USB DMA sends
+// the other one to the host.
+static uint8_t scsi_read(uint32_t lba, uint32_t len) {
+	uint8_t *buf = storage_buf;
+	uint32_t pending = 0;
+
 	storage_debugf("Read lba=%d len=%d", lba, len);
 	while (len) {
 		uint8_t ret;
-		uint16_t read = MIN(len, SECTOR_BUFFER_SIZE/512);
+		uint16_t read = MIN(len, STORAGE_CHUNK);
+
+		// without a second buffer the transfer has to finish first
+		if (pending && storage_buf2 == storage_buf) {
+			if (!storage_wait(pending)) return 0;
+			pending = 0;
+		}
+		// only our own pool buffer can be in flight here
+		storage_yield();
+
 		DISKLED_ON
-		ret = disk_read(fs.pdrv, sector_buffer, lba, read);
+		ret = disk_read(fs.pdrv, buf, lba, read);
 		DISKLED_OFF
+
+		if (pending && !storage_wait(pending)) return 0;
 		if (ret) {
 			iprintf("STORAGE: Error reading from MMC (lba=%d, len=%d)\n", lba, len);
 			return 0;
 		}
+
+		pending = read*512;
+		usb_storage_write_start(buf, pending);
+		buf = other_buf(buf);
 		lba+=read;
 		len-=read;
-		usb_storage_write(sector_buffer, read*512);
 	}
+
+	if (pending && !storage_wait(pending)) return 0;
 	return 1;
 }
 
-static uint8_t scsi_write(uint8_t *cmd) {
-	uint32_t lba = cmd[2]<<24 | cmd[3]<<16 | cmd[4]<<8 | cmd[5];
-	uint16_t len = cmd[7]<<8 | cmd[8];
+// The USB DMA receives the next chunk into one buffer while the other one
+// is written to the SD card.
+static uint8_t scsi_write(uint32_t lba, uint32_t len) {
+	uint8_t *buf = storage_buf;
+	uint16_t write = MIN(len, STORAGE_CHUNK);
+
 	storage_debugf("Write lba=%d len=%d", lba, len);
+	if (!len) return 1;
+
+	usb_storage_read_start(buf, write*512);
 	while (len) {
 		uint8_t ret;
-		uint16_t write = MIN(len, SECTOR_BUFFER_SIZE/512);
-		uint16_t read, total_read = write*512;
-		uint8_t *buf = sector_buffer;
-		long to = GetTimer(100);  // wait max 100ms for host
-		while (total_read) {
-			if (CheckTimer(to)) {
-				iprintf("STORAGE: Timeout while waiting for USB host during write (lba=%d, len=%d)\n", lba, len);
-				return 0;
-			}
-			read = usb_storage_read(buf, total_read);
-			total_read -= read;
-			buf += read;
+		uint8_t *next_buf = other_buf(buf);
+		uint16_t next;
+
+		if (!storage_wait(write*512)) {
+			iprintf("STORAGE: Timeout while waiting for USB host during write (lba=%d, len=%d)\n", lba, len);
+			return 0;
 		}
-		//hexdump(sector_buffer, write*512, 0);
+
+		next = MIN(len - write, STORAGE_CHUNK);
+		if (next && next_buf != buf)
+			usb_storage_read_start(next_buf, next*512);
+
+		//hexdump(buf, write*512, 0);
 		DISKLED_ON
-		ret = disk_write(fs.pdrv, sector_buffer, lba, write);
+		ret = disk_write(fs.pdrv, buf, lba, write);
 		DISKLED_OFF
-		if (ret) return 0;
+		if (ret) {
+			if (next && next_buf != buf) storage_wait(next*512);
+			return 0;
+		}
+
+		storage_yield();
+		if (next && next_buf == buf)
+			usb_storage_read_start(next_buf, next*512);
+
 		lba+=write;
 		len-=write;
+		write = next;
+		buf = next_buf;
 	}
 	return 1;
 }
 
+// Check the sectors the command moves against the data phase of the CBW.
+// A host expecting less than the device would transfer, or data in the
+// other direction, is a phase error (cases 7, 8, 10 and 13 of the
+// bulk-only transport spec).
+static uint8_t storage_check_phase(uint8_t in, uint32_t len) {
+	if (len > data_len/512) return 0;
+	if (len && in != data_in) return 0;
+	return 1;
+}
+
+// Finish a data phase the command left short. Data in is padded with zeros
+// unless a short packet already ended it, data out is received and dropped.
+// The residue reports the bytes of either as not processed.
+static void storage_finish_data(void) {
+	uint32_t left = data_len - data_done;
+
+	if (!left) return;
+
+	if (data_in) {
+		if (data_done % BULK_IN_SIZE) return;
+		memset(storage_buf, 0, SECTOR_BUFFER_SIZE);
+		while (left) {
+			uint32_t len = MIN(left, SECTOR_BUFFER_SIZE);
+			usb_storage_write_start(storage_buf, len);
+			if (usb_storage_wait() != len) return;
+			left -= len;
+		}
+	} else {
+		while (left) {
+			uint32_t len = MIN(left, SECTOR_BUFFER_SIZE);
+			usb_storage_read_start(storage_buf, len);
+			if (usb_storage_wait() != len) return;
+			left -= len;
+		}
+	}
+}
+
 static void storage_control_send_csw(uint32_t tag, uint8_t status) {
-	CSW_t* csw = (CSW_t*)sector_buffer;
-	csw->dCSWSignature = 0x53425355;
+	CSW_t* csw = (CSW_t*)storage_buf;
+
+	storage_finish_data();
+	csw->dCSWSignature = CSW_SIGNATURE;
 	csw->dCSWTag = tag;
-	csw->dCSWDataResidue = 0;
+	csw->dCSWDataResidue = data_len - data_done;
 	csw->bCSWStatus = status;
-	usb_storage_write(sector_buffer, sizeof(CSW_t));
+	usb_storage_write(storage_buf, sizeof(CSW_t));
+}
+
+static uint8_t storage_rw(uint8_t *cmd) {
+	uint8_t in = (cmd[0] == 0x28 || cmd[0] == 0xA8);
+	uint32_t lba = scsi_rw_lba(cmd);
+	uint32_t len = scsi_rw_len(cmd);
+	unsigned long start;
+	uint8_t ret;
+
+	if (!storage_check_phase(in, len)) {
+		storage_debugf("Phase error cmd=%02x len=%d host=%d", cmd[0], len, data_len);
+		return CSW_PHASE_ERROR;
+	}
+
+	if (!in && storage_read_only()) {
+		storage_debugf("Write protected");
+		make_sense(SENSEKEY_DATA_PROTECT, 0x27, 0x00);
+		return CSW_FAILED;
+	}
+
+	start = GetRTTC();
+	ret = in ? scsi_read(lba, len) : scsi_write(lba, len);
+	storage_slice(GetRTTC() - start);
+	if (!in && len) fat_invalidate();
+	if (ret)
+		clear_sense();
+	else
+		make_sense(SENSEKEY_MEDIUM_ERROR, in ? 0x11 : 0x03, 0x00);
+	return ret ? CSW_PASSED : CSW_FAILED;
 }
 
 void storage_control_poll(void) {
 	uint16_t read;
 	uint32_t tag;
-	uint8_t ret;
+	uint8_t cmd[16];
 
 	if (!usb_storage_is_configured()) return;
 
-	// read CSW
-	if((read = usb_storage_read(sector_buffer, BULK_OUT_SIZE)) != 0) {
-		CBW_t *cbw = (CBW_t*)sector_buffer;
-		if (read != 31 || cbw->dCBWSignature != 0x43425355) {
+	if (slice_paused) {
+		if (!CheckTimer(slice_pause)) return;
+		slice_paused = 0;
+	}
+
+	storage_buf = bufpool_acquire(BUF_STORAGE);
+	// read CBW
+	if((read = usb_storage_read(storage_buf, BULK_OUT_SIZE)) != 0) {
+		CBW_t *cbw = (CBW_t*)storage_buf;
+		if (read != 31 || cbw->dCBWSignature != CBW_SIGNATURE) {
+			bufpool_release(storage_buf);
 			return;
 		}
 		tag = cbw->dCBWTag;
-		//hexdump(sector_buffer, read, 0);
+		data_len = cbw->dCBWDataTransferLength;
+		data_in = !!(cbw->bmCBWFlags & 0x80);
+		data_done = 0;
+		// the buffer is reused for the data phase
+		memcpy(cmd, cbw->CBWCB, sizeof(cmd));
+		//hexdump(storage_buf, read, 0);
 		//iprintf("\n");
-		switch (cbw->CBWCB[0]) {
+		switch (cmd[0]) {
 			case 0x00:
 				storage_debugf("Test Unit Ready");
 				clear_sense();
-				storage_control_send_csw(tag, 0);
+				storage_control_send_csw(tag, CSW_PASSED);
 				break;
 			case 0x03:
 				storage_debugf("Request sense");
-				scsi_request_sense(cbw->CBWCB);
-				storage_control_send_csw(tag, 0);
+				scsi_request_sense(cmd);
+				storage_control_send_csw(tag, CSW_PASSED);
 				break;
 			case 0x12:
 				storage_debugf("Inquiry");
 				clear_sense();
-				scsi_inquiry(cbw->CBWCB);
-				storage_control_send_csw(tag, 0);
+				scsi_inquiry(cmd);
+				storage_control_send_csw(tag, CSW_PASSED);
 				break;
 			case 0x1A:
 			case 0x5A:
 				storage_debugf("Mode Sense");
 				clear_sense();
-				scsi_mode_sense(cbw->CBWCB);
-				storage_control_send_csw(tag, 0);
+				scsi_mode_sense(cmd);
+				storage_control_send_csw(tag, CSW_PASSED);
 				break;
 			case 0x1E:
 				storage_debugf("Prevent Removal");
 				clear_sense();
-				storage_control_send_csw(tag, 0);
+				storage_control_send_csw(tag, CSW_PASSED);
 				break;
 			case 0x23:
 				storage_debugf("Read format capacities");
 				clear_sense();
-				scsi_read_format_capacities(cbw->CBWCB);
-				storage_control_send_csw(tag, 0);
+				scsi_read_format_capacities(cmd);
+				storage_control_send_csw(tag, CSW_PASSED);
 				break;
 			case 0x25:
 				storage_debugf("Read Capacity");
 				clear_sense();
-				scsi_readcapacity(cbw->CBWCB);
-				storage_control_send_csw(tag, 0);
-				break;
-			case 0x28:
-				ret = scsi_read(cbw->CBWCB);
-				if (ret)
-					clear_sense();
-				else
-					make_sense(SENSEKEY_MEDIUM_ERROR, 0x11, 0x00);
-				storage_control_send_csw(tag, !ret);
+				scsi_readcapacity(cmd);
+				storage_control_send_csw(tag, CSW_PASSED);
 				break;
-			case 0x2A:
-				ret = scsi_write(cbw->CBWCB);
-				if (ret)
-					clear_sense();
-				else
-					make_sense(SENSEKEY_MEDIUM_ERROR, 0x03, 0x00);
-				storage_control_send_csw(tag, !ret);
+			case 0x28: // READ(10)
+			case 0xA8: // READ(12)
+			case 0x2A: // WRITE(10)
+			case 0xAA: // WRITE(12)
+				// a second pool block, the shared sector_buffer may be
+				// taken by the disk tasks while the transfer yields
+				storage_buf2 = bufpool_acquire(BUF_STORAGE);
+				if (storage_buf2 == sector_buffer) {
+					bufpool_release(storage_buf2);
+					storage_buf2 = storage_buf;
+				}
+				storage_control_send_csw(tag, storage_rw(cmd));
+				if (storage_buf2 != storage_buf) bufpool_release(storage_buf2);
 				break;
 			case 0x1B:
 				storage_debugf("Start stop unit");
 				clear_sense();
-				storage_control_send_csw(tag, 0);
+				storage_control_send_csw(tag, CSW_PASSED);
 				break;
 			default:
-				iprintf("STORAGE: Unhandled cmd: %02x", cbw->CBWCB[0]);
+				iprintf("STORAGE: Unhandled cmd: %02x", cmd[0]);
 				make_sense(SENSEKEY_ILLEGAL_REQUEST, 0x20, 0x00);
-				storage_control_send_csw(tag, 1);
+				storage_control_send_csw(tag, CSW_FAILED);
 				break;
 		}
 	}
+	bufpool_release(storage_buf);
 }
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "usb.h"
+#include "max3421e.h"
+#include "timer.h"
+#include "storage_ex.h"
+
+// usb/storage.c against a simulated bulk-only transport device with a RAM
+// disk. The device rejects transfers above its own limit with a stall, like
+// some sticks do, and the sectors read are compared against a reference.
+
+#define SECTORS      4096
+#define DEV_LIMIT    32     // largest transfer the device accepts, in sectors
+#define MAX_PKT      64
+
+static uint8_t disk[SECTORS*512];
+static uint8_t ref[SECTORS*512];
+static usb_device_t devs[USB_NUMDEVICES];
+
+static struct {
+  enum { CBW, DATA_IN, DATA_OUT, CSW } phase;
+  command_block_wrapper_t cbw;
+  uint8_t *data;
+  uint32_t left;
+  uint8_t status;
+  uint8_t stall;
+  uint8_t sense;
+} dev;
+
+static struct {
+  unsigned commands;
+  unsigned reads;
+  unsigned read_sectors;
+  unsigned stalls;
+} stats;
+
+void iprintf(const char *format, ...) {
+  // the driver is quite verbose
+}
+
+void timer_delay_msec(msec_t t) {
+}
+
+msec_t timer_get_msec() {
+  return 0;
+}
+
+usb_device_t *usb_get_devices() {
+  return devs;
+}
+
+uint8_t usb_set_conf(usb_device_t *d, uint8_t conf_value) {
+  return 0;
+}
+
+uint8_t usb_get_conf_descr(usb_device_t *d, uint16_t nbytes, uint8_t conf, usb_configuration_descriptor_t *p) {
+  static const uint8_t desc[] = {
+    9, USB_DESCRIPTOR_CONFIGURATION, 32, 0, 1, 1, 0, 0x80, 50,
+    9, USB_DESCRIPTOR_INTERFACE, 0, 0, 2, USB_CLASS_MASS_STORAGE, STORAGE_SUBCLASS_SCSI, STORAGE_PROTOCOL_BULK_ONLY, 0,
+    7, USB_DESCRIPTOR_ENDPOINT, 0x81, 2, MAX_PKT, 0, 0,
+    7, USB_DESCRIPTOR_ENDPOINT, 0x02, 2, MAX_PKT, 0, 0
+  };
+  memcpy(p, desc, (nbytes < sizeof(desc)) ? nbytes : sizeof(desc));
+  return 0;
+}
+
+uint8_t usb_ctrl_req(usb_device_t *d, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
+                     uint16_t wInd, uint16_t nbytes, uint8_t *dataptr) {
+  if(bRequest == USB_REQUEST_CLEAR_FEATURE)
+    dev.stall = 0;
+  if(bRequest == STORAGE_REQ_GET_MAX_LUN)
+    *dataptr = 0;
+  return 0;
+}
+
+static void command(void) {
+  uint8_t *cb = dev.cbw.CBWCB;
+  uint32_t lba = (cb[2] << 24) | (cb[3] << 16) | (cb[4] << 8) | cb[5];
+  uint16_t len = (cb[7] << 8) | cb[8];
+  static uint8_t buf[36];
+
+  stats.commands++;
+  dev.status = 0;
+  dev.left = dev.cbw.dCBWDataTransferLength;
+  dev.phase = dev.left ? ((dev.cbw.bmCBWFlags & STORAGE_CMD_DIR_IN) ? DATA_IN : DATA_OUT) : CSW;
+
+  switch(cb[0]) {
+  case SCSI_CMD_INQUIRY:
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf+8, "SIM     BOT DISK        0001", 28);
+    dev.data = buf;
+    break;
+
+  case SCSI_CMD_READ_CAPACITY_10:
+    buf[0] = 0; buf[1] = 0; buf[2] = (SECTORS-1) >> 8; buf[3] = (SECTORS-1) & 0xff;
+    buf[4] = 0; buf[5] = 0; buf[6] = 2; buf[7] = 0;
+    dev.data = buf;
+    break;
+
+  case SCSI_CMD_REQUEST_SENSE:
+    memset(buf, 0, sizeof(buf));
+    buf[0] = 0x70;
+    buf[2] = dev.sense;
+    dev.sense = 0;
+    dev.data = buf;
+    break;
+
+  case SCSI_CMD_TEST_UNIT_READY:
+    break;
+
+  case SCSI_CMD_READ_10:
+  case SCSI_CMD_WRITE_10:
+    if(len > DEV_LIMIT || lba + len > SECTORS || dev.left != len*512) {
+      // stall the data phase, fail the command
+      stats.stalls++;
+      dev.stall = 1;
+      dev.status = 1;
+      dev.sense = 5; // illegal request
+      dev.left = 0;
+      break;
+    }
+    if(cb[0] == SCSI_CMD_READ_10) {
+      stats.reads++;
+      stats.read_sectors += len;
+    }
+    dev.data = disk + lba*512;
+    break;
+
+  default:
+    dev.status = 1;
+    dev.left = 0;
+    dev.phase = CSW;
+  }
+}
+
+uint8_t usb_out_transfer(usb_device_t *d, ep_t *ep, uint16_t nbytes, const uint8_t *data) {
+  if(dev.stall) return hrSTALL;
+
+  if(dev.phase == CBW) {
+    if(nbytes != sizeof(command_block_wrapper_t)) return hrBABBLE;
+    memcpy(&dev.cbw, data, nbytes);
+    if(dev.cbw.dCBWSignature != STORAGE_CBW_SIGNATURE) return hrBABBLE;
+    command();
+    return 0;
+  }
+
+  if(dev.phase != DATA_OUT || nbytes > dev.left) return hrBABBLE;
+  memcpy(dev.data, data, nbytes);
+  dev.data += nbytes;
+  dev.left -= nbytes;
+  if(!dev.left) dev.phase = CSW;
+  return 0;
+}
+
+uint8_t usb_in_transfer(usb_device_t *d, ep_t *ep, uint16_t *nbytesptr, uint8_t *data) {
+  if(dev.stall) {
+    // the host clears the halt and goes on with the status
+    dev.phase = CSW;
+    return hrSTALL;
+  }
+
+  if(dev.phase == CSW) {
+    command_status_wrapper_t csw = { STORAGE_CSW_SIGNATURE, dev.cbw.dCBWTag, dev.left, dev.status };
+    if(*nbytesptr < sizeof(csw)) return hrBABBLE;
+    memcpy(data, &csw, sizeof(csw));
+    *nbytesptr = sizeof(csw);
+    dev.phase = CBW;
+    return 0;
+  }
+
+  if(dev.phase != DATA_IN) return hrBABBLE;
+
+  uint16_t n = (*nbytesptr > dev.left) ? dev.left : *nbytesptr;
+  memcpy(data, dev.data, n);
+  dev.data += n;
+  dev.left -= n;
+  *nbytesptr = n;
+  if(!dev.left) dev.phase = CSW;
+  return 0;
+}
+
+static int check(unsigned long lba, uint16_t len) {
+  static uint8_t buf[256*512];
+
+  memset(buf, 0xa5, sizeof(buf));
+  if(!usb_host_storage_read(lba, buf, len)) {
+    printf("read %lu/%u failed\n", lba, len);
+    return 1;
+  }
+  if(memcmp(buf, ref + lba*512, len*512)) {
+    printf("read %lu/%u mismatch\n", lba, len);
+    return 1;
+  }
+  return 0;
+}
+
+int main() {
+  usb_device_descriptor_t desc;
+  int i, errors = 0;
+  unsigned reads, commands;
+
+  srand(1);
+  for(i=0;i<sizeof(disk);i++)
+    disk[i] = ref[i] = rand();
+
+  memset(&desc, 0, sizeof(desc));
+  desc.bNumConfigurations = 1;
+  devs[3].bAddress = 4;
+  if(usb_storage_class.init(devs+3, &desc)) {
+    printf("init failed\nFAILED\n");
+    return 1;
+  }
+  devs[3].class = &usb_storage_class;
+
+  if(usb_host_storage_capacity() != SECTORS-1) {
+    printf("capacity %u\n", usb_host_storage_capacity());
+    errors++;
+  }
+
+  // a large read is split into the transfers the device accepts
+  errors += check(100, 200);
+  if(stats.stalls != 2 || devs[3].storage_info.max_sectors != DEV_LIMIT) {
+    printf("transfer size not adapted: %u stalls, limit %u\n", stats.stalls, devs[3].storage_info.max_sectors);
+    errors++;
+  }
+
+#if STORAGE_CACHE_LINES
+  // sequential single sector reads are served from the cache lines
+  reads = stats.reads;
+  for(i=0;i<64;i++)
+    errors += check(1000+i, 1);
+  if(stats.reads - reads != 64/STORAGE_CACHE_LINE) {
+    printf("%u reads for 64 sequential sectors\n", stats.reads - reads);
+    errors++;
+  }
+#endif
+
+  // nothing is read or written beyond the end of the device
+  commands = stats.commands;
+  if(usb_host_storage_read(SECTORS-2, disk, 2) || usb_host_storage_read(SECTORS-1, disk, 1) ||
+     usb_host_storage_write(SECTORS-3, disk, 4) || stats.commands != commands) {
+    printf("access beyond the end of the device\n");
+    errors++;
+  }
+
+  // random reads and writes of any size, the cache stays coherent
+  for(i=0;i<20000;i++) {
+    unsigned long lba = rand() % (SECTORS-1);
+    uint16_t len = (rand() & 3) ? 1 + rand() % 3 : 1 + rand() % 16;
+    if(lba + len > SECTORS-1) len = SECTORS-1 - lba;
+
+    if(rand() % 4 == 0) {
+      uint8_t buf[16*512];
+      for(int j=0;j<len*512;j++) buf[j] = rand();
+      if(!usb_host_storage_write(lba, buf, len)) {
+        printf("write %lu/%u failed\n", lba, len);
+        errors++;
+      }
+      memcpy(ref + lba*512, buf, len*512);
+    } else
+      errors += check(lba, len);
+  }
+  if(memcmp(disk, ref, sizeof(disk))) {
+    printf("disk contents differ\n");
+    errors++;
+  }
+
+  // the device is gone
+  usb_storage_class.release(devs+3);
+  devs[3].bAddress = 0;
+  commands = stats.commands;
+  if(usb_host_storage_read(0, disk, 1) || stats.commands != commands) {
+    printf("read from released device\n");
+    errors++;
+  }
+
+  printf("%u commands, %u reads, %u sectors read, %u stalls, %d errors\n",
+    stats.commands, stats.reads, stats.read_sectors, stats.stalls, errors);
+
+  if(errors) {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  printf("OK\n");
+  return 0;
+}
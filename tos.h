@@ -94,6 +94,7 @@ void tos_insert_disk(char i, const unsigned char *name);
 void tos_eject_all();
 void tos_select_hdd_image(char i, const unsigned char *name);
 void tos_set_direct_hdd(char on);
+extern unsigned long hdd_direct; // sectors of the SD card in direct mode, 0 if off
 char tos_get_direct_hdd();
 void tos_reset(char cold);
 char *tos_get_image_name();
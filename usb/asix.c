@@ -19,11 +19,21 @@
 
 #define MAX_FRAMELEN 1536
 
-static unsigned char rx_buf[MAX_FRAMELEN+64];
-static uint16_t rx_cnt;
-
-static unsigned char tx_buf[4+MAX_FRAMELEN];
-static uint16_t tx_cnt, tx_offset;
+// The adapter packs several frames into each bulk transfer, every one
+// behind a header of its length and the inverted length and padded to
+// 16 bit. The rx buffer keeps more than one transfer, the 64 extra bytes
+// allow short frames to be padded from behind
+#define RX_BUF_SIZE (2*MAX_FRAMELEN)
+static unsigned char rx_buf[RX_BUF_SIZE+64];
+static uint16_t rx_cnt, rx_offset;
+static bool rx_skip;         // drop the rest of a transfer
+
+// frames of the core are sent the same way, several per transfer. A
+// transfer the adapter NAKs in the middle is continued on the next poll
+#define TX_BUF_SIZE (2*(MAX_FRAMELEN+4)+8)
+#define TX_BATCH    8
+static unsigned char tx_buf[TX_BUF_SIZE];
+static uint16_t tx_cnt, tx_sent;
 
 bool eth_present = 0;
 
@@ -361,7 +371,7 @@ static uint8_t usb_asix_init(usb_device_t *dev, usb_device_descriptor_t *dev_des
   }
 
   // reset status
-  info->qLastIrqPollTime = info->qLastBulkPollTime = info->qLastMACSendTime = 0;
+  info->qLastIrqPollTime = info->qLastBulkPollTime = 0;
   info->bPollEnable = false;
   info->linkDetected = false;
 
@@ -510,7 +520,9 @@ static uint8_t usb_asix_init(usb_device_t *dev, usb_device_descriptor_t *dev_des
 
   info->bPollEnable = true;
 
-  rx_cnt = tx_cnt = 0;  // reset buffers
+  rx_cnt = rx_offset = 0;  // reset buffers
+  rx_skip = false;
+  tx_cnt = tx_sent = 0;
 
   // finally inform core about ethernet support
   tos_update_sysctrl(tos_system_ctrl() | TOS_CONTROL_ETHERNET);
@@ -531,33 +543,172 @@ static uint8_t usb_asix_release(usb_device_t *dev) {
   return 0;
 }
 
-void usb_asix_xmit(uint16_t len) {
-  asix_debugf("out %d", len);
+// is the frame for the core? Its own MAC or an ARP broadcast
+static bool asix_rx_accept(usb_asix_info_t *info, const uint8_t *frame) {
+  static const uint8_t broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+  if(!memcmp(frame, info->mac, ETH_ALEN))
+    return true;
+
+  // accept broadcasts only for arp
+  return !memcmp(frame, broadcast, ETH_ALEN) && (frame[12] == 0x08) && (frame[13] == 0x06);
+}
+
+// hand the complete frames in the rx buffer to the core as long as its
+// rx buffer is free. Returns false if the buffered data is malformed
+static bool asix_rx_demux(usb_asix_info_t *info, uint32_t *status) {
+  while(rx_cnt - rx_offset >= 4) {
+    uint8_t *p = rx_buf + rx_offset;
+    uint16_t len0 = (p[0] | (p[1] << 8)) & 0x7ff;
+    uint16_t len1 = (~(p[2] | (p[3] << 8))) & 0x7ff;
+
+    if((len0 != len1) || !len0 || (len0 > MAX_FRAMELEN)) {
+      asix_debugf("dropping malformed packet (len %d:%d)", len0, len1);
+      return false;
+    }
+
+    // wait for the rest of the frame
+    if(rx_cnt - rx_offset < len0 + 4)
+      break;
+
+    if(asix_rx_accept(info, p+4)) {
+      // the core hasn't taken the previous frame yet
+      if(*status & 0x20000)
+	break;
+
+      // short frames are padded with whatever follows them
+      user_io_eth_send_rx_frame(p+4, (len0 < 64)?64:len0);
+      *status = user_io_eth_get_status();
+    }
+
+    // frames are 16 bit padded
+    rx_offset += len0 + 4 + (len0 & 1);
+    if(rx_offset > rx_cnt) rx_offset = rx_cnt;
+  }
+
+  return true;
+}
+
+// read as much of the bulk in stream as fits into the rx buffer. A single
+// transfer carries several frames and may end in the middle of one
+static uint8_t asix_rx(usb_device_t *dev, uint32_t *status) {
+  usb_asix_info_t *info = &(dev->asix_info);
+  uint8_t maxpkt = info->ep[1].maxPktSize;
+  uint8_t rcode;
+  bool end;
+
+  // move the unprocessed rest to the start of the buffer
+  if(rx_offset) {
+    memmove(rx_buf, rx_buf + rx_offset, rx_cnt - rx_offset);
+    rx_cnt -= rx_offset;
+    rx_offset = 0;
+  }
+
+  uint16_t want = ((RX_BUF_SIZE - rx_cnt) / maxpkt) * maxpkt;
+  uint16_t read = want;
+  if(!want) return 0;
+
+  // data received before a NAK is valid
+  rcode = usb_in_transfer(dev, &(info->ep[1]), &read, rx_buf + rx_cnt);
+  if(rcode && (rcode != hrNAK)) {
+    asix_debugf("%s() error: %x", __FUNCTION__, rcode);
+    rx_cnt = 0;
+    rx_skip = false;
+    return rcode;
+  }
+
+  // the transfer ends with a short packet
+  end = (read % maxpkt) || (!rcode && (read < want));
+
+  if(rx_skip) {
+    // rest of a transfer with a malformed frame
+    if(end) rx_skip = false;
+  } else
+    rx_cnt += read;
+
+  if(!asix_rx_demux(info, status)) {
+    rx_cnt = rx_offset = 0;
+    rx_skip = !end;
+  }
+
+  return 0;
+}
+
+// collect the frames queued in the core into one bulk transfer
+static void asix_tx_collect(usb_asix_info_t *info, uint32_t *status) {
+  uint16_t cnt = 0;
+  uint8_t i;
 
-  *(uint16_t*)tx_buf = len;
-  *(uint16_t*)(tx_buf+2) = ~len;
+  for(i=0;(i<TX_BATCH) && ((*status >> 24) == 0xa5);i++) {
+    uint16_t len = *status & 0xffff;
 
-  tx_cnt = len+4;
-  tx_offset = 0;
+    if(len > MAX_FRAMELEN) {
+      // too long, take it out of the core anyway
+      asix_debugf("dropping oversized frame (len %d)", len);
+      user_io_eth_receive_tx_frame(NULL, len);
+    } else {
+      // further frames start 16 bit aligned like in the rx direction
+      uint16_t start = (cnt + 1) & ~1;
+      if(start + len + 8 > TX_BUF_SIZE)
+	break;
+
+      if(start != cnt) tx_buf[cnt] = 0;
+      tx_buf[start+0] = len;
+      tx_buf[start+1] = len >> 8;
+      tx_buf[start+2] = ~len;
+      tx_buf[start+3] = (~len) >> 8;
+
+      // read frame into the tx buffer behind its header
+      user_io_eth_receive_tx_frame(tx_buf+start+4, len);
+      cnt = start + len + 4;
+    }
+
+    *status = user_io_eth_get_status();
+  }
+
+  // a transfer of a multiple of the packet size would need a zero length
+  // packet, the adapter takes a 0xffff0000 marker instead
+  if(cnt && !(cnt % info->ep[2].maxPktSize)) {
+    tx_buf[cnt++] = 0x00;
+    tx_buf[cnt++] = 0x00;
+    tx_buf[cnt++] = 0xff;
+    tx_buf[cnt++] = 0xff;
+  }
+
+  tx_cnt = cnt;
+  tx_sent = 0;
+}
+
+// send the collected transfer, or what the adapter didn't take of it yet
+static uint8_t asix_tx(usb_device_t *dev, uint32_t *status) {
+  usb_asix_info_t *info = &(dev->asix_info);
+  uint16_t len;
+  uint8_t rcode;
+
+  if(tx_sent == tx_cnt)
+    asix_tx_collect(info, status);
+
+  if(!(len = tx_cnt - tx_sent)) return 0;
+
+  asix_debugf("out %d bytes", len);
+  rcode = usb_out_transfer_nak(dev, &(info->ep[2]), &len, tx_buf + tx_sent);
+  tx_sent += len;
+
+  if(rcode == hrNAK) return 0;
+  if(rcode) tx_sent = tx_cnt;   // drop the rest
+  return rcode;
 }
 
 static uint8_t usb_asix_poll(usb_device_t *dev) {
   usb_asix_info_t *info = &(dev->asix_info);
   uint8_t rcode = 0;
+  uint32_t status;
 
   if (!info->bPollEnable)
     return 0;
 
-  // poll for MAC address and send it to the FPGA in every 2 secs
-  if (timer_check(info->qLastMACSendTime, 2000)) {
-    if ((rcode = asix_read_cmd(dev, AX_CMD_READ_NODE_ID,
-       0, 0, ETH_ALEN, info->mac)) != 0) {
-      return rcode;
-    }
-
-    user_io_eth_send_mac(info->mac);
-    info->qLastMACSendTime = timer_get_msec();
-  }
+  // the FPGA forgets the MAC address when a core is loaded
+  user_io_eth_update_mac(info->mac);
 
   // poll interrupt endpoint
   if (timer_check(info->qLastIrqPollTime, info->int_poll_ms)) {
@@ -587,11 +738,17 @@ static uint8_t usb_asix_poll(usb_device_t *dev) {
     info->qLastIrqPollTime = timer_get_msec();
   }
 
+  // frames already received go to the core as soon as it takes them
+  if(rx_offset != rx_cnt) {
+    status = user_io_eth_get_status();
+    if(!asix_rx_demux(info, &status))
+      rx_cnt = rx_offset = 0;
+  }
+
   // bulk ep polling at fixed 500Hz
   if (timer_check(info->qLastBulkPollTime, 2)) {
-    uint8_t rcode;
     static uint32_t old_status = 0;
-    uint32_t status = user_io_eth_get_status();
+    status = user_io_eth_get_status();
 
     if(status != old_status) {
       asix_debugf("status changed to cmd %x, eq=%d, prx=%d, ptx=%d, len=%d",
@@ -599,128 +756,11 @@ static uint8_t usb_asix_poll(usb_device_t *dev) {
 		  (status & 0x10000)?1:0, status & 0xffff);
       old_status = status;
     }
-    
-    // --------- poll FPGA for data to be transmitted ------------
-    
-    // no transmission in progress?
-    if(!tx_cnt) {
-      if((status >> 24) == 0xa5) {
-	uint16_t len = status & 0xffff;
-	
-	if(len <= MAX_FRAMELEN) {
-	  // iprintf("TX %d\n", len);
-	  
-	  // read frame into local tx buffer, leave 4 bytes space for
-	  // axis packet header marker
-	  user_io_eth_receive_tx_frame(tx_buf+4, len);
-	  
-	  // hexdump(tx_buf+4, len, 0);
-	  
-	  // schedule packet for transmissoin
-	  usb_asix_xmit(len);
-	}
-      }
-    }
-    
-    // check if there's something to transmit
-    if(tx_cnt) {
-      uint16_t bytes2send = (tx_cnt-tx_offset > info->ep[2].maxPktSize)?
-	info->ep[2].maxPktSize:(tx_cnt-tx_offset);
-      
-      //  asix_debugf("bulk out %d of %d (ep %d), off %d", 
-      //      bytes2send, tx_cnt, info->ep[2].maxPktSize, tx_offset);  
-      rcode = usb_out_transfer(dev, &(info->ep[2]), bytes2send, tx_buf + tx_offset);
-      //      asix_debugf("%s() error: %x", __FUNCTION__, rcode);  
-
-      tx_offset += bytes2send;
-      
-      // mark buffer as free after last pkt was sent
-      if(bytes2send != info->ep[2].maxPktSize)
-	tx_cnt = 0;
-    }
 
-    // poll for rx if receive irq has been cleared (PRX==0)
-    if(!(status & 0x20000)) {
-      // Try to read from bulk in endpoint (ep 2). Raw packets are received this way.
-      // The last USB packet being part of an ethernet frame is marked by being shorter
-      // than the USB FIFO size. If the last packet is exaclty if FIFO size, then an
-      // additional 0 byte packet is appended
-      uint16_t read = info->ep[1].maxPktSize;
-
-      // the rx buffer size (1536+64) can hold an additional maxPktSize (64),
-      // so a transfer still fits into the buffer or there's already 
-      // a full frame present. If it's full we drop all data. This will leave 
-      // the buffered packet incomplete which isn't a problem since
-      // the packet was too long, anyway.
-      uint8_t *data = (rx_cnt < MAX_FRAMELEN)?(rx_buf + rx_cnt):NULL;
-      rcode = usb_in_transfer(dev, &(info->ep[1]), &read, data);
-      
-      if (rcode) {
-	if (rcode != hrNAK)
-	  asix_debugf("%s() error: %x", __FUNCTION__, rcode);
-      } else {
-	rx_cnt += read;
-
-	// check if packet has a valid header
-	uint16_t len0 = (*(uint16_t*)rx_buf) & 0x7ff;
-	uint16_t len1 = (~(*(uint16_t*)(rx_buf+2))) & 0x7ff;
-
-	if(len0 != len1) {
-	  asix_debugf("dropping malformed packet (len %d:%d)", len0, len1);
-	  rx_cnt = 0;
-	} else if(rx_cnt-4 >= len0) {
-	  bool ok2fwd = 0;
-
-	  // enough room to store the entire packet
-
-	  // process packet
-	  //	  iprintf("RX %d\n", len0);
-	  //	  hexdump(rx_buf+4, len0, 0);
-	  //	  hexdump(rx_buf+4, 32, 0);
-
-	  uint16_t frame_size = len0;
-	  if(frame_size < 64) frame_size = 64;
-
-	  // do some sanity checks on frame
-	  //	  iprintf("RX mac = %02x:%02x:%02x:%02x:%02x:%02x\n",
-	  //		  rx_buf[4]&0xff,rx_buf[5]&0xff,rx_buf[6]&0xff,
-	  //		  rx_buf[7]&0xff,rx_buf[8]&0xff,rx_buf[9]&0xff);
-
-	  /* check for own or braodcast mac */
-	  if(!memcmp(rx_buf+4, info->mac, ETH_ALEN)) {
-	    //	    iprintf("MY MAC!!\n");
-	    ok2fwd = 1;  // forward packet into core
-	  }
-	  
-	  if((rx_buf[4] == 0xff)&&(rx_buf[5] == 0xff)&&(rx_buf[6] == 0xff)&&
-	     (rx_buf[7] == 0xff)&&(rx_buf[8] == 0xff)&&(rx_buf[9] == 0xff)) {
-	    //	    iprintf("BROADCAST MAC %x/%x\n", rx_buf[16], rx_buf[17]);
-
-	    // accept broadcasts only for arp
-	    if((rx_buf[16] == 0x08) && (rx_buf[17] == 0x06))
-	      ok2fwd = 1;  // forward packet into core
-	  }
-
-	  // forward frame to FPGA
-	  if(ok2fwd)
-	    user_io_eth_send_rx_frame(rx_buf+4, frame_size);
-	  //	  else
-	  //	    iprintf("ASIX: frame dropped\n");
-
-	  if((rx_cnt-4 > len0) && (rx_cnt < MAX_FRAMELEN+64)) {
-	    // packets are 16 bit padded
-	    if(len0 & 1) len0++;
-	    
-	    // remove len0+4 bytes from buffer
-	    memcpy(rx_buf, rx_buf + len0 + 4, MAX_FRAMELEN + 64 - len0 - 4);
-	    rx_cnt -= len0 + 4;
-	    
-	    // asix_debugf("bytes left in buffer: %d", rx_cnt);
-	  } else
-	    rx_cnt = 0;
-	}
-      }
-    }    
+    if((rcode = asix_tx(dev, &status)) != 0)
+      asix_debugf("bulk out error: %x", rcode);
+
+    rcode = asix_rx(dev, &status);
 
     info->qLastBulkPollTime = timer_get_msec();
   }
@@ -15,12 +15,10 @@ typedef struct {
   bool linkDetected;
   uint8_t mac[ETH_ALEN];
   uint32_t qLastBulkPollTime; // next bulk poll time
-  uint32_t qLastMACSendTime;  // next MAC send time
 } usb_asix_info_t;
 
 // interface to usb core
 extern const usb_device_class_config_t usb_asix_class;
-void usb_asix_xmit(uint16_t len);
 uint8_t *asix_get_mac(void);
 
 #endif // ASIX_H
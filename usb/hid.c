@@ -15,6 +15,7 @@
 #include "../mist_cfg.h"
 #include "../osd.h"
 #include "../state.h"
+#include "../prof.h"
 
 
 static unsigned char kbd_led_state = 0;  // default: all leds off
@@ -105,6 +106,7 @@ static uint8_t hid_get_report_descr(usb_device_t *dev, uint8_t i, uint16_t size)
 				hid_debugf("Detected USB joystick #%d", joystick_count());
 				info->iface[i].device_type = HID_DEVICE_JOYSTICK;
 				info->iface[i].jindex = joystick_add();
+				virtual_joystick_mapping_init(&info->iface[i].jmapping, dev->vid, dev->pid);
 			}
 		} else {
 		// parsing failed. Fall back to boot mode for mice
@@ -292,6 +294,10 @@ static uint8_t usb_hid_parse_conf(usb_device_t *dev, uint8_t conf, uint16_t len)
 	return 0;
 }
 
+#ifdef HAVE_USB_IRQ
+static void usb_hid_irq_report(void *ctx, uint8_t *data, uint8_t len);
+#endif
+
 static uint8_t usb_hid_init(usb_device_t *dev, usb_device_descriptor_t *dev_desc) {
 	hid_debugf("%s(%x)", __FUNCTION__, dev->bAddress);
 
@@ -309,6 +315,9 @@ static uint8_t usb_hid_init(usb_device_t *dev, usb_device_descriptor_t *dev_desc
 
 	for(i=0;i<MAX_IFACES;i++) {
 		info->iface[i].qLastPollTime = 0;
+#ifdef HAVE_USB_IRQ
+		info->iface[i].irq_pipe      = -1;
+#endif
 		info->iface[i].ep.epAddr     = i;
 		info->iface[i].ep.epType     = 0;
 		info->iface[i].ep.maxPktSize = 8;
@@ -421,6 +430,9 @@ static uint8_t usb_hid_init(usb_device_t *dev, usb_device_descriptor_t *dev_desc
 					  info->iface[0].conf.joystick_mouse.button[but].bitmask, but);
 				}
 			}
+
+			// the button positions may have changed
+			hid_plan_compile(&info->iface[0].conf);
 		}
 		rcode = hid_set_idle(dev, info->iface[i].iface_idx, 0, 0);
 		if (rcode && rcode != hrSTALL) {
@@ -455,6 +467,19 @@ static uint8_t usb_hid_init(usb_device_t *dev, usb_device_descriptor_t *dev_desc
 		hid_set_report(dev, 2, 2, 16, 7, "\x10\x01\x10\x15\x00\x00\x00"); timer_delay_msec(100);
 	}
 
+#ifdef HAVE_USB_IRQ
+	// let the usb irq poll the interrupt endpoints, usb_hid_poll() keeps
+	// the interfaces it couldn't take
+	for(i=0;i<info->bNumIfaces;i++) {
+		usb_hid_iface_info_t *iface = info->iface+i;
+		uint16_t len = iface->ep.maxPktSize;
+		if (iface->conf.report_size > len)
+			len = iface->conf.report_size;
+		if(iface->device_type != HID_DEVICE_UNKNOWN && len <= 64)
+			iface->irq_pipe = usb_irq_pipe_add(dev, &iface->ep, iface->interval, len, usb_hid_irq_report, iface);
+	}
+#endif
+
 	info->bPollEnable = true;
 	return 0;
 }
@@ -464,6 +489,10 @@ static uint8_t usb_hid_release(usb_device_t *dev) {
 
 	puts(__FUNCTION__);
 
+#ifdef HAVE_USB_IRQ
+	usb_irq_pipe_remove(dev);
+#endif
+
 	uint8_t i;
 	for(i=0;i<info->bNumIfaces;i++) {
 		// check if a joystick is released
@@ -568,62 +597,17 @@ static void handle_5200daptor(usb_device_t *dev, usb_hid_iface_info_t *iface, ui
 	}
 }
 
-// collect bits from byte stream and assemble them into a signed word
-static uint16_t collect_bits(uint8_t *p, uint16_t offset, uint8_t size, bool is_signed) {
-	// mask unused bits of first byte
-	uint8_t mask = 0xff << (offset&7);
-	uint8_t byte = offset/8;
-	uint8_t bits = size;
-	uint8_t shift = offset&7;
-
-	//  iprintf("0 m:%x by:%d bi=%d sh=%d ->", mask, byte, bits, shift);
-	uint16_t rval = (p[byte++] & mask) >> shift;
-	//  iprintf("%d\n", (int16_t)rval);
-	mask = 0xff;
-	shift = 8-shift;
-	bits -= shift;
-
-	// first byte already contained more bits than we need
-	if(shift > size) {
-		//    iprintf("  too many bits, masked %x ->", (1<<size)-1);
-		// mask unused bits
-		rval &= (1<<size)-1;
-		//    iprintf("%d\n", (int16_t)rval);
-	} else {
-		// further bytes if required
-		while(bits) {
-			mask = (bits<8)?(0xff>>(8-bits)):0xff;
-			//      iprintf("+ m:%x by:%d bi=%d sh=%d ->", mask, byte, bits, shift);
-			rval += (p[byte++] & mask) << shift;
-			//      iprintf("%d\n", (int16_t)rval);
-			shift += 8;
-			bits -= (bits>8)?8:bits;
-		}
-	}
-
-	if(is_signed) {
-		// do sign expansion
-		uint16_t sign_bit = 1<<(size-1);
-		if(rval & sign_bit) {
-			while(sign_bit) {
-				rval |= sign_bit;
-				sign_bit <<= 1;
-			}
-			// iprintf(" is negative -> sign expand to %d\n", (int16_t)rval);
-		}
-	}
-
-	return rval;
-}
-
 static usb_hid_iface_info_t *virt_joy_kbd_iface = NULL;
 
 /* processes a single USB interface */
-static void usb_process_iface (usb_device_t *dev,
+TCMFUNC static void usb_process_iface (usb_device_t *dev,
                                usb_hid_iface_info_t *iface,
                                uint16_t read,
                                uint8_t *buf) {
 
+	if(iface->device_type == HID_DEVICE_KEYBOARD) PROF_INPUT_SOURCE(PROF_IN_KBD);
+	if(iface->device_type == HID_DEVICE_MOUSE)    PROF_INPUT_SOURCE(PROF_IN_MOUSE);
+
 	// successfully received some bytes
 	if(iface->has_boot_mode && !iface->ignore_boot_mode) {
 		if(iface->device_type == HID_DEVICE_MOUSE) {
@@ -669,24 +653,25 @@ static void usb_process_iface (usb_device_t *dev,
 			// hid_debugf("data:"); hexdump(buf, read, 0);
 		
 			// several axes ...
-			for(i=0;i<MAX_AXES;i++) {
-				// if logical minimum is > logical maximum then logical minimum 
-				// is signed. This means that the value itself is also signed
-				bool is_signed = conf->joystick_mouse.axis[i].logical.min > 
-				conf->joystick_mouse.axis[i].logical.max;
-				a[i] = collect_bits(p, conf->joystick_mouse.axis[i].offset, 
-							conf->joystick_mouse.axis[i].size, is_signed);
+			for(i=0;i<MAX_AXES;i++)
+				a[i] = hid_field_get(&conf->plan.axis[i], p);
+
+			if(conf->plan.buttons_packed) {
+				// all buttons in one field
+				uint16_t b = hid_field_get(&conf->plan.buttons, p);
+				btn = b & 0x0f;
+				btn_extra = b >> 4;
+			} else {
+				// ... and four  first buttons
+				for(i=0;i<4;i++)
+					if(p[conf->joystick_mouse.button[i].byte_offset] & 
+					 conf->joystick_mouse.button[i].bitmask) btn |= (1<<i);
+
+				// ... and the eight extra buttons
+				for(i=4;i<12;i++)
+					if(p[conf->joystick_mouse.button[i].byte_offset] & 
+					 conf->joystick_mouse.button[i].bitmask) btn_extra |= (1<<(i-4));
 			}
-			
-			// ... and four  first buttons
-			for(i=0;i<4;i++)
-				if(p[conf->joystick_mouse.button[i].byte_offset] & 
-				 conf->joystick_mouse.button[i].bitmask) btn |= (1<<i);
-			
-			// ... and the eight extra buttons
-			for(i=4;i<12;i++)
-				if(p[conf->joystick_mouse.button[i].byte_offset] & 
-				 conf->joystick_mouse.button[i].bitmask) btn_extra |= (1<<(i-4));
 
 			//if (btn_extra != 0)
 			//  iprintf("EXTRA BTNS:%d\n", btn_extra);
@@ -750,8 +735,7 @@ static void usb_process_iface (usb_device_t *dev,
 
 				// handle hat if present and overwrite any axis value
 				if(conf->joystick_mouse.hat.size && !mist_cfg.joystick_ignore_hat) {
-					uint8_t hat = collect_bits(p, conf->joystick_mouse.hat.offset, 
-								 conf->joystick_mouse.hat.size, 0);
+					uint8_t hat = hid_field_get(&conf->plan.hat, p);
 
 					//  iprintf("HAT = %d\n", hat);
 
@@ -815,13 +799,14 @@ static void usb_process_iface (usb_device_t *dev,
 
 				// report joystick 1 to OSD
 				idx = joystick_index(iface->jindex);
+				PROF_INPUT_SOURCE((idx < 6) ? PROF_IN_JOY + idx : 0xff);
 				StateUsbIdSet( dev->vid, dev->pid, conf->joystick_mouse.button_count, idx);
 				StateUsbJoySet( jmap, btn_extra, idx);
 
 				// map virtual joypad
 				uint32_t vjoy = jmap;
 				vjoy |= btn_extra << 8;
-				vjoy = virtual_joystick_mapping( dev->vid, dev->pid, vjoy );
+				vjoy = virtual_joystick_mapping( &iface->jmapping, vjoy );
 
 				//iprintf("VIRTUAL JOY:%d\n", vjoy);
 				//if (jmap != 0) iprintf("JMAP pre map:%d\n", jmap);
@@ -884,10 +869,31 @@ static void usb_process_iface (usb_device_t *dev,
 			} // end joystick handling
 		} // end hid custom report parsing
   } // end of HID complex parsing
+
+	PROF_INPUT_END();
 }
 
+#ifdef HAVE_USB_IRQ
+// report received by the usb irq, called from usb_irq_poll()
+TCMFUNC static void usb_hid_irq_report(void *ctx, uint8_t *data, uint8_t len) {
+	usb_hid_iface_info_t *iface = ctx;
+	usb_device_t *dev = usb_get_devices();
+	uint8_t i, buf[64];
+
+	for(i=0;i<USB_NUMDEVICES;i++,dev++) {
+		if(dev->bAddress && (dev->class == &usb_hid_class) &&
+		   iface >= dev->hid_info.iface && iface < dev->hid_info.iface + MAX_IFACES) {
+			// the parsers expect a cleared buffer behind short reports
+			memset(buf, 0, sizeof(buf));
+			memcpy(buf, data, len);
+			usb_process_iface (dev, iface, len, buf);
+			return;
+		}
+	}
+}
+#endif
 
-static uint8_t usb_hid_poll(usb_device_t *dev) {
+TCMFUNC static uint8_t usb_hid_poll(usb_device_t *dev) {
 	usb_hid_info_t *info = &(dev->hid_info);
 	int8_t i;
 
@@ -896,6 +902,9 @@ static uint8_t usb_hid_poll(usb_device_t *dev) {
 
 	for(i=0;i<info->bNumIfaces;i++) {
 		usb_hid_iface_info_t *iface = info->iface+i;
+#ifdef HAVE_USB_IRQ
+		if(iface->irq_pipe >= 0) continue;
+#endif
 		if(iface->device_type != HID_DEVICE_UNKNOWN) {
 
 			if (timer_check(iface->qLastPollTime, iface->interval)) { // poll at requested rate
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include "hidparser.h"
+#include "joymapping.h"
 
 #define HID_LED_NUM_LOCK    0x01
 #define HID_LED_CAPS_LOCK   0x02
@@ -69,10 +70,14 @@ typedef struct {
   // (currently only used for joysticks) 
   uint32_t jmap;           // last reported joystick state
   uint16_t jindex;         // joystick index
+  joymapping_lanes_t jmapping; // virtual joystick mapping of the device
   hid_report_t conf;
 
   uint8_t interval;
   uint32_t qLastPollTime;     // last poll time
+#ifdef HAVE_USB_IRQ
+  int8_t irq_pipe;            // served by the usb irq if >= 0
+#endif
 
 } usb_hid_iface_info_t;
 
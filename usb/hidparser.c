@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "hidparser.h"
+#include "attrs.h"
 #include "debug.h"
 
 #if 1
@@ -282,9 +283,10 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 						app_collection--;
 
 						// check if report is usable and stop parsing if it is
-						if(report_is_usable(bit_count, report_complete, conf))
+						if(report_is_usable(bit_count, report_complete, conf)) {
+							hid_plan_compile(conf);
 							return true;
-						else {
+						} else {
 							// retry with next report
 							memset(conf, 0, sizeof(hid_report_t));
 							skip_report = 0;
@@ -496,3 +498,101 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 	// if we get here then no usable setup was found
 	return false;
 }
+
+// Fields larger than 16 bits only deliver their lower 16 bits, as the
+// report processing works with 16 bit values.
+static void hid_field_compile(hid_field_t *f, uint16_t offset, uint8_t size, bool is_signed) {
+	if(size > 16) {
+		size = 16;
+		is_signed = false;
+	}
+
+	f->byte = offset/8;
+	f->shift = offset&7;
+	f->bytes = (f->shift + size + 7)/8;
+	f->mask = (size == 16) ? 0xffff : (1<<size)-1;
+	f->sign = (is_signed && size) ? 1<<(size-1) : 0;
+
+	if(!size)
+		f->kind = HID_FIELD_NONE;
+	else if(!f->shift && size == 8)
+		f->kind = is_signed ? HID_FIELD_S8 : HID_FIELD_U8;
+	else if(!f->shift && size == 16)
+		f->kind = HID_FIELD_16;
+	else
+		f->kind = HID_FIELD_BITS;
+}
+
+// Translate the bit offsets of a joystick/mouse report into an extraction
+// plan. Call it again after changing the button positions.
+void hid_plan_compile(hid_report_t *conf) {
+	hid_plan_t *plan = &conf->plan;
+	uint16_t first = 0;
+	uint8_t i, count = conf->joystick_mouse.button_count;
+
+	for(i=0;i<MAX_AXES;i++) {
+		// if logical minimum is > logical maximum then logical minimum
+		// is signed. This means that the value itself is also signed
+		hid_field_compile(&plan->axis[i], conf->joystick_mouse.axis[i].offset,
+			conf->joystick_mouse.axis[i].size,
+			conf->joystick_mouse.axis[i].logical.min > conf->joystick_mouse.axis[i].logical.max);
+	}
+
+	hid_field_compile(&plan->hat, conf->joystick_mouse.hat.offset,
+		conf->joystick_mouse.hat.size, false);
+
+	// buttons can be read in one go if button n is at bit first+n and
+	// the unused ones are empty
+	plan->buttons_packed = count > 0;
+	for(i=0;i<MAX_BUTTONS && plan->buttons_packed;i++) {
+		uint8_t mask = conf->joystick_mouse.button[i].bitmask;
+		uint16_t bit = conf->joystick_mouse.button[i].byte_offset*8;
+
+		if(i >= count) {
+			plan->buttons_packed = !mask;
+			continue;
+		}
+		if(!mask || (mask & (mask-1))) {
+			plan->buttons_packed = false;
+			continue;
+		}
+		while(!(mask & 1)) {
+			mask >>= 1;
+			bit++;
+		}
+		if(!i) first = bit;
+		plan->buttons_packed = (bit == first+i);
+	}
+
+	if(plan->buttons_packed)
+		hid_field_compile(&plan->buttons, first, count, false);
+	else
+		plan->buttons.kind = HID_FIELD_NONE;
+}
+
+TCMFUNC uint16_t hid_field_get(const hid_field_t *f, const uint8_t *p) {
+	uint32_t v;
+
+	switch(f->kind) {
+	case HID_FIELD_U8:
+		return p[f->byte];
+
+	case HID_FIELD_S8:
+		return (int8_t)p[f->byte];
+
+	case HID_FIELD_16:
+		return p[f->byte] | (p[f->byte+1] << 8);
+
+	case HID_FIELD_BITS:
+		p += f->byte;
+		v = p[0];
+		if(f->bytes > 1) v |= p[1] << 8;
+		if(f->bytes > 2) v |= (uint32_t)p[2] << 16;
+		v = (v >> f->shift) & f->mask;
+		// sign expansion
+		if(v & f->sign) v |= ~f->mask;
+		return v;
+	}
+
+	return 0;
+}
@@ -9,6 +9,30 @@
 #define MAX_AXES 4
 #define MAX_BUTTONS 12
 
+// how a field is read from a report, see hid_plan_compile()
+#define HID_FIELD_NONE  0  // not present, reads as 0
+#define HID_FIELD_U8    1  // byte aligned 8 bits
+#define HID_FIELD_S8    2  // byte aligned 8 bits, sign extended
+#define HID_FIELD_16    3  // byte aligned 16 bits, little endian
+#define HID_FIELD_BITS  4  // anything else, mask and shift over up to 3 bytes
+
+typedef struct {
+  uint8_t kind;      // HID_FIELD_...
+  uint8_t shift;     // bit position in the first byte
+  uint8_t bytes;     // bytes touched
+  uint16_t byte;     // offset of the first byte
+  uint16_t mask;     // value bits after the shift
+  uint16_t sign;     // sign bit if the field is signed, 0 otherwise
+} hid_field_t;
+
+// extraction plan of a joystick/mouse report
+typedef struct {
+  hid_field_t axis[MAX_AXES];
+  hid_field_t hat;
+  hid_field_t buttons;         // all buttons if they are consecutive bits
+  bool buttons_packed;
+} hid_plan_t;
+
 // currently only joysticks are supported
 typedef struct {
   uint8_t type: 2;             // REPORT_TYPE_...
@@ -48,8 +72,12 @@ typedef struct {
       
     } joystick_mouse;
   };
+
+  hid_plan_t plan;
 } hid_report_t;
 
 bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf);
+void hid_plan_compile(hid_report_t *conf);
+uint16_t hid_field_get(const hid_field_t *f, const uint8_t *p);
 
 #endif // HIDPARSER_H
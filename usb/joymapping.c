@@ -27,6 +27,7 @@ This file defines how to handle mapping in the MiST controllers in various ways:
 #include <string.h>
 #include <stdlib.h>
 
+#include "attrs.h"
 #include "timer.h"
 #include "debug.h"
 #include "joymapping.h"
@@ -44,6 +45,9 @@ This file defines how to handle mapping in the MiST controllers in various ways:
 
 static joymapping_t joystick_mappers[MAX_VIRTUAL_JOYSTICK_REMAP];
 
+// bumped whenever a remap changes, the lanes of all devices get resolved again
+static uint32_t joy_map_gen = 1;
+
 static uint16_t default_joystick_mapping [16] = {
 	JOY_RIGHT,
 	JOY_LEFT,
@@ -76,8 +80,10 @@ static char idx = 0;
 void virtual_joystick_remap_init(char save) {
   if(save)
     idx = 0;
-  else
+  else {
     memset(joystick_mappers, 0, sizeof(joystick_mappers));
+    joy_map_gen++;
+  }
 }
 
 /* Parses an input comma-separated string into a mapping strucutre
@@ -161,6 +167,7 @@ char virtual_joystick_remap(char *s, char action, int tag) {
       joystick_mappers[i].vid = vid;
       joystick_mappers[i].pid = pid;
       joystick_mappers[i].tag = tag;
+      joy_map_gen++;
       // default assignment for directions
       joystick_mappers[i].mapping[0] = JOY_RIGHT;
       joystick_mappers[i].mapping[1] = JOY_LEFT;
@@ -193,6 +200,7 @@ void virtual_joystick_remap_update(joymapping_t *map) {
 		    joystick_mappers[i].tag == map->tag) ||
 		    !joystick_mappers[i].vid) {
 			memcpy(&joystick_mappers[i], map, sizeof(joymapping_t));
+			joy_map_gen++;
 			return;
 		}
 	}
@@ -211,6 +219,7 @@ void virtual_joystick_tag_update(uint16_t vid, uint16_t pid, int newtag)
 		}
 	}
 	if (old == -1) return; // old entry not found
+	joy_map_gen++;
 
 	// now search if the entry with the same newtag already there
 	for(i=0;i<MAX_VIRTUAL_JOYSTICK_REMAP;i++) {
@@ -241,6 +250,22 @@ void virtual_joystick_tag_update(uint16_t vid, uint16_t pid, int newtag)
 
 /*****************************************************************************/
 
+// the device tables start with vid and pid and are sorted by them
+typedef struct {
+	uint16_t vid;
+	uint16_t pid;
+} joy_dev_id_t;
+
+static int joy_dev_cmp(const void *key, const void *entry) {
+	const joy_dev_id_t *a = key, *b = entry;
+	if (a->vid != b->vid) return (a->vid < b->vid) ? -1 : 1;
+	if (a->pid != b->pid) return (a->pid < b->pid) ? -1 : 1;
+	return 0;
+}
+
+#define joy_dev_find(table, vid, pid) \
+	bsearch(&(joy_dev_id_t){ vid, pid }, table, sizeof(table)/sizeof(table[0]), sizeof(table[0]), joy_dev_cmp)
+
 static const struct {
 	uint16_t vid;
 	uint16_t pid;
@@ -258,196 +283,107 @@ static const struct {
 	{ 0x0583, 0x2060, "iBuffalo SFC BSGP801" },
 	{ 0x0738, 0x2217, "Speedlink Compet Pro" },
 	{ 0x081F, 0xE401, "SNES Generic Pad" },
-	{ 0x0F30, 0x1012, "Qanba Q4RAF" },
 	{ 0x0CA3, 0x0024, "8BitDo M30 2.4G" },
+	{ 0x0F30, 0x1012, "Qanba Q4RAF" },
 	{ 0x1002, 0x9000, "8BitDo FC30" },
 	{ 0x1235, 0xab11, "8BitDo SFC30" },
 	{ 0x1235, 0xab21, "8BitDo SFC30"},
-	{ 0x1F4F, 0x0003, "ROYDS Stick.EX" },
 	{ 0x1345, 0x1030, "Retro Freak gamepad" },
 	{ 0x1C59, 0x0026, "Retro Games GAMEPAD" },
+	{ 0x1F4F, 0x0003, "ROYDS Stick.EX" },
 };
 
 const char* get_joystick_name( uint16_t vid, uint16_t pid ) {
-	for (int n = 0; n < (sizeof(joy_devs) / sizeof(joy_devs[0])); n++)
-	{
-		if (joy_devs[n].vid == vid && joy_devs[n].pid == pid)
-		{
-			return joy_devs[n].name;
-		}
-	}
-	return NULL;
+	const typeof(joy_devs[0]) *dev = joy_dev_find(joy_devs, vid, pid);
+	return dev ? dev->name : NULL;
 }
 
 /* Translates USB input into internal virtual joystick,
-   with some default handling for common/known gampads */
+   with some default handling for common/known gampads.
+   The mapping of a device is resolved into its lanes once and redone only
+   when a remap changed, the per report translation is a plain bit
+   permutation. */
 
-uint16_t virtual_joystick_mapping (uint16_t vid, uint16_t pid, uint16_t joy_input) {
-	
+// built-in mappings of physical buttons 1-12, keep sorted by vid/pid
+static const struct {
+	uint16_t vid;
+	uint16_t pid;
+	uint16_t button[12];
+} joy_maps[] = {
+	// RetroLink N64 and Gamecube pad (same vid/pid)
+	// A/B on the GC pad are 3/4, on the N64 pad 7/9, Z on the N64 pad is 8
+	{ VID_RETROLINK, 0x0006, { 0, 0, JOY_A, JOY_B, JOY_L | JOY_SELECT, JOY_R | JOY_SELECT,
+	                           JOY_A, JOY_L | JOY_SELECT, JOY_B, JOY_START, 0, 0 } },
+	// Buffalo NES pad - BGCFC801, two ways to hold the controller, L/R also for flippers
+	{ 0x0411, 0x00C6, { JOY_A, JOY_B, JOY_B, JOY_UP, JOY_L | JOY_L2, JOY_R | JOY_R2,
+	                    JOY_SELECT, JOY_START, 0, 0, 0, 0 } },
+	// NEOGEO-daptor, red "A" and yellow "B" are inverted to NES/SNES,
+	// green "C" and blue "D" also act as L/R
+	{ VID_DAPTOR, 0xF421, { JOY_B, JOY_A, JOY_Y | JOY_L, JOY_X | JOY_R, JOY_START, JOY_SELECT,
+	                        0, 0, 0, 0, 0, 0 } },
+	// iBuffalo SNES pad - BSGP801, two ways to hold the controller, L/R also for flippers
+	{ 0x0583, 0x2060, { JOY_A, JOY_B, JOY_B, JOY_UP, JOY_L | JOY_L2, JOY_R | JOY_R2,
+	                    JOY_SELECT, JOY_START, 0, 0, 0, 0 } },
+	// no-brand cheap snes clone pad, two ways to hold the controller, L/R also for flippers
+	{ 0x081F, 0xE401, { JOY_B, JOY_A, JOY_B, JOY_UP, JOY_L | JOY_L2, JOY_R | JOY_R2,
+	                    0, 0, JOY_SELECT, JOY_START, 0, 0 } },
+	// Qanba Q4RAF, X for jump
+	{ 0x0F30, 0x1012, { JOY_A, JOY_B, JOY_B, JOY_A, JOY_X, JOY_SELECT,
+	                    0, JOY_SELECT, 0, JOY_START, 0, 0 } },
+	// 8bitdo FC30, buttons 3 and 6 not used, L/R also for flippers
+	{ 0x1002, 0x9000, { JOY_A, JOY_B, 0, JOY_X, JOY_Y, 0, JOY_L | JOY_L2, JOY_R | JOY_R2,
+	                    JOY_L | JOY_L2, JOY_R | JOY_R2, JOY_SELECT, JOY_START } },
+	// 8bitdo SFC30, buttons 3, 6, 9 and 10 not used, L/R also for flippers
+	{ 0x1235, 0xab11, { JOY_A, JOY_B, 0, JOY_X, JOY_Y, 0, JOY_L | JOY_L2, JOY_R | JOY_R2,
+	                    0, 0, JOY_SELECT, JOY_START } },
+	{ 0x1235, 0xab21, { JOY_A, JOY_B, 0, JOY_X, JOY_Y, 0, JOY_L | JOY_L2, JOY_R | JOY_R2,
+	                    0, 0, JOY_SELECT, JOY_START } },
+	// ROYDS Stick.EX, circle (usually select in PSx), cross (usually cancel), triangle, square
+	{ 0x1F4F, 0x0003, { JOY_B, JOY_X, JOY_A, JOY_Y, JOY_L, JOY_R, JOY_L2, JOY_R2,
+	                    JOY_SELECT, JOY_START, 0, 0 } },
+};
+
+void virtual_joystick_mapping_init(joymapping_lanes_t *lanes, uint16_t vid, uint16_t pid) {
 	uint8_t i;
-	
-	// defines translations between physical buttons and virtual joysticks
-	uint16_t mapping[16];
+	int tag = 0;
+	const typeof(joy_maps[0]) *builtin = joy_dev_find(joy_maps, vid, pid);
+
+	lanes->vid = vid;
+	lanes->pid = pid;
+	lanes->gen = joy_map_gen;
+
 	// keep directions by default
-	for(i=0; i<4; i++) 
-	   mapping[i]=default_joystick_mapping[i]; 
-	// blank the rest
-	for(i=4; i<16; i++) mapping[i]=0;
+	for(i=0; i<4; i++)
+		lanes->lane[i] = default_joystick_mapping[i];
+
+	// the built-in mapping or the default one for the buttons
+	for(i=4; i<16; i++)
+		lanes->lane[i] = builtin ? builtin->button[i-4] : default_joystick_mapping[i];
 
-	uint8_t use_default=1;
-	uint8_t btn_off = 3; // start at three since array is 0 based, so 4 = button 1
-	
-	// mapping for Qanba Q4RAF
-	if( vid==0x0F30 && pid==0x1012) {
-	  mapping[btn_off+1]  = JOY_A;
-	  mapping[btn_off+2]  = JOY_B;
-	  mapping[btn_off+4]  = JOY_A;
-	  mapping[btn_off+3]  = JOY_B;     
-	  mapping[btn_off+5]  = JOY_X; //for jump
-	  mapping[btn_off+6]  = JOY_SELECT;
-	  mapping[btn_off+8]  = JOY_SELECT;
-	  mapping[btn_off+10] = JOY_START;       
-	  use_default=0;
-	}
-	
-	// mapping for no-brand cheap snes clone pad
-	if(vid==0x081F && pid==0xE401) {
-	  mapping[btn_off+2]  = JOY_A;
-	  mapping[btn_off+3]  = JOY_B;
-	  mapping[btn_off+1]  = JOY_B; // allow two ways to hold the controller  
-	  mapping[btn_off+4]  = JOY_UP;
-	  mapping[btn_off+5]  = JOY_L | JOY_L2; // also bind to buttons for flippers
-	  mapping[btn_off+6]  = JOY_R | JOY_R2; 
-	  mapping[btn_off+9]  = JOY_SELECT;
-	  mapping[btn_off+10] = JOY_START;       
-	  use_default=0;
-	}
-	
-	// mapping for iBuffalo SNES pad - BSGP801
-	if(vid==0x0583 && pid==0x2060) {
-	  mapping[btn_off+1] = JOY_A;
-	  mapping[btn_off+2] = JOY_B;
-	  mapping[btn_off+3] = JOY_B;  // allow two ways to hold the controller
-	  mapping[btn_off+4] = JOY_UP; 
-	  mapping[btn_off+5] = JOY_L | JOY_L2; // also bind to buttons for flippers
-	  mapping[btn_off+6] = JOY_R | JOY_R2;                 
-	  mapping[btn_off+7] = JOY_SELECT;
-	  mapping[btn_off+8] = JOY_START;
-	  use_default=0;
-	}
-	
-	//mapping for Buffalo NES pad - BGCFC801
-	if(vid==0x0411 && pid==0x00C6) {
-	  mapping[btn_off+1] = JOY_A;
-	  mapping[btn_off+2] = JOY_B;
-	  mapping[btn_off+3] = JOY_B;  // allow two ways to hold the controller
-	  mapping[btn_off+4] = JOY_UP; 
-	  mapping[btn_off+5] = JOY_L | JOY_L2; // also bind to buttons for flippers
-	  mapping[btn_off+6] = JOY_R | JOY_R2;                     
-	  mapping[btn_off+7] = JOY_SELECT;
-	  mapping[btn_off+8] = JOY_START;
-	  use_default=0;
-	} 
-
-	//mapping for RetroLink N64 and Gamecube pad (same vid/pid)
-	if(vid==VID_RETROLINK && pid==0x0006) {
-	  mapping[btn_off+7] = JOY_A;  // A on N64 pad
-	  mapping[btn_off+9] = JOY_B;  // B on N64 pad
-	  mapping[btn_off+3] = JOY_A;  // A on GC pad
-	  mapping[btn_off+4] = JOY_B;  // B on GC pad
-	  mapping[btn_off+5] = JOY_L | JOY_SELECT;
-	  mapping[btn_off+8] = JOY_L | JOY_SELECT; // Z button on N64 pad
-	  mapping[btn_off+6] = JOY_R | JOY_SELECT;
-	  mapping[btn_off+10] = JOY_START;
-	  use_default=0;
-	}
-	
-	//mapping for ROYDS Stick.EX
-	if(vid==0x1F4F && pid==0x0003) {
-	  mapping[btn_off+3] = JOY_A;  // Circle (usually select in PSx)
-	  mapping[btn_off+1] = JOY_B;  // Cross  (usually cancel in PSx)
-	  mapping[btn_off+2] = JOY_X;  // Triangle
-	  mapping[btn_off+4] = JOY_Y;  // Square
-	  mapping[btn_off+5] = JOY_L;
-	  mapping[btn_off+6] = JOY_R; 
-	  mapping[btn_off+7] = JOY_L2; 
-	  mapping[btn_off+8] = JOY_R2;
-	  mapping[btn_off+9] = JOY_SELECT;
-	  mapping[btn_off+10] = JOY_START;
-	  use_default=0;
-	}
-	
-	//mapping for NEOGEO-daptor
-	if(vid==VID_DAPTOR && pid==0xF421) {
-	  mapping[btn_off+1] = JOY_B;  // red button "A" on pad (inverted order with NES/SNES
-	  mapping[btn_off+2] = JOY_A;  // yellow button "B" on pad (inverted order with NES/SNES
-	  mapping[btn_off+3] = JOY_Y | JOY_L;  // green button, "C" on pad (mapped to Y and L in SNES convention)
-	  mapping[btn_off+4] = JOY_X | JOY_R;  // blue button "D"  
-	  mapping[btn_off+5] = JOY_START;
-	  mapping[btn_off+6] = JOY_SELECT;
-	  use_default=0;
-	}
-	
-	//mapping for 8bitdo SFC30
-	if(vid==0x1235 && (pid==0xab11 || pid==0xab21)) {
-		mapping[btn_off+1] = JOY_A;
-	  mapping[btn_off+2] = JOY_B;
-	  //mapping[btn_off+3] // physical button #3 not used
-		mapping[btn_off+4] = JOY_X;
-		mapping[btn_off+5] = JOY_Y;
-	  //mapping[btn_off+6] // physical button #6 not used
-		mapping[btn_off+7] = JOY_L | JOY_L2; // also bind to buttons for flippers
-	  mapping[btn_off+8] = JOY_R | JOY_R2; // also bind to buttons for flippers
-	  //9 and 10 not used
-		mapping[btn_off+11] = JOY_SELECT;
-		mapping[btn_off+12] = JOY_START;
-		use_default=0;
-	}
-	
-		//mapping for 8bitdo FC30
-	if(vid==0x1002 && pid==0x9000) {
-		mapping[btn_off+1] = JOY_A;
-	  mapping[btn_off+2] = JOY_B;
-	  //mapping[btn_off+3] // physical button #3 not used
-		mapping[btn_off+4] = JOY_X;
-		mapping[btn_off+5] = JOY_Y;
-	  //mapping[btn_off+6] // physical button #6 not used
-		mapping[btn_off+7] = JOY_L | JOY_L2; // also bind to buttons for flippers
-	  mapping[btn_off+8] = JOY_R | JOY_R2; // also bind to buttons for flippers
-		mapping[btn_off+9] = JOY_L | JOY_L2; // also bind to buttons for flippers
-	  mapping[btn_off+10] = JOY_R | JOY_R2; // also bind to buttons for flippers		
-		mapping[btn_off+11] = JOY_SELECT;
-		mapping[btn_off+12] = JOY_START;
-		use_default=0;
-	}
-	
 	// Apply remap information from various config sources if present
 	// Priority (low to high):
 	// 0 - mist.ini
 	// 1 - mistcfg.ini
 	// 2 - [corename].cfg
-	uint8_t j;
-	int tag = 0;
-	for(j=0;j<MAX_VIRTUAL_JOYSTICK_REMAP;j++) {
+	for(uint8_t j=0;j<MAX_VIRTUAL_JOYSTICK_REMAP;j++) {
 		if(joystick_mappers[j].vid==vid && joystick_mappers[j].pid==pid && joystick_mappers[j].tag >= tag) {
-			for(i=0; i<16; i++)
-				mapping[i]=joystick_mappers[j].mapping[i];
-			use_default=0;
+			memcpy(lanes->lane, joystick_mappers[j].mapping, sizeof(lanes->lane));
 			tag = joystick_mappers[j].tag + 1;
 		}
 	}
+}
 
-	// apply default mapping to rest of buttons if requested
-	if (use_default) {
-	  for(i=4; i<16; i++) 
-		if (mapping[i]==0) mapping[i]=default_joystick_mapping[i];
-	}
-	
+TCMFUNC uint16_t virtual_joystick_mapping(joymapping_lanes_t *lanes, uint16_t joy_input) {
 	uint16_t vjoy = 0;
-	for(i=0; i<16; i++) 
-	  if (joy_input & (0x01<<i))  vjoy |= mapping[i];
-  
-  return vjoy;
+	uint8_t i;
+
+	if(lanes->gen != joy_map_gen)
+		virtual_joystick_mapping_init(lanes, lanes->vid, lanes->pid);
+
+	for(i=0; i<16; i++)
+		vjoy |= lanes->lane[i] & -((joy_input >> i) & 1);
+
+	return vjoy;
 }
 
 /*****************************************************************************\
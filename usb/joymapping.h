@@ -36,6 +36,14 @@ typedef struct {
     int      tag;
 } joymapping_t;
 
+// the resolved mapping of a device, the virtual joystick bits of each input bit
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t gen;       // remap generation the lanes were resolved for
+    uint16_t lane[16];
+} joymapping_lanes_t;
+
 /*****************************************************************************/
 
 // INI parsing
@@ -46,8 +54,10 @@ char virtual_joystick_remap(char *, char, int);
 void virtual_joystick_remap_update(joymapping_t*);
 void virtual_joystick_tag_update(uint16_t vid, uint16_t pid, int newtag);
 
-// runtime mapping
-uint16_t virtual_joystick_mapping (uint16_t vid, uint16_t pid, uint16_t joy_input);
+// runtime mapping, resolve the lanes when the device is enumerated. They
+// are resolved again when a remap changed.
+void virtual_joystick_mapping_init(joymapping_lanes_t *lanes, uint16_t vid, uint16_t pid);
+uint16_t virtual_joystick_mapping(joymapping_lanes_t *lanes, uint16_t joy_input);
 
 // name known joysticks
 const char* get_joystick_name( uint16_t vid, uint16_t pid );
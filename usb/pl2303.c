@@ -18,6 +18,7 @@
 #include "utils.h"
 #include "user_io.h"
 #include "timer.h"
+#include "mist_cfg.h"
 
 // list of supported vid/pid pairs
 static const unsigned short supported_devices[][2] = {
@@ -35,15 +36,25 @@ static const unsigned short supported_devices[][2] = {
 
 // #define TX_TEST
 
-// this needs to be at least 64 bytes (the max packet size), otherwise we might loose data
-// since we cannot prevent the device to return less than these bytes
-#define RX_BUF_SIZE 128
+// Ring buffers with free running indices, the sizes must be powers of two.
+// Data from the adapter is only read while the rx ring has room for a max
+// sized packet, since we cannot prevent the device from returning that much.
+#define RX_BUF_SIZE 256
 static uint8_t rx_buf[RX_BUF_SIZE];
-static uint8_t rx_buf_fill;
+static uint16_t rx_head, rx_tail;
 
-#define TX_BUF_SIZE 128
+#define TX_BUF_SIZE 256
 static uint8_t tx_buf[TX_BUF_SIZE];
-static uint8_t tx_buf_fill;
+static uint16_t tx_head, tx_tail;
+
+#define RX_FILL  ((uint16_t)(rx_head - rx_tail))
+#define TX_FILL  ((uint16_t)(tx_head - tx_tail))
+
+// bulk transfers are handled on every usb poll at most this often
+#define BULK_POLL_MS 1
+
+// CTS in the serial state notification of the interrupt endpoint
+#define UART_STATE_CTS 0x80
 
 static uint8_t adapter_count = 0;
 
@@ -57,31 +68,37 @@ uint8_t get_pl2303s(void) {
 int8_t pl2303_is_blocked(void) {
   // if no adapter is installed then there's no need to throttle
   if(!adapter_count) return 0;
-  return(tx_buf_fill == TX_BUF_SIZE);
+  return(TX_FILL == TX_BUF_SIZE);
+}
+
+// free space in the tx ring, the core side reads at most this much in one go
+uint16_t pl2303_tx_space(void) {
+  return TX_BUF_SIZE - TX_FILL;
 }
 
 void pl2303_tx_byte(uint8_t byte) {
-  if(tx_buf_fill < TX_BUF_SIZE)
-    tx_buf[tx_buf_fill++] = byte;
+  if(TX_FILL < TX_BUF_SIZE)
+    tx_buf[tx_head++ & (TX_BUF_SIZE-1)] = byte;
   else 
     iprintf("Drop %d\n", byte);
 }
 
+// queue data for the adapter, sent in full packets from pl2303_poll()
+void pl2303_tx(uint8_t *data, uint16_t len) {
+  while(len--) pl2303_tx_byte(*data++);
+}
+
 int8_t pl2303_present(void) {
   return(adapter_count != 0);
 }
 
 uint8_t pl2303_rx_available(void) {
-  return(rx_buf_fill != 0);
+  return(rx_head != rx_tail);
 }
 
 uint8_t pl2303_rx(void) {
   if(!pl2303_rx_available()) return 0;
-
-  uint8_t retval = rx_buf[0];
-  memmove(rx_buf, rx_buf+1, RX_BUF_SIZE-1);
-  rx_buf_fill--;
-  return retval;
+  return rx_buf[rx_tail++ & (RX_BUF_SIZE-1)];
 }
 
 #define USB_VENDOR_REQ_OUT   USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_VENDOR|USB_SETUP_RECIPIENT_DEVICE
@@ -159,27 +176,24 @@ static int8_t pl2303_tx_dev(usb_device_t *dev, uint8_t *data, uint8_t len) {
 
   usb_pl2303_info_t *info = &(dev->pl2303_info);
 
+  // transmit data
+  uint8_t rcode = usb_out_transfer(dev, &(info->ep[info->ep_bulk_out_idx]), len, data);
+  if(rcode == hrNAK) {
+    pl2303_debugf("%s() NAK", __FUNCTION__);
+    return rcode;
+  }
+  if(rcode) {
+    pl2303_debugf("%s() failed #%x", __FUNCTION__, rcode);
+    return rcode;
+  }
+
 #ifdef PL2303_STAT
   info->tx_cnt += len;
   pl2303_debugf("tx %d bytes, total = %ld", len, info->tx_cnt);
 #else
   pl2303_debugf("tx %d bytes", len);
 #endif
-
-  hexdump(data, len, 0);
-
-  // transmit data
-  uint8_t rcode = usb_out_transfer(dev, &(info->ep[info->ep_bulk_out_idx]), len, data);
-  if(rcode) pl2303_debugf("%s() failed #%x", __FUNCTION__, rcode);
-
-  if(rcode == hrNAK)
-    pl2303_debugf("%s() NAK", __FUNCTION__);
-
-  return rcode;
-}
-
-void pl2303_tx(uint8_t *data, uint8_t len) {
-  pl2303_tx_dev(pl2303_get_dev(), data, len);
+  return 0;
 }
 
 static uint8_t pl2303_parse_conf0(usb_device_t *dev, uint16_t len) {
@@ -237,7 +251,8 @@ static uint8_t pl2303_parse_conf0(usb_device_t *dev, uint16_t len) {
 	    (p->ep_desc.bEndpointAddress & 0x80) == 0x00) {
 	  info->ep_bulk_out_idx = epidx;
 	  pl2303_debugf("bulk out endpoint %d", p->ep_desc.bEndpointAddress & 0x0F);
-	  info->ep[epidx].bmNakPower = USB_NAK_DEFAULT;   // allow retries to avoid data loss
+	  // a busy adapter NAKs, the data stays in the tx ring for the next poll
+	  info->ep[epidx].bmNakPower = USB_NAK_NOWAIT;
 	}
 	
 	epidx++;
@@ -272,9 +287,10 @@ static uint8_t pl2303_init(usb_device_t *dev, usb_device_descriptor_t *dev_desc)
   info->qLastIrqPollTime = 0;
   info->qLastBulkPollTime = 0;
   info->bPollEnable = false;
+  info->uart_state = UART_STATE_CTS;
 
   // buffer should be empty
-  tx_buf_fill = rx_buf_fill = 0;
+  tx_head = tx_tail = rx_head = rx_tail = 0;
 
 #ifdef PL2303_STAT
   info->tx_cnt = info->rx_cnt = 0;
@@ -349,8 +365,14 @@ static uint8_t pl2303_init(usb_device_t *dev, usb_device_descriptor_t *dev_desc)
   pl2303_vendor_write(dev, 8, 0);
   pl2303_vendor_write(dev, 9, 0);
 
-  // Set DTR = 1
-  rcode = pl2303_SetControlLineState(dev, 1);
+  // RTS/CTS handshake done by the adapter itself. RTS drops when its
+  // buffer fills because the rx ring is full, and it stops sending while
+  // CTS is low.
+  if(mist_cfg.pl2303_rtscts)
+    pl2303_vendor_write(dev, 0, (info->type == PL2303_TYPE_HX) ? 0x61 : 0x41);
+
+  // Set DTR = 1, RTS = 1
+  rcode = pl2303_SetControlLineState(dev, 3);
   if(rcode) {
     pl2303_debugf("SetControlLineState");
     return rcode;
@@ -375,6 +397,74 @@ static uint8_t pl2303_release(usb_device_t *dev) {
   return 0;
 }
 
+// send the tx ring in max sized packets, one per transfer so a NAK never
+// leaves a partly sent transfer behind
+static void pl2303_tx_ring(usb_device_t *dev) {
+  usb_pl2303_info_t *info = &(dev->pl2303_info);
+  uint8_t maxpkt = info->ep[info->ep_bulk_out_idx].maxPktSize;
+  uint8_t pkt[maxpkt];
+
+  // the remote side doesn't want data, the adapter would only NAK
+  if(mist_cfg.pl2303_rtscts && !(info->uart_state & UART_STATE_CTS))
+    return;
+
+  while(TX_FILL) {
+    uint8_t i, len = (TX_FILL < maxpkt) ? TX_FILL : maxpkt;
+
+    for(i=0;i<len;i++)
+      pkt[i] = tx_buf[(tx_tail + i) & (TX_BUF_SIZE-1)];
+
+    if(pl2303_tx_dev(dev, pkt, len)) return;
+    tx_tail += len;
+  }
+}
+
+// read packets while the adapter has data and the rx ring has room
+static uint8_t pl2303_rx_ring(usb_device_t *dev) {
+  usb_pl2303_info_t *info = &(dev->pl2303_info);
+  uint8_t maxpkt = info->ep[info->ep_bulk_in_idx].maxPktSize;
+  uint8_t pkt[maxpkt];
+  uint8_t rcode = 0;
+
+  while(RX_BUF_SIZE - RX_FILL >= maxpkt) {
+    uint16_t i, read = maxpkt;
+    rcode = usb_in_transfer(dev, &(info->ep[info->ep_bulk_in_idx]), &read, pkt);
+    if(rcode) {
+      if (rcode != hrNAK)
+	pl2303_debugf("%s() rx error: %x", __FUNCTION__, rcode);
+      else
+	rcode = 0;
+      break;
+    }
+
+#ifdef PL2303_STAT
+    info->rx_cnt += read;
+    pl2303_debugf("rx %d bytes, total = %ld", read, info->rx_cnt);
+#else
+    pl2303_debugf("rx %d bytes", read);
+#endif
+
+    for(i=0;i<read;i++)
+      rx_buf[rx_head++ & (RX_BUF_SIZE-1)] = pkt[i];
+
+    // a short packet means the adapter is drained
+    if(read < maxpkt) break;
+  }
+  return rcode;
+}
+
+// forward up to len bytes of the rx ring to the core
+static void pl2303_rx_to_core(uint16_t len) {
+  while(len && RX_FILL) {
+    uint16_t span = RX_BUF_SIZE - (rx_tail & (RX_BUF_SIZE-1));
+    if(span > RX_FILL) span = RX_FILL;
+    if(span > len) span = len;
+    user_io_serial_tx((char*)rx_buf + (rx_tail & (RX_BUF_SIZE-1)), span);
+    rx_tail += span;
+    len -= span;
+  }
+}
+
 static uint8_t pl2303_poll(usb_device_t *dev) {
   usb_pl2303_info_t *info = &(dev->pl2303_info);
   uint8_t rcode = 0;
@@ -382,8 +472,7 @@ static uint8_t pl2303_poll(usb_device_t *dev) {
   if (!info->bPollEnable)
     return 0;
   
-#if 1 // no need to use the irq channel ...
-  // poll interrupt endpoint
+  // poll interrupt endpoint for the serial state
   if (timer_check(info->qLastIrqPollTime, info->int_poll_ms)) {
     uint16_t read = info->ep[info->ep_int_idx].maxPktSize;
     uint8_t buf[info->ep[info->ep_int_idx].maxPktSize];
@@ -392,54 +481,31 @@ static uint8_t pl2303_poll(usb_device_t *dev) {
     if (rcode) {
       if (rcode != hrNAK)
 	pl2303_debugf("%s() int error: %x", __FUNCTION__, rcode);
-    } else {
-      pl2303_debugf("int %d bytes", read);
-      hexdump(buf, read, 0);
+    } else if(read) {
+      // the state is in byte 8 of the notification, older chips send it alone
+      info->uart_state = buf[(read > 8) ? 8 : 0];
+      pl2303_debugf("uart state %02x", info->uart_state);
     }
     info->qLastIrqPollTime = timer_get_msec();
   }
-#endif
 
-  // Do TX/RX handling at 100Hz
-  if(timer_check(info->qLastBulkPollTime, 10)) {
+  if(timer_check(info->qLastBulkPollTime, BULK_POLL_MS)) {
 
 #ifdef TX_TEST
     if(tx_test < 26) {
       // do some tests (needs a loopback connector)
       uint8_t buffer[30]; 
       memset(buffer, 'A'+tx_test, sizeof(buffer));
-      
-      // send and retry on failure
-      pl2303_tx_dev(dev, buffer, sizeof(buffer));
+      pl2303_tx(buffer, sizeof(buffer));
       tx_test++;
     }
 #endif
 
     // transmit anything that's in the local transmit buffer
-    if(tx_buf_fill) {
-      pl2303_tx_dev(dev, tx_buf, tx_buf_fill);
-      tx_buf_fill = 0;
-    }
+    pl2303_tx_ring(dev);
 
-    // only receive if still enough space in rx buffer for a max sized packet
-    if(rx_buf_fill+info->ep[info->ep_bulk_in_idx].maxPktSize < RX_BUF_SIZE) {
-      uint16_t read = info->ep[info->ep_bulk_in_idx].maxPktSize;
-      rcode = usb_in_transfer(dev, &(info->ep[info->ep_bulk_in_idx]), &read, rx_buf+rx_buf_fill);
-      if(rcode) {
-	if (rcode != hrNAK)
-	  pl2303_debugf("%s() rx error: %x", __FUNCTION__, rcode);
-      } else {
-#ifdef PL2303_STAT
-	info->rx_cnt += read;
-	pl2303_debugf("rx %d bytes, total = %ld", read, info->rx_cnt);
-#else
-	pl2303_debugf("rx %d bytes", read);
-#endif
-
-	hexdump(rx_buf+rx_buf_fill, read, 0);
-	rx_buf_fill += read;
-      }
-    }
+    // and receive what the adapter has
+    rcode = pl2303_rx_ring(dev);
 
     // get current serial status
     serial_status_t stat;
@@ -447,41 +513,21 @@ static uint8_t pl2303_poll(usb_device_t *dev) {
       { static serial_status_t old_stat;
 	if(memcmp(&stat, &old_stat, sizeof(stat)) != 0) { 
 	  pl2303_debugf("stat changed:");
-	  hexdump(&stat, sizeof(stat), 0);
 	  memcpy(&old_stat, &stat, sizeof(stat));
 	}
       }
 
-      // is data to be sent?
-      if(rx_buf_fill) {
-#define BUFFER_SIZE 8  // max 15
-	// check if fifo is empty (the empty fifo can hold up to 15 entries)
-	if(stat.fifo_stat & 4) {
-	  //	  iprintf("space: %d\n", stat.fifo_stat>>4);
-	  uint8_t buffer_space = stat.fifo_stat>>4; // BUFFER_SIZE
-
-	  // send as many bytes as possible from buffer into core ...
-	  uint8_t bytes2send = (rx_buf_fill < buffer_space)?rx_buf_fill:buffer_space;
-	  pl2303_debugf("forward %d bytes into core", bytes2send);
-	  user_io_serial_tx(rx_buf, bytes2send);
-	  // ... and remove sent data from buffer
-	  memmove(rx_buf, rx_buf+bytes2send, RX_BUF_SIZE-bytes2send);
-	  rx_buf_fill -= bytes2send;
-
-	  //	  if(user_io_serial_status(&stat, 0x90)) {
-	  //	    iprintf("After %d: %d\n", bytes2send, stat.fifo_stat>>4);
-	  //	  }
-	}
+      // send as many bytes as the core's input fifo has space for
+      if(RX_FILL && (stat.fifo_stat & 4)) {
+	pl2303_debugf("forward %d bytes into core", RX_FILL);
+	pl2303_rx_to_core(stat.fifo_stat>>4);
       }
 
       // set new com paramters (will be ignored if they stay the same)
       pl2303_settings_dev(dev, stat.bitrate, stat.datasize, stat.parity, stat.stopbits);
     } else {
-      if(rx_buf_fill) {
-	// just throw all data at the core as we have no insight in its buffer state
-	user_io_serial_tx(rx_buf, rx_buf_fill);
-	rx_buf_fill = 0;
-      }
+      // just throw all data at the core as we have no insight in its buffer state
+      pl2303_rx_to_core(RX_FILL);
     }
 
     info->qLastBulkPollTime = timer_get_msec();
@@ -59,6 +59,7 @@ typedef struct {
   uint8_t ep_bulk_out_idx;       //
   uint8_t int_poll_ms;           // poll interval in ms
   line_coding_t line_coding;     // current line coding
+  uint8_t uart_state;            // last serial state notification, CTS etc.
   bool bPollEnable;
 #ifdef PL2303_STAT
   uint32_t tx_cnt, rx_cnt;
@@ -71,8 +72,9 @@ extern const usb_device_class_config_t usb_pl2303_class;
 // interface to higher levels
 int8_t pl2303_present(void);
 void pl2303_settings(uint32_t rate, uint8_t bits, uint8_t parity, uint8_t stop);
-void pl2303_tx(uint8_t *data, uint8_t len);
+void pl2303_tx(uint8_t *data, uint16_t len);
 void pl2303_tx_byte(uint8_t byte);
+uint16_t pl2303_tx_space(void);
 uint8_t pl2303_rx_available(void);
 uint8_t pl2303_rx(void);
 int8_t pl2303_is_blocked(void);
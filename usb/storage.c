@@ -16,6 +16,24 @@
 
 uint8_t storage_devices = 0;
 
+// the device the disk io goes to
+static usb_device_t *storage_dev = NULL;
+
+#if STORAGE_CACHE_LINES
+static struct {
+  uint8_t data[STORAGE_CACHE_LINE*512] __attribute__ ((aligned (32)));
+  uint32_t lba;     // first sector of the line
+  uint32_t used;    // lru stamp, 0 if the line is empty
+  uint8_t count;    // sectors, less than a line at the end of the device
+} cache[STORAGE_CACHE_LINES];
+
+static uint32_t cache_stamp = 0;
+
+#define cache_clear() memset(cache, 0, sizeof(cache))
+#else
+#define cache_clear()
+#endif
+
 static uint8_t storage_parse_conf(usb_device_t *dev, uint8_t conf, uint16_t len) {
   usb_storage_info_t *info = &(dev->storage_info);
   uint8_t rcode;
@@ -164,7 +182,7 @@ static uint8_t handle_usb_error(usb_device_t *dev, uint8_t index) {
   return STORAGE_ERR_SUCCESS;
 }
 
-static uint8_t transaction(usb_device_t *dev, command_block_wrapper_t *cbw, uint16_t size, char *readbuf, const char *writebuf) {
+static uint8_t transaction(usb_device_t *dev, command_block_wrapper_t *cbw, uint32_t size, char *readbuf, const char *writebuf) {
   usb_storage_info_t *info = &(dev->storage_info);
   uint16_t read;
   uint8_t ret;
@@ -181,10 +199,21 @@ static uint8_t transaction(usb_device_t *dev, command_block_wrapper_t *cbw, uint
   }
 
   if(size) {
-    if (cbw->bmCBWFlags & STORAGE_CMD_DIR_IN)
-      info->last_error = usb_in_transfer(dev, &(info->ep[STORAGE_EP_IN]), &size, readbuf);
-    else
-      info->last_error = usb_out_transfer(dev, &(info->ep[STORAGE_EP_OUT]), size, writebuf);
+    while(size && !info->last_error) {
+      uint16_t chunk = (size > STORAGE_XFER_CHUNK) ? STORAGE_XFER_CHUNK : size;
+      uint16_t done = chunk;
+
+      if (cbw->bmCBWFlags & STORAGE_CMD_DIR_IN) {
+        info->last_error = usb_in_transfer(dev, &(info->ep[STORAGE_EP_IN]), &done, readbuf);
+        readbuf += chunk;
+      } else {
+        info->last_error = usb_out_transfer(dev, &(info->ep[STORAGE_EP_OUT]), chunk, writebuf);
+        writebuf += chunk;
+      }
+
+      // a short packet ends the data phase
+      size = (done < chunk) ? 0 : size - chunk;
+    }
 
     if(handle_usb_error(dev, (cbw->bmCBWFlags & STORAGE_CMD_DIR_IN) ? STORAGE_EP_IN: STORAGE_EP_OUT)) {
       storage_debugf("response failed");
@@ -261,7 +290,7 @@ static uint8_t read(usb_device_t *dev, uint8_t lun,
 
   cbw.dCBWSignature             = STORAGE_CBW_SIGNATURE;
   cbw.dCBWTag                   = 0xdeadbeef;
-  cbw.dCBWDataTransferLength    = len*512;
+  cbw.dCBWDataTransferLength    = (uint32_t)len*512;
   cbw.bmCBWFlags                = STORAGE_CMD_DIR_IN;
   cbw.bmCBWLUN                  = lun;
   cbw.bmCBWCBLength             = 10;
@@ -274,7 +303,7 @@ static uint8_t read(usb_device_t *dev, uint8_t lun,
   cbw.CBWCB[3] = ((addr >> 16) & 0xff);
   cbw.CBWCB[2] = ((addr >> 24) & 0xff);
 
-  return transaction(dev, &cbw, len*512, buf, 0);
+  return transaction(dev, &cbw, (uint32_t)len*512, buf, 0);
 }
 
 static uint8_t write(usb_device_t *dev, uint8_t lun, 
@@ -286,7 +315,7 @@ static uint8_t write(usb_device_t *dev, uint8_t lun,
 
   cbw.dCBWSignature             = STORAGE_CBW_SIGNATURE;
   cbw.dCBWTag                   = 0xdeadbeef;
-  cbw.dCBWDataTransferLength    = len*512;
+  cbw.dCBWDataTransferLength    = (uint32_t)len*512;
   cbw.bmCBWFlags                = STORAGE_CMD_DIR_OUT;
   cbw.bmCBWLUN                  = lun;
   cbw.bmCBWCBLength             = 10;
@@ -299,7 +328,7 @@ static uint8_t write(usb_device_t *dev, uint8_t lun,
   cbw.CBWCB[3] = ((addr >> 16) & 0xff);
   cbw.CBWCB[2] = ((addr >> 24) & 0xff);
 
-  return transaction(dev, &cbw, len*512, 0, buf);
+  return transaction(dev, &cbw, (uint32_t)len*512, 0, buf);
 }
 
 static uint8_t usb_storage_init(usb_device_t *dev, usb_device_descriptor_t *dev_desc) {
@@ -399,6 +428,12 @@ static uint8_t usb_storage_init(usb_device_t *dev, usb_device_descriptor_t *dev_
   storage_devices++;
   storage_debugf("supported device, total USB storage devices now %d", storage_devices);
 
+  info->max_sectors = STORAGE_MAX_SECTORS;
+  if(!storage_dev) {
+    storage_dev = dev;
+    cache_clear();
+  }
+
   // this device has just been setup
   info->state = 1;
   info->qNextPollTime = timer_get_msec() + 1000;
@@ -410,9 +445,21 @@ static uint8_t usb_storage_init(usb_device_t *dev, usb_device_descriptor_t *dev_
 }
 
 static uint8_t usb_storage_release(usb_device_t *dev) {
+  usb_device_t *devs = usb_get_devices();
+  uint8_t i;
+
   storage_debugf("%s()", __FUNCTION__);
   storage_devices--;
 
+  // continue with another storage device if there is one
+  if(dev == storage_dev) {
+    storage_dev = NULL;
+    cache_clear();
+    for (i=0; i<USB_NUMDEVICES; i++)
+      if(devs[i].bAddress && (devs[i].class == &usb_storage_class) && (devs+i != dev))
+        storage_dev = devs+i;
+  }
+
   return 0;
 }
 
@@ -442,25 +489,110 @@ static uint8_t usb_storage_poll(usb_device_t *dev) {
   return rcode;
 }
 
-unsigned char usb_host_storage_read(unsigned long lba, unsigned char *pReadBuffer, uint16_t len) {
-  uint8_t i, rcode = 0;
-  usb_device_t *devs = usb_get_devices(), *dev = NULL;
+// READ(10)/WRITE(10) in pieces the device accepts
+static uint8_t storage_xfer(usb_device_t *dev, uint32_t lba, uint32_t len, uint8_t *readbuf, const uint8_t *writebuf) {
+  usb_storage_info_t *info = &(dev->storage_info);
+  request_sense_response_t sense;
+  uint8_t rcode;
+
+  while(len) {
+    uint16_t n = (len > info->max_sectors) ? info->max_sectors : len;
+
+    rcode = readbuf ? read(dev, 0, lba, n, (char*)readbuf) : write(dev, 0, lba, n, (const char*)writebuf);
+    if(rcode) {
+      // clear the error condition of the device
+      request_sense(dev, 0, &sense);
+
+      // the device may not take transfers this large, retry smaller ones
+      if(n == info->max_sectors && n > 8) {
+        info->max_sectors >>= 1;
+        iprintf("STORAGE: transfer size limited to %d sectors\n", info->max_sectors);
+        continue;
+      }
+      return rcode;
+    }
+
+    lba += n;
+    len -= n;
+    if(readbuf) readbuf += n*512;
+    else        writebuf += n*512;
+  }
+  return 0;
+}
 
-  // find first storage device
-  for (i=0; i<USB_NUMDEVICES; i++) 
-    if(devs[i].bAddress && (devs[i].class == &usb_storage_class)) 
-      dev = devs+i;
+#if STORAGE_CACHE_LINES
+static uint8_t cache_read(usb_device_t *dev, uint32_t lba, uint16_t len, unsigned char *buf) {
+  uint8_t i, rcode;
+
+  while(len) {
+    uint32_t base = lba & ~(STORAGE_CACHE_LINE-1);
+    uint8_t line = 0;
+
+    for(i=0; i<STORAGE_CACHE_LINES; i++) {
+      if(cache[i].used && cache[i].lba == base) break;
+      if(cache[i].used < cache[line].used) line = i;
+    }
+
+    if(i == STORAGE_CACHE_LINES) {
+      if(base >= dev->storage_info.capacity)
+        return STORAGE_ERR_GENERAL_USB_ERROR;
+
+      // fill the least recently used line
+      cache[line].used = 0;
+      cache[line].count = STORAGE_CACHE_LINE;
+      if(base + STORAGE_CACHE_LINE > dev->storage_info.capacity)
+        cache[line].count = dev->storage_info.capacity - base;
+      if((rcode = storage_xfer(dev, base, cache[line].count, cache[line].data, 0)))
+        return rcode;
+      cache[line].lba = base;
+    } else
+      line = i;
+    cache[line].used = ++cache_stamp;
+
+    uint8_t n = base + cache[line].count - lba;
+    if(n > len) n = len;
+    memcpy(buf, cache[line].data + (lba - base)*512, n*512);
+    lba += n;
+    len -= n;
+    buf += n*512;
+  }
+  return 0;
+}
+
+// the cache is write through, update the lines the written sectors are in
+static void cache_write(uint32_t lba, uint16_t len, const unsigned char *buf) {
+  uint8_t i;
+
+  for(i=0; i<STORAGE_CACHE_LINES; i++) {
+    uint32_t first = cache[i].lba, last = cache[i].lba + cache[i].count;
+    if(!cache[i].used || lba >= last || lba + len <= first) continue;
+
+    if(lba > first) first = lba;
+    if(lba + len < last) last = lba + len;
+    memcpy(cache[i].data + (first - cache[i].lba)*512, buf + (first - lba)*512, (last - first)*512);
+  }
+}
+#endif
+
+unsigned char usb_host_storage_read(unsigned long lba, unsigned char *pReadBuffer, uint16_t len) {
+  usb_device_t *dev = storage_dev;
+  uint8_t rcode;
 
   if(!dev) return 0;
 
-  if(lba >= dev->storage_info.capacity) {
+  if(lba >= dev->storage_info.capacity || len > dev->storage_info.capacity - lba) {
     storage_debugf("exceed device limits");
     return 0;
   }
 
   // iprintf("USB Read %d %d\n", lba, len);
 
-  rcode = read(dev, 0, lba, len, pReadBuffer);
+#if STORAGE_CACHE_LINES
+  if(len < STORAGE_CACHE_LINE)
+    rcode = cache_read(dev, lba, len, pReadBuffer);
+  else
+#endif
+    rcode = storage_xfer(dev, lba, len, pReadBuffer, 0);
   if(rcode) {
     storage_debugf("Read sector %d failed", lba);
     return 0;
@@ -469,24 +601,24 @@ unsigned char usb_host_storage_read(unsigned long lba, unsigned char *pReadBuffe
 }
 
 unsigned char usb_host_storage_write(unsigned long lba, const unsigned char *pWriteBuffer, uint16_t len) {
-  uint8_t i, rcode = 0;
-  usb_device_t *devs = usb_get_devices(), *dev = NULL;
-
-  // find first storage device
-  for (i=0; i<USB_NUMDEVICES; i++) 
-    if(devs[i].bAddress && (devs[i].class == &usb_storage_class)) 
-      dev = devs+i;
+  usb_device_t *dev = storage_dev;
+  uint8_t rcode;
 
   if(!dev) return 0;
 
-  if(lba >= dev->storage_info.capacity) {
+  if(lba >= dev->storage_info.capacity || len > dev->storage_info.capacity - lba) {
     storage_debugf("exceed device limits");
     return 0;
   }
 
   // iprintf("USB Write %d %d\n", lba, len);
-  rcode = write(dev, 0, lba, len, pWriteBuffer);
+#if STORAGE_CACHE_LINES
+  cache_write(lba, len, pWriteBuffer);
+#endif
+  rcode = storage_xfer(dev, lba, len, 0, pWriteBuffer);
   if(rcode) {
+    // the sectors are in an unknown state now
+    cache_clear();
     storage_debugf("Write sector %d failed", lba);
     return 0;
   }
@@ -495,17 +627,7 @@ unsigned char usb_host_storage_write(unsigned long lba, const unsigned char *pWr
 }
 
 unsigned int usb_host_storage_capacity() {
-  uint8_t i, rcode = 0;
-  usb_device_t *devs = usb_get_devices(), *dev = NULL;
-
-  // find first storage device
-  for (i=0; i<USB_NUMDEVICES; i++) 
-    if(devs[i].bAddress && (devs[i].class == &usb_storage_class))
-      dev = devs+i;
-
-  if(!dev) return 0;
-
-  return (dev->storage_info.capacity);
+  return storage_dev ? storage_dev->storage_info.capacity : 0;
 }
 
 const usb_device_class_config_t usb_storage_class = {
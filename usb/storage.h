@@ -51,6 +51,22 @@ extern uint8_t storage_devices;
 #define SCSI_CMD_MODE_SENSE_6				0x1A
 #define SCSI_CMD_MODE_SENSE_10				0x5A
 
+// largest READ(10)/WRITE(10), halved when a device fails such a transfer
+#define STORAGE_MAX_SECTORS     128
+// the data phase is split into pieces of this size, so that the usb irq
+// pipes are served in between
+#define STORAGE_XFER_CHUNK      4096
+
+// read cache of STORAGE_CACHE_LINES lines, each STORAGE_CACHE_LINE sectors
+// aligned to the line size. Reads of a line or more bypass it. The SAM7S has
+// no RAM to spare for it (BUF_POOL_BLOCKS is 0 there) and reads directly.
+#ifdef CONFIG_CHIP_SAMV71
+#define STORAGE_CACHE_LINES     4
+#define STORAGE_CACHE_LINE      8
+#else
+#define STORAGE_CACHE_LINES     0
+#endif
+
 typedef struct {
   uint8_t  DeviceType          : 5;
   uint8_t  PeripheralQualifier : 3;
@@ -139,6 +155,7 @@ typedef struct {
   uint8_t state;
   uint32_t qNextPollTime;
   uint32_t capacity;
+  uint8_t max_sectors;		// current READ(10)/WRITE(10) size limit
 } usb_storage_info_t;
 
 // interface to usb core
@@ -3,10 +3,43 @@
 #include "timer.h"
 #include "max3421e.h"
 #include "usb.h"
+#include "prof.h"
 
 static uint8_t usb_task_state;
 static uint8_t bmHubPre;
 
+#ifdef HAVE_USB_IRQ
+// The interrupt handler owns the chip between the SPI accesses of the
+// main loop. Code using the chip for more than one register access takes
+// the lock, the handler then leaves the chip alone and comes back on
+// unlock. A transfer the handler still has in flight is finished by the
+// lock, waiting for its done irq like any other transfer.
+static volatile uint8_t usb_lock = 0;
+static volatile int8_t irq_active = -1;   // pipe with a transfer in flight
+static volatile uint8_t irq_deferred = 0;
+static void usb_irq_handler(void);
+static uint8_t usb_irq_done(void);
+
+static void usb_hw_lock() {
+	usb_lock++;
+	while(irq_active >= 0) {
+		while(!(max3421e_read_u08( MAX3421E_HIRQ ) & MAX3421E_HXFRDNIRQ ));
+		max3421e_write_u08( MAX3421E_HIRQ, MAX3421E_HXFRDNIRQ );
+		if(!usb_irq_done()) irq_active = -1;
+	}
+}
+
+static void usb_hw_unlock() {
+	if(--usb_lock == 0 && irq_deferred) {
+		irq_deferred = 0;
+		UsbIrqRetrigger();
+	}
+}
+#else
+#define usb_hw_lock()
+#define usb_hw_unlock()
+#endif
+
 void usb_reset_state() {
   puts(__FUNCTION__);
   bmHubPre	 = 0;
@@ -20,6 +53,10 @@ void usb_hw_init() {
 	usb_task_state = USB_DETACHED_SUBSTATE_INITIALIZE; 
 
 	usb_reset_state();
+
+#ifdef HAVE_USB_IRQ
+	UsbIrqEnable(usb_irq_handler);
+#endif
 }
 
 static uint8_t usb_set_address(usb_device_t *dev, ep_t *ep, 
@@ -54,7 +91,10 @@ static uint8_t usb_set_address(usb_device_t *dev, ep_t *ep,
 /* If nak_limit == 0, do not count NAKs, exit after timeout */
 /* If bus timeout, re-sends up to USB_RETRY_LIMIT times */
 /* return codes 0x00-0x0f are HRSLT (0x00 being success), 0xff means timeout */
-static uint8_t usb_dispatchPkt( uint8_t token, uint8_t ep, uint16_t nak_limit ) {
+/* usb_completePkt() is the same for a packet which has already been launched */
+static uint8_t last_hirq;  // HIRQ at the completion of the last packet
+
+static uint8_t usb_completePkt( uint8_t token, uint8_t ep, uint16_t nak_limit ) {
 	//  iprintf("  %s(token=%x, ep=%d, nak_limit=%d)\n", 
 	//	  __FUNCTION__, token, ep, nak_limit);
 	unsigned long timeout = timer_get_msec();
@@ -62,9 +102,12 @@ static uint8_t usb_dispatchPkt( uint8_t token, uint8_t ep, uint16_t nak_limit )
 	uint8_t rcode = 0x00;
 	uint8_t retry_count = 0;
 	uint16_t nak_count = 0;
+	bool launched = true;
 
 	while( !timer_check(timeout, USB_XFER_TIMEOUT) )  {
-		max3421e_write_u08( MAX3421E_HXFR, ( token|ep )); //launch the transfer
+		if( !launched )
+			max3421e_write_u08( MAX3421E_HXFR, ( token|ep )); //launch the transfer
+		launched = false;
 		rcode = USB_ERROR_TRANSFER_TIMEOUT;
 
 		// wait for transfer completion
@@ -72,6 +115,7 @@ static uint8_t usb_dispatchPkt( uint8_t token, uint8_t ep, uint16_t nak_limit )
 			tmpdata = max3421e_read_u08( MAX3421E_HIRQ );
 
 			if( tmpdata & MAX3421E_HXFRDNIRQ ) {
+				last_hirq = tmpdata;
 				//clear the interrupt
 				max3421e_write_u08( MAX3421E_HIRQ, MAX3421E_HXFRDNIRQ );
 				rcode = 0x00;
@@ -107,6 +151,11 @@ static uint8_t usb_dispatchPkt( uint8_t token, uint8_t ep, uint16_t nak_limit )
 	return( rcode );
 }
 
+static uint8_t usb_dispatchPkt( uint8_t token, uint8_t ep, uint16_t nak_limit ) {
+	max3421e_write_u08( MAX3421E_HXFR, ( token|ep )); //launch the transfer
+	return usb_completePkt( token, ep, nak_limit );
+}
+
 static uint8_t usb_InTransfer(ep_t *pep, uint16_t nak_limit, 
 		       uint16_t *nbytesptr, uint8_t* data) {
 	uint8_t rcode = 0;
@@ -114,25 +163,32 @@ static uint8_t usb_InTransfer(ep_t *pep, uint16_t nak_limit,
 
 	uint16_t nbytes    = *nbytesptr;
 	uint8_t maxpktsize = pep->maxPktSize; 
+	bool next;
 
 	*nbytesptr = 0;
 	// set toggle value
 	max3421e_write_u08( MAX3421E_HCTL, 
 	      (pep->bmRcvToggle) ? MAX3421E_RCVTOG1 : MAX3421E_RCVTOG0 );
 
+	//IN packet to EP-'endpoint'. Function takes care of NAKS.
+	rcode = usb_dispatchPkt( tokIN, pep->epAddr, nak_limit );
+
 	// use a 'return' to exit this loop
 	while( 1 ) {
-		//IN packet to EP-'endpoint'. Function takes care of NAKS.
-		rcode = usb_dispatchPkt( tokIN, pep->epAddr, nak_limit );
-
 		//should be 0, indicating ACK. Else return error code.
-		if( rcode )
+		if( rcode ) {
+			// the data received before is valid, keep the toggle the
+			// next transfer has to continue with
+			if( *nbytesptr )
+				pep->bmRcvToggle = (( max3421e_read_u08( MAX3421E_HRSL ) &
+				    MAX3421E_RCVTOGRD )) ? 1 : 0;
 			return( rcode );
+		}
 
 		/* check for RCVDAVIRQ and generate error if not present */ 
 		/* the only case when absense of RCVDAVIRQ makes sense is when */
 		/* toggle error occured. Need to add handling for that */
-		if(( max3421e_read_u08( MAX3421E_HIRQ ) & MAX3421E_RCVDAVIRQ ) == 0 ) 
+		if(( last_hirq & MAX3421E_RCVDAVIRQ ) == 0 ) 
 			return ( 0xf0 );                            //receive error
 
 		pktsize = max3421e_read_u08( MAX3421E_RCVBC ); // number of received bytes
@@ -142,6 +198,13 @@ static uint8_t usb_InTransfer(ep_t *pep, uint16_t nak_limit,
 		if (mem_left < 0)
 			mem_left = 0;
 
+		// The RCVFIFO is double buffered. If more data is expected the next
+		// IN is launched before this packet is read, so the bus transfer
+		// overlaps the SPI burst reading the FIFO.
+		next = ( pktsize == maxpktsize ) && ( pktsize < mem_left );
+		if( next )
+			max3421e_write_u08( MAX3421E_HXFR, ( tokIN | pep->epAddr ));
+
 		data = max3421e_read(MAX3421E_RCVFIFO, 
 		 ((pktsize > mem_left) ? mem_left : pktsize), data );
 
@@ -153,6 +216,12 @@ static uint8_t usb_InTransfer(ep_t *pep, uint16_t nak_limit,
 		/* 1. The device sent a short packet (L.T. maxPacketSize)   */
 		/* 2. 'nbytes' have been transferred.                       */
 
+		// wait for the launched packet
+		if( next ) {
+			rcode = usb_completePkt( tokIN, pep->epAddr, nak_limit );
+			continue;
+		}
+
 		// have we transferred 'nbytes' bytes?
 		if (( pktsize < maxpktsize ) || (*nbytesptr >= nbytes )) {
 			// Save toggle value
@@ -172,14 +241,18 @@ static uint8_t usb_InTransfer(ep_t *pep, uint16_t nak_limit,
 uint8_t usb_in_transfer( usb_device_t *dev, ep_t *ep, uint16_t *nbytesptr, uint8_t* data) {
 	uint16_t nak_limit = 0;
 
+	usb_hw_lock();
 	uint8_t rcode = usb_set_address(dev, ep, &nak_limit);
-	if (rcode) return rcode;
-
-	return usb_InTransfer(ep, nak_limit, nbytesptr, data);
+	if (!rcode)
+		rcode = usb_InTransfer(ep, nak_limit, nbytesptr, data);
+	usb_hw_unlock();
+	if (!rcode)
+		PROF_INPUT_ARRIVAL(GetProfTicks());
+	return rcode;
 }
 
 static uint8_t usb_OutTransfer(ep_t *pep, uint16_t nak_limit, 
-			uint16_t nbytes, const uint8_t *data) {
+			uint16_t nbytes, const uint8_t *data, uint16_t *sentptr) {
 	//  iprintf("%s(%d)\n", __FUNCTION__, nbytes);
 
 	uint8_t rcode = 0, retry_count;
@@ -220,8 +293,15 @@ static uint8_t usb_OutTransfer(ep_t *pep, uint16_t nak_limit,
 			switch( rcode ) {
 			case hrNAK:
 				nak_count ++;
-				if( nak_limit && ( nak_count == nak_limit ))
+				if( nak_limit && ( nak_count == nak_limit )) {
+					// the packets sent so far were taken, a caller
+					// knowing how many may resume behind them
+					if( sentptr ) {
+						*sentptr = nbytes - bytes_left;
+						pep->bmSndToggle = ( max3421e_read_u08( MAX3421E_HRSL ) & MAX3421E_SNDTOGRD ) ? 1 : 0;
+					}
 					return( rcode );
+				}
 				break;
 			case hrTIMEOUT:
 				retry_count ++;
@@ -251,6 +331,7 @@ static uint8_t usb_OutTransfer(ep_t *pep, uint16_t nak_limit,
 
 	//update toggle
 	pep->bmSndToggle = ( max3421e_read_u08( MAX3421E_HRSL ) & MAX3421E_SNDTOGRD ) ? 1 : 0;
+	if( sentptr ) *sentptr = nbytes;
 	return( rcode );    //should be 0 in all cases
 }
 
@@ -260,10 +341,27 @@ static uint8_t usb_OutTransfer(ep_t *pep, uint16_t nak_limit,
 uint8_t usb_out_transfer(usb_device_t *dev, ep_t *ep, uint16_t nbytes, const uint8_t* data ) {
 	uint16_t nak_limit = 0;
 
+	usb_hw_lock();
 	uint8_t rcode = usb_set_address(dev, ep, &nak_limit);
-	if (rcode) return rcode;
+	if (!rcode)
+		rcode = usb_OutTransfer(ep, nak_limit, nbytes, data, NULL);
+	usb_hw_unlock();
+	return rcode;
+}
+
+/* OUT transfer that may end at a NAK. '*nbytesptr' returns the number of */
+/* bytes the device took, the rest can be sent by a later call.           */
+uint8_t usb_out_transfer_nak(usb_device_t *dev, ep_t *ep, uint16_t *nbytesptr, const uint8_t* data ) {
+	uint16_t nak_limit = 0;
+	uint16_t nbytes = *nbytesptr;
 
-	return usb_OutTransfer(ep, nak_limit, nbytes, data);
+	*nbytesptr = 0;
+	usb_hw_lock();
+	uint8_t rcode = usb_set_address(dev, ep, &nak_limit);
+	if (!rcode)
+		rcode = usb_OutTransfer(ep, nak_limit, nbytes, data, nbytesptr);
+	usb_hw_unlock();
+	return rcode;
 }
 
 /* Control transfer. Sets address, endpoint, fills control packet */
@@ -274,7 +372,7 @@ uint8_t usb_out_transfer(usb_device_t *dev, ep_t *ep, uint16_t nbytes, const uin
 /* 00       =   success         */
 /* 01-0f    =   non-zero HRSLT  */
 
-uint8_t usb_ctrl_req(usb_device_t *dev, uint8_t bmReqType, 
+static uint8_t usb_CtrlReq(usb_device_t *dev, uint8_t bmReqType, 
 		    uint8_t bRequest, uint8_t wValLo, uint8_t wValHi, 
 		    uint16_t wInd, uint16_t nbytes, uint8_t* dataptr) {
 	//  iprintf("%s(addr=%x, len=%d, ptr=%p)\n", __FUNCTION__,
@@ -312,7 +410,7 @@ uint8_t usb_ctrl_req(usb_device_t *dev, uint8_t bmReqType,
 			rcode = usb_InTransfer( &(dev->ep0), nak_limit, &nbytes, dataptr );
 		} else { //OUT transfer
 			dev->ep0.bmSndToggle = 1;
-			rcode = usb_OutTransfer( &(dev->ep0), nak_limit, nbytes, dataptr );
+			rcode = usb_OutTransfer( &(dev->ep0), nak_limit, nbytes, dataptr, NULL );
 		}
 
 		//return error
@@ -324,6 +422,226 @@ uint8_t usb_ctrl_req(usb_device_t *dev, uint8_t bmReqType,
 	return usb_dispatchPkt( (direction) ? tokOUTHS : tokINHS, 0, nak_limit );
 }
 
+uint8_t usb_ctrl_req(usb_device_t *dev, uint8_t bmReqType, 
+		    uint8_t bRequest, uint8_t wValLo, uint8_t wValHi, 
+		    uint16_t wInd, uint16_t nbytes, uint8_t* dataptr) {
+	usb_hw_lock();
+	uint8_t rcode = usb_CtrlReq(dev, bmReqType, bRequest, wValLo, wValHi, wInd, nbytes, dataptr);
+	usb_hw_unlock();
+	return rcode;
+}
+
+#ifdef HAVE_USB_IRQ
+// Interrupt IN pipes. On every SOF the handler starts an IN transfer for
+// the next due pipe, NAKs just end it until the next frame. Received
+// reports go to a single producer/single consumer ring which
+// usb_irq_poll() empties in the main loop.
+#define USB_IRQ_PIPES  8
+#define USB_IRQ_QUEUE 16  // power of two
+
+typedef struct {
+	usb_device_t *dev;
+	ep_t *ep;
+	uint8_t interval;
+	uint8_t len;
+	msec_t last;
+	usb_irq_report_cb_t report;
+	void *ctx;
+} usb_irq_pipe_t;
+
+// data first and line aligned, the SPI DMA invalidates the lines it writes
+typedef struct {
+	uint8_t data[64];
+	uint8_t pipe;
+	uint8_t len;
+#ifdef PROFILE
+	uint32_t ticks;   // arrival
+#endif
+} __attribute__((aligned(32))) usb_irq_slot_t;
+
+static usb_irq_pipe_t irq_pipes[USB_IRQ_PIPES];
+static usb_irq_slot_t irq_queue[USB_IRQ_QUEUE];
+static volatile uint8_t irq_head = 0, irq_tail = 0;
+static uint8_t irq_next = 0;   // round robin start
+static uint8_t irq_pipe_cnt = 0;
+static uint8_t irq_got = 0;    // bytes received by the active transfer
+static usb_irq_stats_t irq_stats;
+
+static void usb_irq_start(uint8_t p) {
+	usb_irq_pipe_t *pipe = &irq_pipes[p];
+	uint16_t nak_limit;
+
+	irq_active = p;
+	irq_got = 0;
+	pipe->last = timer_get_msec();
+	usb_set_address(pipe->dev, pipe->ep, &nak_limit);
+	max3421e_write_u08( MAX3421E_HCTL,
+	      (pipe->ep->bmRcvToggle) ? MAX3421E_RCVTOG1 : MAX3421E_RCVTOG0 );
+	max3421e_write_u08( MAX3421E_HXFR, tokIN | pipe->ep->epAddr );
+}
+
+// transfer of the active pipe done, returns 1 if it continues
+static uint8_t usb_irq_done(void) {
+	usb_irq_pipe_t *pipe = &irq_pipes[irq_active];
+	usb_irq_slot_t *slot = &irq_queue[irq_head & (USB_IRQ_QUEUE-1)];
+	uint8_t rcode = max3421e_read_u08( MAX3421E_HRSL ) & 0x0f;
+	uint8_t pktsize;
+
+	if(rcode == hrNAK) {
+		// nothing to report, or the device paused within the report
+		if(irq_got) {
+			pipe->ep->bmRcvToggle = ( max3421e_read_u08( MAX3421E_HRSL ) &
+			      MAX3421E_RCVTOGRD ) ? 1 : 0;
+			irq_stats.errors++;
+		}
+		irq_stats.naks++;
+		return 0;
+	}
+
+	if(rcode || !(max3421e_read_u08( MAX3421E_HIRQ ) & MAX3421E_RCVDAVIRQ )) {
+		irq_stats.errors++;
+		return 0;
+	}
+
+	pktsize = max3421e_read_u08( MAX3421E_RCVBC );
+	max3421e_read( MAX3421E_RCVFIFO,
+	      (pktsize > pipe->len - irq_got) ? pipe->len - irq_got : pktsize,
+	      slot->data + irq_got );
+	max3421e_write_u08( MAX3421E_HIRQ, MAX3421E_RCVDAVIRQ );
+	irq_got = (pktsize > pipe->len - irq_got) ? pipe->len : irq_got + pktsize;
+
+	// a report longer than one packet continues in the same frame
+	if(pktsize == pipe->ep->maxPktSize && irq_got < pipe->len) {
+		max3421e_write_u08( MAX3421E_HXFR, tokIN | pipe->ep->epAddr );
+		return 1;
+	}
+
+	pipe->ep->bmRcvToggle = ( max3421e_read_u08( MAX3421E_HRSL ) &
+	      MAX3421E_RCVTOGRD ) ? 1 : 0;
+	slot->pipe = irq_active;
+	slot->len = irq_got;
+#ifdef PROFILE
+	slot->ticks = GetProfTicks();
+#endif
+	irq_head++;
+	irq_stats.reports++;
+	return 0;
+}
+
+static void usb_irq_handler(void) {
+	uint8_t hirq, i, p;
+
+	while((hirq = max3421e_read_u08( MAX3421E_HIRQ ) & (MAX3421E_FRAMEIRQ | MAX3421E_HXFRDNIRQ))) {
+		if(usb_lock) {
+			// the main loop has the chip, the level stays active and
+			// usb_hw_unlock() pends us again
+			irq_deferred = 1;
+			return;
+		}
+
+		if(hirq & MAX3421E_HXFRDNIRQ) {
+			max3421e_write_u08( MAX3421E_HIRQ, MAX3421E_HXFRDNIRQ );
+			if(irq_active >= 0) {
+				if(usb_irq_done()) continue;
+				irq_active = -1;
+			}
+		}
+
+		if(hirq & MAX3421E_FRAMEIRQ)
+			max3421e_write_u08( MAX3421E_HIRQ, MAX3421E_FRAMEIRQ );
+
+		if(irq_active >= 0)
+			continue;
+
+		// start the next due pipe, one transfer per frame and pipe
+		for(i = 0; i < USB_IRQ_PIPES; i++) {
+			p = (irq_next + i) % USB_IRQ_PIPES;
+			if(!irq_pipes[p].dev || !timer_check(irq_pipes[p].last, irq_pipes[p].interval))
+				continue;
+			if((uint8_t)(irq_head - irq_tail) >= USB_IRQ_QUEUE) {
+				irq_stats.dropped++;
+				irq_pipes[p].last = timer_get_msec();
+				continue;
+			}
+			irq_next = p + 1;
+			usb_irq_start(p);
+			break;
+		}
+	}
+}
+
+static void usb_irq_update(void) {
+	uint8_t i;
+
+	irq_pipe_cnt = 0;
+	for(i = 0; i < USB_IRQ_PIPES; i++)
+		if(irq_pipes[i].dev) irq_pipe_cnt++;
+	max3421e_write_u08( MAX3421E_HIEN, irq_pipe_cnt ?
+	      MAX3421E_FRAMEIE | MAX3421E_HXFRDNIE : MAX3421E_CONDETIE );
+}
+
+// serve an interrupt IN endpoint from the irq, returns the pipe or -1
+int8_t usb_irq_pipe_add(usb_device_t *dev, ep_t *ep, uint8_t interval,
+                        uint8_t len, usb_irq_report_cb_t report, void *ctx) {
+	int8_t p;
+
+	if(len > sizeof(irq_queue[0].data) || !ep->maxPktSize)
+		return -1;
+
+	usb_hw_lock();
+	for(p = 0; p < USB_IRQ_PIPES && irq_pipes[p].dev; p++);
+	if(p < USB_IRQ_PIPES) {
+		irq_pipes[p].ep = ep;
+		irq_pipes[p].interval = interval;
+		irq_pipes[p].len = len;
+		irq_pipes[p].last = timer_get_msec();
+		irq_pipes[p].report = report;
+		irq_pipes[p].ctx = ctx;
+		irq_pipes[p].dev = dev;
+		usb_irq_update();
+	} else
+		p = -1;
+	usb_hw_unlock();
+	return p;
+}
+
+// remove all pipes of a device, its queued reports are dropped
+void usb_irq_pipe_remove(usb_device_t *dev) {
+	uint8_t i, t;
+
+	usb_hw_lock();
+	for(i = 0; i < USB_IRQ_PIPES; i++) {
+		if(irq_pipes[i].dev != dev) continue;
+		irq_pipes[i].dev = NULL;
+		for(t = irq_tail; t != irq_head; t++)
+			if(irq_queue[t & (USB_IRQ_QUEUE-1)].pipe == i)
+				irq_queue[t & (USB_IRQ_QUEUE-1)].pipe = 0xff;
+	}
+	usb_irq_update();
+	usb_hw_unlock();
+}
+
+// main loop side, hands the queued reports to the drivers
+void usb_irq_poll(void) {
+	usb_irq_slot_t *slot;
+	usb_irq_pipe_t *pipe;
+
+	while(irq_tail != irq_head) {
+		slot = &irq_queue[irq_tail & (USB_IRQ_QUEUE-1)];
+		if(slot->pipe < USB_IRQ_PIPES) {
+			pipe = &irq_pipes[slot->pipe];
+			PROF_INPUT_ARRIVAL(slot->ticks);
+			pipe->report(pipe->ctx, slot->data, slot->len);
+		}
+		irq_tail++;
+	}
+}
+
+const usb_irq_stats_t *usb_irq_stats(void) {
+	return &irq_stats;
+}
+#endif
+
 void usb_poll() {
 	uint8_t rcode;
 	uint8_t tmpdata;
@@ -331,7 +649,9 @@ void usb_poll() {
 	bool lowspeed = false;
 
 	// poll underlaying hardware layer
+	usb_hw_lock();
 	tmpdata = max3421e_poll();
+	usb_hw_unlock();
 
 	/* modify USB task state if Vbus changed */
 	switch( tmpdata )  {
@@ -378,6 +698,7 @@ void usb_poll() {
 		if(dev[i].bAddress && dev[i].class && dev[i].class->poll)
 			rcode = dev[i].class->poll(dev+i);
 
+		usb_hw_lock();
 		switch( usb_task_state ) {
 		case USB_DETACHED_SUBSTATE_INITIALIZE:
 			usb_reset_state();
@@ -434,6 +755,7 @@ void usb_poll() {
 		case USB_STATE_RUNNING:
 		break;
 		}
+		usb_hw_unlock();
 	}
 }
 
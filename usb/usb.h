@@ -313,6 +313,7 @@ usb_device_t *usb_get_devices();
 // device-specific functions
 uint8_t usb_in_transfer( usb_device_t *, ep_t *ep, uint16_t *nbytesptr, uint8_t* data);
 uint8_t usb_out_transfer( usb_device_t *, ep_t *ep, uint16_t nbytes, const uint8_t* data );
+uint8_t usb_out_transfer_nak( usb_device_t *, ep_t *ep, uint16_t *nbytesptr, const uint8_t* data );
 uint8_t usb_ctrl_req( usb_device_t *, uint8_t bmReqType,
                       uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
                       uint16_t wInd, uint16_t nbytes, uint8_t* dataptr);
@@ -321,6 +322,24 @@ void usb_poll();
 void usb_SetHubPreMask(void);
 void usb_ResetHubPreMask(void);
 
+#ifdef HAVE_USB_IRQ
+// interrupt IN endpoints served by the MAX3421E irq
+typedef void (*usb_irq_report_cb_t)(void *ctx, uint8_t *data, uint8_t len);
+
+typedef struct {
+  uint32_t reports;
+  uint32_t naks;
+  uint32_t errors;
+  uint32_t dropped;  // polls skipped while the queue was full
+} usb_irq_stats_t;
+
+int8_t usb_irq_pipe_add(usb_device_t *dev, ep_t *ep, uint8_t interval,
+                        uint8_t len, usb_irq_report_cb_t report, void *ctx);
+void usb_irq_pipe_remove(usb_device_t *dev);
+void usb_irq_poll(void);
+const usb_irq_stats_t *usb_irq_stats(void);
+#endif
+
 // debug functions
 void usb_dump_device_descriptor(usb_device_descriptor_t *desc);
 void usb_dump_device_qualifier_descriptor(usb_device_qualifier_descriptor_t *desc);
@@ -33,6 +33,7 @@
 #include "state.h"
 #include "user_io.h"
 #include "debug.h"
+#include "prof.h"
 
 
 static uint8_t usb_xbox_parse_conf(usb_device_t *dev, uint8_t conf, uint16_t len) {
@@ -166,6 +167,7 @@ uint8_t usb_xbox_init(usb_device_t *dev, usb_device_descriptor_t *dev_desc) {
 
 	usb_debugf("add xbox joystick #%d", joystick_count());
 	dev->xbox_info.jindex = joystick_add();
+	virtual_joystick_mapping_init(&dev->xbox_info.jmapping, dev->vid, dev->pid);
 	dev->xbox_info.bPollEnable = true;
 	return 0;
 }
@@ -219,11 +221,12 @@ static void usb_xbox_read_report(usb_device_t *dev, uint16_t len, uint8_t *buf)
 	if(((buf[13]+128) & 0xFF) > JOYSTICK_AXIS_TRIGGER_MAX) jmap |= JOY_UP;
 	buttons |= (jmap << 16);
 
-	uint32_t vjoy = virtual_joystick_mapping(dev->vid, dev->pid, buttons);
+	uint32_t vjoy = virtual_joystick_mapping(&dev->xbox_info.jmapping, buttons);
 	// add right stick (no remap)
 	vjoy |= (jmap << 16);
 
 	uint8_t idx = dev->xbox_info.jindex;
+	PROF_INPUT_SOURCE((idx < 6) ? PROF_IN_JOY + idx : 0xff);
 	StateUsbIdSet(dev->vid, dev->pid, 12, idx);
 	StateUsbJoySet(buttons, buttons>>8, idx);
 	StateJoySet(vjoy, idx);
@@ -266,6 +269,7 @@ uint8_t usb_xbox_poll(usb_device_t *dev) {
 				usb_debugf("%s() error: %d", __FUNCTION__, rcode);
 		} else {
 			usb_xbox_read_report(dev, read, buf);
+			PROF_INPUT_END();
 		}
 		dev->xbox_info.qLastPollTime = timer_get_msec();   // poll at requested rate
 	}
@@ -24,6 +24,8 @@
 #ifndef _xboxusb_h_
 #define _xboxusb_h_
 
+#include "joymapping.h"
+
 // Data Xbox 360 taken from descriptors
 #define XBOX_INTERFACE_CLASS     0xff
 #define XBOX_INTERFACE_SUBCLASS  0x5D
@@ -56,6 +58,7 @@ typedef struct {
 	ep_t     inEp;
   ep_t     outEp;
 	uint16_t jindex;
+	joymapping_lanes_t jmapping;
 } usb_xbox_info_t;
 
 // interface to usb core
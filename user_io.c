@@ -13,6 +13,7 @@
 #include "neocd.h"
 #include "psx.h"
 #include "hdd.h"
+#include "fpga.h"
 #include "cdc_control.h"
 #include "usb.h"
 #include "debug.h"
@@ -20,6 +21,9 @@
 #include "ikbd.h"
 #include "idxfile.h"
 #include "spi.h"
+#include "spi_batch.h"
+#include "prof.h"
+#include "bufpool.h"
 #include "mist_cfg.h"
 #include "mmc.h"
 #include "tos.h"
@@ -94,6 +98,10 @@ bool scrl_status = 0;
 #define RTC_FREQ 1000   // 1 s
 static unsigned long rtc_timer;
 
+// the MAC address the FPGA has, it's gone when a core is loaded
+static uint8_t eth_mac[6];
+static char eth_mac_valid = 0;
+
 static unsigned char modifier = 0, pressed[6] = { 0,0,0,0,0,0 };
 
 static unsigned char ps2_typematic_rate = 0x80;
@@ -136,6 +144,60 @@ static uint8_t hdmi_hiclk = 0;
 static uint16_t conf_idx[CONF_TBL_MAX];
 static int conf_items = 0;
 
+// shadow copies of the values periodically sent to the core. A write is
+// suppressed if the core already has the value. The input slots are sent
+// again when the last real write is older than SHADOW_REFRESH ms, UIO_BUT_SW
+// only goes out on a change or when forced, like before.
+#define SHADOW_REFRESH    1000
+#define SHADOW_JOY        0   // UIO_JOYSTICK0..5
+#define SHADOW_JOY_EXT    6   // UIO_JOYSTICK0_EXT..5
+#define SHADOW_ASTICK     12  // UIO_ASTICK 0..5
+#define SHADOW_BUT_SW     18  // UIO_BUT_SW
+#define SHADOW_ENTRIES    19
+
+typedef struct {
+	uint8_t valid;
+	uint32_t value;
+	unsigned long timer;
+	uint32_t sent;
+	uint32_t suppressed;
+} uio_shadow_t;
+
+static uio_shadow_t uio_shadow[SHADOW_ENTRIES];
+
+static const char *uio_shadow_name(uint8_t slot) {
+	if (slot < SHADOW_JOY_EXT) return "JOY";
+	if (slot < SHADOW_ASTICK) return "JOYEXT";
+	if (slot < SHADOW_BUT_SW) return "ASTICK";
+	return "BUT_SW";
+}
+
+// returns true if the value has to be sent to the core
+static char uio_shadow_update(uint8_t slot, uint32_t value) {
+	uio_shadow_t *sh = &uio_shadow[slot];
+
+	if (sh->valid && sh->value == value && (slot == SHADOW_BUT_SW || !CheckTimer(sh->timer))) {
+		sh->suppressed++;
+		return 0;
+	}
+	sh->valid = 1;
+	sh->value = value;
+	sh->timer = GetTimer(SHADOW_REFRESH);
+	sh->sent++;
+	return 1;
+}
+
+static void uio_shadow_invalidate() {
+	for (int i=0; i<SHADOW_ENTRIES; i++) uio_shadow[i].valid = 0;
+}
+
+void user_io_shadow_dump() {
+	for (int i=0; i<SHADOW_ENTRIES; i++)
+		if (uio_shadow[i].sent)
+			iprintf("%s %d: sent %lu, suppressed %lu\n", uio_shadow_name(i), i % 6,
+			        uio_shadow[i].sent, uio_shadow[i].suppressed);
+}
+
 char user_io_osd_is_visible() {
 	return osd_is_visible;
 }
@@ -166,6 +228,7 @@ void user_io_reset() {
 	autofire_joy = -1;
 	conf_items = 0;
 	conf_idx[0] = 0;
+	uio_shadow_invalidate();
 }
 
 void user_io_init() {
@@ -252,16 +315,16 @@ void user_io_send_rtc(void) {
 	if (GetRTC((uint8_t*)&date)) {
 		//iprintf("Sending time of day %u:%02u:%02u %u.%u.%u\n",
 		//  date[T_HOUR], date[T_MIN], date[T_SEC], date[T_DAY], date[T_MONTH], 1900 + date[T_YEAR]);
-		spi_uio_cmd_cont(UIO_SET_RTC);
-		spi8(bin2bcd(date[T_SEC])); // sec
-		spi8(bin2bcd(date[T_MIN])); // min
-		spi8(bin2bcd(date[T_HOUR])); // hour
-		spi8(bin2bcd(date[T_DAY])); // date
-		spi8(bin2bcd(date[T_MONTH])); // month
-		spi8(bin2bcd(date[T_YEAR]-100)); // year
-		spi8(bin2bcd(date[T_WDAY])-1); //day 1-7 -> 0-6
-		spi8(0x40); // flag
-		DisableIO();
+		// queued, sent with the next spi_batch_flush()
+		uint8_t *p = spi_batch_uio(UIO_SET_RTC, 8, 0);
+		p[0] = bin2bcd(date[T_SEC]); // sec
+		p[1] = bin2bcd(date[T_MIN]); // min
+		p[2] = bin2bcd(date[T_HOUR]); // hour
+		p[3] = bin2bcd(date[T_DAY]); // date
+		p[4] = bin2bcd(date[T_MONTH]); // month
+		p[5] = bin2bcd(date[T_YEAR]-100); // year
+		p[6] = bin2bcd(date[T_WDAY])-1; //day 1-7 -> 0-6
+		p[7] = 0x40; // flag
 	}
 }
 
@@ -281,10 +344,14 @@ static void user_io_read_core_features() {
 	}
 	DisableIO();
 	if (core_features & FEAT_PS2REP) ps2_typematic_rate = 0x08;
+	// boards without the request line poll these cores as well
+	if (!FpgaIrqEnable(core_features & FEAT_FPGA_IRQ ? 1 : 0))
+		core_features &= ~FEAT_FPGA_IRQ;
 }
 
 void user_io_detect_core_type() {
 	core_name[0] = 0;
+	eth_mac_valid = 0;
 
 	EnableIO();
 	core_type = SPI(0xff);
@@ -490,6 +557,10 @@ void user_io_analog_joystick(unsigned char joystick, char valueX, char valueY, c
 		int16_t valueXX2 = valueX2*mist_cfg.joystick_analog_mult/128 + mist_cfg.joystick_analog_offset;
 		int16_t valueYY2 = valueY2*mist_cfg.joystick_analog_mult/128 + mist_cfg.joystick_analog_offset;
 		//iprintf("analog: x=%d, y=%d, xx=%d, yy=%d, mult=%d, offs=%d\n", valueX, valueY, valueXX, valueYY, mist_cfg.joystick_analog_mult, mist_cfg.joystick_analog_offset);
+		if (joystick < 6 && !uio_shadow_update(SHADOW_ASTICK + joystick,
+		    (valueXX & 0xff) | (valueYY & 0xff) << 8 | (valueXX2 & 0xff) << 16 | (uint32_t)(valueYY2 & 0xff) << 24))
+			return;
+		PROF_INPUT_SENT();
 		spi_uio_cmd8_cont(UIO_ASTICK, joystick);
 		spi8(valueXX);
 		spi8(valueYY);
@@ -519,7 +590,10 @@ void user_io_digital_joystick(unsigned char joystick, unsigned char map) {
 
 	// every other core else uses this
 	// (even MIST, joystick 3 and 4 were introduced later)
-	spi_uio_cmd8((joystick < 2)?(UIO_JOYSTICK0 + joystick):((UIO_JOYSTICK2 + joystick - 2)), map);
+	if (uio_shadow_update(SHADOW_JOY + joystick, map)) {
+		PROF_INPUT_SENT();
+		spi_uio_cmd8((joystick < 2)?(UIO_JOYSTICK0 + joystick):((UIO_JOYSTICK2 + joystick - 2)), map);
+	}
 }
 
 void user_io_digital_joystick_ext(unsigned char joystick, uint32_t map) {
@@ -527,7 +601,10 @@ void user_io_digital_joystick_ext(unsigned char joystick, uint32_t map) {
 	if(joystick > 5) return;
 	if(osd_is_visible && map) return;
 	//iprintf("ext j%d: %x\n", joystick, map);
-	spi_uio_cmd32(UIO_JOYSTICK0_EXT + joystick, 0x000fffff & map);
+	if (uio_shadow_update(SHADOW_JOY_EXT + joystick, 0x000fffff & map)) {
+		PROF_INPUT_SENT();
+		spi_uio_cmd32(UIO_JOYSTICK0_EXT + joystick, 0x000fffff & map);
+	}
 	if (autofire && (map & 0x30)) {
 		autofire_mask = map & 0x30;
 		autofire_map = (autofire_map & autofire_mask) | (map & ~autofire_mask);
@@ -595,11 +672,20 @@ void user_io_midi_tx(char chr) {
 void user_io_eth_send_mac(uint8_t *mac) {
 	uint8_t i;
 
+	memcpy(eth_mac, mac, sizeof(eth_mac));
+	eth_mac_valid = 1;
+
 	spi_uio_cmd_cont(UIO_ETH_MAC);
 	for(i=0;i<6;i++) spi8(*mac++);
 	DisableIO();
 }
 
+// send the mac address only if the FPGA doesn't have it yet
+void user_io_eth_update_mac(uint8_t *mac) {
+	if(!eth_mac_valid || memcmp(eth_mac, mac, sizeof(eth_mac)))
+		user_io_eth_send_mac(mac);
+}
+
 // set SD card info in FPGA (CSD, CID)
 void user_io_sd_set_config(void) {
 	unsigned char data[33];
@@ -668,17 +754,6 @@ uint8_t user_io_sd_get_status(uint32_t *lba, uint8_t *drive_index, uint8_t *blks
 	return c;
 }
 
-// read 8 bit keyboard LEDs status from FPGA
-static uint8_t user_io_kbdled_get_status(void) {
-	uint8_t c;
-
-	spi_uio_cmd_cont(UIO_GET_KBD_LED);
-	c = spi_in();
-	DisableIO();
-
-	return c;
-}
-
 // read 32 bit ethernet status word from FPGA
 uint32_t user_io_eth_get_status(void) {
 	uint32_t s;
@@ -693,18 +768,19 @@ uint32_t user_io_eth_get_status(void) {
 	return s;
 }
 
-// read ethernet frame from FPGAs ethernet tx buffer
+// read ethernet frame from FPGAs ethernet tx buffer, a NULL buffer
+// discards it
 void user_io_eth_receive_tx_frame(uint8_t *d, uint16_t len) {
 	spi_uio_cmd_cont(UIO_ETH_FRM_IN);
-	while(len--) *d++=spi_in();
+	if(!d) while(len--) spi_in();
+	else if(len) spi_read((char*)d, len);
 	DisableIO();
 }
 
 // write ethernet frame to FPGAs rx buffer
 void user_io_eth_send_rx_frame(uint8_t *s, uint16_t len) {
 	spi_uio_cmd_cont(UIO_ETH_FRM_OUT);
-	while(len--) SPI(*s++);
-	//spi_write(s, len);
+	spi_write((const char*)s, len);
 	spi8(0);     // one additional byte to allow fpga to store the previous one
 	DisableIO();
 }
@@ -755,6 +831,10 @@ static void user_io_joystick_emu() {
 static unsigned short kbd_fifo[KBD_FIFO_SIZE];
 static unsigned char kbd_fifo_r=0, kbd_fifo_w=0;
 static long kbd_timer = 0;
+#ifdef PROFILE
+static prof_input_t kbd_fifo_lat;
+static prof_input_t mouse_lat, mouse_batch_lat;
+#endif
 
 static void kbd_fifo_minimig_send(unsigned short code) {
 	spi_uio_cmd8((code&OSD)?UIO_KBD_OSD:UIO_KEYBOARD, code & 0xff);
@@ -769,6 +849,7 @@ static void kbd_fifo_enqueue(unsigned short code) {
 	// store in queue
 	kbd_fifo[kbd_fifo_w] = code;
 	kbd_fifo_w = (kbd_fifo_w + 1)&(KBD_FIFO_SIZE-1);
+	PROF_INPUT_QUEUE(&kbd_fifo_lat);
 }
 
 // send pending bytes if timer has run up
@@ -784,6 +865,7 @@ static void kbd_fifo_poll() {
 
 	kbd_fifo_minimig_send(kbd_fifo[kbd_fifo_r]);
 	kbd_fifo_r = (kbd_fifo_r + 1)&(KBD_FIFO_SIZE-1);
+	PROF_INPUT_DEQUEUE(&kbd_fifo_lat);
 }
 
 
@@ -1030,10 +1112,11 @@ void user_io_send_buttons(char force) {
 
 	if(mist_cfg.sdram64) map |= CONF_SDRAM64;
 
-	if((map != key_map) || force) {
-		key_map = map;
+	if(force) uio_shadow[SHADOW_BUT_SW].valid = 0;
+	if(uio_shadow_update(SHADOW_BUT_SW, map)) {
 		spi_uio_cmd8(UIO_BUT_SW, map);
-		iprintf("sending keymap\n");
+		if(map != key_map || force) iprintf("sending keymap\n");
+		key_map = map;
 	}
 }
 
@@ -1058,13 +1141,9 @@ static void set_kbd_led(unsigned char led, bool on)
 	}
 }
 
-static void handle_ps2_kbd_commands()
+// c and cmd are the two bytes read with UIO_KEYBOARD_IN
+static void handle_ps2_kbd_commands(unsigned char c, unsigned char cmd)
 {
-	unsigned char c, cmd;
-	spi_uio_cmd_cont(UIO_KEYBOARD_IN);
-	c = spi_in();
-	cmd = spi_in();
-	DisableIO();
 	if (c == UIO_KEYBOARD_IN) { // receiving echo of the command code shows the core supports this message
 		iprintf("PS2 keyboard cmd: %02x\n", cmd);
 		switch (ps2_kbd_state) {
@@ -1162,13 +1241,9 @@ static void handle_ps2_typematic_repeat()
 	}
 }
 
-static void handle_ps2_mouse_commands()
+// c and cmd are the two bytes read with UIO_MOUSE_IN
+static void handle_ps2_mouse_commands(unsigned char c, unsigned char cmd)
 {
-	unsigned char c, cmd;
-	spi_uio_cmd_cont(UIO_MOUSE_IN);
-	c = spi_in();
-	cmd = spi_in();
-	DisableIO();
 	if (c == UIO_MOUSE_IN) { // receiving echo of the command code shows the core supports this message
 		iprintf("PS2 mouse cmd: %02x\n", cmd);
 		switch (ps2_mouse_state) {
@@ -1232,6 +1307,204 @@ static void handle_ps2_mouse_commands()
 	}
 }
 
+// disk, CD and SD card emulation requests of the core
+void user_io_poll_disk() {
+	if((core_type == CORE_TYPE_8BIT) && (!strcmp(user_io_get_core_name(), "TGFX16") || (core_features & FEAT_PCECD))) {
+		PROF_START(t);
+		pcecd_poll();
+		PROF_END(PROF_PCECD, t);
+	}
+	if((core_type == CORE_TYPE_8BIT) && (core_features & FEAT_NEOCD)) {
+		PROF_START(t);
+		neocd_poll();
+		PROF_END(PROF_NEOCD, t);
+	}
+
+	// sd card emulation
+	if((core_type == CORE_TYPE_8BIT) ||
+	   (core_type == CORE_TYPE_MIST2) ||
+	   (core_type == CORE_TYPE_ARCHIE))
+	{
+		PROF_START(t);
+		uint32_t lba;
+		uint8_t drive_index;
+		uint8_t blksz;
+		uint8_t c = user_io_sd_get_status(&lba, &drive_index, &blksz);
+
+		// valid sd commands start with "5x" (old API), or "6x" (new API)
+		// to avoid problems with cores that don't implement this command
+		if((c & 0xf0) == 0x50 || (c & 0xf0) == 0x60) {
+
+#if 0
+			// debug: If the io controller reports and non-sdhc card, then
+			// the core should never set the sdhc flag
+			if((c & 3) && !MMC_IsSDHC() && (c & 0x04))
+				iprintf("WARNING: SDHC access to non-sdhc card\n");
+#endif
+
+			// check if core requests configuration
+			if(c & 0x08) {
+				iprintf("core requests SD config\n");
+				user_io_sd_set_config();
+			}
+
+			// check if system is trying to access a sdhc card from 
+			// a sd/mmc setup
+
+			// check if an SDHC card is inserted
+			if(MMC_IsSDHC()) {
+				static char using_sdhc = 1;
+
+				// SD request and 
+				if(c & 0x03){
+					if (!(c & 0x04)) {
+						if(using_sdhc) {
+							// we have not been using sdhc so far? 
+							// -> complain!
+							ErrorMessage(" This core does not support\n"
+								" SDHC cards. Using them may\n"
+								" lead to data corruption.\n\n"
+								" Please use an SD card <2GB!", 0);
+							using_sdhc = 0;
+						}
+					} else
+						// SDHC request from core is always ok
+						using_sdhc = 1;
+				}
+			}
+
+			// Write to file/SD Card
+			if((c & 0x03) == 0x02) {
+				// only write if the inserted card is not sdhc or
+				// if the core uses sdhc
+				if((!MMC_IsSDHC()) || (c & 0x04)) {
+					if(user_io_dip_switch1())
+						iprintf("SD WR (%d) %d/%d\n", drive_index, lba, 512<<blksz);
+
+					// if we write the sector stored in the read buffer, then
+					// invalidate the cache
+					if(buffer_lba == lba && buffer_drive_index == drive_index) {
+						buffer_lba = 0xffffffff;
+					}
+					uint8_t *wr_buf = bufpool_acquire(BUF_SD);
+					user_io_sd_ack(drive_index);
+					// Fetch sector data from FPGA ...
+					spi_uio_cmd_cont(UIO_SECTOR_WR);
+					spi_read(wr_buf, 512<<blksz);
+					DisableIO();
+
+					// ... and write it to disk
+					DISKLED_ON;
+
+#if 1
+					if(sd_image[sd_index(drive_index)].valid) {
+						if(((f_size(&sd_image[sd_index(drive_index)].file)-1) >> (9+blksz)) >= lba) {
+							IDXSeek(&sd_image[sd_index(drive_index)], (lba<<blksz));
+							IDXWrite(&sd_image[sd_index(drive_index)], wr_buf, blksz);
+						}
+					} else if (!drive_index && !umounted)
+						disk_write(fs.pdrv, wr_buf, lba, 1<<blksz);
+#else
+					hexdump(wr_buf, 32, 0);
+#endif
+
+					DISKLED_OFF;
+					bufpool_release(wr_buf);
+				}
+			}
+
+			// Read from file/SD Card
+			if((c & 0x03) == 0x01) {
+
+				if(user_io_dip_switch1())
+					iprintf("SD RD (%d) %d/%d\n", drive_index, lba, 512<<blksz);
+
+				// invalidate cache if it stores data from another drive
+				if (drive_index != buffer_drive_index)
+					buffer_lba = 0xffffffff;
+
+#ifdef HAVE_PSX
+				if ((core_features & FEAT_PSX) && drive_index == 1) {
+					psx_read_cd(drive_index, lba);
+				} else {
+#endif
+				// are we using a file as the sd card image?
+				// (C64 floppy does that ...)
+				if(buffer_lba != lba) {
+					DISKLED_ON;
+					if(sd_image[sd_index(drive_index)].valid) {
+						if(((f_size(&sd_image[sd_index(drive_index)].file)-1) >> (9+blksz)) >= lba) {
+							IDXSeek(&sd_image[sd_index(drive_index)], lba<<blksz);
+							IDXRead(&sd_image[sd_index(drive_index)], cache_buffer, blksz);
+						}
+					} else if (!drive_index && !umounted) {
+						// sector read
+						// read sector from sd card if it is not already present in
+						// the buffer
+						disk_read(fs.pdrv, cache_buffer, lba, 1<<blksz);
+					}
+					buffer_lba = lba;
+					DISKLED_OFF;
+				}
+				if(buffer_lba == lba) {
+					// hexdump(cache_buffer, 512<<blksz, 0);
+					user_io_sd_ack(drive_index);
+					// data is now stored in buffer. send it to fpga
+					spi_uio_cmd_cont(UIO_SECTOR_RD);
+					spi_write(cache_buffer, 512<<blksz);
+					DisableIO();
+
+					// the end of this transfer acknowledges the FPGA internal
+					// sd card emulation
+				}
+
+				// just load the next sector now, so it may be prefetched
+				// for the next request already
+				DISKLED_ON;
+				if(sd_image[sd_index(drive_index)].valid) {
+					// but check if it would overrun on the file
+					if(((f_size(&sd_image[sd_index(drive_index)].file)-1) >> (9+blksz)) > lba) {
+						IDXSeek(&sd_image[sd_index(drive_index)], (lba+1)<<blksz);
+						IDXRead(&sd_image[sd_index(drive_index)], cache_buffer, blksz);
+						buffer_lba = lba + 1;
+					}
+				} else {
+					// sector read
+					// read sector from sd card if it is not already present in
+					// the buffer
+					disk_read(fs.pdrv, cache_buffer, lba+1, 1<<blksz);
+					buffer_lba = lba+1;
+				}
+				buffer_drive_index = drive_index;
+				DISKLED_OFF;
+#ifdef HAVE_PSX
+				}
+#endif
+			}
+		}
+		PROF_END(PROF_SD, t);
+	}
+
+	if(core_features & FEAT_IDE_MASK)
+	{
+		unsigned char  c1 = 0;
+
+		if(FpgaRequestPending(FPGA_REQ_IDE)) {
+			EnableFpga();
+			c1 = SPI(0); // cmd request
+			SPI(0);
+			SPI(0);
+			SPI(0);
+			SPI(0);
+			SPI(0);
+			DisableFpga();
+			if(c1 & (CMD_IDECMD | CMD_IDEDAT))
+				FpgaRequestAgain(FPGA_REQ_IDE);
+		}
+		HandleHDD(c1, 0, 1);
+	}
+}
+
 void user_io_poll() {
 
 	// check of core has changed from a good one to a not supported on
@@ -1284,33 +1557,47 @@ void user_io_poll() {
 		USART_Poll();
 
 		unsigned char c = 0;
+		// data for the USB/CDC redirection is collected while the core is
+		// selected and handed over in one piece afterwards. A full span ends
+		// the burst, the core keeps the rest for the next poll.
+		char span[64];
+		uint8_t n = 0;
 
 		// check for incoming serial data. this is directly forwarded to the
 		// arm rs232 and mixes with debug output. Useful for debugging only of
 		// e.g. the diagnostic cartridge    
 		if(!pl2303_is_blocked()) {
+			// if a serial/usb adapter is connected it has precesence over
+			// any other sink. Only as much as its buffer takes is read.
+			uint8_t adapter = pl2303_present();
+			uint8_t max = sizeof(span);
+			if(adapter && (pl2303_tx_space() < max))
+				max = pl2303_tx_space();
+
 			if (core_type == CORE_TYPE_MIST)
 				spi_uio_cmd_cont(UIO_SERIAL_IN);
 			else
 				spi_uio_cmd_cont(UIO_SIO_IN);
 
-			while(spi_in() && !pl2303_is_blocked()) {
+			while((n < max) && spi_in()) {
 				c = spi_in();
 
-				// if a serial/usb adapter is connected it has precesence over
-				// any other sink
-				if(pl2303_present()) 
-					pl2303_tx_byte(c);
+				if(adapter)
+					span[n++] = c;
 				else {
 					if(c != 0xff)
 						putchar(c);
 
 					// forward to USB if redirection via USB/CDC enabled
 					if(redirect == CDC_REDIRECT_RS232)
-						cdc_control_tx(c);
+						span[n++] = c;
 				}
 			}
 			DisableIO();
+			if(n) {
+				if(adapter) pl2303_tx((uint8_t*)span, n);
+				else        cdc_control_write(span, n);
+			}
 		}
 
 		// check for incoming parallel/midi data
@@ -1318,51 +1605,63 @@ void user_io_poll() {
 			spi_uio_cmd_cont((redirect == CDC_REDIRECT_PARALLEL)?UIO_PARALLEL_IN:UIO_MIDI_IN);
 			// character 0xff is returned if FPGA isn't configured
 			c = 0;
-			while(spi_in() && (c!= 0xff)) {
+			n = 0;
+			while((n < sizeof(span)) && spi_in() && (c!= 0xff)) {
 				c = spi_in();
-				cdc_control_tx(c);
+				span[n++] = c;
 			}
 			DisableIO();
-			// always flush when doing midi to reduce latencies
-			if(redirect == CDC_REDIRECT_MIDI)
-				cdc_control_flush();
+			// in MIDI mode complete messages go out right away
+			if(n) cdc_control_write(span, n);
 		}
 	}
 
 	// poll db9 joysticks
+	static joymapping_lanes_t db9_mapping[2] = { { 0x00db, 0x0000 }, { 0x00db, 0x0001 } };
 	uint16_t joy_state = 0, joy_map = 0;
 
 	if(GetDB9(0, &joy_state)) {
 
-		joy_map = virtual_joystick_mapping(0x00db, 0x0000, joy_state);
+		joy_map = virtual_joystick_mapping(&db9_mapping[0], joy_state);
 
 		uint8_t idx = joystick_renumber(0);
 		uint8_t id = mist_cfg.joystick_db9_fixed_index ? idx : joystick_count();
+		PROF_INPUT_ARRIVAL(GetProfTicks());
+		PROF_INPUT_SOURCE((id < 6) ? PROF_IN_JOY + id : 0xff);
 		if (!user_io_osd_is_visible()) user_io_joystick(idx, joy_map);
 		StateUsbIdSet(0x00db, 0x0000, 2, id);
 		StateJoySet(joy_map, id); // send to OSD
 		StateJoySetExtra(joy_map >> 8, id); // send to OSD
 		StateUsbJoySet(joy_state, joy_state >> 8, id);
 		virtual_joystick_keyboard(joy_map);
+		PROF_INPUT_END();
 	}
 	if(GetDB9(1, &joy_state)) {
 
-		joy_map = virtual_joystick_mapping(0x00db, 0x0001, joy_state);
+		joy_map = virtual_joystick_mapping(&db9_mapping[1], joy_state);
 
 		uint8_t idx = joystick_renumber(1);
 		uint8_t id = mist_cfg.joystick_db9_fixed_index ? idx : joystick_count() + 1;
+		PROF_INPUT_ARRIVAL(GetProfTicks());
+		PROF_INPUT_SOURCE((id < 6) ? PROF_IN_JOY + id : 0xff);
 		if (!user_io_osd_is_visible()) user_io_joystick(idx, joy_map);
 		StateUsbIdSet(0x00db, 0x0001, 2, id);
 		StateJoySet(joy_map, id); // send to OSD
 		StateJoySetExtra(joy_map >> 8, id); // send to OSD
 		StateUsbJoySet(joy_state, joy_state >> 8, id);
 		virtual_joystick_keyboard(joy_map);
+		PROF_INPUT_END();
 	}
 
 	if (autofire && autofire_joy >= 0 && autofire_joy <= 5 && CheckTimer(autofire_timer)) {
+		uint8_t *p = spi_batch_uio(UIO_JOYSTICK0_EXT + autofire_joy, 4, 0);
 		autofire_map ^= autofire_mask;
 		//iprintf("06x\n", autofire_map);
-		spi_uio_cmd32(UIO_JOYSTICK0_EXT + autofire_joy, 0x000fffff & autofire_map);
+		p[0] = autofire_map;
+		p[1] = autofire_map >> 8;
+		p[2] = (autofire_map >> 16) & 0x0f;
+		// keep the shadow in sync with what the core sees
+		uio_shadow_update(SHADOW_JOY_EXT + autofire_joy, 0x000fffff & autofire_map);
 		autofire_timer = GetTimer(autofire*50);
 	}
 
@@ -1437,21 +1736,21 @@ void user_io_poll() {
 						mouse_pos[idx][Z] = 0;
 					}
 
+					uint8_t *p;
 					if (!idx) {
 						// send the first mouse only with the old message
-						spi_uio_cmd_cont(UIO_MOUSE);
-						spi8(x);
-						spi8(y);
-						spi8(mouse_flags[idx] & 0x07);
-						DisableIO();
+						p = spi_batch_uio(UIO_MOUSE, 3, 0);
+						p[0] = x;
+						p[1] = y;
+						p[2] = mouse_flags[idx] & 0x07;
 					}
 
-					spi_uio_cmd_cont(UIO_MOUSE0_EXT + idx);
-					spi8(x);
-					spi8(y);
-					spi8(mouse_flags[idx] & 0x07);
-					spi8(z);
-					DisableIO();
+					p = spi_batch_uio(UIO_MOUSE0_EXT + idx, 4, 0);
+					p[0] = x;
+					p[1] = y;
+					p[2] = mouse_flags[idx] & 0x07;
+					p[3] = z;
+					PROF_INPUT_MOVE(&mouse_batch_lat, &mouse_lat);
 
 					// reset flags
 					mouse_flags[idx] = 0;
@@ -1498,172 +1797,6 @@ void user_io_poll() {
 		DisableIO();
 	}
 
-	if((core_type == CORE_TYPE_8BIT) && (!strcmp(user_io_get_core_name(), "TGFX16") || (core_features & FEAT_PCECD)))
-		pcecd_poll();
-	if((core_type == CORE_TYPE_8BIT) && (core_features & FEAT_NEOCD))
-		neocd_poll();
-
-	// sd card emulation
-	if((core_type == CORE_TYPE_8BIT) ||
-	   (core_type == CORE_TYPE_MIST2) ||
-	   (core_type == CORE_TYPE_ARCHIE))
-	{
-		uint32_t lba;
-		uint8_t drive_index;
-		uint8_t blksz;
-		uint8_t c = user_io_sd_get_status(&lba, &drive_index, &blksz);
-
-		// valid sd commands start with "5x" (old API), or "6x" (new API)
-		// to avoid problems with cores that don't implement this command
-		if((c & 0xf0) == 0x50 || (c & 0xf0) == 0x60) {
-
-#if 0
-			// debug: If the io controller reports and non-sdhc card, then
-			// the core should never set the sdhc flag
-			if((c & 3) && !MMC_IsSDHC() && (c & 0x04))
-				iprintf("WARNING: SDHC access to non-sdhc card\n");
-#endif
-
-			// check if core requests configuration
-			if(c & 0x08) {
-				iprintf("core requests SD config\n");
-				user_io_sd_set_config();
-			}
-
-			// check if system is trying to access a sdhc card from 
-			// a sd/mmc setup
-
-			// check if an SDHC card is inserted
-			if(MMC_IsSDHC()) {
-				static char using_sdhc = 1;
-
-				// SD request and 
-				if(c & 0x03){
-					if (!(c & 0x04)) {
-						if(using_sdhc) {
-							// we have not been using sdhc so far? 
-							// -> complain!
-							ErrorMessage(" This core does not support\n"
-								" SDHC cards. Using them may\n"
-								" lead to data corruption.\n\n"
-								" Please use an SD card <2GB!", 0);
-							using_sdhc = 0;
-						}
-					} else
-						// SDHC request from core is always ok
-						using_sdhc = 1;
-				}
-			}
-
-			// Write to file/SD Card
-			if((c & 0x03) == 0x02) {
-				// only write if the inserted card is not sdhc or
-				// if the core uses sdhc
-				if((!MMC_IsSDHC()) || (c & 0x04)) {
-					if(user_io_dip_switch1())
-						iprintf("SD WR (%d) %d/%d\n", drive_index, lba, 512<<blksz);
-
-					// if we write the sector stored in the read buffer, then
-					// invalidate the cache
-					if(buffer_lba == lba && buffer_drive_index == drive_index) {
-						buffer_lba = 0xffffffff;
-					}
-					user_io_sd_ack(drive_index);
-					// Fetch sector data from FPGA ...
-					spi_uio_cmd_cont(UIO_SECTOR_WR);
-					spi_read(sector_buffer, 512<<blksz);
-					DisableIO();
-
-					// ... and write it to disk
-					DISKLED_ON;
-
-#if 1
-					if(sd_image[sd_index(drive_index)].valid) {
-						if(((f_size(&sd_image[sd_index(drive_index)].file)-1) >> (9+blksz)) >= lba) {
-							IDXSeek(&sd_image[sd_index(drive_index)], (lba<<blksz));
-							IDXWrite(&sd_image[sd_index(drive_index)], sector_buffer, blksz);
-						}
-					} else if (!drive_index && !umounted)
-						disk_write(fs.pdrv, sector_buffer, lba, 1<<blksz);
-#else
-					hexdump(sector_buffer, 32, 0);
-#endif
-
-					DISKLED_OFF;
-				}
-			}
-
-			// Read from file/SD Card
-			if((c & 0x03) == 0x01) {
-
-				if(user_io_dip_switch1())
-					iprintf("SD RD (%d) %d/%d\n", drive_index, lba, 512<<blksz);
-
-				// invalidate cache if it stores data from another drive
-				if (drive_index != buffer_drive_index)
-					buffer_lba = 0xffffffff;
-
-#ifdef HAVE_PSX
-				if ((core_features & FEAT_PSX) && drive_index == 1) {
-					psx_read_cd(drive_index, lba);
-				} else {
-#endif
-				// are we using a file as the sd card image?
-				// (C64 floppy does that ...)
-				if(buffer_lba != lba) {
-					DISKLED_ON;
-					if(sd_image[sd_index(drive_index)].valid) {
-						if(((f_size(&sd_image[sd_index(drive_index)].file)-1) >> (9+blksz)) >= lba) {
-							IDXSeek(&sd_image[sd_index(drive_index)], lba<<blksz);
-							IDXRead(&sd_image[sd_index(drive_index)], cache_buffer, blksz);
-						}
-					} else if (!drive_index && !umounted) {
-						// sector read
-						// read sector from sd card if it is not already present in
-						// the buffer
-						disk_read(fs.pdrv, cache_buffer, lba, 1<<blksz);
-					}
-					buffer_lba = lba;
-					DISKLED_OFF;
-				}
-				if(buffer_lba == lba) {
-					// hexdump(cache_buffer, 512<<blksz, 0);
-					user_io_sd_ack(drive_index);
-					// data is now stored in buffer. send it to fpga
-					spi_uio_cmd_cont(UIO_SECTOR_RD);
-					spi_write(cache_buffer, 512<<blksz);
-					DisableIO();
-
-					// the end of this transfer acknowledges the FPGA internal
-					// sd card emulation
-				}
-
-				// just load the next sector now, so it may be prefetched
-				// for the next request already
-				DISKLED_ON;
-				if(sd_image[sd_index(drive_index)].valid) {
-					// but check if it would overrun on the file
-					if(((f_size(&sd_image[sd_index(drive_index)].file)-1) >> (9+blksz)) > lba) {
-						IDXSeek(&sd_image[sd_index(drive_index)], (lba+1)<<blksz);
-						IDXRead(&sd_image[sd_index(drive_index)], cache_buffer, blksz);
-						buffer_lba = lba + 1;
-					}
-				} else {
-					// sector read
-					// read sector from sd card if it is not already present in
-					// the buffer
-					disk_read(fs.pdrv, cache_buffer, lba+1, 1<<blksz);
-					buffer_lba = lba+1;
-				}
-				buffer_drive_index = drive_index;
-				DISKLED_OFF;
-#ifdef HAVE_PSX
-				}
-#endif
-			}
-		}
-	}
-
 	if((core_type == CORE_TYPE_8BIT) ||
 	   (core_type == CORE_TYPE_MIST2)) {
 
@@ -1727,19 +1860,11 @@ void user_io_poll() {
 						iprintf("PS2 MOUSE(%d): %x %d %d %d\n", idx, ps2_mouse[0], ps2_mouse[1], ps2_mouse[2], ps2_mouse[3]);
 
 					// old message sends the movements for all mice
-					spi_uio_cmd_cont(UIO_MOUSE);
-					spi8(ps2_mouse[0]);
-					spi8(ps2_mouse[1]);
-					spi8(ps2_mouse[2]);
-					DisableIO();
+					memcpy(spi_batch_uio(UIO_MOUSE, 3, 0), ps2_mouse, 3);
 
 					// new message with Intellimouse PS2 message
-					spi_uio_cmd_cont(UIO_MOUSE0_EXT+idx);
-					spi8(ps2_mouse[0]);
-					spi8(ps2_mouse[1]);
-					spi8(ps2_mouse[2]);
-					spi8(ps2_mouse[3]);
-					DisableIO();
+					memcpy(spi_batch_uio(UIO_MOUSE0_EXT+idx, 4, 0), ps2_mouse, 4);
+					PROF_INPUT_MOVE(&mouse_batch_lat, &mouse_lat);
 
 					// reset counters
 					mouse_flags[idx] = 0;
@@ -1750,30 +1875,11 @@ void user_io_poll() {
 	}
 
 	if(core_type == CORE_TYPE_8BIT)
-	{
 		handle_ps2_typematic_repeat();
-		handle_ps2_kbd_commands();
-		handle_ps2_mouse_commands();
-	}
 
 	if(core_type == CORE_TYPE_ARCHIE) 
 		archie_poll();
 
-	if(core_features & FEAT_IDE_MASK)
-	{
-		unsigned char  c1;
-
-		EnableFpga();
-		c1 = SPI(0); // cmd request
-		SPI(0);
-		SPI(0);
-		SPI(0);
-		SPI(0);
-		SPI(0);
-		DisableFpga();
-		HandleHDD(c1, 0, 1);
-	}
-
 	if((core_type == CORE_TYPE_MINIMIG2) ||
 	   (core_type == CORE_TYPE_MIST2) ||
 	   (core_type == CORE_TYPE_ARCHIE) ||
@@ -1786,10 +1892,30 @@ void user_io_poll() {
 		}
 	}
 
-	if(CheckTimer(led_timer))
+	// the periodic transfers queued in this pass go out together with
+	// the status reads below
+	unsigned char ps2_kbd_cmd[2], ps2_mouse_cmd[2];
+	uint8_t leds = 0;
+	char led_poll = CheckTimer(led_timer);
+
+	if(core_type == CORE_TYPE_8BIT) {
+		spi_batch_uio(UIO_KEYBOARD_IN, 2, ps2_kbd_cmd);
+		spi_batch_uio(UIO_MOUSE_IN, 2, ps2_mouse_cmd);
+	}
+	if(led_poll)
+		spi_batch_uio(UIO_GET_KBD_LED, 1, &leds);
+	spi_batch_flush();
+	PROF_INPUT_DEQUEUE(&mouse_batch_lat);
+
+	if(core_type == CORE_TYPE_8BIT)
+	{
+		handle_ps2_kbd_commands(ps2_kbd_cmd[0], ps2_kbd_cmd[1]);
+		handle_ps2_mouse_commands(ps2_mouse_cmd[0], ps2_mouse_cmd[1]);
+	}
+
+	if(led_poll)
 	{
 		led_timer = GetTimer(LED_FREQ);
-		uint8_t leds = user_io_kbdled_get_status();
 		if((leds & KBD_LED_FLAG_MASK) != KBD_LED_FLAG_STATUS) leds = 0;
 
 		if((keyboard_leds & KBD_LED_CAPS_MASK) != (leds & KBD_LED_CAPS_MASK))
@@ -1881,9 +2007,10 @@ static void send_keycode(unsigned short code) {
 		if(code & BREAK) code = (code & 0xff) | 0x80;
 
 		// send immediately if possible
-		if(CheckTimer(kbd_timer) &&(kbd_fifo_w == kbd_fifo_r) )
+		if(CheckTimer(kbd_timer) &&(kbd_fifo_w == kbd_fifo_r) ) {
+			PROF_INPUT_SENT();
 			kbd_fifo_minimig_send(code);
-		else
+		} else
 			kbd_fifo_enqueue(code);
 	}
 
@@ -1895,6 +2022,7 @@ static void send_keycode(unsigned short code) {
 	if((core_type == CORE_TYPE_8BIT) ||
 	   (core_type == CORE_TYPE_MIST2)) {
 		// send ps2 keycodes for those cores that prefer ps2
+		PROF_INPUT_SENT();
 		spi_uio_cmd_cont(UIO_KEYBOARD);
 
 		// "pause" has a complex code 
@@ -1950,6 +2078,8 @@ void user_io_mouse(unsigned char idx, unsigned char b, char x, char y, char z) {
 		mouse_pos[idx][Y] += y;
 		mouse_pos[idx][Z] += z;
 		mouse_flags[idx] |= 0x80 | (b&7);
+		// sent at a fixed rate by user_io_poll()
+		PROF_INPUT_QUEUE(&mouse_lat);
 	}
 
 	// 8 bit core expects ps2 like data
@@ -1959,6 +2089,7 @@ void user_io_mouse(unsigned char idx, unsigned char b, char x, char y, char z) {
 		mouse_pos[idx][Y] -= y;  // ps2 y axis is reversed over usb
 		mouse_pos[idx][Z] += z;
 		mouse_flags[idx] |= 0x08 | (b&7);
+		PROF_INPUT_QUEUE(&mouse_lat);
 	}
 
 	// send mouse data as mist expects it
@@ -106,6 +106,11 @@
 #define FEAT_BIGOSD     0x2000 // 16 line tall OSD
 #define FEAT_HDMI       0x4000 // HDMI output
 #define FEAT_PSX        0x8000 // PSX-specific CD image handling
+#define FEAT_DIO_GAP    0x00FF0000 // minimum gap between data_io upload bytes (in 100ns units)
+#define FEAT_DIO_GAP_SHIFT 16
+#define FEAT_DIO_DMA    0x01000000 // data_io uploads may use DMA, paced by FEAT_DIO_GAP
+#define FEAT_FPGA_IRQ   0x02000000 // core signals IDE/FDD requests on the FPGA_IRQ line (QSPI IO3, idle outside QSPI transfers)
+#define FEAT_IDE_QSPI   0x04000000 // IDE sector data on QSPI in both directions
 
 #define JOY_RIGHT       0x01
 #define JOY_LEFT        0x02
@@ -208,8 +213,10 @@ char minimig_v1();
 char minimig_v2();
 char user_io_is_8bit_with_config_string();
 void user_io_poll();
+void user_io_poll_disk();
 void user_io_osd_key_enable(char);
 void user_io_serial_tx(char *, uint16_t);
+void user_io_midi_tx(char);
 char *user_io_8bit_get_string(unsigned char);
 unsigned long long user_io_8bit_set_status(unsigned long long, unsigned long long);
 void user_io_sd_set_config(void);
@@ -226,6 +233,7 @@ void user_io_sd_ack(char drive_index);
 // io controllers interface for FPGA ethernet emulation using usb ethernet
 // devices attached to the io controller (ethernec emulation)
 void user_io_eth_send_mac(uint8_t *);
+void user_io_eth_update_mac(uint8_t *);
 uint32_t user_io_eth_get_status(void);
 void user_io_eth_send_rx_frame(uint8_t *, uint16_t);
 void user_io_eth_receive_tx_frame(uint8_t *, uint16_t);
@@ -241,6 +249,7 @@ void user_io_digital_joystick_ext(unsigned char, uint32_t);
 void user_io_analog_joystick(unsigned char, char, char, char, char);
 char user_io_osd_is_visible();
 void user_io_send_buttons(char);
+void user_io_shadow_dump();
 char user_io_i2c_write(unsigned char addr, unsigned char subaddr, unsigned char data);
 char user_io_i2c_read(unsigned char addr, unsigned char subaddr, unsigned char *data);
 
@@ -0,0 +1,427 @@
+/*
+ * xfer.c
+ *
+ * File transfer over the USB CDC port, see xfer.h for the protocol. The
+ * frames are parsed as the packets come in and the payload of the DATA
+ * frame the card is waiting for goes straight into a pool buffer at its
+ * position modulo the buffer size. The buffer is written through FatFs
+ * whenever it is full, so the card sees aligned multi-sector writes of
+ * its size. The clusters of a file of known size are allocated
+ * at once when it is opened.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xfer.h"
+#include "FatFs/ff.h"
+#include "bufpool.h"
+#include "sched.h"
+#include "cdc_control.h"
+#include "debug.h"
+
+#ifdef XFER_TEST
+uint32_t xfer_test_now(void);
+void iprintf(const char *format, ...);
+#define xfer_now() xfer_test_now()
+#else
+#include "hardware.h"
+#define xfer_now() ((uint32_t)GetRTTC())
+#endif
+
+// The buffer is held from OPEN to CLOSE, across the main loop polls. The
+// shared sector_buffer can't be used for that, the disks of the core
+// write it in between. Without a pool (SAM7S) a buffer of one frame is
+// written after each frame instead.
+#if BUF_POOL_BLOCKS
+#define XFER_BUF_SIZE SECTOR_BUFFER_SIZE
+#else
+#define XFER_BUF_SIZE XFER_MAX_PAYLOAD
+static uint8_t xfer_buf[XFER_BUF_SIZE];
+#endif
+
+#if XFER_BUF_SIZE % XFER_MAX_PAYLOAD
+#error "XFER_MAX_PAYLOAD must divide XFER_BUF_SIZE"
+#endif
+
+static uint8_t active = 0;
+static uint32_t last_rx;
+
+// frame parser
+static union {
+  xfer_hdr_t hdr;
+  uint8_t b[sizeof(xfer_hdr_t)];
+} rx;
+static uint8_t hdr_fill = 0;
+static uint16_t pay_fill;
+static uint8_t *pay_dst;     // where the payload goes, NULL to drop it
+static uint32_t frame_crc;   // as sent
+static uint32_t crc;         // running
+
+static uint8_t cmd_buf[XFER_CMD_MAX+1];
+
+// the file being written
+static FIL file;
+static uint8_t file_open = 0;
+static uint8_t file_err;
+static uint8_t *buf;         // file data at offset % XFER_BUF_SIZE
+static uint32_t pos;         // next expected offset
+static uint32_t flushed;     // data up to here went to the card
+static uint8_t nak_sent;     // only one XFER_ERR_SEQ per gap
+
+// result of the last CLOSE, for a retry after a lost reply
+static uint8_t last_valid = 0;
+static uint32_t last_size, last_crc;
+
+static const uint32_t crc_table[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+// CRC32 (polynomial 0xEDB88320) with a nibble table, start with ~0 and
+// invert the result
+static uint32_t crc32_update(uint32_t c, const uint8_t *p, uint32_t len) {
+  while(len--) {
+    c ^= *p++;
+    c = (c >> 4) ^ crc_table[c & 15];
+    c = (c >> 4) ^ crc_table[c & 15];
+  }
+  return c;
+}
+
+static void xfer_reply(uint8_t cmd, uint8_t status, uint32_t offset, const void *data, uint16_t len) {
+  xfer_hdr_t hdr = { XFER_MAGIC, cmd | XFER_REPLY, status, len, offset, 0 };
+
+  hdr.crc = ~crc32_update(crc32_update(~0, (uint8_t*)&hdr, sizeof(hdr)), data, len);
+  cdc_control_write((char*)&hdr, sizeof(hdr));
+  if(len) cdc_control_write(data, len);
+  cdc_control_flush();
+}
+
+static uint8_t *xfer_acquire(void) {
+#if BUF_POOL_BLOCKS
+  return bufpool_try_acquire(BUF_XFER);
+#else
+  return xfer_buf;
+#endif
+}
+
+static void xfer_release(void) {
+#if BUF_POOL_BLOCKS
+  bufpool_release(buf);
+#endif
+}
+
+// write what's in the buffer, it never spans a buffer boundary
+static void xfer_flush(void) {
+  uint32_t len = pos - flushed;
+  UINT bw;
+
+  if(!len || file_err) return;
+  if(f_write(&file, buf + (flushed % XFER_BUF_SIZE), len, &bw) != FR_OK || bw != len) {
+    xfer_debugf("write at %lu failed", flushed);
+    file_err = 1;
+  }
+  flushed = pos;
+  sched_yield();
+}
+
+// end the file at the data received so far, an aborted transfer can be
+// resumed from there
+static void xfer_close_file(void) {
+  if(!file_open) return;
+
+  xfer_flush();
+  if(!file_err && f_truncate(&file) != FR_OK) file_err = 1;
+  if(f_close(&file) != FR_OK) file_err = 1;
+  xfer_release();
+  file_open = 0;
+}
+
+static void xfer_open(uint32_t size) {
+  uint8_t flags = cmd_buf[0];
+  char *path = (char*)cmd_buf + 1;
+  FRESULT res;
+
+  xfer_close_file();
+  last_valid = 0;
+
+  // all pool blocks in use, the host may retry later
+  if(!(buf = xfer_acquire())) {
+    xfer_reply(XFER_OPEN, XFER_ERR_STATE, 0, 0, 0);
+    return;
+  }
+
+  res = f_open(&file, path, FA_READ | FA_WRITE | ((flags & XFER_RESUME) ? FA_OPEN_ALWAYS : FA_CREATE_ALWAYS));
+  if(res == FR_OK) {
+    if(flags & XFER_RESUME)
+      res = f_lseek(&file, f_size(&file));
+    // seeking beyond the end allocates the cluster chain in one go
+    else if(size && (res = f_lseek(&file, size)) == FR_OK)
+      res = f_lseek(&file, 0);
+    if(res != FR_OK) f_close(&file);
+  }
+
+  if(res != FR_OK) {
+    xfer_debugf("open %s failed: %d", path, res);
+    xfer_release();
+    xfer_reply(XFER_OPEN, XFER_ERR_FS, res, 0, 0);
+    return;
+  }
+
+  file_open = 1;
+  file_err = 0;
+  nak_sent = 0;
+  pos = flushed = f_tell(&file);
+  xfer_reply(XFER_OPEN, XFER_OK, pos, 0, 0);
+}
+
+static void xfer_close(uint32_t size) {
+  uint32_t c = ~0;
+  UINT br;
+
+  if(!file_open) {
+    if(last_valid && size == last_size)
+      xfer_reply(XFER_CLOSE, XFER_OK, last_size, &last_crc, sizeof(last_crc));
+    else
+      xfer_reply(XFER_CLOSE, XFER_ERR_STATE, 0, 0, 0);
+    return;
+  }
+
+  if(size != pos) {
+    xfer_reply(XFER_CLOSE, XFER_ERR_ARG, pos, 0, 0);
+    return;
+  }
+
+  xfer_flush();
+  if(!file_err && f_truncate(&file) != FR_OK) file_err = 1;
+
+  // read back what is on the card
+  if(!file_err && f_lseek(&file, 0) == FR_OK) {
+    do {
+      if(f_read(&file, buf, XFER_BUF_SIZE, &br) != FR_OK) {
+        file_err = 1;
+        break;
+      }
+      c = crc32_update(c, buf, br);
+      sched_yield();
+    } while(br == XFER_BUF_SIZE);
+  } else
+    file_err = 1;
+
+  if(f_close(&file) != FR_OK) file_err = 1;
+  xfer_release();
+  file_open = 0;
+
+  if(file_err) {
+    xfer_reply(XFER_CLOSE, XFER_ERR_FS, 0, 0, 0);
+    return;
+  }
+
+  last_valid = 1;
+  last_size = size;
+  last_crc = ~c;
+  xfer_reply(XFER_CLOSE, XFER_OK, last_size, &last_crc, sizeof(last_crc));
+}
+
+static void xfer_data(uint8_t ok) {
+  uint32_t offset = rx.hdr.offset;
+
+  if(!file_open) {
+    xfer_reply(XFER_DATA, XFER_ERR_STATE, 0, 0, 0);
+    return;
+  }
+  if(file_err) {
+    xfer_reply(XFER_DATA, XFER_ERR_FS, pos, 0, 0);
+    return;
+  }
+
+  // a repeated frame, the host missed the reply
+  if(ok && offset < pos) {
+    xfer_reply(XFER_DATA, XFER_OK, pos, 0, 0);
+    return;
+  }
+
+  // damaged or a frame is missing, the host has to go back
+  if(!ok || !pay_dst) {
+    if(!nak_sent) xfer_reply(XFER_DATA, XFER_ERR_SEQ, pos, 0, 0);
+    nak_sent = 1;
+    return;
+  }
+
+  pos += rx.hdr.len;
+  nak_sent = 0;
+  xfer_reply(XFER_DATA, XFER_OK, pos, 0, 0);
+
+  // the card write overlaps with the next frames on the USB
+  if(!(pos % XFER_BUF_SIZE)) xfer_flush();
+}
+
+static void xfer_list(void) {
+  DIR dir;
+  FILINFO fno;
+  uint16_t len = 0;
+
+  if(f_opendir(&dir, (char*)cmd_buf) != FR_OK) {
+    xfer_reply(XFER_LIST, XFER_ERR_FS, 0, 0, 0);
+    return;
+  }
+
+  // the request is done with, the entries are collected in its place
+  while(f_readdir(&dir, &fno) == FR_OK && fno.fname[0]) {
+    uint16_t n = strlen(fno.fname) + 1;
+    uint32_t size = fno.fsize;
+
+    if(len + 5 + n > XFER_CMD_MAX) {
+      xfer_reply(XFER_LIST, XFER_MORE, 0, cmd_buf, len);
+      len = 0;
+    }
+
+    memcpy(cmd_buf + len, &size, 4);
+    cmd_buf[len + 4] = fno.fattrib;
+    memcpy(cmd_buf + len + 5, fno.fname, n);
+    len += 5 + n;
+  }
+  f_closedir(&dir);
+
+  xfer_reply(XFER_LIST, XFER_OK, 0, cmd_buf, len);
+}
+
+static void xfer_frame(void) {
+  uint8_t ok = (~crc == frame_crc);
+  uint8_t cmd = rx.hdr.cmd;
+  FRESULT res;
+
+  hdr_fill = 0;
+
+  if(cmd == XFER_DATA) {
+    xfer_data(ok);
+    return;
+  }
+
+  if(!ok) {
+    xfer_reply(cmd, XFER_ERR_CRC, 0, 0, 0);
+    return;
+  }
+
+  cmd_buf[rx.hdr.len] = 0;  // terminate paths
+
+  switch(cmd) {
+  case XFER_HELLO: {
+    uint8_t info[3] = { XFER_MAX_PAYLOAD & 0xff, XFER_MAX_PAYLOAD >> 8, XFER_WINDOW };
+    xfer_reply(XFER_HELLO, XFER_OK, XFER_VERSION, info, sizeof(info));
+    break;
+  }
+
+  case XFER_OPEN:
+    if(!rx.hdr.len) xfer_reply(cmd, XFER_ERR_ARG, 0, 0, 0);
+    else xfer_open(rx.hdr.offset);
+    break;
+
+  case XFER_CLOSE:
+    xfer_close(rx.hdr.offset);
+    break;
+
+  case XFER_LIST:
+    xfer_list();
+    break;
+
+  case XFER_DELETE:
+  case XFER_MKDIR:
+    if(file_open) {
+      xfer_reply(cmd, XFER_ERR_STATE, 0, 0, 0);
+      break;
+    }
+    res = (cmd == XFER_DELETE) ? f_unlink((char*)cmd_buf) : f_mkdir((char*)cmd_buf);
+    if(cmd == XFER_MKDIR && res == FR_EXIST) res = FR_OK;
+    xfer_reply(cmd, res ? XFER_ERR_FS : XFER_OK, res, 0, 0);
+    break;
+
+  case XFER_EXIT:
+    xfer_close_file();
+    xfer_reply(cmd, XFER_OK, 0, 0, 0);
+    active = 0;
+    break;
+
+  default:
+    xfer_reply(cmd, XFER_ERR_ARG, 0, 0, 0);
+    break;
+  }
+}
+
+static void xfer_header(void) {
+  uint16_t len = rx.hdr.len;
+
+  if(len > ((rx.hdr.cmd == XFER_DATA) ? XFER_MAX_PAYLOAD : XFER_CMD_MAX)) {
+    // not a header after all, look for the next one
+    hdr_fill = 0;
+    return;
+  }
+
+  frame_crc = rx.hdr.crc;
+  rx.hdr.crc = 0;
+  crc = crc32_update(~0, rx.b, sizeof(rx.b));
+  pay_fill = 0;
+
+  if(rx.hdr.cmd != XFER_DATA)
+    pay_dst = cmd_buf;
+  // only the expected frame is received into the buffer, it must stay
+  // within a payload sized block
+  else if(file_open && rx.hdr.offset == pos && len &&
+          (pos % XFER_MAX_PAYLOAD) + len <= XFER_MAX_PAYLOAD)
+    pay_dst = buf + (pos % XFER_BUF_SIZE);
+  else
+    pay_dst = 0;
+
+  if(!len) xfer_frame();
+}
+
+void xfer_rx(const char *data, uint16_t len) {
+  last_rx = xfer_now();
+
+  while(len && active) {
+    if(hdr_fill < sizeof(rx.b)) {
+      uint8_t c = *data++;
+      len--;
+
+      // sync on the magic
+      if(hdr_fill < 4 && c != ((XFER_MAGIC >> (8*hdr_fill)) & 0xff)) {
+        hdr_fill = 0;
+        if(c != (XFER_MAGIC & 0xff)) continue;
+      }
+
+      rx.b[hdr_fill++] = c;
+      if(hdr_fill == sizeof(rx.b)) xfer_header();
+    } else {
+      uint16_t n = rx.hdr.len - pay_fill;
+      if(n > len) n = len;
+
+      crc = crc32_update(crc, (uint8_t*)data, n);
+      if(pay_dst) memcpy(pay_dst + pay_fill, data, n);
+      pay_fill += n;
+      data += n;
+      len -= n;
+
+      if(pay_fill == rx.hdr.len) xfer_frame();
+    }
+  }
+}
+
+void xfer_start(void) {
+  active = 1;
+  hdr_fill = 0;
+  last_rx = xfer_now();
+}
+
+uint8_t xfer_active(void) {
+  return active;
+}
+
+// leave the mode if the host has gone away
+void xfer_poll(void) {
+  if(active && (xfer_now() - last_rx) > XFER_TIMEOUT) {
+    iprintf("XFER: timeout\n");
+    xfer_close_file();
+    active = 0;
+  }
+}
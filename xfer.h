@@ -0,0 +1,75 @@
+/*
+ * xfer.h
+ * File transfer protocol over the USB CDC port
+ *
+ * The host enters the transfer mode with the 'F' command of the CDC
+ * control mode. From then on both sides exchange frames of a header and
+ * up to XFER_MAX_PAYLOAD data bytes. The CRC32 covers the header, with
+ * the crc field zero, and the payload. Every request gets a reply frame
+ * with the same cmd or'ed with XFER_REPLY.
+ *
+ * File data goes in DATA frames carrying their file offset. The host may
+ * have a window of frames in flight. Each frame is acknowledged with the
+ * next expected offset, a lost or damaged frame is answered once with
+ * XFER_ERR_SEQ and the offset the host has to go back to. A frame must
+ * not cross a multiple of the payload size, so the data lines up with the
+ * card writes. CLOSE reads the file back and replies its CRC32.
+ *
+ * Multi byte values are little endian. The host side is mistxfer.c.
+ */
+
+#ifndef XFER_H
+#define XFER_H
+
+#include <inttypes.h>
+
+#define XFER_MAGIC      0x3146584d  // "MXF1"
+#define XFER_VERSION    1
+
+#ifdef CONFIG_CHIP_SAMV71
+#define XFER_MAX_PAYLOAD 4096
+#else
+#define XFER_MAX_PAYLOAD 1024
+#endif
+#define XFER_WINDOW      8     // frames in flight
+#define XFER_CMD_MAX     320   // payload of requests other than DATA
+#define XFER_TIMEOUT     10000 // ms without a frame before the mode ends
+
+typedef struct {
+  uint32_t magic;
+  uint8_t  cmd;
+  uint8_t  status;    // replies only
+  uint16_t len;       // of the payload
+  uint32_t offset;    // file offset or argument
+  uint32_t crc;
+} __attribute__ ((packed)) xfer_hdr_t;
+
+// requests, the offset and payload of the request / reply
+#define XFER_HELLO   0x01  // - / version, payload: max payload (16 bit), window (8 bit)
+#define XFER_OPEN    0x02  // total size or 0, flags (8 bit) and path / resume offset
+#define XFER_DATA    0x03  // file offset, data / next expected offset
+#define XFER_CLOSE   0x04  // final size / size, payload: CRC32 of the file
+#define XFER_LIST    0x05  // directory path / entries: size (32 bit), attrib (8 bit), name, 0
+#define XFER_DELETE  0x06  // path / -
+#define XFER_MKDIR   0x07  // path / -
+#define XFER_EXIT    0x08  // back to the command mode
+#define XFER_REPLY   0x80
+
+// OPEN flags
+#define XFER_RESUME  0x01  // keep the data of an earlier attempt
+
+// status of the replies, LIST sends XFER_MORE in all but the last one
+#define XFER_OK         0
+#define XFER_MORE       1
+#define XFER_ERR_CRC    2
+#define XFER_ERR_SEQ    3
+#define XFER_ERR_STATE  4  // no file open or request not allowed now
+#define XFER_ERR_FS     5  // FatFs error
+#define XFER_ERR_ARG    6
+
+void xfer_start(void);
+uint8_t xfer_active(void);
+void xfer_rx(const char *data, uint16_t len);
+void xfer_poll(void);
+
+#endif // XFER_H
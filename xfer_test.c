@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// FatFs has its own DIR
+#define DIR host_dir_t
+#include <dirent.h>
+#undef DIR
+
+#include "FatFs/ff.h"
+#include "xfer.h"
+#include "mistxfer.h"
+
+// The host client of mistxfer.c against the firmware side in xfer.c. The
+// link between them loses and damages frames, FatFs works on a directory
+// of the host. The files are compared with the source data after each
+// transfer, and the card has to see buffer sized aligned writes only.
+
+#define ROOT      "xfertest.dir"
+#define FILE_SIZE (3*1024*1024 + 123)
+
+static uint32_t now = 0;
+static uint8_t pool_buf[SECTOR_BUFFER_SIZE];
+static int pool_full;
+
+// the link
+static uint8_t dev_out[65536];
+static int out_head, out_tail;
+static int damage;           // one in n frames is damaged, one in n lost
+static long cut = -1;        // bytes until the link breaks, -1 for never
+static uint32_t damaged, lost;
+
+static struct {
+  FILE *fp;
+  unsigned writes;
+  unsigned partial;          // writes not of a whole aligned buffer
+  unsigned prealloc;
+} fs;
+
+void iprintf(const char *format, ...) {
+}
+
+uint32_t xfer_test_now(void) {
+  return now;
+}
+
+uint8_t *bufpool_try_acquire(uint8_t owner) {
+  return pool_full ? 0 : pool_buf;
+}
+
+void bufpool_release(uint8_t *buf) {
+}
+
+void sched_yield(void) {
+}
+
+void cdc_control_write(const char *data, uint16_t len) {
+  while(len--) dev_out[out_head++ & (sizeof(dev_out)-1)] = *data++;
+}
+
+void cdc_control_flush(void) {
+}
+
+// ---------------- FatFs on a host directory ----------------
+
+static const char *host_path(const char *path) {
+  static char p[512];
+  snprintf(p, sizeof(p), ROOT "/%s", path);
+  return p;
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode) {
+  struct stat st;
+  int exists = !stat(host_path(path), &st);
+
+  if(!exists && !(mode & (FA_OPEN_ALWAYS | FA_CREATE_ALWAYS))) return FR_NO_FILE;
+  fs.fp = fopen(host_path(path), (exists && !(mode & FA_CREATE_ALWAYS)) ? "r+b" : "w+b");
+  if(!fs.fp) return FR_NO_PATH;
+
+  memset(fp, 0, sizeof(FIL));
+  fseek(fs.fp, 0, SEEK_END);
+  fp->obj.objsize = ftell(fs.fp);
+  fseek(fs.fp, 0, SEEK_SET);
+  return FR_OK;
+}
+
+FRESULT f_close(FIL *fp) {
+  fclose(fs.fp);
+  fs.fp = 0;
+  return FR_OK;
+}
+
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br) {
+  fseek(fs.fp, fp->fptr, SEEK_SET);
+  *br = fread(buff, 1, btr, fs.fp);
+  fp->fptr += *br;
+  return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw) {
+  fs.writes++;
+  if(btw != SECTOR_BUFFER_SIZE || (fp->fptr % SECTOR_BUFFER_SIZE)) fs.partial++;
+
+  fseek(fs.fp, fp->fptr, SEEK_SET);
+  *bw = fwrite(buff, 1, btw, fs.fp);
+  fp->fptr += *bw;
+  if(fp->fptr > fp->obj.objsize) fp->obj.objsize = fp->fptr;
+  return FR_OK;
+}
+
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs) {
+  if(ofs > fp->obj.objsize) {
+    fs.prealloc++;
+    fflush(fs.fp);
+    if(ftruncate(fileno(fs.fp), ofs)) return FR_DISK_ERR;
+    fp->obj.objsize = ofs;
+  }
+  fp->fptr = ofs;
+  return FR_OK;
+}
+
+FRESULT f_truncate(FIL *fp) {
+  fflush(fs.fp);
+  if(ftruncate(fileno(fs.fp), fp->fptr)) return FR_DISK_ERR;
+  fp->obj.objsize = fp->fptr;
+  return FR_OK;
+}
+
+static host_dir_t *host_dir;
+static char dir_path[512];
+
+FRESULT f_opendir(DIR *dp, const TCHAR *path) {
+  strcpy(dir_path, host_path(path));
+  host_dir = opendir(dir_path);
+  return host_dir ? FR_OK : FR_NO_PATH;
+}
+
+FRESULT f_closedir(DIR *dp) {
+  closedir(host_dir);
+  return FR_OK;
+}
+
+FRESULT f_readdir(DIR *dp, FILINFO *fno) {
+  struct dirent *e;
+  struct stat st;
+  char p[1024];
+
+  do {
+    e = readdir(host_dir);
+  } while(e && e->d_name[0] == '.');
+
+  memset(fno, 0, sizeof(FILINFO));
+  if(!e) return FR_OK;
+
+  snprintf(p, sizeof(p), "%s/%s", dir_path, e->d_name);
+  stat(p, &st);
+  strcpy(fno->fname, e->d_name);
+  fno->fsize = st.st_size;
+  fno->fattrib = S_ISDIR(st.st_mode) ? AM_DIR : 0;
+  return FR_OK;
+}
+
+FRESULT f_mkdir(const TCHAR *path) {
+  return mkdir(host_path(path), 0755) ? FR_EXIST : FR_OK;
+}
+
+FRESULT f_unlink(const TCHAR *path) {
+  return unlink(host_path(path)) ? FR_NO_FILE : FR_OK;
+}
+
+// ---------------- the link ----------------
+
+static void link_write(void *ctx, const uint8_t *buf, int len) {
+  static uint8_t frame[65536];
+
+  // the control mode
+  if(!xfer_active()) {
+    if(len == 1 && buf[0] == 'F') xfer_start();
+    return;
+  }
+
+  if(cut >= 0) {
+    if(cut < len) {
+      len = cut;
+      cut = 0;
+    } else
+      cut -= len;
+  }
+
+  memcpy(frame, buf, len);
+  if(damage && len > 1 && !(rand() % damage)) {
+    frame[rand() % len] ^= 1 << (rand() & 7);
+    damaged++;
+  }
+  if(damage && !(rand() % damage)) {
+    lost++;
+    return;
+  }
+
+  // in USB packets
+  for(int i=0;i<len;i+=512)
+    xfer_rx((char*)frame + i, (len - i < 512) ? len - i : 512);
+}
+
+static int link_read(void *ctx, uint8_t *buf, int len, int timeout) {
+  int n = 0;
+
+  while(n < len && out_tail != out_head)
+    buf[n++] = dev_out[out_tail++ & (sizeof(dev_out)-1)];
+
+  if(!n) {
+    now += timeout;
+    xfer_poll();
+  }
+  return n;
+}
+
+// ---------------- tests ----------------
+
+static int listed_size;
+
+static void list_entry(const char *name, uint32_t size, uint8_t attr) {
+  if(!strcmp(name, "game.rom")) listed_size = size;
+}
+
+static int check_file(const char *path, const uint8_t *data, uint32_t size) {
+  uint8_t *buf = malloc(size + 1);
+  FILE *f = fopen(host_path(path), "rb");
+  int n = f ? fread(buf, 1, size + 1, f) : -1;
+
+  if(f) fclose(f);
+  n = (n != size || memcmp(buf, data, size));
+  free(buf);
+  if(n) printf("%s differs\n", path);
+  return n;
+}
+
+int main() {
+  xfer_link_t link;
+  uint8_t *data = malloc(FILE_SIZE);
+  int errors = 0, i;
+
+  srand(1);
+  for(i=0;i<FILE_SIZE;i++)
+    data[i] = rand();
+
+  if(system("rm -rf " ROOT) || mkdir(ROOT, 0755)) {
+    printf("cannot create " ROOT "\nFAILED\n");
+    return 1;
+  }
+
+  memset(&link, 0, sizeof(link));
+  link.read = link_read;
+  link.write = link_write;
+
+  if(mx_connect(&link) || link.payload != XFER_MAX_PAYLOAD) {
+    printf("connect failed\nFAILED\n");
+    return 1;
+  }
+
+  // clean link
+  errors += mx_mkdir(&link, "/roms") != 0;
+  if(mx_put(&link, data, FILE_SIZE, "/roms/game.rom", 0)) {
+    printf("clean put failed\n");
+    errors++;
+  }
+  errors += check_file("/roms/game.rom", data, FILE_SIZE);
+  if(fs.prealloc != 1 || fs.partial > 1 || link.resent) {
+    printf("clean put: %u writes, %u partial, %u preallocations, %u resent\n",
+      fs.writes, fs.partial, fs.prealloc, link.resent);
+    errors++;
+  }
+  printf("clean: %u frames, %u card writes\n", link.frames, fs.writes);
+
+  // lost and damaged frames, the last one is shorter than the payload
+  damage = 50;
+  fs.writes = fs.partial = 0;
+  if(mx_put(&link, data + 7, FILE_SIZE - 7, "/roms/game.rom", 0)) {
+    printf("put on a bad link failed\n");
+    errors++;
+  }
+  errors += check_file("/roms/game.rom", data + 7, FILE_SIZE - 7);
+  if(fs.partial > 1 || !link.resent) {
+    printf("bad link: %u partial writes, %u resent\n", fs.partial, link.resent);
+    errors++;
+  }
+  printf("bad link: %u frames, %u damaged, %u lost, %u bytes resent\n", link.frames, damaged, lost, link.resent);
+  damage = 0;
+
+  // the link breaks, the firmware gives up and the transfer is resumed
+  cut = FILE_SIZE / 3;
+  if(!mx_put(&link, data, FILE_SIZE, "/roms/game.rom", 0)) {
+    printf("put over a broken link succeeded\n");
+    errors++;
+  }
+  now += XFER_TIMEOUT + 1;
+  xfer_poll();
+  if(xfer_active()) {
+    printf("transfer mode still active\n");
+    errors++;
+  }
+  cut = -1;
+  fs.writes = fs.partial = 0;
+  if(mx_connect(&link) || mx_put(&link, data, FILE_SIZE, "/roms/game.rom", 1)) {
+    printf("resume failed\n");
+    errors++;
+  }
+  if(!link.resumed || link.resumed > FILE_SIZE / 3 || fs.partial > 2) {
+    printf("resumed at %u, %u partial writes\n", link.resumed, fs.partial);
+    errors++;
+  }
+  errors += check_file("/roms/game.rom", data, FILE_SIZE);
+  printf("resumed at %u\n", link.resumed);
+
+  // no pool block free, the transfer doesn't start
+  pool_full = 1;
+  if(!mx_put(&link, data, 1000, "/roms/other.rom", 0) || !access(host_path("/roms/other.rom"), F_OK)) {
+    printf("put without a pool block succeeded\n");
+    errors++;
+  }
+  pool_full = 0;
+
+  // directory listing and delete
+  listed_size = -1;
+  if(mx_list(&link, "/roms", list_entry) || listed_size != FILE_SIZE) {
+    printf("listed size %d\n", listed_size);
+    errors++;
+  }
+  errors += mx_remove(&link, "/roms/game.rom") != 0;
+  listed_size = -1;
+  if(mx_list(&link, "/roms", list_entry) || listed_size != -1) {
+    printf("deleted file still listed\n");
+    errors++;
+  }
+  if(!mx_remove(&link, "/roms/game.rom")) {
+    printf("delete of a missing file succeeded\n");
+    errors++;
+  }
+
+  errors += mx_exit(&link) != 0;
+  if(xfer_active()) {
+    printf("transfer mode not left\n");
+    errors++;
+  }
+
+  if(system("rm -rf " ROOT)) errors++;
+  free(data);
+
+  printf("%d errors\n", errors);
+  if(errors) {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  printf("OK\n");
+  return 0;
+}